@@ -0,0 +1,60 @@
+/**
+  ******************************************************************************
+  * @file    app_rtos.h
+  * @brief   Header for app_rtos.c module
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 STMicroelectronics.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __APP_RTOS_H
+#define __APP_RTOS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include "cmsis_os.h"
+
+/* Exported constants --------------------------------------------------------*/
+/* A frame is captured every APP_CAPTURE_PERIOD_MS, APP_CAPTURE_FRAMES in all */
+#define APP_CAPTURE_PERIOD_MS  40U
+#define APP_CAPTURE_FRAMES     1500U
+
+/* Frames are sized to the card's stream rate, up to APP_FRAME_MAX_BYTES, and
+ * held in a ring of APP_RING_SIZE bytes while the card is busy */
+#define APP_FRAME_MAX_BYTES    (16U * 1024U)
+#define APP_RING_SIZE          (64U * 1024U)
+
+/* Frames written between two syncs of the recording */
+#define APP_SYNC_EVERY         25U
+
+/* The recording loops over the card in segments of APP_SEGMENT_MS */
+#define APP_SEGMENT_MS         10000U
+
+/* Built with APP_CAMERA, the most the sensor sends as it is set up, which
+ * each segment is sized to hold for APP_SEGMENT_MS */
+#define APP_CAMERA_KIB_S       1024U
+
+/* An incident locks the open segment and this many before it */
+#define APP_INCIDENT_PREVIOUS  1U
+
+/* Exported functions ------------------------------------------------------- */
+void APP_RTOS_Init(void);
+void APP_Incident(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __APP_RTOS_H */
@@ -0,0 +1,130 @@
+/**
+  ******************************************************************************
+  * @file    benchmark.h
+  * @brief   Header for benchmark.c module
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 STMicroelectronics.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __BENCHMARK_H
+#define __BENCHMARK_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include <stdint.h>
+#include "ff.h"
+
+/* Exported types ------------------------------------------------------------*/
+/**
+  * @brief Results of one sequential write run
+  */
+typedef struct
+{
+  uint32_t write_size;     /* Bytes passed to each write call */
+  uint32_t file_size;      /* Bytes written before the file is closed */
+  uint32_t sync_interval;  /* Bytes between syncs, 0 to sync on close only */
+  uint32_t flags;          /* BENCH_PREALLOCATE or BENCH_ALIGNED */
+  uint32_t calls;          /* Write calls timed */
+  uint64_t total_ticks;    /* Open to close, inclusive */
+  uint32_t p50_ticks;      /* Per-call write latency percentiles */
+  uint32_t p99_ticks;
+  uint32_t max_ticks;
+  uint32_t stall_ticks;    /* Longest gap between two write returns, syncs included */
+  uint32_t copy_bytes;     /* File data copied to a sector buffer on the way to the disk */
+} BENCH_Result;
+
+/**
+  * @brief Write performance of the card, stated and measured, and the
+  *        recording stream it can take
+  */
+typedef struct
+{
+  uint32_t speed_class;    /* Speed Class stated by the card in MB/s, 0 if none */
+  uint32_t au_sectors;     /* Allocation unit stated by the card, 0 if none */
+  uint32_t probe_bytes;    /* Bytes written by the probe */
+  uint32_t write_kib_s;    /* Sustained write rate measured by the probe */
+  uint32_t max_write_us;   /* Longest single write of the probe */
+  uint32_t stream_kib_s;   /* Highest recording rate to run the card at */
+  uint32_t buffer_kib;     /* RAM to hold the stream through the longest write */
+  uint32_t cached;         /* 1 if read back from the last probe of this card */
+} BENCH_Profile;
+
+/* Exported constants --------------------------------------------------------*/
+/* Largest write size in the sweep, and so the size of the source buffer */
+#define BENCH_MAX_WRITE_SIZE  (64U * 1024U)
+
+/* Write through a preallocated recording file (REC_Write) instead of f_write */
+#define BENCH_PREALLOCATE     0x01U
+
+/* Write with f_write_aligned, so each call that starts on a sector boundary
+ * is sent to the disk straight from the source buffer */
+#define BENCH_ALIGNED         0x02U
+
+/* The allocation benchmark fills the free space with this many recordings,
+ * then deletes one in BENCH_FILL_HOLE_EVERY to leave scattered holes */
+#define BENCH_FILL_FILES      100U
+#define BENCH_FILL_HOLE_EVERY 10U
+
+/* The card profile probe writes BENCH_PROBE_SIZE, or one allocation unit up
+ * to BENCH_PROBE_MAX_SIZE, in blocks of BENCH_PROBE_CHUNK. It runs once per
+ * card, its result is kept on the card keyed by the CID. */
+#define BENCH_PROBE_SIZE      (1U * 1024U * 1024U)
+#define BENCH_PROBE_MAX_SIZE  (4U * 1024U * 1024U)
+#define BENCH_PROBE_CHUNK     (32U * 1024U)
+
+/* The loop recording benchmark counts each segment as BENCH_LOOP_SEGMENT_S
+ * of recording and reports the run in BENCH_LOOP_WINDOWS spans */
+#define BENCH_LOOP_SEGMENT_S  60U
+#define BENCH_LOOP_WINDOWS    10U
+
+/* An incident is locked during one segment in BENCH_LOOP_INCIDENT_EVERY,
+ * keeping that segment and the one before */
+#define BENCH_LOOP_INCIDENT_EVERY  1440U
+
+/* The streams benchmark grows a recording in BENCH_PROBE_CHUNK writes and a
+ * side file, as a log would be, by one byte in BENCH_STREAMS_SIDE of them,
+ * syncing both every BENCH_STREAMS_SYNC bytes of recording */
+#define BENCH_STREAMS_SIDE    8U
+#define BENCH_STREAMS_SYNC    (1024U * 1024U)
+
+/* The directory benchmark creates files in one directory, timing each create,
+ * and each time the count reaches BENCH_DIR_FIRST times a power of 10, opens
+ * BENCH_DIR_OPENS of them picked at random by name */
+#define BENCH_DIR_FIRST       100U
+#define BENCH_DIR_OPENS       100U
+
+/* Recording rate planned for, as a percentage of the measured write rate */
+#define BENCH_STREAM_MARGIN   75U
+
+/* Exported functions ------------------------------------------------------- */
+FRESULT BENCH_Run(const char *path);
+FRESULT BENCH_RunOne(const char *path, uint32_t write_size, uint32_t file_size,
+                     uint32_t sync_interval, uint32_t flags, BENCH_Result *result);
+void BENCH_PrintResult(const BENCH_Result *result);
+FRESULT BENCH_RunFill(const char *path);
+FRESULT BENCH_RunLoop(const char *path, uint32_t segments, uint32_t segment_bytes);
+FRESULT BENCH_RunStreams(const char *path, uint32_t bytes);
+FRESULT BENCH_RunDirectory(const char *path, uint32_t files);
+void BENCH_RunCpu(void);
+FRESULT BENCH_ProfileCard(const char *path, uint32_t speed_class, uint32_t au_sectors,
+                          const uint32_t *cid, uint8_t reprobe, BENCH_Profile *profile);
+void BENCH_PrintProfile(const BENCH_Profile *profile);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __BENCHMARK_H */
@@ -0,0 +1,63 @@
+/**
+  ******************************************************************************
+  * @file    camera.h
+  * @brief   Header for camera.c module
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 STMicroelectronics.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __CAMERA_H
+#define __CAMERA_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include <stdint.h>
+#include "frame_ring.h"
+
+/* Exported types ------------------------------------------------------------*/
+/**
+  * @brief Capture statistics, since the last CAM_Start
+  */
+typedef struct
+{
+  uint32_t frames;         /* Frame ends seen */
+  uint32_t chunks;         /* Chunks committed to the ring, the last one padded */
+  uint32_t dropped;        /* Chunks lost with the ring full */
+  uint32_t errors;         /* Overruns, sync errors and DMA errors */
+} CAM_Stats;
+
+/* Exported constants --------------------------------------------------------*/
+/* Capture modes for CAM_Start: one frame then stop, rather than continuous,
+ * and compressed frames of any length rather than fixed-size raw frames */
+#define CAM_SNAPSHOT      0x01U
+#define CAM_JPEG          0x02U
+
+/* Largest ring slot the capture fills, and the size of its spill buffer for
+ * when the ring is full */
+#define CAM_CHUNK_BYTES   (8U * 1024U)
+
+/* Exported functions ------------------------------------------------------- */
+int CAM_Start(RING_Buffer *ring, uint32_t mode);
+void CAM_Stop(void);
+uint32_t CAM_IsRunning(void);
+void CAM_GetStats(CAM_Stats *out);
+void CAM_ChunkCallback(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CAMERA_H */
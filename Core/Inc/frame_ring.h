@@ -0,0 +1,75 @@
+/**
+  ******************************************************************************
+  * @file    frame_ring.h
+  * @brief   Header for frame_ring.c module
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 STMicroelectronics.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __FRAME_RING_H
+#define __FRAME_RING_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include <stdint.h>
+
+/* Exported types ------------------------------------------------------------*/
+/**
+  * @brief Ring of fixed-size frame slots with one producer and one consumer
+  */
+typedef struct
+{
+  uint8_t *slots;              /* Slot storage, n_slots * slot_size bytes */
+  uint32_t slot_size;          /* Bytes per slot, a multiple of 4 */
+  uint32_t n_slots;            /* Slots in the ring */
+  volatile uint32_t head;      /* Next slot to fill, 0 to 2 * n_slots - 1, producer only */
+  volatile uint32_t tail;      /* Next slot to drain, 0 to 2 * n_slots - 1, consumer only */
+  uint32_t pushed;             /* Frames committed, producer only */
+  uint32_t dropped;            /* Frames refused with the ring full, producer only */
+  uint32_t high_water;         /* Most slots filled at once, producer only */
+} RING_Buffer;
+
+/**
+  * @brief Ring statistics
+  */
+typedef struct
+{
+  uint32_t n_slots;            /* Slots in the ring */
+  uint32_t filled;             /* Slots filled now */
+  uint32_t pushed;             /* Frames committed */
+  uint32_t dropped;            /* Frames refused with the ring full */
+  uint32_t high_water;         /* Most slots filled at once */
+} RING_Stats;
+
+/* Exported constants --------------------------------------------------------*/
+/* Alignment of the slot storage; slots stay aligned if slot_size is a
+ * multiple of it */
+#define RING_ALIGN  32U
+
+/* Exported functions ------------------------------------------------------- */
+uint32_t RING_Init(RING_Buffer *ring, void *buff, uint32_t size, uint32_t slot_size);
+void *RING_Acquire(RING_Buffer *ring);
+void *RING_AcquireAhead(RING_Buffer *ring, uint32_t ahead);
+void RING_Commit(RING_Buffer *ring);
+uint32_t RING_Peek(RING_Buffer *ring, uint8_t **first);
+void RING_Release(RING_Buffer *ring, uint32_t count);
+void RING_GetStats(const RING_Buffer *ring, RING_Stats *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __FRAME_RING_H */
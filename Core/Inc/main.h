@@ -41,12 +41,40 @@ extern "C" {
 
 /* Exported constants --------------------------------------------------------*/
 /* USER CODE BEGIN EC */
-
+/* Core clock in MHz, set with CLOCK= in the Makefile:
+ *   96: HSI, voltage scale 3, 3 wait states, PLL48CLK 48 MHz
+ *  168: HSE bypass, voltage scale 1, 5 wait states, PLL48CLK 48 MHz
+ *  180: HSE bypass, over-drive, 5 wait states, PLL48CLK 45 MHz
+ * The F429 takes PLL48CLK from the main PLL, and no divider of a 360 MHz VCO
+ * gives 48 MHz, so SDIO runs at 45 MHz at the full core clock. */
+#if !defined(SYSCLK_MHZ)
+#define SYSCLK_MHZ 180
+#endif
+/* Preemption priority of the SDIO and SD DMA interrupts. Under the RTOS they
+ * release a semaphore, so the number must be no less than the kernel's
+ * configLIBRARY_MAX_SYSCALL_INTERRUPT_PRIORITY (5 in the usual port setup). */
+#if defined(APP_RTOS)
+#define SD_IRQ_PRIORITY 5U
+#else
+#define SD_IRQ_PRIORITY 0U
+#endif
+/* Preemption priority of the DCMI and its DMA interrupts, which are held to
+ * the same limit since the chunk callback may signal a thread */
+#define CAM_IRQ_PRIORITY SD_IRQ_PRIORITY
+/* Preemption priority of the user button's interrupt, which signals the
+ * storage thread to lock the footage around an incident */
+#define BTN_IRQ_PRIORITY SD_IRQ_PRIORITY
+/* Preemption priority of the card detect interrupt, which aborts the SD
+ * transfer in flight, so the same as the SDIO's */
+#define CD_IRQ_PRIORITY SD_IRQ_PRIORITY
 /* USER CODE END EC */
 
 /* Exported macro ------------------------------------------------------------*/
 /* USER CODE BEGIN EM */
-
+/* Places a variable, which must be zero-initialised, in the 64K CCM RAM. The
+ * CPU reaches it with no wait states and without contending with DMA, but DMA
+ * cannot reach it at all, so only data the CPU alone touches belongs there. */
+#define __CCMRAM __attribute__((section(".ccmbss")))
 /* USER CODE END EM */
 
 /* Exported functions prototypes ---------------------------------------------*/
@@ -0,0 +1,543 @@
+/**
+  ******************************************************************************
+  * @file    app_rtos.c
+  * @brief   Capture, storage and housekeeping threads of the RTOS build
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 STMicroelectronics.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+/*
+ * The capture thread runs at high priority on a fixed period and never
+ * touches the card: it fills the next slot of the frame ring in place and
+ * commits it. The storage thread owns the card. It mounts the volume,
+ * profiles the card, then writes the filled slots to a loop recording (see
+ * loop_recorder.c), as many at once as lie together in the ring, and releases
+ * them. The loop is cut into a new segment every APP_SEGMENT_MS. APP_Incident,
+ * from the user button or any other trigger, has the storage thread lock the
+ * open segment and the one before it, which takes a few index writes. While the
+ * card is busy the storage thread sleeps in the SD driver, so capture timing
+ * does not depend on the card. A frame is dropped, not delayed, when the ring
+ * is full. When the card is pulled its writes fail at once; frames are dropped
+ * until a card is back, then the loop is opened again on it.
+ *
+ * The frame contents are a placeholder: the frame number and the kernel tick
+ * it was taken at, then whatever the buffer held before. Built with
+ * APP_CAMERA, the capture thread instead runs the DCMI for the same length of
+ * time, and its DMA fills the ring in chunks of CAM_CHUNK_BYTES, see camera.c.
+ */
+
+/* Includes ------------------------------------------------------------------*/
+#include <stdio.h>
+#include "main.h"
+#include "app_rtos.h"
+#include "fatfs.h"
+#include "loop_recorder.h"
+#include "benchmark.h"
+#include "frame_ring.h"
+#if defined(APP_CAMERA)
+#include "camera.h"
+#endif
+
+/* Private define ------------------------------------------------------------*/
+/* Housekeeping LED toggle, and the storage thread's idle poll once done */
+#define APP_LED_PERIOD_MS      500U
+#define APP_IDLE_PERIOD_MS     10U
+
+/* Thread flags: start the capture thread, tell the storage thread a frame is
+ * waiting, that the capture has ended, or that an incident wants locking */
+#define APP_FLAG_START         0x0001U
+#define APP_FLAG_FRAME         0x0002U
+#define APP_FLAG_END           0x0004U
+#define APP_FLAG_INCIDENT      0x0008U
+
+/* Private macro -------------------------------------------------------------*/
+#define APP_MS_TO_TICKS(ms)    ((uint32_t)(((uint64_t)(ms) * osKernelGetTickFreq()) / 1000U))
+
+/* Private variables ---------------------------------------------------------*/
+static osThreadId_t captureTaskHandle;
+static const osThreadAttr_t captureTask_attributes = {
+  .name = "captureTask",
+  .stack_size = 256 * 4,
+  .priority = (osPriority_t) osPriorityHigh,
+};
+static osThreadId_t storageTaskHandle;
+static const osThreadAttr_t storageTask_attributes = {
+  .name = "storageTask",
+  .stack_size = 2048 * 4,
+  .priority = (osPriority_t) osPriorityNormal,
+};
+static osThreadId_t housekeepingTaskHandle;
+static const osThreadAttr_t housekeepingTask_attributes = {
+  .name = "housekeepingTask",
+  .stack_size = 128 * 4,
+  .priority = (osPriority_t) osPriorityLow,
+};
+
+/* Frames from capture to storage, in SRAM so DMA can reach them, and the
+ * ring indices beside the CPU's other data */
+static uint8_t app_ring_mem[APP_RING_SIZE] __ALIGNED(RING_ALIGN);
+static __CCMRAM RING_Buffer app_ring;
+
+static BENCH_Profile app_profile;
+static SD_DiskStats app_stats;
+static RING_Stats app_ring_stats;
+#if defined(APP_CAMERA)
+static CAM_Stats app_cam_stats;
+#endif
+static LOOP_Recorder app_loop;
+
+#if !defined(APP_CAMERA)
+/* Largest deviation of the capture period, written by the capture thread */
+static volatile uint32_t app_max_jitter_us;
+#endif
+
+/* Private function prototypes -----------------------------------------------*/
+static void StartCaptureTask(void *argument);
+static void StartStorageTask(void *argument);
+static void StartHousekeepingTask(void *argument);
+static void APP_Record(void);
+static uint32_t APP_FrameBytes(const BENCH_Profile *profile);
+static FSIZE_t APP_SegmentBytes(void);
+
+/* Exported functions --------------------------------------------------------*/
+/**
+  * @brief  Creates the threads, to be called before osKernelStart
+  * @retval None
+  */
+void APP_RTOS_Init(void)
+{
+  captureTaskHandle = osThreadNew(StartCaptureTask, NULL, &captureTask_attributes);
+  storageTaskHandle = osThreadNew(StartStorageTask, NULL, &storageTask_attributes);
+  housekeepingTaskHandle = osThreadNew(StartHousekeepingTask, NULL,
+                                       &housekeepingTask_attributes);
+
+  if (captureTaskHandle == NULL || storageTaskHandle == NULL ||
+      housekeepingTaskHandle == NULL)
+  {
+    Error_Handler();
+  }
+}
+
+/**
+  * @brief  Locks the footage around an incident: the open segment and
+  *         APP_INCIDENT_PREVIOUS before it
+  * @retval None
+  * @note   May be called from an interrupt. The storage thread does the
+  *         locking, before it next writes.
+  */
+void APP_Incident(void)
+{
+  if (storageTaskHandle != NULL)
+  {
+    osThreadFlagsSet(storageTaskHandle, APP_FLAG_INCIDENT);
+  }
+}
+
+/**
+  * @brief  Treats a press of the user button as an incident
+  * @param  GPIO_Pin: Pin whose EXTI line fired
+  * @retval None
+  * @note   Presses and bounces before the storage thread runs make a single
+  *         incident, as the thread flag is set only once.
+  */
+void HAL_GPIO_EXTI_Callback(uint16_t GPIO_Pin)
+{
+  if (GPIO_Pin == USER_Btn_Pin)
+  {
+    APP_Incident();
+  }
+}
+
+/* Private functions ---------------------------------------------------------*/
+/**
+  * @brief  Chooses the frame size from the card profile
+  * @param  profile: Card profile, or NULL for the largest frames
+  * @retval Bytes per frame, a whole number of sectors
+  */
+static uint32_t APP_FrameBytes(const BENCH_Profile *profile)
+{
+  uint32_t bytes;
+
+  if (profile == NULL || profile->stream_kib_s == 0)
+  {
+    return APP_FRAME_MAX_BYTES;
+  }
+
+  /* What the card takes in one period, in whole sectors */
+  bytes = (uint32_t)(((uint64_t)profile->stream_kib_s * 1024U * APP_CAPTURE_PERIOD_MS) / 1000U);
+  bytes &= ~(uint32_t)(_MAX_SS - 1);
+  if (bytes < _MAX_SS)
+  {
+    bytes = _MAX_SS;
+  }
+  return (bytes < APP_FRAME_MAX_BYTES) ? bytes : APP_FRAME_MAX_BYTES;
+}
+
+/**
+  * @brief  Sizes the loop slots to hold APP_SEGMENT_MS of the stream
+  * @retval Bytes per segment
+  * @note   The camera's chunks follow its data rate, not the card profile,
+  *         and the chunk padded at a segment's end is allowed for. Frames
+  *         are held at their largest, so the layout on the card stays the
+  *         same whatever the profile comes to.
+  */
+static FSIZE_t APP_SegmentBytes(void)
+{
+#if defined(APP_CAMERA)
+  return (FSIZE_t)APP_CAMERA_KIB_S * 1024U * APP_SEGMENT_MS / 1000U + CAM_CHUNK_BYTES;
+#else
+  return (FSIZE_t)APP_FRAME_MAX_BYTES * (APP_SEGMENT_MS / APP_CAPTURE_PERIOD_MS);
+#endif
+}
+
+#if defined(APP_CAMERA)
+/**
+  * @brief  Runs the camera for APP_CAPTURE_FRAMES periods once started
+  * @param  argument: Not used
+  * @retval None
+  */
+static void StartCaptureTask(void *argument)
+{
+  (void)argument;
+  osThreadFlagsWait(APP_FLAG_START, osFlagsWaitAny, osWaitForever);
+
+  if (CAM_Start(&app_ring, CAM_JPEG) != 0)
+  {
+    printf("camera failed to start.\n");
+  }
+  else
+  {
+    osDelay(APP_MS_TO_TICKS(APP_CAPTURE_PERIOD_MS * APP_CAPTURE_FRAMES));
+    CAM_Stop();
+  }
+
+  osThreadFlagsSet(storageTaskHandle, APP_FLAG_END);
+  osThreadExit();
+}
+
+/**
+  * @brief  Tells the storage thread a chunk is waiting, from the DMA interrupt
+  * @retval None
+  */
+void CAM_ChunkCallback(void)
+{
+  osThreadFlagsSet(storageTaskHandle, APP_FLAG_FRAME);
+}
+#else
+/**
+  * @brief  Takes a frame every APP_CAPTURE_PERIOD_MS once started
+  * @param  argument: Not used
+  * @retval None
+  */
+static void StartCaptureTask(void *argument)
+{
+  uint32_t cycles_per_us;
+  uint32_t period;
+  uint32_t wake;
+  uint32_t last = 0;
+  uint32_t now;
+  uint32_t dev;
+  uint32_t frame;
+  uint32_t *slot;
+
+  (void)argument;
+  osThreadFlagsWait(APP_FLAG_START, osFlagsWaitAny, osWaitForever);
+
+  /* Time each wake-up against the core clock */
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+  cycles_per_us = SystemCoreClock / 1000000U;
+  period = cycles_per_us * 1000U * APP_CAPTURE_PERIOD_MS;
+
+  wake = osKernelGetTickCount();
+  for (frame = 0; frame < APP_CAPTURE_FRAMES; frame++)
+  {
+    wake += APP_MS_TO_TICKS(APP_CAPTURE_PERIOD_MS);
+    osDelayUntil(wake);
+
+    now = DWT->CYCCNT;
+    if (frame > 0)
+    {
+      dev = now - last;
+      dev = (dev > period) ? dev - period : period - dev;
+      if (dev / cycles_per_us > app_max_jitter_us)
+      {
+        app_max_jitter_us = dev / cycles_per_us;
+      }
+    }
+    last = now;
+
+    // A full ring drops the frame and counts it
+    slot = (uint32_t *)RING_Acquire(&app_ring);
+    if (slot == NULL)
+    {
+      continue;
+    }
+    slot[0] = frame;
+    slot[1] = osKernelGetTickCount();
+    RING_Commit(&app_ring);
+    osThreadFlagsSet(storageTaskHandle, APP_FLAG_FRAME);
+  }
+
+  osThreadFlagsSet(storageTaskHandle, APP_FLAG_END);
+  osThreadExit();
+}
+#endif
+
+/**
+  * @brief  Owns the card: records the capture, then keeps pre-erasing
+  * @param  argument: Not used
+  * @retval None
+  */
+static void StartStorageTask(void *argument)
+{
+  (void)argument;
+  APP_Record();
+  for (;;)
+  {
+    SD_Idle_Poll();
+    osDelay(APP_MS_TO_TICKS(APP_IDLE_PERIOD_MS));
+  }
+}
+
+/**
+  * @brief  Mounts the card, sizes the stream to it, then records the frames
+  *         queued by the capture thread until it ends
+  * @retval None
+  */
+static void APP_Record(void)
+{
+  uint32_t frame_bytes;
+  uint32_t slot_bytes;
+  uint32_t frames = 0;
+  uint32_t max_write_us = 0;
+  uint32_t max_lock_us = 0;
+  uint32_t incidents = 0;
+  uint32_t max_reopen_us = 0;
+  uint32_t reopens = 0;
+  uint32_t overflows = 0;
+  uint32_t seq;
+  uint32_t mount_ms;
+  uint32_t first_ms = 0;
+  uint32_t elapsed;
+  uint32_t segment_start;
+  uint32_t flags;
+  uint32_t n;
+  uint8_t *first;
+  FRESULT res;
+  FRESULT lock_res;
+
+  mount_ms = HAL_GetTick();
+  if ((res = f_mount(&SDFatFS, SDPath, 1)) != FR_OK)
+  {
+    printf("failed to mount card, code: %i.\n", res);
+    return;
+  }
+  mount_ms = HAL_GetTick() - mount_ms;
+
+  // Measure what the card sustains, to size the frames. A card is probed
+  // once, or again while the user button is held.
+  SD_GetStats(&app_stats);
+  if ((res = BENCH_ProfileCard(SDPath, app_stats.speed_class, app_stats.au_sectors, app_stats.cid,
+                               HAL_GPIO_ReadPin(USER_Btn_GPIO_Port, USER_Btn_Pin) == GPIO_PIN_SET,
+                               &app_profile)) != FR_OK)
+  {
+    printf("card profile failed, code: %i.\n", res);
+    frame_bytes = APP_FrameBytes(NULL);
+  }
+  else
+  {
+    BENCH_PrintProfile(&app_profile);
+    frame_bytes = APP_FrameBytes(&app_profile);
+  }
+
+  // The camera fills slots of its own chunk size
+#if defined(APP_CAMERA)
+  slot_bytes = CAM_CHUNK_BYTES;
+#else
+  slot_bytes = frame_bytes;
+#endif
+  n = RING_Init(&app_ring, app_ring_mem, sizeof(app_ring_mem), slot_bytes);
+
+  if ((res = LOOP_Open(&app_loop, SDPath, APP_SegmentBytes(), LOOP_MAX_SLOTS)) != FR_OK)
+  {
+    printf("loop recording failed, code: %i.\n", res);
+    return;
+  }
+  printf("loop: %lu slots of %lu KiB %s, recording segment %lu.\n",
+         (unsigned long)app_loop.n_slots, (unsigned long)(app_loop.segment_bytes / 1024U),
+         app_loop.created ? "allocated" : "found", (unsigned long)app_loop.seq);
+  if (app_loop.kept)
+  {
+    printf("loop: %lu locked segments moved to %s%s.\n", (unsigned long)app_loop.kept,
+           SDPath, LOOP_KEEP_DIR);
+  }
+  printf("capture: %lu frames of %lu B every %lu ms, %lu slots of %lu B in the ring.\n",
+         (unsigned long)APP_CAPTURE_FRAMES, (unsigned long)frame_bytes,
+         (unsigned long)APP_CAPTURE_PERIOD_MS, (unsigned long)n, (unsigned long)slot_bytes);
+  if ((uint64_t)app_profile.buffer_kib * 1024U > (uint64_t)n * slot_bytes)
+  {
+    printf("capture: the card may need %lu KiB of buffering, frames may drop.\n",
+           (unsigned long)app_profile.buffer_kib);
+  }
+  osThreadFlagsSet(captureTaskHandle, APP_FLAG_START);
+  segment_start = osKernelGetTickCount();
+
+  for (;;)
+  {
+    flags = osThreadFlagsWait(APP_FLAG_FRAME | APP_FLAG_END | APP_FLAG_INCIDENT,
+                              osFlagsWaitAny, APP_MS_TO_TICKS(APP_CAPTURE_PERIOD_MS));
+
+    // Lock first, as the frames can wait in the ring
+    if (!(flags & osFlagsError) && (flags & APP_FLAG_INCIDENT) && res == FR_OK)
+    {
+      elapsed = DWT->CYCCNT;
+      lock_res = LOOP_Lock(&app_loop, APP_INCIDENT_PREVIOUS);
+      elapsed = (DWT->CYCCNT - elapsed) / (SystemCoreClock / 1000000U);
+      if (elapsed > max_lock_us)
+      {
+        max_lock_us = elapsed;
+      }
+      if (lock_res == FR_OK)
+      {
+        incidents++;
+      }
+      else
+      {
+        printf("incident lock failed, code: %i.\n", lock_res);
+      }
+    }
+
+    // Write every frame waiting, those that lie together in one call. After
+    // an error the frames are still released, so capture can finish.
+    while ((n = RING_Peek(&app_ring, &first)) != 0)
+    {
+      if (res == FR_OK)
+      {
+        seq = app_loop.seq;
+        elapsed = DWT->CYCCNT;
+        res = LOOP_Write(&app_loop, first, n * slot_bytes);
+        elapsed = (DWT->CYCCNT - elapsed) / (SystemCoreClock / 1000000U);
+        if (elapsed > max_write_us)
+        {
+          max_write_us = elapsed;
+        }
+
+        // A segment that filled up carries on in the next slot, so nothing
+        // is lost, but segments no longer follow APP_SEGMENT_MS
+        overflows += app_loop.seq - seq;
+      }
+      RING_Release(&app_ring, n);
+
+      if (res == FR_OK)
+      {
+        if (frames == 0)
+        {
+          first_ms = HAL_GetTick();
+        }
+        frames += n;
+        if (frames / APP_SYNC_EVERY != (frames - n) / APP_SYNC_EVERY)
+        {
+          res = LOOP_Sync(&app_loop);
+        }
+      }
+    }
+
+    if (res == FR_OK &&
+        osKernelGetTickCount() - segment_start >= APP_MS_TO_TICKS(APP_SEGMENT_MS))
+    {
+      res = LOOP_NextSegment(&app_loop);
+      segment_start += APP_MS_TO_TICKS(APP_SEGMENT_MS);
+    }
+
+    // A card pulled out leaves the drive to be initialized again. Once one is
+    // back, opening the loop remounts the volume and recording carries on.
+    if (res != FR_OK && (disk_status(SDFatFS.drv) & STA_NOINIT) &&
+        BSP_SD_IsDetected() == SD_PRESENT)
+    {
+      (void)LOOP_Close(&app_loop);
+      elapsed = DWT->CYCCNT;
+      res = LOOP_Open(&app_loop, SDPath, APP_SegmentBytes(), LOOP_MAX_SLOTS);
+      elapsed = (DWT->CYCCNT - elapsed) / (SystemCoreClock / 1000000U);
+      if (res == FR_OK)
+      {
+        reopens++;
+        if (elapsed > max_reopen_us)
+        {
+          max_reopen_us = elapsed;
+        }
+        segment_start = osKernelGetTickCount();
+      }
+    }
+
+    if (flags & osFlagsError)
+    {
+      // Pre-erase while no frame is waiting
+      SD_Idle_Poll();
+    }
+    else if (flags & APP_FLAG_END)
+    {
+      break;
+    }
+  }
+
+  if (res != FR_OK)
+  {
+    printf("capture write failed, code: %i.\n", res);
+  }
+  if ((res = LOOP_Close(&app_loop)) != FR_OK)
+  {
+    printf("capture close failed, code: %i.\n", res);
+  }
+  RING_GetStats(&app_ring, &app_ring_stats);
+#if defined(APP_CAMERA)
+  CAM_GetStats(&app_cam_stats);
+  printf("capture: %lu camera frames, %lu chunks written, %lu dropped, %lu errors, "
+         "longest write %lu us.\n",
+         (unsigned long)app_cam_stats.frames, (unsigned long)frames,
+         (unsigned long)app_cam_stats.dropped, (unsigned long)app_cam_stats.errors,
+         (unsigned long)max_write_us);
+#else
+  printf("capture: %lu frames written, %lu dropped, max jitter %lu us, longest write %lu us.\n",
+         (unsigned long)frames, (unsigned long)app_ring_stats.dropped,
+         (unsigned long)app_max_jitter_us, (unsigned long)max_write_us);
+#endif
+  printf("capture ring: %lu of %lu slots at most.\n",
+         (unsigned long)app_ring_stats.high_water, (unsigned long)app_ring_stats.n_slots);
+  printf("loop: %lu incidents locked, %lu of %lu slots locked, longest lock %lu us.\n",
+         (unsigned long)incidents, (unsigned long)app_loop.locked,
+         (unsigned long)app_loop.n_slots, (unsigned long)max_lock_us);
+  if (overflows)
+  {
+    printf("loop: %lu segments filled before %lu ms, the stream is faster than "
+           "the slots allow.\n", (unsigned long)overflows, (unsigned long)APP_SEGMENT_MS);
+  }
+  printf("card: reopened %lu times after being pulled, longest reopen %lu us.\n",
+         (unsigned long)reopens, (unsigned long)max_reopen_us);
+  printf("start-up: card mounted in %lu ms, first frame written %lu ms after reset.\n",
+         (unsigned long)mount_ms, (unsigned long)first_ms);
+}
+
+/**
+  * @brief  Blinks LD3 to show the scheduler is running
+  * @param  argument: Not used
+  * @retval None
+  */
+static void StartHousekeepingTask(void *argument)
+{
+  (void)argument;
+  for (;;)
+  {
+    HAL_GPIO_TogglePin(LD3_GPIO_Port, LD3_Pin);
+    osDelay(APP_MS_TO_TICKS(APP_LED_PERIOD_MS));
+  }
+}
@@ -0,0 +1,1320 @@
+/**
+  ******************************************************************************
+  * @file    benchmark.c
+  * @brief   Sequential write throughput benchmark for the FatFs volume
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 STMicroelectronics.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+/* Includes ------------------------------------------------------------------*/
+#include <stdio.h>
+#include <string.h>
+#include "benchmark.h"
+#include "recorder.h"
+#include "loop_recorder.h"
+
+#if defined(HOST_BUILD)
+#include <time.h>
+#define __CCMRAM
+#else
+#include "main.h"
+#endif
+
+/* Private typedef -----------------------------------------------------------*/
+/* Contents of BENCH_PROFILE_NAME */
+typedef struct
+{
+  uint32_t magic;
+  uint32_t cid[4];         /* Card the profile was measured on */
+  BENCH_Profile profile;
+} BENCH_ProfileRecord;
+
+/* Private define ------------------------------------------------------------*/
+#define BENCH_FILE_NAME      "bench.bin"
+#define BENCH_FILL_NAME      "fill%03lu.bin"
+#define BENCH_PROBE_NAME     "probe.bin"
+#define BENCH_PROFILE_NAME   "profile.bin"
+#define BENCH_SIDE_NAME      "side.bin"
+#define BENCH_DIR_NAME       "dir"
+#define BENCH_DIR_FILE_NAME  BENCH_DIR_NAME "/seg%05lu.bin"
+
+/* Per-call latencies go into a log-linear histogram: four buckets per power of
+ * two, so percentiles come out within 25% without storing every sample. */
+#define BENCH_HIST_SUB       4U
+#define BENCH_HIST_BUCKETS   (31U * BENCH_HIST_SUB)
+
+#define BENCH_KIB            1024U
+#define BENCH_MIB            (1024U * 1024U)
+
+/* "PRF1": changes whenever BENCH_Profile does */
+#define BENCH_PROFILE_MAGIC  0x31465250U
+
+/* Private variables ---------------------------------------------------------*/
+/* 1000 B and 48000 B are not whole sectors, as camera frames often are not */
+static const uint32_t bench_write_sizes[] = {
+  512U, 1000U, 1U * BENCH_KIB, 2U * BENCH_KIB, 4U * BENCH_KIB,
+  8U * BENCH_KIB, 16U * BENCH_KIB, 32U * BENCH_KIB, 48000U, BENCH_MAX_WRITE_SIZE
+};
+
+static const uint32_t bench_file_sizes[] = {
+  1U * BENCH_MIB, 8U * BENCH_MIB
+};
+
+/* 0 leaves the flush to the close */
+static const uint32_t bench_sync_intervals[] = {
+  0U, 1U * BENCH_MIB, 64U * BENCH_KIB
+};
+
+/* f_write on a growing file, then f_write_aligned, then a preallocated
+ * recording file */
+static const uint32_t bench_modes[] = {
+  0U, BENCH_ALIGNED, BENCH_PREALLOCATE
+};
+
+static uint32_t bench_data[BENCH_MAX_WRITE_SIZE / 4];
+static uint8_t bench_data_ready = 0;
+static __CCMRAM uint32_t bench_hist[BENCH_HIST_BUCKETS];
+static FIL bench_file;
+static FIL bench_side;
+static REC_File bench_rec;
+static LOOP_Recorder bench_loop;
+
+/* Private function prototypes -----------------------------------------------*/
+static void BENCH_TimerInit(void);
+static uint32_t BENCH_Ticks(void);
+static uint32_t BENCH_TicksPerUs(void);
+static uint32_t BENCH_Bucket(uint32_t ticks);
+static uint32_t BENCH_BucketLimit(uint32_t bucket);
+static uint32_t BENCH_Percentile(uint32_t calls, uint32_t percent, uint32_t max_ticks);
+static void BENCH_PrintUs(const char *label, uint32_t ticks);
+static void BENCH_InitData(void);
+static FRESULT BENCH_Open(const char *name, uint32_t file_size, uint32_t flags);
+static FRESULT BENCH_Write(UINT chunk, UINT *written, uint32_t flags);
+static FRESULT BENCH_Sync(uint32_t flags);
+static FRESULT BENCH_Close(uint32_t flags);
+static FATFS *BENCH_FileSystem(uint32_t flags);
+static FRESULT BENCH_FillUnlink(const char *path, uint32_t count, uint32_t every);
+static uint8_t BENCH_LoadProfile(const char *path, const uint32_t *cid, BENCH_Profile *profile);
+static FRESULT BENCH_SaveProfile(const char *path, const uint32_t *cid,
+                                 const BENCH_Profile *profile);
+
+/* Private functions ---------------------------------------------------------*/
+#if defined(HOST_BUILD)
+static void BENCH_TimerInit(void)
+{
+}
+
+/* Nanoseconds, truncated: only differences between two readings are used */
+static uint32_t BENCH_Ticks(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t)((uint64_t)ts.tv_sec * 1000000000U + (uint64_t)ts.tv_nsec);
+}
+
+static uint32_t BENCH_TicksPerUs(void)
+{
+  return 1000U;
+}
+#else
+/* Core clock cycles from the DWT counter, which wraps every 23 s at 180 MHz */
+static void BENCH_TimerInit(void)
+{
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CYCCNT = 0;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+static uint32_t BENCH_Ticks(void)
+{
+  return DWT->CYCCNT;
+}
+
+static uint32_t BENCH_TicksPerUs(void)
+{
+  return SystemCoreClock / 1000000U;
+}
+#endif
+
+static uint32_t BENCH_Bucket(uint32_t ticks)
+{
+  uint32_t msb;
+
+  if (ticks < BENCH_HIST_SUB)
+  {
+    return ticks;
+  }
+  msb = 31U - (uint32_t)__builtin_clz(ticks);
+  return (msb - 1U) * BENCH_HIST_SUB + ((ticks >> (msb - 2U)) & (BENCH_HIST_SUB - 1U));
+}
+
+/* Largest latency that lands in the given bucket */
+static uint32_t BENCH_BucketLimit(uint32_t bucket)
+{
+  uint32_t msb;
+  uint32_t sub;
+
+  if (bucket < BENCH_HIST_SUB)
+  {
+    return bucket;
+  }
+  msb = bucket / BENCH_HIST_SUB + 1U;
+  sub = bucket % BENCH_HIST_SUB;
+  return ((BENCH_HIST_SUB | sub) << (msb - 2U)) + ((1U << (msb - 2U)) - 1U);
+}
+
+static uint32_t BENCH_Percentile(uint32_t calls, uint32_t percent, uint32_t max_ticks)
+{
+  uint32_t rank = (uint32_t)(((uint64_t)calls * percent + 99U) / 100U);
+  uint32_t seen = 0;
+  uint32_t i;
+
+  for (i = 0; i < BENCH_HIST_BUCKETS; i++)
+  {
+    seen += bench_hist[i];
+    if (seen >= rank)
+    {
+      break;
+    }
+  }
+  if (i == BENCH_HIST_BUCKETS || BENCH_BucketLimit(i) > max_ticks)
+  {
+    return max_ticks;
+  }
+  return BENCH_BucketLimit(i);
+}
+
+static void BENCH_PrintUs(const char *label, uint32_t ticks)
+{
+  uint64_t centi_us = (uint64_t)ticks * 100U / BENCH_TicksPerUs();
+
+  printf(", %s %lu.%02lu us", label, (unsigned long)(centi_us / 100U),
+         (unsigned long)(centi_us % 100U));
+}
+
+/* Source data for every write, a pattern the card cannot compress */
+static void BENCH_InitData(void)
+{
+  uint32_t i;
+
+  if (!bench_data_ready)
+  {
+    for (i = 0; i < BENCH_MAX_WRITE_SIZE / 4; i++)
+    {
+      bench_data[i] = i * 0x9E3779B1U;
+    }
+    bench_data_ready = 1;
+  }
+}
+
+/* The file under test is either a plain FatFs file or a recording file */
+static FRESULT BENCH_Open(const char *name, uint32_t file_size, uint32_t flags)
+{
+  if (flags & BENCH_PREALLOCATE)
+  {
+    return REC_Open(&bench_rec, name, file_size);
+  }
+  return f_open(&bench_file, name, FA_WRITE | FA_CREATE_ALWAYS);
+}
+
+static FRESULT BENCH_Write(UINT chunk, UINT *written, uint32_t flags)
+{
+  if (flags & BENCH_PREALLOCATE)
+  {
+    return REC_Write(&bench_rec, bench_data, chunk, written);
+  }
+  if (flags & BENCH_ALIGNED)
+  {
+    return f_write_aligned(&bench_file, bench_data, chunk, written);
+  }
+  return f_write(&bench_file, bench_data, chunk, written);
+}
+
+static FRESULT BENCH_Sync(uint32_t flags)
+{
+  if (flags & BENCH_PREALLOCATE)
+  {
+    return REC_Sync(&bench_rec);
+  }
+  return f_sync(&bench_file);
+}
+
+static FRESULT BENCH_Close(uint32_t flags)
+{
+  if (flags & BENCH_PREALLOCATE)
+  {
+    return REC_Close(&bench_rec);
+  }
+  return f_close(&bench_file);
+}
+
+/* Volume of the open file under test, for its copy counter */
+static FATFS *BENCH_FileSystem(uint32_t flags)
+{
+  if (flags & BENCH_PREALLOCATE)
+  {
+    return bench_rec.fil.obj.fs;
+  }
+  return bench_file.obj.fs;
+}
+
+/* Deletes fill files 0 to count - 1, except those already deleted as holes */
+static FRESULT BENCH_FillUnlink(const char *path, uint32_t count, uint32_t every)
+{
+  char name[24];
+  FRESULT res;
+  uint32_t i;
+
+  for (i = 0; i < count; i++)
+  {
+    if (every && i % every == every / 2U)
+    {
+      continue;
+    }
+    snprintf(name, sizeof(name), "%s" BENCH_FILL_NAME, path, (unsigned long)i);
+    res = f_unlink(name);
+    if (res != FR_OK)
+    {
+      return res;
+    }
+  }
+  return FR_OK;
+}
+
+/* Exported functions --------------------------------------------------------*/
+/**
+  * @brief  Writes one file sequentially and times every write call
+  * @param  path: logical drive path, e.g. "0:/"
+  * @param  write_size: bytes per write call, at most BENCH_MAX_WRITE_SIZE
+  * @param  file_size: bytes to write before closing the file
+  * @param  sync_interval: bytes between syncs, 0 to sync on close only
+  * @param  flags: BENCH_PREALLOCATE to write through a recording file, or
+  *         BENCH_ALIGNED to write with f_write_aligned
+  * @param  result: filled in with the timings
+  * @retval FR_OK, or the first FatFs error met
+  */
+FRESULT BENCH_RunOne(const char *path, uint32_t write_size, uint32_t file_size,
+                     uint32_t sync_interval, uint32_t flags, BENCH_Result *result)
+{
+  char name[16];
+  FATFS *fs;
+  FRESULT res;
+  UINT written;
+  uint32_t offset;
+  uint32_t since_sync = 0;
+  uint32_t prev;
+  uint32_t start;
+  uint32_t now;
+  uint32_t ticks;
+  uint32_t last_return;
+  uint32_t copy_start;
+
+  if (write_size == 0 || write_size > BENCH_MAX_WRITE_SIZE)
+  {
+    return FR_INVALID_PARAMETER;
+  }
+  BENCH_InitData();
+  BENCH_TimerInit();
+
+  snprintf(name, sizeof(name), "%s%s", path, BENCH_FILE_NAME);
+  memset(result, 0, sizeof(*result));
+  memset(bench_hist, 0, sizeof(bench_hist));
+  result->write_size = write_size;
+  result->file_size = file_size;
+  result->sync_interval = sync_interval;
+  result->flags = flags;
+
+  prev = BENCH_Ticks();
+  res = BENCH_Open(name, file_size, flags);
+  if (res != FR_OK)
+  {
+    return res;
+  }
+  now = BENCH_Ticks();
+  result->total_ticks += now - prev;
+  last_return = now;
+  fs = BENCH_FileSystem(flags);
+  copy_start = fs->wr_copy;
+
+  for (offset = 0; offset < file_size; offset += written)
+  {
+    UINT chunk = (file_size - offset < write_size) ? file_size - offset : write_size;
+
+    start = BENCH_Ticks();
+    res = BENCH_Write(chunk, &written, flags);
+    now = BENCH_Ticks();
+    if (res == FR_OK && written != chunk)
+    {
+      res = FR_DENIED;  /* Volume full */
+    }
+    if (res != FR_OK)
+    {
+      BENCH_Close(flags);
+      return res;
+    }
+
+    ticks = now - start;
+    bench_hist[BENCH_Bucket(ticks)]++;
+    result->calls++;
+    result->total_ticks += now - last_return;
+    if (ticks > result->max_ticks)
+    {
+      result->max_ticks = ticks;
+    }
+    if (now - last_return > result->stall_ticks)
+    {
+      result->stall_ticks = now - last_return;
+    }
+    last_return = now;
+
+    since_sync += written;
+    if (sync_interval && since_sync >= sync_interval)
+    {
+      res = BENCH_Sync(flags);
+      if (res != FR_OK)
+      {
+        BENCH_Close(flags);
+        return res;
+      }
+      since_sync = 0;
+    }
+  }
+
+  res = BENCH_Close(flags);
+  now = BENCH_Ticks();
+  result->copy_bytes = fs->wr_copy - copy_start;
+  result->total_ticks += now - last_return;
+  if (now - last_return > result->stall_ticks)
+  {
+    result->stall_ticks = now - last_return;
+  }
+  if (res != FR_OK)
+  {
+    return res;
+  }
+
+  result->p50_ticks = BENCH_Percentile(result->calls, 50U, result->max_ticks);
+  result->p99_ticks = BENCH_Percentile(result->calls, 99U, result->max_ticks);
+
+  /* Give the space back for the next run */
+  return f_unlink(name);
+}
+
+/**
+  * @brief  Prints one run as a single line
+  * @param  result: timings from BENCH_RunOne
+  * @retval None
+  */
+void BENCH_PrintResult(const BENCH_Result *result)
+{
+  uint64_t centi_mbps = 0;
+
+  /* Bytes per microsecond is MB/s */
+  if (result->total_ticks)
+  {
+    centi_mbps = (uint64_t)result->file_size * BENCH_TicksPerUs() * 100U / result->total_ticks;
+  }
+
+  printf("bench: %5lu B writes, %5lu KiB file, ", (unsigned long)result->write_size,
+         (unsigned long)(result->file_size / BENCH_KIB));
+  if (result->sync_interval)
+  {
+    printf("sync %4lu KiB", (unsigned long)(result->sync_interval / BENCH_KIB));
+  }
+  else
+  {
+    printf("sync on close");
+  }
+  if (result->flags & BENCH_PREALLOCATE)
+  {
+    printf(", preallocated");
+  }
+  if (result->flags & BENCH_ALIGNED)
+  {
+    printf(", aligned");
+  }
+  printf(": %lu.%02lu MB/s", (unsigned long)(centi_mbps / 100U),
+         (unsigned long)(centi_mbps % 100U));
+  BENCH_PrintUs("p50", result->p50_ticks);
+  BENCH_PrintUs("p99", result->p99_ticks);
+  BENCH_PrintUs("max", result->max_ticks);
+  BENCH_PrintUs("stall", result->stall_ticks);
+  printf(", copy %lu B/MiB.\n",
+         (unsigned long)((uint64_t)result->copy_bytes * BENCH_MIB / result->file_size));
+}
+
+/**
+  * @brief  Sweeps write size, file size and sync interval for f_write,
+  *         f_write_aligned and recording files, printing each run
+  * @param  path: logical drive path of a mounted volume
+  * @retval FR_OK, or the first FatFs error met
+  */
+FRESULT BENCH_Run(const char *path)
+{
+  BENCH_Result result;
+  FRESULT res;
+  uint32_t m;
+  uint32_t f;
+  uint32_t s;
+  uint32_t w;
+
+  for (m = 0; m < sizeof(bench_modes) / sizeof(bench_modes[0]); m++)
+  {
+    for (f = 0; f < sizeof(bench_file_sizes) / sizeof(bench_file_sizes[0]); f++)
+    {
+      for (s = 0; s < sizeof(bench_sync_intervals) / sizeof(bench_sync_intervals[0]); s++)
+      {
+        for (w = 0; w < sizeof(bench_write_sizes) / sizeof(bench_write_sizes[0]); w++)
+        {
+          res = BENCH_RunOne(path, bench_write_sizes[w], bench_file_sizes[f],
+                             bench_sync_intervals[s], bench_modes[m], &result);
+          if (res != FR_OK)
+          {
+            printf("bench: %lu B writes failed, code: %i.\n",
+                   (unsigned long)bench_write_sizes[w], res);
+            return res;
+          }
+          BENCH_PrintResult(&result);
+        }
+      }
+    }
+  }
+  return FR_OK;
+}
+
+/**
+  * @brief  Times CPU-bound work, to compare clock profiles without the card
+  * @retval None
+  * @note   A checksum of 64 KiB and a 32 KiB memcpy, both in SRAM.
+  */
+void BENCH_RunCpu(void)
+{
+  uint32_t start;
+  uint32_t copy_ticks;
+  uint32_t sum_ticks;
+  uint32_t sum = 0;
+  uint32_t i;
+
+  BENCH_TimerInit();
+  BENCH_InitData();
+
+  start = BENCH_Ticks();
+  for (i = 0; i < BENCH_MAX_WRITE_SIZE / 4; i++)
+  {
+    sum = ((sum << 1) | (sum >> 31)) ^ bench_data[i];
+  }
+  sum_ticks = BENCH_Ticks() - start;
+
+  start = BENCH_Ticks();
+  memcpy(bench_data, bench_data + BENCH_MAX_WRITE_SIZE / 8, BENCH_MAX_WRITE_SIZE / 2);
+  copy_ticks = BENCH_Ticks() - start;
+
+  /* The copy overwrote half the write pattern */
+  bench_data_ready = 0;
+  BENCH_InitData();
+
+  printf("cpu: checksum %08lx", (unsigned long)sum);
+  BENCH_PrintUs("64 KiB checksum", sum_ticks);
+  BENCH_PrintUs("32 KiB copy", copy_ticks);
+  printf(".\n");
+}
+
+/**
+  * @brief  Times mounting and cluster allocation on a volume left 90% full
+  * @param  path: logical drive path of a mounted volume
+  * @retval FR_OK, or the first FatFs error met
+  * @note   The free space is filled with BENCH_FILL_FILES preallocated files,
+  *         one in BENCH_FILL_HOLE_EVERY of which is then deleted. The volume
+  *         is remounted and timed up to a valid free cluster count, then a
+  *         new file is grown one cluster at a time across several holes, and
+  *         finally a contiguous run larger than any hole is searched for.
+  *         Every file is deleted afterwards.
+  */
+FRESULT BENCH_RunFill(const char *path)
+{
+  char name[24];
+  FATFS *fs;
+  FRESULT res;
+  FRESULT run_res;
+  DWORD free_clst;
+  DWORD open_clst = 0;
+  DWORD left_clst;
+  FSIZE_t cluster;
+  uint32_t rec_clst;
+  uint32_t grow_clst;
+  uint32_t i;
+  uint32_t start;
+  uint32_t ticks;
+  uint32_t mount_ticks;
+  uint32_t first_ticks = 0;
+  uint32_t max_ticks = 0;
+  uint32_t run_ticks;
+
+  BENCH_TimerInit();
+  res = f_getfree(path, &free_clst, &fs);
+  if (res != FR_OK)
+  {
+    return res;
+  }
+  cluster = (FSIZE_t)fs->csize * _MAX_SS;
+  /* One file's worth is left over, as free space already split by deleted
+   * files, such as the card probe, may not fit a whole file */
+  rec_clst = free_clst / (BENCH_FILL_FILES + 1U);
+#if _FS_AUALIGN
+  /* Whole allocation units, so that starting each file on one wastes none */
+  rec_clst = (free_clst > fs->au_clst) ?
+             (free_clst - fs->au_clst) / (BENCH_FILL_FILES + 1U) / fs->au_clst * fs->au_clst : 0;
+#endif
+  if (rec_clst < 2U)
+  {
+    return FR_DENIED;
+  }
+
+  /* Fill the volume, then punch the holes */
+  for (i = 0; i < BENCH_FILL_FILES; i++)
+  {
+    snprintf(name, sizeof(name), "%s" BENCH_FILL_NAME, path, (unsigned long)i);
+    res = f_open(&bench_file, name, FA_WRITE | FA_CREATE_ALWAYS);
+    if (res != FR_OK)
+    {
+      break;
+    }
+    res = f_expand(&bench_file, rec_clst * cluster, 1);
+    f_close(&bench_file);
+    if (res != FR_OK)
+    {
+      f_unlink(name);
+      break;
+    }
+  }
+  if (res != FR_OK)
+  {
+    BENCH_FillUnlink(path, i, 0);
+    return res;
+  }
+  for (i = BENCH_FILL_HOLE_EVERY / 2U; i < BENCH_FILL_FILES; i += BENCH_FILL_HOLE_EVERY)
+  {
+    snprintf(name, sizeof(name), "%s" BENCH_FILL_NAME, path, (unsigned long)i);
+    res = f_unlink(name);
+    if (res != FR_OK)
+    {
+      BENCH_FillUnlink(path, BENCH_FILL_FILES, 0);
+      return res;
+    }
+  }
+
+  /* Remount, as after a reset, until the free space is known */
+  start = BENCH_Ticks();
+  res = f_mount(fs, path, 1);
+  if (res == FR_OK)
+  {
+    res = f_getfree(path, &free_clst, &fs);
+  }
+  mount_ticks = BENCH_Ticks() - start;
+
+  /* Grow a file over two and a half holes, one cluster per call */
+  memset(bench_hist, 0, sizeof(bench_hist));
+  grow_clst = rec_clst * 5U / 2U;
+  snprintf(name, sizeof(name), "%s%s", path, BENCH_FILE_NAME);
+  if (res == FR_OK)
+  {
+    res = f_open(&bench_file, name, FA_WRITE | FA_CREATE_ALWAYS);
+  }
+  if (res == FR_OK)
+  {
+    res = f_getfree(path, &open_clst, &fs);  /* Its entry may have taken one */
+  }
+  for (i = 0; res == FR_OK && i < grow_clst; i++)
+  {
+    start = BENCH_Ticks();
+    res = f_lseek(&bench_file, (i + 1U) * cluster);
+    ticks = BENCH_Ticks() - start;
+    if (res == FR_OK && f_tell(&bench_file) != (i + 1U) * cluster)
+    {
+      res = FR_DENIED;  /* Volume full */
+    }
+    bench_hist[BENCH_Bucket(ticks)]++;
+    if (i == 0)
+    {
+      first_ticks = ticks;
+    }
+    if (ticks > max_ticks)
+    {
+      max_ticks = ticks;
+    }
+  }
+  if (i)
+  {
+    f_close(&bench_file);
+    if (res == FR_OK)
+    {
+      /* It spans several holes, so every fragment must come back with it */
+      res = f_unlink(name);
+      if (res == FR_OK)
+      {
+        res = f_getfree(path, &left_clst, &fs);
+      }
+      if (res == FR_OK && left_clst != open_clst)
+      {
+        printf("fill: %lu clusters not freed with the grown file.\n",
+               (unsigned long)(open_clst - left_clst));
+        res = FR_INT_ERR;
+      }
+    }
+    else
+    {
+      f_unlink(name);
+    }
+  }
+
+  /* No hole can hold this, so the search covers the whole volume */
+  run_ticks = 0;
+  run_res = FR_OK;
+  if (res == FR_OK)
+  {
+    res = f_open(&bench_file, name, FA_WRITE | FA_CREATE_ALWAYS);
+  }
+  if (res == FR_OK)
+  {
+    start = BENCH_Ticks();
+    run_res = f_expand(&bench_file, (FSIZE_t)(rec_clst + 1U) * cluster, 0);
+    run_ticks = BENCH_Ticks() - start;
+    f_close(&bench_file);
+    res = f_unlink(name);
+  }
+
+  if (res == FR_OK)
+  {
+    res = BENCH_FillUnlink(path, BENCH_FILL_FILES, BENCH_FILL_HOLE_EVERY);
+  }
+  else
+  {
+    BENCH_FillUnlink(path, BENCH_FILL_FILES, BENCH_FILL_HOLE_EVERY);
+  }
+  if (res != FR_OK)
+  {
+    return res;
+  }
+
+  printf("fill: %lu files of %lu clusters, %lu clusters free",
+         (unsigned long)BENCH_FILL_FILES, (unsigned long)rec_clst,
+         (unsigned long)free_clst);
+  BENCH_PrintUs("mount", mount_ticks);
+  printf(".\n");
+  printf("fill: %lu clusters allocated", (unsigned long)grow_clst);
+  BENCH_PrintUs("first", first_ticks);
+  BENCH_PrintUs("p50", BENCH_Percentile(grow_clst, 50U, max_ticks));
+  BENCH_PrintUs("p99", BENCH_Percentile(grow_clst, 99U, max_ticks));
+  BENCH_PrintUs("max", max_ticks);
+  BENCH_PrintUs(run_res == FR_DENIED ? "run not found" : "run found", run_ticks);
+  printf(".\n");
+  return FR_OK;
+}
+
+/**
+  * @brief  Records a loop for many times over the slots it has, to show the
+  *         rate holds up as old segments are recorded over
+  * @param  path: logical drive path of a mounted volume
+  * @param  segments: Segments to record
+  * @param  segment_bytes: Size of each, rounded up to whole sectors
+  * @retval FR_OK, or the first FatFs error met
+  * @note   Each segment stands for BENCH_LOOP_SEGMENT_S of recording, written
+  *         in BENCH_PROBE_CHUNK blocks. The run is reported in
+  *         BENCH_LOOP_WINDOWS spans: rate, longest write, segment switch
+  *         included, and window write-backs per segment. An incident is
+  *         locked after the first block of one segment in
+  *         BENCH_LOOP_INCIDENT_EVERY, and timed. The slots are kept, as they
+  *         would be on a recorder.
+  */
+FRESULT BENCH_RunLoop(const char *path, uint32_t segments, uint32_t segment_bytes)
+{
+  FATFS *fs;
+  FRESULT res;
+  uint64_t window_ticks = 0;
+  uint64_t window_bytes = 0;
+  uint64_t centi_mbps;
+  uint32_t window;
+  uint32_t window_start = 0;
+  uint32_t wc_start;
+  uint32_t max_ticks = 0;
+  uint32_t lock_ticks = 0;
+  uint32_t incidents = 0;
+  uint32_t open_ticks;
+  uint32_t start;
+  uint32_t ticks;
+  uint32_t left;
+  uint32_t chunk;
+  uint32_t i;
+
+  BENCH_TimerInit();
+  BENCH_InitData();
+  start = BENCH_Ticks();
+  res = LOOP_Open(&bench_loop, path, segment_bytes, LOOP_MAX_SLOTS);
+  open_ticks = BENCH_Ticks() - start;
+  if (res != FR_OK)
+  {
+    return res;
+  }
+  fs = bench_loop.index.obj.fs;
+  printf("loop: %lu slots of %lu KiB %s", (unsigned long)bench_loop.n_slots,
+         (unsigned long)(bench_loop.segment_bytes / BENCH_KIB),
+         bench_loop.created ? "allocated" : "found");
+  BENCH_PrintUs("open", open_ticks);
+  printf(", %lu segments of %lu s.\n", (unsigned long)segments,
+         (unsigned long)BENCH_LOOP_SEGMENT_S);
+  if (bench_loop.kept)
+  {
+    printf("loop: %lu locked segments moved to %s%s.\n", (unsigned long)bench_loop.kept,
+           path, LOOP_KEEP_DIR);
+  }
+
+  window = (segments + BENCH_LOOP_WINDOWS - 1U) / BENCH_LOOP_WINDOWS;
+  wc_start = fs->wc_write;
+  for (i = 0; res == FR_OK && i < segments; i++)
+  {
+    for (left = (uint32_t)bench_loop.segment_bytes; res == FR_OK && left; left -= chunk)
+    {
+      chunk = (left < BENCH_PROBE_CHUNK) ? left : BENCH_PROBE_CHUNK;
+      start = BENCH_Ticks();
+      res = LOOP_Write(&bench_loop, bench_data, chunk);
+      ticks = BENCH_Ticks() - start;
+      window_ticks += ticks;
+      window_bytes += chunk;
+      if (ticks > max_ticks)
+      {
+        max_ticks = ticks;
+      }
+
+      if (res == FR_OK && left == bench_loop.segment_bytes &&
+          i % BENCH_LOOP_INCIDENT_EVERY == BENCH_LOOP_INCIDENT_EVERY - 1U)
+      {
+        start = BENCH_Ticks();
+        res = LOOP_Lock(&bench_loop, 1U);
+        ticks = BENCH_Ticks() - start;
+        if (ticks > lock_ticks)
+        {
+          lock_ticks = ticks;
+        }
+        if (res == FR_DENIED)
+        {
+          res = FR_OK;  /* Every slot but one is locked, record on regardless */
+        }
+        else if (res == FR_OK)
+        {
+          incidents++;
+        }
+      }
+    }
+
+    if (res == FR_OK && (i + 1U == segments || (i + 1U) % window == 0))
+    {
+      centi_mbps = window_ticks ?
+                   window_bytes * BENCH_TicksPerUs() * 100U / window_ticks : 0;
+      printf("loop: hours %5lu to %5lu: %lu.%02lu MB/s",
+             (unsigned long)((uint64_t)window_start * BENCH_LOOP_SEGMENT_S / 3600U),
+             (unsigned long)((uint64_t)(i + 1U) * BENCH_LOOP_SEGMENT_S / 3600U),
+             (unsigned long)(centi_mbps / 100U), (unsigned long)(centi_mbps % 100U));
+      BENCH_PrintUs("max", max_ticks);
+      printf(", %lu write-backs/segment.\n",
+             (unsigned long)((fs->wc_write - wc_start) / (i + 1U - window_start)));
+      window_start = i + 1U;
+      window_ticks = 0;
+      window_bytes = 0;
+      max_ticks = 0;
+      wc_start = fs->wc_write;
+    }
+  }
+
+  if (res == FR_OK)
+  {
+    res = LOOP_Close(&bench_loop);
+  }
+  else
+  {
+    LOOP_Close(&bench_loop);
+  }
+  if (res == FR_OK)
+  {
+    printf("loop: %lu of %lu segments recorded over older ones.\n",
+           (unsigned long)bench_loop.reused, (unsigned long)bench_loop.segments);
+    printf("loop: %lu incidents, %lu slots locked, %lu passed over",
+           (unsigned long)incidents, (unsigned long)bench_loop.locked,
+           (unsigned long)bench_loop.skipped);
+    BENCH_PrintUs("longest lock", lock_ticks);
+    printf(".\n");
+  }
+  return res;
+}
+
+/**
+  * @brief  Grows a recording and a side file together with f_write, as a
+  *         recorder writing a log alongside its video does
+  * @param  path: logical drive path of a mounted volume
+  * @param  bytes: Bytes of recording, in BENCH_PROBE_CHUNK writes
+  * @retval FR_OK, or the first FatFs error met
+  * @note   The side file takes one byte in BENCH_STREAMS_SIDE, in a write
+  *         after each of the recording's. Both are synced every
+  *         BENCH_STREAMS_SYNC bytes of recording. The longest write of each,
+  *         the window write-backs, and on exFAT whether each file kept clear
+  *         of a FAT chain, are reported. Both files are deleted afterwards.
+  */
+FRESULT BENCH_RunStreams(const char *path, uint32_t bytes)
+{
+  char name[16];
+  char side_name[16];
+  FATFS *fs;
+  FRESULT res;
+  FRESULT side_res;
+  UINT written;
+  uint32_t offset;
+  uint32_t wc_start;
+  uint32_t start;
+  uint32_t ticks;
+  uint32_t max_ticks = 0;
+  uint32_t side_max_ticks = 0;
+  BYTE contiguous = 0;
+  BYTE side_contiguous = 0;
+
+  BENCH_TimerInit();
+  BENCH_InitData();
+  snprintf(name, sizeof(name), "%s%s", path, BENCH_FILE_NAME);
+  snprintf(side_name, sizeof(side_name), "%s%s", path, BENCH_SIDE_NAME);
+  res = f_open(&bench_file, name, FA_WRITE | FA_CREATE_ALWAYS);
+  if (res != FR_OK)
+  {
+    return res;
+  }
+  res = f_open(&bench_side, side_name, FA_WRITE | FA_CREATE_ALWAYS);
+  if (res != FR_OK)
+  {
+    f_close(&bench_file);
+    f_unlink(name);
+    return res;
+  }
+  fs = bench_file.obj.fs;
+  wc_start = fs->wc_write;
+
+  for (offset = 0; res == FR_OK && offset < bytes; offset += BENCH_PROBE_CHUNK)
+  {
+    start = BENCH_Ticks();
+    res = f_write(&bench_file, bench_data, BENCH_PROBE_CHUNK, &written);
+    ticks = BENCH_Ticks() - start;
+    if (res == FR_OK && written != BENCH_PROBE_CHUNK)
+    {
+      res = FR_DENIED;  /* Volume full */
+    }
+    if (ticks > max_ticks)
+    {
+      max_ticks = ticks;
+    }
+
+    if (res == FR_OK)
+    {
+      start = BENCH_Ticks();
+      res = f_write(&bench_side, bench_data, BENCH_PROBE_CHUNK / BENCH_STREAMS_SIDE, &written);
+      ticks = BENCH_Ticks() - start;
+      if (ticks > side_max_ticks)
+      {
+        side_max_ticks = ticks;
+      }
+    }
+
+    if (res == FR_OK && (offset + BENCH_PROBE_CHUNK) % BENCH_STREAMS_SYNC == 0)
+    {
+      res = f_sync(&bench_file);
+      if (res == FR_OK)
+      {
+        res = f_sync(&bench_side);
+      }
+    }
+  }
+
+#if _FS_EXFAT
+  /* Still contiguous, the chain was never written to the FAT */
+  contiguous = (fs->fs_type == FS_EXFAT && bench_file.obj.stat == 2);
+  side_contiguous = (fs->fs_type == FS_EXFAT && bench_side.obj.stat == 2);
+#endif
+  side_res = f_close(&bench_side);
+  if (res == FR_OK)
+  {
+    res = side_res;
+  }
+  side_res = f_close(&bench_file);
+  if (res == FR_OK)
+  {
+    res = side_res;
+  }
+  f_unlink(side_name);
+  f_unlink(name);
+  if (res != FR_OK)
+  {
+    return res;
+  }
+
+  printf("streams: %lu MiB recorded with a side file of %lu MiB",
+         (unsigned long)(bytes / BENCH_MIB),
+         (unsigned long)(bytes / BENCH_STREAMS_SIDE / BENCH_MIB));
+  BENCH_PrintUs("max", max_ticks);
+  BENCH_PrintUs("side max", side_max_ticks);
+  printf(", %lu write-backs.\n", (unsigned long)(fs->wc_write - wc_start));
+#if _FS_EXFAT
+  if (fs->fs_type == FS_EXFAT)
+  {
+    printf("streams: recording %s, side file %s.\n",
+           contiguous ? "contiguous" : "on a FAT chain",
+           side_contiguous ? "contiguous" : "on a FAT chain");
+  }
+#endif
+  return FR_OK;
+}
+
+/**
+  * @brief  Fills a directory with files and times creating them and opening
+  *         them by name as it grows
+  * @param  path: logical drive path of a mounted volume
+  * @param  files: Files to create, named as loop segments are
+  * @retval FR_OK, or the first FatFs error met
+  * @note   At BENCH_DIR_FIRST files, ten times as many, and so on up to the
+  *         last, the average and longest create since the last report, and
+  *         the sectors read per create, are reported. Then BENCH_DIR_OPENS
+  *         files picked at random are opened and closed, and the same is
+  *         reported for the opens. The directory is deleted afterwards.
+  */
+FRESULT BENCH_RunDirectory(const char *path, uint32_t files)
+{
+  char name[24];
+  FATFS *fs;
+  FRESULT res;
+  FRESULT del_res;
+  uint32_t i;
+  uint32_t n;
+  uint32_t next = BENCH_DIR_FIRST;
+  uint32_t seed = 1;
+  uint32_t misses;
+  uint32_t start;
+  uint32_t ticks;
+  uint32_t total_ticks;
+  uint32_t max_ticks;
+  uint32_t span = 0;               /* Files created since the last report */
+  uint32_t span_misses = 0;
+  uint64_t span_ticks = 0;
+  uint32_t span_max = 0;
+  DWORD free_clst;
+
+  BENCH_TimerInit();
+  res = f_getfree(path, &free_clst, &fs);
+  if (res != FR_OK)
+  {
+    return res;
+  }
+  snprintf(name, sizeof(name), "%s%s", path, BENCH_DIR_NAME);
+  res = f_mkdir(name);
+  if (res != FR_OK)
+  {
+    return res;
+  }
+
+  for (i = 0; res == FR_OK && i < files; i++)
+  {
+    snprintf(name, sizeof(name), "%s" BENCH_DIR_FILE_NAME, path, (unsigned long)i);
+    misses = fs->wc_miss;
+    start = BENCH_Ticks();
+    res = f_open(&bench_file, name, FA_WRITE | FA_CREATE_NEW);
+    if (res != FR_OK)
+    {
+      break;
+    }
+    res = f_close(&bench_file);
+    ticks = BENCH_Ticks() - start;
+    span++;
+    span_misses += fs->wc_miss - misses;
+    span_ticks += ticks;
+    if (ticks > span_max)
+    {
+      span_max = ticks;
+    }
+    if (res != FR_OK || (i + 1U != next && i + 1U != files))
+    {
+      continue;
+    }
+    if (i + 1U == next)
+    {
+      next *= 10U;
+    }
+
+    printf("directory: %lu files", (unsigned long)(i + 1U));
+    BENCH_PrintUs("create avg", (uint32_t)(span_ticks / span));
+    BENCH_PrintUs("max", span_max);
+    span_misses = (uint32_t)((uint64_t)span_misses * 100U / span);
+    printf(", %lu.%02lu sectors read per create.\n", (unsigned long)(span_misses / 100U),
+           (unsigned long)(span_misses % 100U));
+    span = 0;
+    span_misses = 0;
+    span_ticks = 0;
+    span_max = 0;
+
+    misses = fs->wc_miss;
+    total_ticks = 0;
+    max_ticks = 0;
+    for (n = 0; res == FR_OK && n < BENCH_DIR_OPENS; n++)
+    {
+      seed = seed * 1103515245U + 12345U;
+      snprintf(name, sizeof(name), "%s" BENCH_DIR_FILE_NAME, path,
+               (unsigned long)((seed >> 8) % (i + 1U)));
+      start = BENCH_Ticks();
+      res = f_open(&bench_file, name, FA_READ);
+      ticks = BENCH_Ticks() - start;
+      if (res == FR_OK)
+      {
+        res = f_close(&bench_file);
+      }
+      total_ticks += ticks;
+      if (ticks > max_ticks)
+      {
+        max_ticks = ticks;
+      }
+    }
+    if (res == FR_OK)
+    {
+      misses = (fs->wc_miss - misses) * 100U / BENCH_DIR_OPENS;
+      printf("directory: %lu files", (unsigned long)(i + 1U));
+      BENCH_PrintUs("open avg", total_ticks / BENCH_DIR_OPENS);
+      BENCH_PrintUs("max", max_ticks);
+      printf(", %lu.%02lu sectors read per open.\n", (unsigned long)(misses / 100U),
+             (unsigned long)(misses % 100U));
+    }
+  }
+
+  /* i files were created */
+  for (n = 0; n < i; n++)
+  {
+    snprintf(name, sizeof(name), "%s" BENCH_DIR_FILE_NAME, path, (unsigned long)n);
+    del_res = f_unlink(name);
+    if (res == FR_OK)
+    {
+      res = del_res;
+    }
+  }
+  snprintf(name, sizeof(name), "%s%s", path, BENCH_DIR_NAME);
+  del_res = f_unlink(name);
+  return (res == FR_OK) ? del_res : res;
+}
+
+/**
+  * @brief  Reads back the profile kept by the last probe
+  * @param  path: logical drive path of a mounted volume
+  * @param  cid: CID of the card in the drive
+  * @param  profile: receives the profile
+  * @retval 1 if a profile of this card was found, 0 otherwise
+  */
+static uint8_t BENCH_LoadProfile(const char *path, const uint32_t *cid, BENCH_Profile *profile)
+{
+  BENCH_ProfileRecord record;
+  char name[16];
+  UINT read = 0;
+
+  snprintf(name, sizeof(name), "%s%s", path, BENCH_PROFILE_NAME);
+  if (f_open(&bench_file, name, FA_READ) != FR_OK)
+  {
+    return 0;
+  }
+  if (f_read(&bench_file, &record, sizeof(record), &read) != FR_OK)
+  {
+    read = 0;
+  }
+  f_close(&bench_file);
+  if ((read != sizeof(record)) || (record.magic != BENCH_PROFILE_MAGIC) ||
+      (memcmp(record.cid, cid, sizeof(record.cid)) != 0))
+  {
+    return 0;
+  }
+
+  *profile = record.profile;
+  profile->cached = 1;
+  return 1;
+}
+
+/**
+  * @brief  Keeps a profile on the card for the next mount
+  * @param  path: logical drive path of a mounted volume
+  * @param  cid: CID of the card in the drive
+  * @param  profile: profile measured by the probe
+  * @retval FR_OK, or the first FatFs error met
+  */
+static FRESULT BENCH_SaveProfile(const char *path, const uint32_t *cid,
+                                 const BENCH_Profile *profile)
+{
+  BENCH_ProfileRecord record;
+  char name[16];
+  FRESULT res;
+  UINT written;
+
+  memset(&record, 0, sizeof(record));
+  record.magic = BENCH_PROFILE_MAGIC;
+  memcpy(record.cid, cid, sizeof(record.cid));
+  record.profile = *profile;
+
+  snprintf(name, sizeof(name), "%s%s", path, BENCH_PROFILE_NAME);
+  res = f_open(&bench_file, name, FA_WRITE | FA_CREATE_ALWAYS);
+  if (res != FR_OK)
+  {
+    return res;
+  }
+  res = f_write(&bench_file, &record, sizeof(record), &written);
+  if (res == FR_OK && written != sizeof(record))
+  {
+    res = FR_DENIED;
+  }
+  if (res == FR_OK)
+  {
+    res = f_close(&bench_file);
+  }
+  else
+  {
+    f_close(&bench_file);
+  }
+  return res;
+}
+
+/**
+  * @brief  Measures how fast the card takes a recording and sizes the
+  *         recording stream to suit
+  * @param  path: logical drive path of a mounted volume
+  * @param  speed_class: Speed Class stated by the card in MB/s, 0 if none
+  * @param  au_sectors: allocation unit stated by the card, 0 if none
+  * @param  cid: CID of the card, or NULL to probe without keeping the result
+  * @param  reprobe: 1 to probe even if this card was profiled before
+  * @param  profile: filled in with the card's figures and the stream to use
+  * @retval FR_OK, or the first FatFs error met
+  * @note   A card is probed once: the profile is kept in BENCH_PROFILE_NAME
+  *         with the CID, and read back on later mounts of the same card.
+  * @note   The probe writes BENCH_PROBE_CHUNK blocks through a recording file
+  *         of BENCH_PROBE_SIZE bytes, or of one allocation unit when that is
+  *         larger, up to BENCH_PROBE_MAX_SIZE. The file is deleted afterwards.
+  */
+FRESULT BENCH_ProfileCard(const char *path, uint32_t speed_class, uint32_t au_sectors,
+                          const uint32_t *cid, uint8_t reprobe, BENCH_Profile *profile)
+{
+  char name[16];
+  FRESULT res;
+  UINT written;
+  uint32_t size;
+  uint32_t offset;
+  uint32_t start;
+  uint32_t ticks;
+  uint32_t max_ticks = 0;
+  uint64_t total_ticks = 0;
+  uint64_t total_us;
+  uint32_t class_kib_s;
+
+  if (cid != NULL && !reprobe && BENCH_LoadProfile(path, cid, profile))
+  {
+    return FR_OK;
+  }
+
+  memset(profile, 0, sizeof(*profile));
+  profile->speed_class = speed_class;
+  profile->au_sectors = au_sectors;
+
+  size = BENCH_PROBE_SIZE;
+  if (au_sectors > size / _MAX_SS)
+  {
+    size = (au_sectors < BENCH_PROBE_MAX_SIZE / _MAX_SS) ? au_sectors * _MAX_SS : BENCH_PROBE_MAX_SIZE;
+    size -= size % BENCH_PROBE_CHUNK;
+  }
+  BENCH_InitData();
+  BENCH_TimerInit();
+
+  /* The extent is pre-erased and AU aligned like any recording */
+  snprintf(name, sizeof(name), "%s%s", path, BENCH_PROBE_NAME);
+  res = REC_Open(&bench_rec, name, size);
+  if (res != FR_OK)
+  {
+    return res;
+  }
+  for (offset = 0; offset < size; offset += BENCH_PROBE_CHUNK)
+  {
+    start = BENCH_Ticks();
+    res = REC_Write(&bench_rec, bench_data, BENCH_PROBE_CHUNK, &written);
+    ticks = BENCH_Ticks() - start;
+    if (res != FR_OK)
+    {
+      REC_Close(&bench_rec);
+      return res;
+    }
+    total_ticks += ticks;
+    if (ticks > max_ticks)
+    {
+      max_ticks = ticks;
+    }
+  }
+  start = BENCH_Ticks();
+  res = REC_Sync(&bench_rec);
+  total_ticks += BENCH_Ticks() - start;
+  if (res == FR_OK)
+  {
+    res = REC_Close(&bench_rec);
+  }
+  else
+  {
+    REC_Close(&bench_rec);
+  }
+  if (res == FR_OK)
+  {
+    res = f_unlink(name);
+  }
+  else
+  {
+    f_unlink(name);
+  }
+  if (res != FR_OK)
+  {
+    return res;
+  }
+
+  total_us = total_ticks / BENCH_TicksPerUs();
+  profile->probe_bytes = size;
+  profile->write_kib_s = total_us ? (uint32_t)((uint64_t)size * 1000000U / BENCH_KIB / total_us) : 0U;
+  profile->max_write_us = max_ticks / BENCH_TicksPerUs();
+
+  /* Leave headroom below the measured rate, but trust the Speed Class where
+   * the card did reach it, as it is guaranteed on AU aligned writes */
+  profile->stream_kib_s = profile->write_kib_s * BENCH_STREAM_MARGIN / 100U;
+  class_kib_s = speed_class * 1000000U / BENCH_KIB;
+  if (class_kib_s > profile->stream_kib_s && class_kib_s <= profile->write_kib_s)
+  {
+    profile->stream_kib_s = class_kib_s;
+  }
+
+  /* Data keeps arriving while the longest write holds up the next one, on
+   * top of the block being written */
+  profile->buffer_kib = (uint32_t)(((uint64_t)profile->stream_kib_s * profile->max_write_us
+                                    + 999999U) / 1000000U) + BENCH_PROBE_CHUNK / BENCH_KIB;
+  return (cid != NULL) ? BENCH_SaveProfile(path, cid, profile) : FR_OK;
+}
+
+/**
+  * @brief  Prints a card profile on one line
+  * @param  profile: profile filled in by BENCH_ProfileCard
+  * @retval None
+  */
+void BENCH_PrintProfile(const BENCH_Profile *profile)
+{
+  printf("card profile: class %lu, AU %lu KiB, %s %lu KiB at %lu KiB/s, "
+         "longest write %lu us; stream %lu KiB/s with %lu KiB buffered.\n",
+         (unsigned long)profile->speed_class, (unsigned long)(profile->au_sectors / 2U),
+         profile->cached ? "kept from a probe of" : "probe",
+         (unsigned long)(profile->probe_bytes / BENCH_KIB), (unsigned long)profile->write_kib_s,
+         (unsigned long)profile->max_write_us, (unsigned long)profile->stream_kib_s,
+         (unsigned long)profile->buffer_kib);
+}
@@ -0,0 +1,304 @@
+/**
+  ******************************************************************************
+  * @file    camera.c
+  * @brief   DCMI capture into the frame ring by double-buffered DMA
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 STMicroelectronics.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+/*
+ * The DMA stream runs in double-buffer mode with both of its memory addresses
+ * pointing at ring slots, so the sensor data lands where the storage writer
+ * will send it to the card and is never copied. Each time one slot fills the
+ * DMA carries on into the other, and the transfer complete interrupt commits
+ * the full slot and points the idle memory address at the next free one. With
+ * the ring full it is pointed at a spill buffer instead and that chunk is
+ * dropped, so the DMA never stops for the card.
+ *
+ * The stream is cut into slot-sized chunks regardless of frame boundaries. A
+ * JPEG stream carries its own start and end markers, and in JPEG mode the
+ * DCMI sends no data between frames, so the recording is the frames back to
+ * back. A raw frame is a whole number of chunks if the slot size divides it.
+ * The partial chunk left at a snapshot's end or at CAM_Stop is padded with
+ * zeros and committed.
+ *
+ * The sensor itself must already be set up to send frames; its registers sit
+ * behind a sensor-specific SCCB/I2C interface this module does not cover.
+ */
+
+/* Includes ------------------------------------------------------------------*/
+#include <string.h>
+#include "main.h"
+#include "camera.h"
+
+/* Private variables ---------------------------------------------------------*/
+extern DCMI_HandleTypeDef hdcmi;
+
+static RING_Buffer *cam_ring;
+static uint32_t cam_mode;
+static volatile uint32_t cam_running;
+
+/* Where each DMA memory address points: a ring slot, or cam_spill. The
+ * interrupts alone touch them while capture runs. */
+static __CCMRAM uint8_t *cam_target[2];
+static __CCMRAM uint32_t cam_held;   /* Ring slots among cam_target[] */
+static __CCMRAM CAM_Stats cam_stats;
+
+/* Receives the chunks that find the ring full, so in SRAM for the DMA */
+static uint8_t cam_spill[CAM_CHUNK_BYTES] __ALIGNED(4);
+
+/* Private function prototypes -----------------------------------------------*/
+static uint8_t *CAM_NextTarget(void);
+static void CAM_ChunkDone(DMA_HandleTypeDef *hdma, uint32_t mem);
+static void CAM_DMAXferM0Cplt(DMA_HandleTypeDef *hdma);
+static void CAM_DMAXferM1Cplt(DMA_HandleTypeDef *hdma);
+static void CAM_DMAError(DMA_HandleTypeDef *hdma);
+static void CAM_Finish(void);
+
+/* Private functions ---------------------------------------------------------*/
+/**
+  * @brief  Chooses where the DMA writes the chunk after those it holds
+  * @retval The next free ring slot, or cam_spill when there is none
+  */
+static uint8_t *CAM_NextTarget(void)
+{
+  uint8_t *slot = (uint8_t *)RING_AcquireAhead(cam_ring, cam_held);
+
+  if (slot == NULL)
+  {
+    return cam_spill;
+  }
+  cam_held++;
+  return slot;
+}
+
+/**
+  * @brief  Commits, or drops, the chunk one DMA memory has just filled, and
+  *         hands that memory its next target
+  * @param  hdma: DCMI DMA handle
+  * @param  mem: 0 or 1, the memory address that filled
+  * @retval None
+  * @note   The DMA is already writing the other memory, so the filled one may
+  *         be changed. Slots are filled, and so committed, in the order
+  *         CAM_NextTarget handed them out.
+  */
+static void CAM_ChunkDone(DMA_HandleTypeDef *hdma, uint32_t mem)
+{
+  if (cam_target[mem] == cam_spill)
+  {
+    cam_stats.dropped++;
+  }
+  else
+  {
+    RING_Commit(cam_ring);
+    cam_held--;
+    cam_stats.chunks++;
+    CAM_ChunkCallback();
+  }
+
+  cam_target[mem] = CAM_NextTarget();
+  HAL_DMAEx_ChangeMemory(hdma, (uint32_t)cam_target[mem], mem ? MEMORY1 : MEMORY0);
+}
+
+static void CAM_DMAXferM0Cplt(DMA_HandleTypeDef *hdma)
+{
+  CAM_ChunkDone(hdma, 0U);
+}
+
+static void CAM_DMAXferM1Cplt(DMA_HandleTypeDef *hdma)
+{
+  CAM_ChunkDone(hdma, 1U);
+}
+
+/**
+  * @brief  Stops capture after a DMA transfer error
+  * @param  hdma: DCMI DMA handle
+  * @retval None
+  */
+static void CAM_DMAError(DMA_HandleTypeDef *hdma)
+{
+  (void)hdma;
+  cam_stats.errors++;
+  __HAL_DCMI_DISABLE(&hdcmi);
+  hdcmi.State = HAL_DCMI_STATE_READY;
+  cam_running = 0;
+}
+
+/**
+  * @brief  Stops the DMA and commits the partial chunk it was filling
+  * @retval None
+  * @note   Called with the DCMI and DMA interrupts unable to run, from one of
+  *         them or with them disabled.
+  */
+static void CAM_Finish(void)
+{
+  DMA_HandleTypeDef *hdma = hdcmi.DMA_Handle;
+  uint32_t mem;
+  uint32_t left;
+
+  // A chunk that filled with the frame's last word is committed first
+  HAL_DMA_IRQHandler(hdma);
+
+  mem = (hdma->Instance->CR & DMA_SxCR_CT) ? 1U : 0U;
+  HAL_DMA_Abort(hdma);
+  __HAL_DCMI_DISABLE(&hdcmi);
+  hdcmi.State = HAL_DCMI_STATE_READY;
+
+  left = __HAL_DMA_GET_COUNTER(hdma) * 4U;
+  if (left < cam_ring->slot_size && cam_target[mem] != cam_spill)
+  {
+    memset(cam_target[mem] + cam_ring->slot_size - left, 0, left);
+    RING_Commit(cam_ring);
+    cam_stats.chunks++;
+    CAM_ChunkCallback();
+  }
+  cam_running = 0;
+}
+
+/* Exported functions --------------------------------------------------------*/
+/**
+  * @brief  Starts capturing into a ring
+  * @param  ring: Ring to fill, its slots in SRAM and at most CAM_CHUNK_BYTES;
+  *         the caller is its consumer
+  * @param  mode: CAM_SNAPSHOT and/or CAM_JPEG, 0 for continuous raw frames
+  * @retval 0, or -1 if capture is already running, the ring does not hold two
+  *         slots or its slots are too large
+  * @note   The statistics restart from zero.
+  */
+int CAM_Start(RING_Buffer *ring, uint32_t mode)
+{
+  DMA_HandleTypeDef *hdma = hdcmi.DMA_Handle;
+
+  if (cam_running || ring->n_slots < 2U || ring->slot_size > CAM_CHUNK_BYTES)
+  {
+    return -1;
+  }
+  cam_ring = ring;
+  cam_mode = mode;
+  cam_held = 0;
+  memset(&cam_stats, 0, sizeof(cam_stats));
+  cam_target[0] = CAM_NextTarget();
+  cam_target[1] = CAM_NextTarget();
+
+  // The mode and JPEG bits may only change with the DCMI disabled
+  __HAL_DCMI_DISABLE(&hdcmi);
+  MODIFY_REG(hdcmi.Instance->CR, DCMI_CR_CM | DCMI_CR_JPEG,
+             ((mode & CAM_SNAPSHOT) ? DCMI_MODE_SNAPSHOT : DCMI_MODE_CONTINUOUS) |
+             ((mode & CAM_JPEG) ? DCMI_JPEG_ENABLE : DCMI_JPEG_DISABLE));
+
+  hdma->XferCpltCallback = CAM_DMAXferM0Cplt;
+  hdma->XferM1CpltCallback = CAM_DMAXferM1Cplt;
+  hdma->XferHalfCpltCallback = NULL;
+  hdma->XferM1HalfCpltCallback = NULL;
+  hdma->XferErrorCallback = CAM_DMAError;
+  if (HAL_DMAEx_MultiBufferStart_IT(hdma, (uint32_t)&hdcmi.Instance->DR,
+                                    (uint32_t)cam_target[0], (uint32_t)cam_target[1],
+                                    ring->slot_size / 4U) != HAL_OK)
+  {
+    return -1;
+  }
+
+  cam_running = 1;
+  hdcmi.State = HAL_DCMI_STATE_BUSY;
+
+  // HAL_DCMI_Init enables an interrupt per line, which capture has no use for
+  __HAL_DCMI_DISABLE_IT(&hdcmi, DCMI_IT_LINE | DCMI_IT_VSYNC);
+  __HAL_DCMI_ENABLE_IT(&hdcmi, DCMI_IT_FRAME | DCMI_IT_OVR | DCMI_IT_ERR);
+  __HAL_DCMI_ENABLE(&hdcmi);
+  hdcmi.Instance->CR |= DCMI_CR_CAPTURE;
+  return 0;
+}
+
+/**
+  * @brief  Stops capturing, committing the partial chunk
+  * @retval None
+  * @note   Not for interrupt context. Does nothing if capture has stopped.
+  */
+void CAM_Stop(void)
+{
+  HAL_NVIC_DisableIRQ(DCMI_IRQn);
+  HAL_NVIC_DisableIRQ(DMA2_Stream1_IRQn);
+  if (cam_running)
+  {
+    hdcmi.Instance->CR &= ~DCMI_CR_CAPTURE;
+    __HAL_DCMI_DISABLE_IT(&hdcmi, DCMI_IT_FRAME | DCMI_IT_OVR | DCMI_IT_ERR);
+    CAM_Finish();
+  }
+  HAL_NVIC_EnableIRQ(DMA2_Stream1_IRQn);
+  HAL_NVIC_EnableIRQ(DCMI_IRQn);
+}
+
+/**
+  * @brief  Tells whether capture is running
+  * @retval 1 while running, 0 once stopped, a snapshot has completed or an
+  *         error has ended capture
+  */
+uint32_t CAM_IsRunning(void)
+{
+  return cam_running;
+}
+
+/**
+  * @brief  Reads the capture statistics
+  * @param  out: Receives the statistics
+  * @retval None
+  */
+void CAM_GetStats(CAM_Stats *out)
+{
+  *out = cam_stats;
+}
+
+/**
+  * @brief  Called from interrupt context each time a chunk is committed
+  * @retval None
+  */
+__weak void CAM_ChunkCallback(void)
+{
+}
+
+/**
+  * @brief  Counts a frame, and ends a snapshot
+  * @param  hdcmi: DCMI handle
+  * @retval None
+  * @note   The HAL disables the frame interrupt each time, so continuous
+  *         capture enables it again.
+  */
+void HAL_DCMI_FrameEventCallback(DCMI_HandleTypeDef *hdcmi)
+{
+  if (!cam_running)
+  {
+    return;
+  }
+  cam_stats.frames++;
+  if (cam_mode & CAM_SNAPSHOT)
+  {
+    CAM_Finish();
+  }
+  else
+  {
+    __HAL_DCMI_ENABLE_IT(hdcmi, DCMI_IT_FRAME);
+  }
+}
+
+/**
+  * @brief  Ends capture after an overrun or a sync error, which the HAL has
+  *         already stopped the DMA for
+  * @param  hdcmi: DCMI handle
+  * @retval None
+  */
+void HAL_DCMI_ErrorCallback(DCMI_HandleTypeDef *hdcmi)
+{
+  cam_stats.errors++;
+  __HAL_DCMI_DISABLE_IT(hdcmi, DCMI_IT_FRAME | DCMI_IT_OVR | DCMI_IT_ERR);
+  __HAL_DCMI_DISABLE(hdcmi);
+  cam_running = 0;
+}
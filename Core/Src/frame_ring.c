@@ -0,0 +1,214 @@
+/**
+  ******************************************************************************
+  * @file    frame_ring.c
+  * @brief   Lock-free ring of frame slots between capture and storage
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 STMicroelectronics.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+/*
+ * One producer, normally an interrupt handler or the capture thread, fills
+ * slots in place: RING_Acquire hands out the next free slot, or NULL when the
+ * ring is full, and RING_Commit publishes it. Neither blocks or loops, so both
+ * may run in interrupt context. One consumer, the storage writer, takes every
+ * filled slot up to the end of the storage with RING_Peek, writes them out in
+ * one go and gives them back with RING_Release.
+ *
+ * Each side writes only its own index, so no lock is needed. The indices run
+ * from 0 to 2 * n_slots - 1, which tells a full ring from an empty one for
+ * any slot count without a division. The memory barriers order the slot data
+ * against the index that hands it over; DMA writes into a slot must have
+ * completed before it is committed.
+ *
+ * A producer that keeps several slots in flight, such as a DMA in
+ * double-buffer mode, looks further ahead with RING_AcquireAhead and commits
+ * the slots in the order they were handed out.
+ *
+ * The slot storage must be in SRAM1/SRAM2, not CCM RAM, if DMA fills slots or
+ * drains them to the card.
+ */
+
+/* Includes ------------------------------------------------------------------*/
+#include <stddef.h>
+#include "frame_ring.h"
+
+#if defined(HOST_BUILD)
+#define __DMB() __sync_synchronize()
+#else
+#include "main.h"
+#endif
+
+/* Private macro -------------------------------------------------------------*/
+/* Slot number of a ring index, and the index after idx + count */
+#define RING_SLOT(ring, idx) \
+  (((idx) < (ring)->n_slots) ? (idx) : (idx) - (ring)->n_slots)
+#define RING_ADVANCE(ring, idx, count) \
+  ((((idx) + (count)) < 2U * (ring)->n_slots) ? \
+   ((idx) + (count)) : ((idx) + (count)) - 2U * (ring)->n_slots)
+
+/* Private function prototypes -----------------------------------------------*/
+static uint32_t RING_Filled(const RING_Buffer *ring, uint32_t head, uint32_t tail);
+
+/* Private functions ---------------------------------------------------------*/
+/**
+  * @brief  Counts the filled slots between two indices
+  * @param  ring: Ring
+  * @param  head: Producer index
+  * @param  tail: Consumer index
+  * @retval Number of filled slots
+  */
+static uint32_t RING_Filled(const RING_Buffer *ring, uint32_t head, uint32_t tail)
+{
+  return (head >= tail) ? head - tail : head + 2U * ring->n_slots - tail;
+}
+
+/* Exported functions --------------------------------------------------------*/
+/**
+  * @brief  Lays a ring out over a buffer, empty
+  * @param  ring: Ring to initialise
+  * @param  buff: Slot storage, aligned up to RING_ALIGN if it is not
+  * @param  size: Bytes of storage
+  * @param  slot_size: Bytes per slot, a multiple of 4
+  * @retval Number of slots, 0 if the storage does not hold one
+  * @note   Neither side may be using the ring while it is initialised.
+  */
+uint32_t RING_Init(RING_Buffer *ring, void *buff, uint32_t size, uint32_t slot_size)
+{
+  uint32_t pad = (RING_ALIGN - ((uintptr_t)buff & (RING_ALIGN - 1U))) & (RING_ALIGN - 1U);
+
+  ring->slots = (uint8_t *)buff + pad;
+  ring->slot_size = slot_size;
+  ring->n_slots = (size > pad && slot_size != 0 && (slot_size & 3U) == 0) ?
+                  (size - pad) / slot_size : 0U;
+  ring->head = 0;
+  ring->tail = 0;
+  ring->pushed = 0;
+  ring->dropped = 0;
+  ring->high_water = 0;
+  return ring->n_slots;
+}
+
+/**
+  * @brief  Gives the producer the next free slot to fill
+  * @param  ring: Ring
+  * @retval Slot, slot_size bytes, or NULL when the ring is full. A full ring
+  *         counts the frame as dropped.
+  * @note   Producer side, wait-free and safe in interrupt context. The same
+  *         slot is returned until it is committed.
+  */
+void *RING_Acquire(RING_Buffer *ring)
+{
+  void *slot = RING_AcquireAhead(ring, 0U);
+
+  if (slot == NULL)
+  {
+    ring->dropped++;
+  }
+  return slot;
+}
+
+/**
+  * @brief  Gives the producer a free slot beyond those it already holds
+  * @param  ring: Ring
+  * @param  ahead: Slots acquired and not yet committed; 0 gives the same slot
+  *         as RING_Acquire
+  * @retval Slot, slot_size bytes, or NULL when fewer than ahead + 1 slots are
+  *         free. Nothing is counted as dropped.
+  * @note   Producer side, wait-free and safe in interrupt context.
+  */
+void *RING_AcquireAhead(RING_Buffer *ring, uint32_t ahead)
+{
+  uint32_t head = ring->head;
+
+  if (RING_Filled(ring, head, ring->tail) + ahead >= ring->n_slots)
+  {
+    return NULL;
+  }
+  head = RING_ADVANCE(ring, head, ahead);
+  return ring->slots + RING_SLOT(ring, head) * ring->slot_size;
+}
+
+/**
+  * @brief  Hands the oldest acquired slot to the consumer
+  * @param  ring: Ring
+  * @retval None
+  * @note   Producer side, wait-free and safe in interrupt context.
+  */
+void RING_Commit(RING_Buffer *ring)
+{
+  uint32_t head = RING_ADVANCE(ring, ring->head, 1U);
+  uint32_t filled = RING_Filled(ring, head, ring->tail);
+
+  /* The slot contents must be visible before the index that publishes them */
+  __DMB();
+  ring->head = head;
+  ring->pushed++;
+  if (filled > ring->high_water)
+  {
+    ring->high_water = filled;
+  }
+}
+
+/**
+  * @brief  Finds the filled slots the consumer can take in one run
+  * @param  ring: Ring
+  * @param  first: Receives the oldest filled slot
+  * @retval Number of filled slots from first, stopping at the end of the
+  *         storage, so count * slot_size bytes may be read from first
+  * @note   Consumer side. The slots stay filled until RING_Release.
+  */
+uint32_t RING_Peek(RING_Buffer *ring, uint8_t **first)
+{
+  uint32_t tail = ring->tail;
+  uint32_t slot = RING_SLOT(ring, tail);
+  uint32_t count = RING_Filled(ring, ring->head, tail);
+
+  /* Read the slots only after the index that published them */
+  __DMB();
+  if (count > ring->n_slots - slot)
+  {
+    count = ring->n_slots - slot;
+  }
+  *first = ring->slots + slot * ring->slot_size;
+  return count;
+}
+
+/**
+  * @brief  Returns the oldest filled slots to the producer
+  * @param  ring: Ring
+  * @param  count: Slots to release, at most what RING_Peek returned
+  * @retval None
+  * @note   Consumer side.
+  */
+void RING_Release(RING_Buffer *ring, uint32_t count)
+{
+  /* Finish reading the slots before the producer may refill them */
+  __DMB();
+  ring->tail = RING_ADVANCE(ring, ring->tail, count);
+}
+
+/**
+  * @brief  Reads the ring statistics
+  * @param  ring: Ring
+  * @param  out: Receives the statistics
+  * @retval None
+  * @note   Either side, or a third party; the fields are read one at a time,
+  *         so they may be from slightly different moments.
+  */
+void RING_GetStats(const RING_Buffer *ring, RING_Stats *out)
+{
+  out->n_slots = ring->n_slots;
+  out->filled = RING_Filled(ring, ring->head, ring->tail);
+  out->pushed = ring->pushed;
+  out->dropped = ring->dropped;
+  out->high_water = ring->high_water;
+}
@@ -23,6 +23,11 @@
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
 #include <stdio.h>
+#include "benchmark.h"
+#if defined(APP_RTOS)
+#include "cmsis_os.h"
+#include "app_rtos.h"
+#endif
 /* USER CODE END Includes */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -33,7 +38,8 @@
 /* Private define ------------------------------------------------------------*/
 /* USER CODE BEGIN PD */
 #define FATFS_BUFFER_SIZE 64
-#define FATFS_DUMMY_DATA_SIZE 1024
+#define CARD_SPEED_CHUNK_SECTORS 16
+#define CARD_SPEED_TOTAL_SECTORS 512
 /* USER CODE END PD */
 
 /* Private macro -------------------------------------------------------------*/
@@ -42,20 +48,29 @@
 /* USER CODE END PM */
 
 /* Private variables ---------------------------------------------------------*/
+DCMI_HandleTypeDef hdcmi;
+DMA_HandleTypeDef hdma_dcmi;
+
 SD_HandleTypeDef hsd;
+DMA_HandleTypeDef hdma_sdio_rx;
+DMA_HandleTypeDef hdma_sdio_tx;
 
 /* USER CODE BEGIN PV */
 static FRESULT fatfs_err;
-static const unsigned char fatfs_dummy_data[FATFS_DUMMY_DATA_SIZE] = {0};
-unsigned int fatfs_written_bytes;
+static SD_DiskStats sd_stats;
+static BENCH_Profile card_profile;
+static uint32_t card_speed_buffer[CARD_SPEED_CHUNK_SECTORS * 512 / 4];
 /* USER CODE END PV */
 
 /* Private function prototypes -----------------------------------------------*/
 void SystemClock_Config(void);
 static void MX_GPIO_Init(void);
+static void MX_DMA_Init(void);
 static void MX_SDIO_SD_Init(void);
+static void MX_DCMI_Init(void);
 /* USER CODE BEGIN PFP */
 extern void initialise_monitor_handles(void);
+static void report_card_speed(void);
 /* USER CODE END PFP */
 
 /* Private user code ---------------------------------------------------------*/
@@ -87,14 +102,25 @@ int main(void)
   SystemClock_Config();
 
   /* USER CODE BEGIN SysInit */
-
+  printf("core clock: %lu MHz.\n", (unsigned long)(HAL_RCC_GetSysClockFreq() / 1000000U));
   /* USER CODE END SysInit */
 
   /* Initialize all configured peripherals */
   MX_GPIO_Init();
+  MX_DMA_Init();
   MX_SDIO_SD_Init();
   MX_FATFS_Init();
+  MX_DCMI_Init();
   /* USER CODE BEGIN 2 */
+#if defined(APP_RTOS)
+  // Capture, storage and housekeeping run as threads, see app_rtos.c
+  osKernelInitialize();
+  APP_RTOS_Init();
+  osKernelStart();
+#else
+  // Time CPU-bound work, which scales with the core clock
+  BENCH_RunCpu();
+
   // Mount SD card drive
   if ((fatfs_err = f_mount(&SDFatFS, SDPath, 1))) {
     printf("failed to mount card, code: %i.\n", fatfs_err);
@@ -103,35 +129,54 @@ int main(void)
       exit(fatfs_err);
     }
     printf("continuing.\n");
+  } else {
+    report_card_speed();
+
+    // Measure what the card sustains, to size the recording stream. A card
+    // is probed once, or again while the user button is held.
+    SD_GetStats(&sd_stats);
+    if ((fatfs_err = BENCH_ProfileCard(SDPath, sd_stats.speed_class, sd_stats.au_sectors,
+                                       sd_stats.cid,
+                                       HAL_GPIO_ReadPin(USER_Btn_GPIO_Port, USER_Btn_Pin) == GPIO_PIN_SET,
+                                       &card_profile))) {
+      printf("card profile failed, code: %i.\n", fatfs_err);
+    } else {
+      BENCH_PrintProfile(&card_profile);
+    }
   }
 
-  // Open file
-  if ((fatfs_err = f_open(&SDFile, "test.txt", FA_WRITE | FA_CREATE_ALWAYS))) {
-    printf("failed to open file, code: %i.\n", fatfs_err);
-    printf("exiting.\n");
-    exit(fatfs_err);
-  }
-
-  // Write to file
-  if ((fatfs_err = f_write(&SDFile,
-                           fatfs_dummy_data,
-                           FATFS_DUMMY_DATA_SIZE,
-                           &fatfs_written_bytes))) {
-    printf("failed to write file, code: %i\n", fatfs_err);
+  // Sweep write size, file size and sync interval over semihosting
+  if ((fatfs_err = BENCH_Run(SDPath))) {
+    printf("benchmark failed, code: %i.\n", fatfs_err);
     printf("exiting.\n");
     exit(fatfs_err);
   }
-  if (fatfs_written_bytes != FATFS_DUMMY_DATA_SIZE) {
-    printf("wrote %i bytes, less than the expected %i.\n",
-           fatfs_written_bytes, FATFS_DUMMY_DATA_SIZE);
-  }
 
-  // Close file
-  if ((fatfs_err = f_close(&SDFile))) {
-    printf("failed to close file, code: %i.\n", fatfs_err);
-    printf("exiting.\n");
-    exit(fatfs_err);
-  }
+  // Report how many card commands the transfers took
+  SD_GetStats(&sd_stats);
+  printf("card writes: %lu commands, %lu per MiB.\n",
+         (unsigned long)sd_stats.wr_cmds,
+         (unsigned long)SD_CMDS_PER_MIB(sd_stats.wr_cmds, sd_stats.wr_sectors));
+  printf("card reads: %lu commands, %lu per MiB.\n",
+         (unsigned long)sd_stats.rd_cmds,
+         (unsigned long)SD_CMDS_PER_MIB(sd_stats.rd_cmds, sd_stats.rd_sectors));
+  printf("stop commands: %lu.\n", (unsigned long)sd_stats.stop_cmds);
+  printf("card class: %lu MB/s, allocation unit %lu KiB, write factor x%lu.\n",
+         (unsigned long)sd_stats.speed_class, (unsigned long)(sd_stats.au_sectors / 2U),
+         (unsigned long)(1U << sd_stats.wr_factor));
+  printf("pre-erase: %lu commands, %lu KiB, %lu ranges dropped.\n",
+         (unsigned long)sd_stats.erase_cmds, (unsigned long)(sd_stats.erase_sectors / 2U),
+         (unsigned long)sd_stats.erase_dropped);
+  printf("write copies: %lu bytes, %lu per MiB.\n",
+         (unsigned long)sd_stats.wr_copied,
+         (unsigned long)(sd_stats.wr_sectors ?
+                         (uint64_t)sd_stats.wr_copied * 2048U / sd_stats.wr_sectors : 0U));
+
+  // Report how often FAT and directory sectors came from the window cache
+  printf("fatfs window: %lu hits, %lu misses, %lu write-backs.\n",
+         (unsigned long)SDFatFS.wc_hit, (unsigned long)SDFatFS.wc_miss,
+         (unsigned long)SDFatFS.wc_write);
+#endif
   /* USER CODE END 2 */
 
   /* Infinite loop */
@@ -142,6 +187,7 @@ int main(void)
     /* USER CODE END WHILE */
 
     /* USER CODE BEGIN 3 */
+    SD_Idle_Poll();
     HAL_GPIO_TogglePin(LD3_GPIO_Port, LD3_Pin);
     HAL_Delay(500);
   }
@@ -160,11 +206,16 @@ void SystemClock_Config(void)
   /** Configure the main internal regulator output voltage
   */
   __HAL_RCC_PWR_CLK_ENABLE();
+#if SYSCLK_MHZ == 96
   __HAL_PWR_VOLTAGESCALING_CONFIG(PWR_REGULATOR_VOLTAGE_SCALE3);
+#else
+  __HAL_PWR_VOLTAGESCALING_CONFIG(PWR_REGULATOR_VOLTAGE_SCALE1);
+#endif
 
   /** Initializes the RCC Oscillators according to the specified parameters
   * in the RCC_OscInitTypeDef structure.
   */
+#if SYSCLK_MHZ == 96
   RCC_OscInitStruct.OscillatorType = RCC_OSCILLATORTYPE_HSI;
   RCC_OscInitStruct.HSIState = RCC_HSI_ON;
   RCC_OscInitStruct.HSICalibrationValue = RCC_HSICALIBRATION_DEFAULT;
@@ -174,24 +225,97 @@ void SystemClock_Config(void)
   RCC_OscInitStruct.PLL.PLLN = 192;
   RCC_OscInitStruct.PLL.PLLP = RCC_PLLP_DIV2;
   RCC_OscInitStruct.PLL.PLLQ = 4;
+#elif SYSCLK_MHZ == 168 || SYSCLK_MHZ == 180
+  /* 8 MHz from the ST-LINK MCO on PH0, 2 MHz into the PLL, VCO at twice
+     the core clock */
+  RCC_OscInitStruct.OscillatorType = RCC_OSCILLATORTYPE_HSE;
+  RCC_OscInitStruct.HSEState = RCC_HSE_BYPASS;
+  RCC_OscInitStruct.PLL.PLLState = RCC_PLL_ON;
+  RCC_OscInitStruct.PLL.PLLSource = RCC_PLLSOURCE_HSE;
+  RCC_OscInitStruct.PLL.PLLM = 4;
+  RCC_OscInitStruct.PLL.PLLN = SYSCLK_MHZ;
+  RCC_OscInitStruct.PLL.PLLP = RCC_PLLP_DIV2;
+#if SYSCLK_MHZ == 168
+  RCC_OscInitStruct.PLL.PLLQ = 7;
+#else
+  RCC_OscInitStruct.PLL.PLLQ = 8;
+#endif
+#else
+#error "SYSCLK_MHZ must be 96, 168 or 180"
+#endif
   if (HAL_RCC_OscConfig(&RCC_OscInitStruct) != HAL_OK)
   {
     Error_Handler();
   }
 
+#if SYSCLK_MHZ == 180
+  /** Activate the Over-Drive mode
+  */
+  if (HAL_PWREx_EnableOverDrive() != HAL_OK)
+  {
+    Error_Handler();
+  }
+#endif
+
   /** Initializes the CPU, AHB and APB buses clocks
   */
   RCC_ClkInitStruct.ClockType = RCC_CLOCKTYPE_HCLK|RCC_CLOCKTYPE_SYSCLK
                               |RCC_CLOCKTYPE_PCLK1|RCC_CLOCKTYPE_PCLK2;
-  RCC_ClkInitStruct.SYSCLKSource = RCC_SYSCLKSOURCE_HSI;
+  RCC_ClkInitStruct.SYSCLKSource = RCC_SYSCLKSOURCE_PLLCLK;
   RCC_ClkInitStruct.AHBCLKDivider = RCC_SYSCLK_DIV1;
-  RCC_ClkInitStruct.APB1CLKDivider = RCC_HCLK_DIV2;
-  RCC_ClkInitStruct.APB2CLKDivider = RCC_HCLK_DIV1;
+  RCC_ClkInitStruct.APB1CLKDivider = RCC_HCLK_DIV4;
+  RCC_ClkInitStruct.APB2CLKDivider = RCC_HCLK_DIV2;
+
+#if SYSCLK_MHZ == 96
+  if (HAL_RCC_ClockConfig(&RCC_ClkInitStruct, FLASH_LATENCY_3) != HAL_OK)
+#else
+  if (HAL_RCC_ClockConfig(&RCC_ClkInitStruct, FLASH_LATENCY_5) != HAL_OK)
+#endif
+  {
+    Error_Handler();
+  }
+
+  /* HAL_Init turned on prefetch and the ART caches; keep them on at the new
+     wait states */
+  __HAL_FLASH_PREFETCH_BUFFER_ENABLE();
+  __HAL_FLASH_INSTRUCTION_CACHE_ENABLE();
+  __HAL_FLASH_DATA_CACHE_ENABLE();
+}
 
-  if (HAL_RCC_ClockConfig(&RCC_ClkInitStruct, FLASH_LATENCY_0) != HAL_OK)
+/**
+  * @brief DCMI Initialization Function
+  * @param None
+  * @retval None
+  */
+static void MX_DCMI_Init(void)
+{
+
+  /* USER CODE BEGIN DCMI_Init 0 */
+#if !defined(APP_CAMERA)
+  // Without the camera its pins are left to the board's other functions
+  return;
+#endif
+  /* USER CODE END DCMI_Init 0 */
+
+  /* USER CODE BEGIN DCMI_Init 1 */
+
+  /* USER CODE END DCMI_Init 1 */
+  hdcmi.Instance = DCMI;
+  hdcmi.Init.SynchroMode = DCMI_SYNCHRO_HARDWARE;
+  hdcmi.Init.PCKPolarity = DCMI_PCKPOLARITY_RISING;
+  hdcmi.Init.VSPolarity = DCMI_VSPOLARITY_LOW;
+  hdcmi.Init.HSPolarity = DCMI_HSPOLARITY_LOW;
+  hdcmi.Init.CaptureRate = DCMI_CR_ALL_FRAME;
+  hdcmi.Init.ExtendedDataMode = DCMI_EXTEND_DATA_8B;
+  hdcmi.Init.JPEGMode = DCMI_JPEG_ENABLE;
+  if (HAL_DCMI_Init(&hdcmi) != HAL_OK)
   {
     Error_Handler();
   }
+  /* USER CODE BEGIN DCMI_Init 2 */
+
+  /* USER CODE END DCMI_Init 2 */
+
 }
 
 /**
@@ -214,13 +338,35 @@ static void MX_SDIO_SD_Init(void)
   hsd.Init.ClockPowerSave = SDIO_CLOCK_POWER_SAVE_DISABLE;
   hsd.Init.BusWide = SDIO_BUS_WIDE_1B;
   hsd.Init.HardwareFlowControl = SDIO_HARDWARE_FLOW_CONTROL_DISABLE;
-  hsd.Init.ClockDiv = 118;
+  hsd.Init.ClockDiv = 0;
   /* USER CODE BEGIN SDIO_Init 2 */
 
   /* USER CODE END SDIO_Init 2 */
 
 }
 
+/**
+  * Enable DMA controller clock
+  */
+static void MX_DMA_Init(void)
+{
+
+  /* DMA controller clock enable */
+  __HAL_RCC_DMA2_CLK_ENABLE();
+
+  /* DMA interrupt init */
+  /* DMA2_Stream1_IRQn interrupt configuration */
+  HAL_NVIC_SetPriority(DMA2_Stream1_IRQn, CAM_IRQ_PRIORITY, 0);
+  HAL_NVIC_EnableIRQ(DMA2_Stream1_IRQn);
+  /* DMA2_Stream3_IRQn interrupt configuration */
+  HAL_NVIC_SetPriority(DMA2_Stream3_IRQn, SD_IRQ_PRIORITY, 0);
+  HAL_NVIC_EnableIRQ(DMA2_Stream3_IRQn);
+  /* DMA2_Stream6_IRQn interrupt configuration */
+  HAL_NVIC_SetPriority(DMA2_Stream6_IRQn, SD_IRQ_PRIORITY, 0);
+  HAL_NVIC_EnableIRQ(DMA2_Stream6_IRQn);
+
+}
+
 /**
   * @brief GPIO Initialization Function
   * @param None
@@ -289,11 +435,17 @@ static void MX_GPIO_Init(void)
   GPIO_InitStruct.Alternate = GPIO_AF7_USART3;
   HAL_GPIO_Init(GPIOD, &GPIO_InitStruct);
 
-  /*Configure GPIO pins : SD_CD_Pin USB_OverCurrent_Pin */
-  GPIO_InitStruct.Pin = SD_CD_Pin|USB_OverCurrent_Pin;
+  /*Configure GPIO pin : SD_CD_Pin */
+  GPIO_InitStruct.Pin = SD_CD_Pin;
+  GPIO_InitStruct.Mode = GPIO_MODE_IT_RISING_FALLING;
+  GPIO_InitStruct.Pull = GPIO_NOPULL;
+  HAL_GPIO_Init(SD_CD_GPIO_Port, &GPIO_InitStruct);
+
+  /*Configure GPIO pin : USB_OverCurrent_Pin */
+  GPIO_InitStruct.Pin = USB_OverCurrent_Pin;
   GPIO_InitStruct.Mode = GPIO_MODE_INPUT;
   GPIO_InitStruct.Pull = GPIO_NOPULL;
-  HAL_GPIO_Init(GPIOG, &GPIO_InitStruct);
+  HAL_GPIO_Init(USB_OverCurrent_GPIO_Port, &GPIO_InitStruct);
 
   /*Configure GPIO pin : USB_PowerSwitchOn_Pin */
   GPIO_InitStruct.Pin = USB_PowerSwitchOn_Pin;
@@ -324,12 +476,74 @@ static void MX_GPIO_Init(void)
   GPIO_InitStruct.Alternate = GPIO_AF11_ETH;
   HAL_GPIO_Init(GPIOG, &GPIO_InitStruct);
 
+  /* EXTI interrupt init*/
+  HAL_NVIC_SetPriority(EXTI2_IRQn, CD_IRQ_PRIORITY, 0);
+  HAL_NVIC_EnableIRQ(EXTI2_IRQn);
+
+  HAL_NVIC_SetPriority(EXTI15_10_IRQn, BTN_IRQ_PRIORITY, 0);
+  HAL_NVIC_EnableIRQ(EXTI15_10_IRQn);
+
 }
 
 /* USER CODE BEGIN 4 */
+/**
+  * @brief Prints the negotiated SD bus mode and the raw read throughput it gives
+  * @retval None
+  */
+static void report_card_speed(void)
+{
+  uint32_t start;
+  uint32_t elapsed;
+  DWORD sector;
+
+  printf("card bus: %s at %lu kHz.\n",
+         BSP_SD_GetBusModeName(), (unsigned long)(BSP_SD_GetBusClock() / 1000));
+
+  start = HAL_GetTick();
+  for (sector = 0; sector < CARD_SPEED_TOTAL_SECTORS; sector += CARD_SPEED_CHUNK_SECTORS) {
+    if (disk_read(SDFatFS.drv, (BYTE *)card_speed_buffer, sector,
+                  CARD_SPEED_CHUNK_SECTORS) != RES_OK) {
+      printf("card read failed at sector %lu.\n", (unsigned long)sector);
+      return;
+    }
+  }
+  elapsed = HAL_GetTick() - start;
 
+  // Sectors are 512 B, so sectors / 2 is KiB
+  printf("card read: %lu KiB in %lu ms", (unsigned long)(CARD_SPEED_TOTAL_SECTORS / 2),
+         (unsigned long)elapsed);
+  if (elapsed) {
+    printf(", %lu KiB/s", (unsigned long)(CARD_SPEED_TOTAL_SECTORS / 2 * 1000 / elapsed));
+  }
+  printf(".\n");
+}
 /* USER CODE END 4 */
 
+#if defined(APP_RTOS)
+/**
+  * @brief  Period elapsed callback in non blocking mode
+  * @note   This function is called  when TIM6 interrupt took place, inside
+  * HAL_TIM_IRQHandler(). It makes a direct call to HAL_IncTick() to increment
+  * a global variable "uwTick" used as application time base.
+  * @param  htim : TIM handle
+  * @retval None
+  */
+void HAL_TIM_PeriodElapsedCallback(TIM_HandleTypeDef *htim)
+{
+  /* USER CODE BEGIN Callback 0 */
+
+  /* USER CODE END Callback 0 */
+  if (htim->Instance == TIM6) {
+    HAL_IncTick();
+  }
+  /* USER CODE BEGIN Callback 1 */
+  if (htim->Instance == TIM6) {
+    SD_Tick();
+  }
+  /* USER CODE END Callback 1 */
+}
+#endif
+
 /**
   * @brief  This function is executed in case of error occurrence.
   * @retval None
@@ -20,7 +20,7 @@
 
 uint8_t retSD;    /* Return value for SD */
 char SDPath[4];   /* SD logical drive path */
-FATFS SDFatFS;    /* File system object for SD logical drive */
+_FS_CCMRAM FATFS SDFatFS;    /* File system object for SD logical drive */
 FIL SDFile;       /* File object for SD */
 
 /* USER CODE BEGIN Variables */
@@ -30,7 +30,11 @@ FIL SDFile;       /* File object for SD */
 void MX_FATFS_Init(void)
 {
   /*## FatFS: Link the SD driver ###########################*/
+#if defined(HOST_BUILD)
+  retSD = FATFS_LinkDriver(&IMAGE_Driver, SDPath);
+#else
   retSD = FATFS_LinkDriver(&SD_Driver, SDPath);
+#endif
 
   /* USER CODE BEGIN Init */
   if (retSD != 0) {
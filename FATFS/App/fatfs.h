@@ -25,9 +25,14 @@
 
 #include "ff.h"
 #include "ff_gen_drv.h"
+#if defined(HOST_BUILD)
+#include "image_diskio.h" /* the host build stands a disk image in for the card */
+#else
 #include "sd_diskio.h" /* defines SD_Driver as external */
+#endif
 
 /* USER CODE BEGIN Includes */
+#include <stdlib.h> /* exit() in MX_FATFS_Init */
 
 /* USER CODE END Includes */
 
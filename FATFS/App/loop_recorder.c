@@ -0,0 +1,718 @@
+/**
+  ******************************************************************************
+  * @file    loop_recorder.c
+  * @brief   Loop recording over a fixed set of preallocated segment files
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 STMicroelectronics.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+/*
+ * The first LOOP_Open on a volume fills its free space with slot files, each
+ * a recording file (see recorder.c) of one segment's capacity, as a single
+ * contiguous extent. From then on the recorder only ever records over them,
+ * in turn: when a segment fills, or the caller cuts it, the next slot is
+ * reopened and written from its start. The slot after the newest segment
+ * always holds the oldest, so reclaiming it takes no search, and no file is
+ * ever deleted or grown, so the FAT, the free space and the directory never
+ * change and the volume cannot fragment however long the loop runs.
+ *
+ * The slot files keep their full size on the disk. An index file holds, for
+ * each slot, the number of the segment in it and how many bytes of it are
+ * data. A slot's record is marked open before the slot is recorded over and
+ * completed when it is closed, so after a reset the index still tells which
+ * segment was cut off.
+ *
+ * LOOP_Lock keeps the open segment and those just before it, e.g. around an
+ * incident, by setting a flag in their index records. The loop then passes
+ * over their slots, so the footage stays where it was recorded and nothing is
+ * copied. The recorder remembers which slots its newest segments are in, so
+ * a lock writes a few words of the index and syncs it, without searching.
+ * Locked slots stay out of the loop until it is allocated afresh, e.g. for
+ * another segment size or after a reset cut the allocation short. Their files
+ * are first moved out of the loop directory, to LOOP_KEEP_DIR, and the index
+ * is only rewritten once every one of them has been moved.
+ */
+
+/* Includes ------------------------------------------------------------------*/
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "loop_recorder.h"
+
+/* Private define ------------------------------------------------------------*/
+/* The index starts with a header record, then one LOOP_Slot per slot */
+#define LOOP_MAGIC    0x504F4F4CU   /* "LOOP" */
+#define LOOP_VERSION  1U
+#define LOOP_SS       _MAX_SS
+
+/* Clusters left free when the slots are allocated, besides those the index
+ * and the loop directory's entries need */
+#define LOOP_RESERVE_CLUSTERS  2U
+
+/* Private function prototypes -----------------------------------------------*/
+static void LOOP_SlotName(const LOOP_Recorder *lr, TCHAR *name, UINT size, DWORD slot);
+static FRESULT LOOP_IndexRead(LOOP_Recorder *lr, DWORD slot, LOOP_Slot *rec);
+static FRESULT LOOP_IndexWrite(LOOP_Recorder *lr, DWORD slot, const LOOP_Slot *rec);
+static FRESULT LOOP_IndexPut(LOOP_Recorder *lr, const LOOP_Slot *rec);
+static FRESULT LOOP_Keep(LOOP_Recorder *lr);
+static FRESULT LOOP_Format(LOOP_Recorder *lr, DWORD max_slots);
+static FRESULT LOOP_Begin(LOOP_Recorder *lr);
+static FRESULT LOOP_End(LOOP_Recorder *lr);
+
+/* Private functions ---------------------------------------------------------*/
+static void LOOP_SlotName(const LOOP_Recorder *lr, TCHAR *name, UINT size, DWORD slot)
+{
+  snprintf(name, size, "%s" LOOP_SEGMENT_NAME, lr->path, (unsigned long)slot);
+}
+
+/**
+  * @brief  Reads the index record of a slot
+  * @param  lr: Loop recorder
+  * @param  slot: Slot number
+  * @param  rec: Receives the record
+  * @retval FR_OK, FR_INT_ERR if the index is short, or another FatFs error
+  */
+static FRESULT LOOP_IndexRead(LOOP_Recorder *lr, DWORD slot, LOOP_Slot *rec)
+{
+  FRESULT res;
+  UINT br;
+
+  res = f_lseek(&lr->index, (FSIZE_t)(slot + 1U) * sizeof(LOOP_Slot));
+  if (res == FR_OK)
+  {
+    res = f_read(&lr->index, rec, sizeof(LOOP_Slot), &br);
+  }
+  if (res == FR_OK && br != sizeof(LOOP_Slot))
+  {
+    res = FR_INT_ERR;
+  }
+  return res;
+}
+
+/**
+  * @brief  Writes the index record of a slot and commits it to the disk
+  * @param  lr: Loop recorder
+  * @param  slot: Slot number
+  * @param  rec: Record to write
+  * @retval FR_OK, FR_DENIED if the volume is full, or another FatFs error
+  */
+static FRESULT LOOP_IndexWrite(LOOP_Recorder *lr, DWORD slot, const LOOP_Slot *rec)
+{
+  FRESULT res;
+
+  res = f_lseek(&lr->index, (FSIZE_t)(slot + 1U) * sizeof(LOOP_Slot));
+  if (res == FR_OK)
+  {
+    res = LOOP_IndexPut(lr, rec);
+  }
+  if (res == FR_OK)
+  {
+    res = f_sync(&lr->index);
+  }
+  return res;
+}
+
+/**
+  * @brief  Writes a record at the index's file pointer
+  * @param  lr: Loop recorder
+  * @param  rec: Record to write
+  * @retval FR_OK, FR_DENIED if the volume is full, or another FatFs error
+  */
+static FRESULT LOOP_IndexPut(LOOP_Recorder *lr, const LOOP_Slot *rec)
+{
+  FRESULT res;
+  UINT bw;
+
+  res = f_write(&lr->index, rec, sizeof(LOOP_Slot), &bw);
+  if (res == FR_OK && bw != sizeof(LOOP_Slot))
+  {
+    res = FR_DENIED;
+  }
+  return res;
+}
+
+/**
+  * @brief  Moves the locked segments of the loop in the index to LOOP_KEEP_DIR
+  * @param  lr: Loop recorder, its index open
+  * @retval FR_OK, FR_DENIED if LOOP_KEEP_MAX segments are kept already, or
+  *         another FatFs error
+  * @note   An index without a valid header holds no lock, as LOOP_Open only
+  *         reallocates the loop once every locked slot has been moved. A slot
+  *         file that is missing was moved by an earlier call cut short by a
+  *         reset.
+  */
+static FRESULT LOOP_Keep(LOOP_Recorder *lr)
+{
+  TCHAR name[32];
+  TCHAR kept[32];
+  LOOP_Slot rec;
+  FRESULT res;
+  DWORD number = 0;
+  DWORD n;
+  DWORD i;
+  UINT br;
+
+  res = f_lseek(&lr->index, 0);
+  if (res == FR_OK)
+  {
+    res = f_read(&lr->index, &rec, sizeof(rec), &br);
+  }
+  if (res != FR_OK || br != sizeof(rec) || rec.seq != LOOP_MAGIC ||
+      rec.reserved != LOOP_VERSION)
+  {
+    return res;
+  }
+  n = (rec.bytes < LOOP_MAX_SLOTS) ? rec.bytes : LOOP_MAX_SLOTS;
+
+  // Records past a short index are lost with it, so stop at its end
+  for (i = 0; i < n; i++)
+  {
+    res = f_read(&lr->index, &rec, sizeof(rec), &br);
+    if (res != FR_OK || br != sizeof(rec))
+    {
+      break;
+    }
+    if (rec.seq == 0 || !(rec.flags & LOOP_FLAG_LOCKED))
+    {
+      continue;
+    }
+    if (lr->kept == 0)
+    {
+      snprintf(kept, sizeof(kept), "%s" LOOP_KEEP_DIR, lr->path);
+      res = f_mkdir(kept);
+      if (res != FR_OK && res != FR_EXIST)
+      {
+        return res;
+      }
+    }
+
+    // The next number no kept segment has, earlier loops' included
+    do
+    {
+      if (++number > LOOP_KEEP_MAX)
+      {
+        return FR_DENIED;
+      }
+      snprintf(kept, sizeof(kept), "%s" LOOP_KEEP_NAME, lr->path, (unsigned long)number);
+      res = f_stat(kept, NULL);
+    } while (res == FR_OK);
+    if (res != FR_NO_FILE)
+    {
+      return res;
+    }
+    LOOP_SlotName(lr, name, sizeof(name), i);
+    res = f_rename(name, kept);
+    if (res == FR_NO_FILE)
+    {
+      res = FR_OK;
+      number--;  /* Moved already, its number is still free */
+      continue;
+    }
+    if (res != FR_OK)
+    {
+      return res;
+    }
+    lr->kept++;
+  }
+  return res;
+}
+
+/**
+  * @brief  Allocates the slots over the free space and writes a fresh index
+  * @param  lr: Loop recorder, its index open and segment_bytes set
+  * @param  max_slots: Most slots to allocate
+  * @retval FR_OK, FR_DENIED if fewer than two slots fit, or another FatFs
+  *         error
+  * @note   Slot files of an earlier layout, that is every file in LOOP_DIR
+  *         but the index, are deleted first. The index is
+  *         allocated, contiguous and zeroed, before the slots, so they cannot
+  *         take the space it needs, and until its header is written last it
+  *         describes no loop.
+  */
+static FRESULT LOOP_Format(LOOP_Recorder *lr, DWORD max_slots)
+{
+  TCHAR name[32];
+  LOOP_Slot rec;
+  FATFS *fs;
+  FRESULT res;
+  DWORD free_clst;
+  DWORD cluster_bytes;
+  DWORD reserve;
+  DWORD n;
+  DWORD i;
+  DIR dir;
+  FILINFO fno;
+
+  // Every file in the loop directory but the index is a slot of the old loop,
+  // whether or not the slots before it were moved or deleted already
+  snprintf(name, sizeof(name), "%s" LOOP_DIR, lr->path);
+  res = f_opendir(&dir, name);
+  while (res == FR_OK)
+  {
+    res = f_readdir(&dir, &fno);
+    if (res != FR_OK || fno.fname[0] == 0)
+    {
+      break;
+    }
+    if ((fno.fattrib & AM_DIR) || strcmp(fno.fname, strrchr(LOOP_INDEX_NAME, '/') + 1) == 0 ||
+        (UINT)snprintf(name, sizeof(name), "%s" LOOP_DIR "/%s", lr->path, fno.fname) >= sizeof(name))
+    {
+      continue;
+    }
+    res = f_unlink(name);
+  }
+  if (res == FR_OK)
+  {
+    res = f_closedir(&dir);
+  }
+  else
+  {
+    f_closedir(&dir);
+  }
+  if (res != FR_OK)
+  {
+    return res;
+  }
+
+  res = f_lseek(&lr->index, 0);
+  if (res == FR_OK)
+  {
+    res = f_truncate(&lr->index);
+  }
+  if (res == FR_OK)
+  {
+    res = f_getfree(lr->path, &free_clst, &fs);
+  }
+  if (res != FR_OK)
+  {
+    return res;
+  }
+
+  // Keep back the index, the directory entries of the slots and a reserve
+  cluster_bytes = (DWORD)fs->csize * LOOP_SS;
+  reserve = ((max_slots + 1U) * sizeof(rec) + cluster_bytes - 1U) / cluster_bytes +
+            ((max_slots + 2U) * 32U + cluster_bytes - 1U) / cluster_bytes +
+            LOOP_RESERVE_CLUSTERS;
+  n = (free_clst > reserve) ?
+      (DWORD)((uint64_t)(free_clst - reserve) * cluster_bytes / lr->segment_bytes) : 0U;
+  if (n > max_slots)
+  {
+    n = max_slots;
+  }
+  if (n < 2U)
+  {
+    return FR_DENIED;
+  }
+
+  res = f_expand(&lr->index, (FSIZE_t)(n + 1U) * sizeof(rec), 1);
+  memset(&rec, 0, sizeof(rec));
+  for (i = 0; res == FR_OK && i <= n; i++)
+  {
+    res = LOOP_IndexPut(lr, &rec);
+  }
+  if (res == FR_OK)
+  {
+    res = f_sync(&lr->index);
+  }
+  if (res != FR_OK)
+  {
+    return res;
+  }
+
+  // Stop early if the free space has no contiguous run left for a slot
+  for (i = 0; i < n; i++)
+  {
+    LOOP_SlotName(lr, name, sizeof(name), i);
+    res = REC_Open(&lr->rec, name, lr->segment_bytes);
+    if (res == FR_DENIED)
+    {
+      break;
+    }
+    if (res == FR_OK)
+    {
+      res = REC_CloseKeep(&lr->rec);
+    }
+    if (res != FR_OK)
+    {
+      return res;
+    }
+  }
+  lr->n_slots = i;
+  lr->created = i;
+  if (i < 2U)
+  {
+    return FR_DENIED;
+  }
+
+  // Cut the index to the slots that fit, then write its header
+  res = f_lseek(&lr->index, (FSIZE_t)(lr->n_slots + 1U) * sizeof(rec));
+  if (res == FR_OK)
+  {
+    res = f_truncate(&lr->index);
+  }
+  rec.seq = LOOP_MAGIC;
+  rec.bytes = lr->n_slots;
+  rec.flags = (DWORD)(lr->segment_bytes / LOOP_SS);
+  rec.reserved = LOOP_VERSION;
+  if (res == FR_OK)
+  {
+    res = f_lseek(&lr->index, 0);
+  }
+  if (res == FR_OK)
+  {
+    res = LOOP_IndexPut(lr, &rec);
+  }
+  if (res == FR_OK)
+  {
+    res = f_sync(&lr->index);
+  }
+  return res;
+}
+
+/**
+  * @brief  Opens the next slot to record a new segment over it
+  * @param  lr: Loop recorder
+  * @retval FR_OK, or the first FatFs error met
+  */
+static FRESULT LOOP_Begin(LOOP_Recorder *lr)
+{
+  TCHAR name[32];
+  LOOP_Slot rec;
+  LOOP_Recent *recent;
+  FRESULT res;
+  DWORD i;
+
+  for (i = 0; ; i++)
+  {
+    res = LOOP_IndexRead(lr, lr->slot, &rec);
+    if (res != FR_OK)
+    {
+      return res;
+    }
+    if (!(rec.flags & LOOP_FLAG_LOCKED))
+    {
+      break;
+    }
+    if (i + 1U >= lr->n_slots)
+    {
+      return FR_DENIED;
+    }
+    lr->slot = (lr->slot + 1U < lr->n_slots) ? lr->slot + 1U : 0U;
+    lr->skipped++;
+  }
+  if (rec.seq != 0)
+  {
+    lr->reused++;
+  }
+
+  // The old segment is gone from here on, whatever happens next
+  for (i = 0; i < LOOP_RECENT; i++)
+  {
+    if (lr->recent[i].slot == lr->slot)
+    {
+      lr->recent[i].seq = 0;
+    }
+  }
+  rec.seq = lr->seq;
+  rec.bytes = LOOP_BYTES_OPEN;
+  rec.flags = 0;
+  res = LOOP_IndexWrite(lr, lr->slot, &rec);
+  if (res == FR_OK)
+  {
+    recent = &lr->recent[lr->seq % LOOP_RECENT];
+    recent->seq = lr->seq;
+    recent->slot = lr->slot;
+    recent->flags = 0;
+    LOOP_SlotName(lr, name, sizeof(name), lr->slot);
+    res = REC_Reopen(&lr->rec, name);
+  }
+  if (res == FR_OK)
+  {
+    lr->recording = 1;
+    lr->segments++;
+  }
+  return res;
+}
+
+/**
+  * @brief  Closes the segment being recorded and moves on to the next slot
+  * @param  lr: Loop recorder
+  * @retval FR_OK, or the first FatFs error met
+  */
+static FRESULT LOOP_End(LOOP_Recorder *lr)
+{
+  LOOP_Slot rec;
+  FRESULT res;
+  FRESULT index_res;
+
+  memset(&rec, 0, sizeof(rec));
+  rec.seq = lr->seq;
+  rec.bytes = (DWORD)lr->rec.written;
+  rec.flags = lr->recent[lr->seq % LOOP_RECENT].flags;
+  res = REC_CloseKeep(&lr->rec);
+  index_res = LOOP_IndexWrite(lr, lr->slot, &rec);
+
+  lr->recording = 0;
+  lr->slot = (lr->slot + 1U < lr->n_slots) ? lr->slot + 1U : 0U;
+  lr->seq++;
+  return (res != FR_OK) ? res : index_res;
+}
+
+/* Exported functions --------------------------------------------------------*/
+/**
+  * @brief  Opens the loop on a volume, allocating its slots the first time
+  * @param  lr: Loop recorder to initialise
+  * @param  path: Logical drive path of a mounted volume, e.g. "0:/", which
+  *         must stay valid while the recorder is open
+  * @param  segment_bytes: Capacity of each slot, rounded up to whole sectors
+  * @param  max_slots: Most slots to allocate, up to LOOP_MAX_SLOTS
+  * @retval FR_OK, FR_DENIED if fewer than two slots fit, or another FatFs
+  *         error
+  * @note   An existing loop with the same segment size is taken over as it
+  *         is, recording on after its newest segment. Otherwise the locked
+  *         segments are moved to LOOP_KEEP_DIR, the other slots are deleted,
+  *         and the free space is divided into up to max_slots new ones, which
+  *         may take a while.
+  */
+FRESULT LOOP_Open(LOOP_Recorder *lr, const TCHAR *path, FSIZE_t segment_bytes,
+                  DWORD max_slots)
+{
+  TCHAR name[32];
+  LOOP_Slot rec;
+  LOOP_Recent *recent;
+  FRESULT res;
+  DWORD last = 0;
+  DWORD i;
+  UINT br;
+
+  memset(lr, 0, sizeof(*lr));
+  lr->path = path;
+  lr->segment_bytes = (segment_bytes + LOOP_SS - 1U) / LOOP_SS * LOOP_SS;
+  if (lr->segment_bytes == 0)
+  {
+    return FR_INVALID_PARAMETER;
+  }
+  if (max_slots > LOOP_MAX_SLOTS)
+  {
+    max_slots = LOOP_MAX_SLOTS;
+  }
+
+  snprintf(name, sizeof(name), "%s" LOOP_DIR, path);
+  res = f_mkdir(name);
+  if (res != FR_OK && res != FR_EXIST)
+  {
+    return res;
+  }
+  snprintf(name, sizeof(name), "%s" LOOP_INDEX_NAME, path);
+  res = f_open(&lr->index, name, FA_READ | FA_WRITE | FA_OPEN_ALWAYS);
+  if (res != FR_OK)
+  {
+    return res;
+  }
+
+  // Take over the loop already on the volume if it is of the same layout
+  res = f_read(&lr->index, &rec, sizeof(rec), &br);
+  if (res == FR_OK && br == sizeof(rec) && rec.seq == LOOP_MAGIC &&
+      rec.reserved == LOOP_VERSION && rec.flags == lr->segment_bytes / LOOP_SS &&
+      rec.bytes >= 2U && rec.bytes <= LOOP_MAX_SLOTS &&
+      f_size(&lr->index) == (FSIZE_t)(rec.bytes + 1U) * sizeof(rec))
+  {
+    lr->n_slots = rec.bytes;
+    for (i = 0; res == FR_OK && i < lr->n_slots; i++)
+    {
+      res = f_read(&lr->index, &rec, sizeof(rec), &br);
+      if (res != FR_OK || rec.seq == 0)
+      {
+        continue;
+      }
+      if (rec.seq > lr->seq)
+      {
+        lr->seq = rec.seq;
+        last = i;
+      }
+      if (rec.flags & LOOP_FLAG_LOCKED)
+      {
+        lr->locked++;
+      }
+      recent = &lr->recent[rec.seq % LOOP_RECENT];
+      if (rec.seq > recent->seq)
+      {
+        recent->seq = rec.seq;
+        recent->slot = i;
+        recent->flags = rec.flags;
+      }
+    }
+    lr->slot = (lr->seq != 0 && last + 1U < lr->n_slots) ? last + 1U : 0U;
+  }
+  else if (res == FR_OK)
+  {
+    res = LOOP_Keep(lr);
+    if (res == FR_OK)
+    {
+      res = LOOP_Format(lr, max_slots);
+    }
+  }
+
+  if (res != FR_OK)
+  {
+    f_close(&lr->index);
+    return res;
+  }
+  lr->seq++;
+  return FR_OK;
+}
+
+/**
+  * @brief  Records data, moving on to the next slot as each one fills
+  * @param  lr: Loop recorder
+  * @param  buff: Data to be written
+  * @param  btw: Number of bytes to write
+  * @retval FR_OK, or the first FatFs error met
+  * @note   A segment starts with the first write after LOOP_Open or the end
+  *         of the last one. Its data goes to the disk as by REC_Write.
+  */
+FRESULT LOOP_Write(LOOP_Recorder *lr, const void *buff, UINT btw)
+{
+  const BYTE *p = (const BYTE *)buff;
+  FRESULT res;
+  UINT bw;
+
+  while (btw)
+  {
+    if (!lr->recording)
+    {
+      res = LOOP_Begin(lr);
+      if (res != FR_OK)
+      {
+        return res;
+      }
+    }
+    res = REC_Write(&lr->rec, p, btw, &bw);
+    if (res != FR_OK)
+    {
+      return res;
+    }
+    p += bw;
+    btw -= bw;
+    if (lr->rec.written == lr->rec.capacity)
+    {
+      res = LOOP_End(lr);
+      if (res != FR_OK)
+      {
+        return res;
+      }
+    }
+  }
+  return FR_OK;
+}
+
+/**
+  * @brief  Ends the segment being recorded, so the next write starts another
+  * @param  lr: Loop recorder
+  * @retval FR_OK, or the first FatFs error met
+  * @note   For segments of fixed duration rather than of fixed size.
+  */
+FRESULT LOOP_NextSegment(LOOP_Recorder *lr)
+{
+  return lr->recording ? LOOP_End(lr) : FR_OK;
+}
+
+/**
+  * @brief  Keeps the open segment and those just before it out of the loop
+  * @param  lr: Loop recorder
+  * @param  previous: Segments before the open one to keep as well, up to
+  *         LOOP_LOCK_MAX_PREVIOUS
+  * @retval FR_OK, FR_DENIED if too few slots would be left to record in, or
+  *         another FatFs error
+  * @note   With no segment open, the newest segment counts as the open one.
+  *         Segments already locked, or recorded over, are left as they are.
+  *         Writes at most one word of the index per segment, then syncs it.
+  */
+FRESULT LOOP_Lock(LOOP_Recorder *lr, DWORD previous)
+{
+  const DWORD flags = LOOP_FLAG_LOCKED;
+  LOOP_Recent *recent;
+  FRESULT res = FR_OK;
+  FRESULT sync_res;
+  DWORD seq;
+  DWORD i;
+  UINT bw;
+
+  if (previous > LOOP_LOCK_MAX_PREVIOUS)
+  {
+    previous = LOOP_LOCK_MAX_PREVIOUS;
+  }
+  seq = lr->recording ? lr->seq : lr->seq - 1U;
+
+  for (i = 0; i <= previous && i < seq; i++)
+  {
+    recent = &lr->recent[(seq - i) % LOOP_RECENT];
+    if (recent->seq != seq - i)
+    {
+      break;
+    }
+    if (recent->flags & LOOP_FLAG_LOCKED)
+    {
+      continue;
+    }
+
+    // One slot must stay free to record in
+    if (lr->locked + 1U >= lr->n_slots)
+    {
+      res = FR_DENIED;
+      break;
+    }
+    res = f_lseek(&lr->index, (FSIZE_t)(recent->slot + 1U) * sizeof(LOOP_Slot) +
+                              offsetof(LOOP_Slot, flags));
+    if (res == FR_OK)
+    {
+      res = f_write(&lr->index, &flags, sizeof(flags), &bw);
+    }
+    if (res == FR_OK && bw != sizeof(flags))
+    {
+      res = FR_DENIED;
+    }
+    if (res != FR_OK)
+    {
+      break;
+    }
+    recent->flags |= LOOP_FLAG_LOCKED;
+    lr->locked++;
+  }
+
+  sync_res = f_sync(&lr->index);
+  return (res != FR_OK) ? res : sync_res;
+}
+
+/**
+  * @brief  Makes everything recorded so far durable on the disk
+  * @param  lr: Loop recorder
+  * @retval FR_OK or FR_DISK_ERR
+  */
+FRESULT LOOP_Sync(LOOP_Recorder *lr)
+{
+  return lr->recording ? REC_Sync(&lr->rec) : FR_OK;
+}
+
+/**
+  * @brief  Ends the segment being recorded and closes the index
+  * @param  lr: Loop recorder
+  * @retval FR_OK, or the first FatFs error met
+  */
+FRESULT LOOP_Close(LOOP_Recorder *lr)
+{
+  FRESULT res = LOOP_NextSegment(lr);
+  FRESULT close_res = f_close(&lr->index);
+
+  return (res != FR_OK) ? res : close_res;
+}
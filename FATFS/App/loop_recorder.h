@@ -0,0 +1,114 @@
+/**
+  ******************************************************************************
+  * @file    loop_recorder.h
+  * @brief   Header for loop_recorder.c module
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 STMicroelectronics.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __LOOP_RECORDER_H
+#define __LOOP_RECORDER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include "ff.h"
+#include "recorder.h"
+
+/* Exported constants --------------------------------------------------------*/
+/* Directory holding the segment files and the index, under the drive path */
+#define LOOP_DIR           "loop"
+#define LOOP_SEGMENT_NAME  LOOP_DIR "/seg%04lu.bin"
+#define LOOP_INDEX_NAME    LOOP_DIR "/index.bin"
+
+/* Where LOOP_Open moves locked segments before allocating the loop afresh,
+ * numbered in the order they are moved */
+#define LOOP_KEEP_DIR      "keep"
+#define LOOP_KEEP_NAME     LOOP_KEEP_DIR "/lock%04lu.bin"
+#define LOOP_KEEP_MAX      9999U
+
+/* Most slots LOOP_Open allocates */
+#define LOOP_MAX_SLOTS     1000U
+
+/* LOOP_Slot.bytes of the segment being recorded, or cut off by a reset */
+#define LOOP_BYTES_OPEN    0xFFFFFFFFU
+
+/* LOOP_Slot.flags: the segment is kept, and the loop passes over its slot */
+#define LOOP_FLAG_LOCKED   0x00000001U
+
+/* Most segments before the open one that LOOP_Lock can reach */
+#define LOOP_LOCK_MAX_PREVIOUS  7U
+#define LOOP_RECENT             (LOOP_LOCK_MAX_PREVIOUS + 1U)
+
+/* Exported types ------------------------------------------------------------*/
+/**
+  * @brief Index record of one slot, as stored in the index file
+  */
+typedef struct
+{
+  DWORD seq;               /* Segment number, 0 if the slot has never been used */
+  DWORD bytes;             /* Bytes recorded, LOOP_BYTES_OPEN while recording */
+  DWORD flags;             /* LOOP_FLAG_LOCKED, or 0 */
+  DWORD reserved;
+} LOOP_Slot;
+
+/**
+  * @brief Where a recent segment was recorded, so it can be locked without
+  *        searching the index
+  */
+typedef struct
+{
+  DWORD seq;               /* Segment number, 0 if none */
+  DWORD slot;              /* Slot it is in */
+  DWORD flags;             /* Its LOOP_Slot.flags */
+} LOOP_Recent;
+
+/**
+  * @brief Loop recorder: a fixed set of preallocated segment files, recorded
+  *        over oldest first
+  */
+typedef struct
+{
+  REC_File rec;            /* Segment being recorded */
+  FIL index;               /* Index file, open while the recorder is */
+  const TCHAR *path;       /* Logical drive path the files are under */
+  FSIZE_t segment_bytes;   /* Capacity of each slot */
+  DWORD n_slots;           /* Slots in the loop */
+  DWORD slot;              /* Slot being recorded, or next to be */
+  DWORD seq;               /* Segment number recorded in it */
+  BYTE recording;          /* A segment is open */
+  DWORD created;           /* Slots allocated by LOOP_Open, 0 if it found them */
+  DWORD kept;              /* Locked segments LOOP_Open moved to LOOP_KEEP_DIR */
+  DWORD segments;          /* Segments started since LOOP_Open */
+  DWORD reused;            /* Of which recorded over an older segment */
+  DWORD locked;            /* Slots locked, the open segment's included */
+  DWORD skipped;           /* Locked slots passed over since LOOP_Open */
+  LOOP_Recent recent[LOOP_RECENT]; /* Newest segments, by number modulo LOOP_RECENT */
+} LOOP_Recorder;
+
+/* Exported functions ------------------------------------------------------- */
+FRESULT LOOP_Open(LOOP_Recorder *lr, const TCHAR *path, FSIZE_t segment_bytes,
+                  DWORD max_slots);
+FRESULT LOOP_Write(LOOP_Recorder *lr, const void *buff, UINT btw);
+FRESULT LOOP_NextSegment(LOOP_Recorder *lr);
+FRESULT LOOP_Lock(LOOP_Recorder *lr, DWORD previous);
+FRESULT LOOP_Sync(LOOP_Recorder *lr);
+FRESULT LOOP_Close(LOOP_Recorder *lr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LOOP_RECORDER_H */
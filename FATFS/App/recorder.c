@@ -0,0 +1,344 @@
+/**
+  ******************************************************************************
+  * @file    recorder.c
+  * @brief   Recording files: preallocated, contiguous, written by LBA
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 STMicroelectronics.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+/*
+ * A recording file is given its whole capacity up front with f_expand, as a
+ * single run of clusters. Its sectors are then consecutive LBAs, so data is
+ * sent straight to disk_write without FatFs looking at the FAT, the allocation
+ * bitmap or the directory entry. Only a trailing partial sector is held back
+ * in RAM. REC_Close releases whatever capacity went unused and records the
+ * real size.
+ *
+ * Until REC_Close, the directory entry gives the file its full capacity, so a
+ * recording interrupted by power loss reads back at that size with the unused
+ * end holding stale card data.
+ *
+ * REC_CloseKeep closes the file at its full capacity instead, and REC_Reopen
+ * later records over it from the start. Neither touches the FAT or the
+ * directory, so an extent can be recorded over again and again at no cost;
+ * the caller keeps track of how much of it holds data.
+ *
+ * With re-entrancy enabled, the writes that go behind FatFs take the volume
+ * lock themselves, so other threads may use FatFs on the same volume while a
+ * recording is open.
+ */
+
+/* Includes ------------------------------------------------------------------*/
+#include <string.h>
+#include "recorder.h"
+#include "diskio.h"
+
+/* Private define ------------------------------------------------------------*/
+/* FatFs is configured for fixed 512-byte sectors */
+#define REC_SS _MAX_SS
+
+/* Private macro -------------------------------------------------------------*/
+#if _FS_REENTRANT
+#define REC_LOCK(fs)    (ff_req_grant((fs)->sobj) ? FR_OK : FR_TIMEOUT)
+#define REC_UNLOCK(fs)  ff_rel_grant((fs)->sobj)
+#else
+#define REC_LOCK(fs)    FR_OK
+#define REC_UNLOCK(fs)
+#endif
+
+/* Private function prototypes -----------------------------------------------*/
+static void REC_SetExtent(REC_File *rf, FSIZE_t capacity);
+static DRESULT REC_FlushTail(REC_File *rf);
+
+/* Private functions ---------------------------------------------------------*/
+/**
+  * @brief  Takes the extent from the open file, empty, and lets the card know
+  *         it may erase it
+  * @param  rf: Recording file, its fil open on a contiguous file
+  * @param  capacity: Bytes the extent holds
+  * @retval None
+  */
+static void REC_SetExtent(REC_File *rf, FSIZE_t capacity)
+{
+  FATFS *fs = rf->fil.obj.fs;
+
+  rf->start_lba = fs->database + (rf->fil.obj.sclust - 2) * fs->csize;
+  rf->n_sectors = (DWORD)((capacity + REC_SS - 1) / REC_SS);
+  rf->capacity = capacity;
+  rf->written = 0;
+  rf->tail_len = 0;
+
+#if _USE_TRIM
+  /* Let the card erase the extent ahead of the data, as a hint only */
+  {
+    DWORD rt[2];
+
+    rt[0] = rf->start_lba;
+    rt[1] = rf->start_lba + rf->n_sectors - 1;
+    disk_ioctl(fs->drv, CTRL_TRIM, rt);
+  }
+#endif
+}
+
+/**
+  * @brief  Writes the partial sector held in RAM, padded with zeros
+  * @param  rf: Recording file
+  * @retval DRESULT: Operation result
+  * @note   The sector stays in tail[] and is written again once it fills.
+  */
+static DRESULT REC_FlushTail(REC_File *rf)
+{
+  DWORD sect;
+
+  if (rf->tail_len == 0)
+  {
+    return RES_OK;
+  }
+  sect = rf->start_lba + (DWORD)((rf->written - rf->tail_len) / REC_SS);
+  memset(rf->tail + rf->tail_len, 0, REC_SS - rf->tail_len);
+  return disk_write(rf->fil.obj.fs->drv, rf->tail, sect, 1);
+}
+
+/* Exported functions --------------------------------------------------------*/
+/**
+  * @brief  Creates a recording file with a contiguous extent of capacity bytes
+  * @param  rf: Recording file object to initialise
+  * @param  path: File name, an existing file is overwritten
+  * @param  capacity: Most bytes that will be written to the file
+  * @retval FR_OK, FR_DENIED when no contiguous free space is large enough, or
+  *         another FatFs error. The file does not exist on failure.
+  */
+FRESULT REC_Open(REC_File *rf, const TCHAR *path, FSIZE_t capacity)
+{
+  FRESULT res;
+
+  memset(rf, 0, sizeof(*rf));
+  res = f_open(&rf->fil, path, FA_WRITE | FA_CREATE_ALWAYS);
+  if (res != FR_OK)
+  {
+    return res;
+  }
+
+  /* Allocate, then commit the allocation so it survives a reset */
+  res = f_expand(&rf->fil, capacity, 1);
+  if (res == FR_OK)
+  {
+    res = f_sync(&rf->fil);
+  }
+  if (res != FR_OK)
+  {
+    f_close(&rf->fil);
+    f_unlink(path);
+    return res;
+  }
+
+  REC_SetExtent(rf, capacity);
+  return FR_OK;
+}
+
+/**
+  * @brief  Opens a recording file left at its capacity by REC_CloseKeep, to
+  *         record over it from the start
+  * @param  rf: Recording file object to initialise
+  * @param  path: File name
+  * @retval FR_OK, FR_DENIED if the file is empty, or another FatFs error
+  * @note   The file must have been created by REC_Open, as its clusters are
+  *         taken to be contiguous without walking the FAT. Its old data stays
+  *         on the disk until it is written over.
+  */
+FRESULT REC_Reopen(REC_File *rf, const TCHAR *path)
+{
+  FRESULT res;
+
+  memset(rf, 0, sizeof(*rf));
+  res = f_open(&rf->fil, path, FA_WRITE | FA_OPEN_EXISTING);
+  if (res != FR_OK)
+  {
+    return res;
+  }
+  if (rf->fil.obj.sclust == 0)
+  {
+    f_close(&rf->fil);
+    return FR_DENIED;
+  }
+
+  REC_SetExtent(rf, f_size(&rf->fil));
+  return FR_OK;
+}
+
+/**
+  * @brief  Appends data to a recording file
+  * @param  rf: Recording file
+  * @param  buff: Data to be written
+  * @param  btw: Number of bytes to write
+  * @param  bw: Receives the number of bytes written, less than btw once the
+  *         capacity is reached
+  * @retval FR_OK or FR_DISK_ERR
+  * @note   Whole sectors are passed to disk_write straight from buff, so a
+  *         4-byte aligned buffer avoids any copy on the DMA path.
+  */
+FRESULT REC_Write(REC_File *rf, const void *buff, UINT btw, UINT *bw)
+{
+  const BYTE *p = (const BYTE *)buff;
+  FATFS *fs = rf->fil.obj.fs;
+  FRESULT res;
+  DWORD sect;
+  UINT n;
+
+  *bw = 0;
+  if (fs == 0)
+  {
+    return FR_INVALID_OBJECT;   /* Not open */
+  }
+  res = REC_LOCK(fs);
+  if (res != FR_OK)
+  {
+    return res;
+  }
+  if (btw > rf->capacity - rf->written)
+  {
+    btw = (UINT)(rf->capacity - rf->written);
+  }
+
+  while (btw)
+  {
+    sect = rf->start_lba + (DWORD)((rf->written - rf->tail_len) / REC_SS);
+    if (rf->tail_len == 0 && btw >= REC_SS)
+    {
+      /* Whole sectors go to the disk as they are */
+      n = btw / REC_SS;
+      if (disk_write(fs->drv, p, sect, n) != RES_OK)
+      {
+        res = FR_DISK_ERR;
+        break;
+      }
+      n *= REC_SS;
+    }
+    else
+    {
+      /* Gather a partial sector, writing it once it fills */
+      n = REC_SS - rf->tail_len;
+      if (n > btw)
+      {
+        n = btw;
+      }
+      memcpy(rf->tail + rf->tail_len, p, n);
+      fs->wr_copy += n;
+      rf->tail_len += n;
+      if (rf->tail_len == REC_SS)
+      {
+        if (disk_write(fs->drv, rf->tail, sect, 1) != RES_OK)
+        {
+          res = FR_DISK_ERR;
+          break;
+        }
+        rf->tail_len = 0;
+      }
+    }
+    p += n;
+    btw -= n;
+    *bw += n;
+    rf->written += n;
+  }
+
+  REC_UNLOCK(fs);
+  return res;
+}
+
+/**
+  * @brief  Makes everything written so far durable on the disk
+  * @param  rf: Recording file
+  * @retval FR_OK or FR_DISK_ERR
+  * @note   The file size on the disk stays at the capacity until REC_Close.
+  */
+FRESULT REC_Sync(REC_File *rf)
+{
+  FATFS *fs = rf->fil.obj.fs;
+  FRESULT res;
+
+  if (fs == 0)
+  {
+    return FR_INVALID_OBJECT;
+  }
+  res = REC_LOCK(fs);
+  if (res != FR_OK)
+  {
+    return res;
+  }
+  if (REC_FlushTail(rf) != RES_OK ||
+      disk_ioctl(fs->drv, CTRL_SYNC, 0) != RES_OK)
+  {
+    res = FR_DISK_ERR;
+  }
+  REC_UNLOCK(fs);
+  return res;
+}
+
+/**
+  * @brief  Writes the remaining data, frees unused capacity and closes the file
+  * @param  rf: Recording file
+  * @retval FR_OK, or the first FatFs error met
+  */
+FRESULT REC_Close(REC_File *rf)
+{
+  FRESULT res = FR_OK;
+  FRESULT close_res;
+
+  if (rf->fil.obj.fs == 0)
+  {
+    return FR_INVALID_OBJECT;
+  }
+  res = REC_LOCK(rf->fil.obj.fs);
+  if (res == FR_OK)
+  {
+    if (REC_FlushTail(rf) != RES_OK)
+    {
+      res = FR_DISK_ERR;
+    }
+    REC_UNLOCK(rf->fil.obj.fs);
+  }
+
+  /* Cut the file, and its cluster chain, back to the data written */
+  if (res == FR_OK)
+  {
+    res = f_lseek(&rf->fil, rf->written);
+  }
+  if (res == FR_OK)
+  {
+    res = f_truncate(&rf->fil);
+  }
+
+  close_res = f_close(&rf->fil);
+  return (res != FR_OK) ? res : close_res;
+}
+
+/**
+  * @brief  Writes the remaining data and closes the file at its full
+  *         capacity, ready for REC_Reopen
+  * @param  rf: Recording file
+  * @retval FR_OK, or the first FatFs error met
+  * @note   The directory entry is left as it is, so the size read back is the
+  *         capacity whatever was written.
+  */
+FRESULT REC_CloseKeep(REC_File *rf)
+{
+  FRESULT res;
+  FRESULT close_res;
+
+  res = REC_Sync(rf);
+  if (res == FR_INVALID_OBJECT)
+  {
+    return res;
+  }
+  close_res = f_close(&rf->fil);
+  return (res != FR_OK) ? res : close_res;
+}
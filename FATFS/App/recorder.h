@@ -0,0 +1,57 @@
+/**
+  ******************************************************************************
+  * @file    recorder.h
+  * @brief   Header for recorder.c module
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 STMicroelectronics.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __RECORDER_H
+#define __RECORDER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include "ff.h"
+
+/* Exported types ------------------------------------------------------------*/
+/**
+  * @brief Recording file: a FatFs file preallocated as one contiguous extent
+  *        and written by sector address rather than through f_write
+  */
+typedef struct
+{
+  FIL fil;                 /* Underlying file, only touched on open and close */
+  DWORD start_lba;         /* First sector of the extent */
+  DWORD n_sectors;         /* Sectors in the extent */
+  FSIZE_t capacity;        /* Bytes preallocated */
+  FSIZE_t written;         /* Bytes accepted so far */
+  UINT tail_len;           /* Bytes held in tail[], not yet on the disk */
+  BYTE tail[_MAX_SS];      /* Partial sector at the end of the data */
+} REC_File;
+
+/* Exported functions ------------------------------------------------------- */
+FRESULT REC_Open(REC_File *rf, const TCHAR *path, FSIZE_t capacity);
+FRESULT REC_Reopen(REC_File *rf, const TCHAR *path);
+FRESULT REC_Write(REC_File *rf, const void *buff, UINT btw, UINT *bw);
+FRESULT REC_Sync(REC_File *rf);
+FRESULT REC_Close(REC_File *rf);
+FRESULT REC_CloseKeep(REC_File *rf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __RECORDER_H */
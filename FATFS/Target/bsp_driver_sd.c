@@ -30,6 +30,8 @@
 #else
 /* USER CODE BEGIN FirstSection */
 /* can be used to modify / undefine following code or add new definitions */
+#include <string.h>
+#include "main.h"
 /* USER CODE END FirstSection */
 /* Includes ------------------------------------------------------------------*/
 #include "bsp_driver_sd.h"
@@ -40,6 +42,7 @@ extern SD_HandleTypeDef hsd;
 
 /* USER CODE BEGIN BeforeInitSection */
 /* can be used to modify / undefine following code or add code */
+static void SD_DetectSettle(void);
 /* USER CODE END BeforeInitSection */
 /**
   * @brief  Initializes the SD card device.
@@ -48,46 +51,452 @@ extern SD_HandleTypeDef hsd;
 __weak uint8_t BSP_SD_Init(void)
 {
   uint8_t sd_state = MSD_OK;
-  /* Check if the SD card is plugged in the slot */
+  /* Check if the SD card is plugged in the slot, once it has stopped moving */
+  SD_DetectSettle();
   if (BSP_SD_IsDetected() != SD_PRESENT)
   {
     return MSD_ERROR;
   }
   /* HAL SD initialization */
   sd_state = HAL_SD_Init(&hsd);
-  /* Configure SD Bus width (4 bits mode selected) */
+  /* Configure SD Bus width and speed (fastest working mode selected) */
   if (sd_state == MSD_OK)
   {
-    /* Enable wide operation */
-    if (HAL_SD_ConfigWideBusOperation(&hsd, SDIO_BUS_WIDE_4B) != HAL_OK)
-    {
-      sd_state = MSD_ERROR;
-    }
+    sd_state = BSP_SD_NegotiateBus();
   }
 
   return sd_state;
 }
 /* USER CODE BEGIN AfterInitSection */
 /* can be used to modify previous code / undefine following code / add code */
+
+/*
+ * Bus modes, fastest first. High speed needs the card to have been switched
+ * with CMD6 and runs SDIO_CK straight from PLL48CLK (bypass), 48 MHz or 45
+ * MHz depending on the core clock; the others divide it by clock_div + 2. A
+ * card switched to high speed keeps working in the slower modes, so the list
+ * is also the fallback order.
+ */
+static const struct
+{
+  const char *name;
+  uint32_t    bypass;
+  uint32_t    clock_div;
+  uint32_t    bus_wide;
+} BusModes[] =
+{
+  { "high speed, 4-bit",    SDIO_CLOCK_BYPASS_ENABLE,  0, SDIO_BUS_WIDE_4B },
+  { "default speed, 4-bit", SDIO_CLOCK_BYPASS_DISABLE, 0, SDIO_BUS_WIDE_4B },
+  { "default speed, 4-bit", SDIO_CLOCK_BYPASS_DISABLE, 2, SDIO_BUS_WIDE_4B },
+  { "default speed, 1-bit", SDIO_CLOCK_BYPASS_DISABLE, 2, SDIO_BUS_WIDE_1B },
+};
+
+#define BUS_MODE_HIGH_SPEED   0U
+#define BUS_MODE_DEFAULT      1U
+#define BUS_MODE_1BIT         3U
+#define BUS_MODE_COUNT        (sizeof(BusModes) / sizeof(BusModes[0]))
+
+/* CMD6 arguments: query or select function 1 (high speed) of group 1 */
+#define SD_SWITCH_CHECK_HS    0x00FFFFF1U
+#define SD_SWITCH_SET_HS      0x80FFFFF1U
+
+/* Card command class 10 (switch) in the CSD */
+#define SD_CCC_SWITCH         (1U << 10)
+
+/* Time allowed for the verification read at each bus mode, in ms */
+#define SD_VERIFY_TIMEOUT     1000U
+
+/* Time the card detect switch must be still before the card is initialized,
+ * in ms. It bounces for a few ms as a card goes in or out. */
+#define SD_DETECT_SETTLE_MS   50U
+
+static uint32_t BusMode = BUS_MODE_1BIT;
+__ALIGN_BEGIN static uint8_t VerifyBlock[BLOCKSIZE] __ALIGN_END;
+
+/* The card the bus was last negotiated with, and whether it is the one
+ * BSP_SD_Init found since. A card seen before goes straight back to the mode
+ * it ran at, with no trial of the faster ones. */
+static uint32_t KnownCID[4];
+static uint8_t KnownCard;
+static uint8_t SameCard;
+
+/* Last edge of the card detect switch, and whether it has settled since */
+static volatile uint32_t DetectTick;
+static volatile uint8_t DetectMoved;
+
+/**
+  * @brief  Waits until the card detect switch has been still for
+  *         SD_DETECT_SETTLE_MS since its last edge.
+  * @retval None
+  * @note   Returns at once if the switch has not moved since the last call.
+  *         An edge during the wait starts it again.
+  */
+static void SD_DetectSettle(void)
+{
+  uint32_t elapsed;
+
+  while (DetectMoved)
+  {
+    elapsed = HAL_GetTick() - DetectTick;
+    if (elapsed >= SD_DETECT_SETTLE_MS)
+    {
+      DetectMoved = 0;
+      break;
+    }
+    HAL_Delay(SD_DETECT_SETTLE_MS - elapsed);
+  }
+}
+
+/**
+  * @brief  Runs CMD6 and reads back the 512-bit switch function status.
+  * @param  Argument: CMD6 argument (mode and function per group)
+  * @param  pStatus: Receives the 64 status bytes, most significant first
+  * @retval HAL SD error code
+  */
+static uint32_t SD_SwitchFunction(uint32_t Argument, uint8_t *pStatus)
+{
+  SDIO_DataInitTypeDef config;
+  uint32_t errorstate;
+  uint32_t tickstart = HAL_GetTick();
+  uint32_t index = 0U;
+  uint32_t word;
+
+  /* Set Block Size To 64 Bytes */
+  errorstate = SDMMC_CmdBlockLength(hsd.Instance, 64U);
+  if (errorstate != HAL_SD_ERROR_NONE)
+  {
+    return errorstate;
+  }
+
+  config.DataTimeOut   = SDMMC_DATATIMEOUT;
+  config.DataLength    = 64U;
+  config.DataBlockSize = SDIO_DATABLOCK_SIZE_64B;
+  config.TransferDir   = SDIO_TRANSFER_DIR_TO_SDIO;
+  config.TransferMode  = SDIO_TRANSFER_MODE_BLOCK;
+  config.DPSM          = SDIO_DPSM_ENABLE;
+  (void)SDIO_ConfigData(hsd.Instance, &config);
+
+  errorstate = SDMMC_CmdSwitch(hsd.Instance, Argument);
+  if (errorstate == HAL_SD_ERROR_NONE)
+  {
+    while (!__HAL_SD_GET_FLAG(&hsd, SDIO_FLAG_RXOVERR | SDIO_FLAG_DCRCFAIL | SDIO_FLAG_DTIMEOUT | SDIO_FLAG_DATAEND))
+    {
+      if (__HAL_SD_GET_FLAG(&hsd, SDIO_FLAG_RXDAVL) && (index < 64U))
+      {
+        /* the FIFO packs bytes in the order they arrived, LSB first */
+        word = SDIO_ReadFIFO(hsd.Instance);
+        pStatus[index++] = (uint8_t)word;
+        pStatus[index++] = (uint8_t)(word >> 8);
+        pStatus[index++] = (uint8_t)(word >> 16);
+        pStatus[index++] = (uint8_t)(word >> 24);
+      }
+
+      if ((HAL_GetTick() - tickstart) >= SD_VERIFY_TIMEOUT)
+      {
+        errorstate = HAL_SD_ERROR_TIMEOUT;
+        break;
+      }
+    }
+
+    /* Empty FIFO if there is still any data */
+    while (__HAL_SD_GET_FLAG(&hsd, SDIO_FLAG_RXDAVL) && (index < 64U))
+    {
+      word = SDIO_ReadFIFO(hsd.Instance);
+      pStatus[index++] = (uint8_t)word;
+      pStatus[index++] = (uint8_t)(word >> 8);
+      pStatus[index++] = (uint8_t)(word >> 16);
+      pStatus[index++] = (uint8_t)(word >> 24);
+    }
+
+    if (__HAL_SD_GET_FLAG(&hsd, SDIO_FLAG_DTIMEOUT))
+    {
+      errorstate = HAL_SD_ERROR_DATA_TIMEOUT;
+    }
+    else if (__HAL_SD_GET_FLAG(&hsd, SDIO_FLAG_DCRCFAIL))
+    {
+      errorstate = HAL_SD_ERROR_DATA_CRC_FAIL;
+    }
+    else if (__HAL_SD_GET_FLAG(&hsd, SDIO_FLAG_RXOVERR))
+    {
+      errorstate = HAL_SD_ERROR_RX_OVERRUN;
+    }
+    else if (index != 64U)
+    {
+      errorstate = HAL_SD_ERROR_GENERAL_UNKNOWN_ERR;
+    }
+  }
+
+  /* Clear all the static flags */
+  __HAL_SD_CLEAR_FLAG(&hsd, SDIO_STATIC_FLAGS);
+
+  /* Restore the Block Size */
+  if (SDMMC_CmdBlockLength(hsd.Instance, BLOCKSIZE) != HAL_SD_ERROR_NONE)
+  {
+    errorstate |= HAL_SD_ERROR_GENERAL_UNKNOWN_ERR;
+  }
+
+  return errorstate;
+}
+
+/**
+  * @brief  Switches the card to high speed timing if it supports it.
+  * @retval SD status
+  */
+static uint8_t SD_EnableHighSpeed(void)
+{
+  HAL_SD_CardCSDTypeDef csd;
+  uint8_t status[64];
+
+  /* CMD6 only exists on cards implementing command class 10 (SD 1.10+) */
+  if ((HAL_SD_GetCardCSD(&hsd, &csd) != HAL_OK) ||
+      !(csd.CardComdClasses & SD_CCC_SWITCH))
+  {
+    return MSD_ERROR;
+  }
+
+  /* bit 401: function 1 of group 1 supported */
+  if ((SD_SwitchFunction(SD_SWITCH_CHECK_HS, status) != HAL_SD_ERROR_NONE) ||
+      !(status[13] & 0x02U))
+  {
+    return MSD_ERROR;
+  }
+
+  /* bits 379:376: function now selected in group 1 */
+  if ((SD_SwitchFunction(SD_SWITCH_SET_HS, status) != HAL_SD_ERROR_NONE) ||
+      ((status[16] & 0x0FU) != 0x01U))
+  {
+    return MSD_ERROR;
+  }
+
+  return MSD_OK;
+}
+
+/**
+  * @brief  Reprograms the SDIO clock and bus width for a bus mode.
+  * @param  Mode: Index into BusModes[]
+  * @retval SD status
+  */
+static uint8_t SD_ApplyBusMode(uint32_t Mode)
+{
+  hsd.Init.ClockBypass = BusModes[Mode].bypass;
+  hsd.Init.ClockDiv = BusModes[Mode].clock_div;
+
+  /* this also programs the clock settings above */
+  if (HAL_SD_ConfigWideBusOperation(&hsd, BusModes[Mode].bus_wide) != HAL_OK)
+  {
+    return MSD_ERROR;
+  }
+  hsd.Init.BusWide = BusModes[Mode].bus_wide;
+
+  return MSD_OK;
+}
+
+/**
+  * @brief  Checks that data can be read back at the current bus mode.
+  * @retval SD status
+  */
+static uint8_t SD_VerifyBus(void)
+{
+  uint32_t tickstart;
+
+  if (HAL_SD_ReadBlocks(&hsd, VerifyBlock, 0, 1, SD_VERIFY_TIMEOUT) != HAL_OK)
+  {
+    return MSD_ERROR;
+  }
+
+  tickstart = HAL_GetTick();
+  while (HAL_SD_GetCardState(&hsd) != HAL_SD_CARD_TRANSFER)
+  {
+    if ((HAL_GetTick() - tickstart) >= SD_VERIFY_TIMEOUT)
+    {
+      return MSD_ERROR;
+    }
+  }
+
+  return MSD_OK;
+}
+
+/**
+  * @brief  Puts a card seen before back in the bus mode it last ran at.
+  * @retval SD status
+  * @note   The card has been power cycled, so high speed is selected again
+  *         with CMD6, but neither the query nor the verification read is
+  *         repeated.
+  */
+static uint8_t SD_ResumeBusMode(void)
+{
+  uint8_t status[64];
+
+  if ((BusModes[BusMode].bypass == SDIO_CLOCK_BYPASS_ENABLE) &&
+      ((SD_SwitchFunction(SD_SWITCH_SET_HS, status) != HAL_SD_ERROR_NONE) ||
+       ((status[16] & 0x0FU) != 0x01U)))
+  {
+    return MSD_ERROR;
+  }
+
+  return SD_ApplyBusMode(BusMode);
+}
+
+/**
+  * @brief  Brings the bus up to the fastest mode the card and board sustain.
+  * @retval SD status
+  * @note   Must follow HAL_SD_Init(). Each mode is checked with a read and
+  *         the next slower one is tried when it fails (e.g. on CRC errors).
+  *         The card that was negotiated with last resumes its mode instead.
+  */
+uint8_t BSP_SD_NegotiateBus(void)
+{
+  uint32_t mode = BUS_MODE_DEFAULT;
+
+  SameCard = KnownCard && (memcmp(hsd.CID, KnownCID, sizeof(KnownCID)) == 0);
+  if (SameCard && (SD_ResumeBusMode() == MSD_OK))
+  {
+    return MSD_OK;
+  }
+  SameCard = 0;
+
+  if (SD_EnableHighSpeed() == MSD_OK)
+  {
+    mode = BUS_MODE_HIGH_SPEED;
+  }
+
+  for (; mode < BUS_MODE_COUNT; mode++)
+  {
+    if ((SD_ApplyBusMode(mode) == MSD_OK) && (SD_VerifyBus() == MSD_OK))
+    {
+      BusMode = mode;
+      memcpy(KnownCID, hsd.CID, sizeof(KnownCID));
+      KnownCard = 1;
+      return MSD_OK;
+    }
+  }
+
+  KnownCard = 0;
+  return MSD_ERROR;
+}
+
+/**
+  * @brief  Tells whether the last BSP_SD_Init() found the card it had found
+  *         before, by its CID.
+  * @retval 1 if it is the same card, 0 otherwise
+  */
+uint8_t BSP_SD_IsSameCard(void)
+{
+  return SameCard;
+}
+
+/**
+  * @brief  Steps down to a slower bus mode after a link error.
+  * @retval MSD_OK if the failed transfer is worth retrying
+  * @note   Only data CRC errors and FIFO under/overruns are blamed on the
+  *         link; other errors, or the slowest mode failing, return MSD_ERROR.
+  */
+uint8_t BSP_SD_RecoverBusError(void)
+{
+  uint32_t link_errors = HAL_SD_ERROR_DATA_CRC_FAIL | HAL_SD_ERROR_TX_UNDERRUN |
+                         HAL_SD_ERROR_RX_OVERRUN;
+
+  if (!(HAL_SD_GetError(&hsd) & link_errors))
+  {
+    return MSD_ERROR;
+  }
+
+  while (++BusMode < BUS_MODE_COUNT)
+  {
+    if ((SD_ApplyBusMode(BusMode) == MSD_OK) && (SD_VerifyBus() == MSD_OK))
+    {
+      return MSD_OK;
+    }
+  }
+
+  BusMode = BUS_MODE_COUNT - 1U;
+  return MSD_ERROR;
+}
+
+/**
+  * @brief  Gets a description of the negotiated bus mode.
+  * @retval Mode name
+  */
+const char *BSP_SD_GetBusModeName(void)
+{
+  return BusModes[BusMode].name;
+}
+
+/**
+  * @brief  Gets the negotiated SDIO_CK frequency.
+  * @retval Clock frequency in Hz
+  */
+uint32_t BSP_SD_GetBusClock(void)
+{
+  uint32_t pllcfgr = RCC->PLLCFGR;
+  uint32_t source;
+  uint32_t pll48;
+
+  /* PLL48CLK = PLL input / PLLM * PLLN / PLLQ */
+  source = (pllcfgr & RCC_PLLCFGR_PLLSRC) ? HSE_VALUE : HSI_VALUE;
+  pll48 = (uint32_t)(((uint64_t)source *
+                      ((pllcfgr & RCC_PLLCFGR_PLLN) >> RCC_PLLCFGR_PLLN_Pos)) /
+                     ((pllcfgr & RCC_PLLCFGR_PLLM) *
+                      ((pllcfgr & RCC_PLLCFGR_PLLQ) >> RCC_PLLCFGR_PLLQ_Pos)));
+
+  if (BusModes[BusMode].bypass == SDIO_CLOCK_BYPASS_ENABLE)
+  {
+    return pll48;
+  }
+  return pll48 / (BusModes[BusMode].clock_div + 2U);
+}
 /* USER CODE END AfterInitSection */
 
 /* USER CODE BEGIN InterruptMode */
 /**
   * @brief  Configures Interrupt mode for SD detection pin.
   * @retval Returns 0
+  * @note   The EXTI line fires on both edges, at the SDIO interrupt priority
+  *         so that the two never preempt each other. MX_GPIO_Init() sets the
+  *         pin up this way already, as configured in the .ioc; this is only
+  *         needed where the pin is left as a plain input.
   */
-__weak uint8_t BSP_SD_ITConfig(void)
+uint8_t BSP_SD_ITConfig(void)
 {
-  /* Code to be updated by the user or replaced by one from the FW pack (in a stmxxxx_sd.c file) */
+  GPIO_InitTypeDef gpio_init_structure = {0};
+
+  gpio_init_structure.Pin = SD_DETECT_PIN;
+  gpio_init_structure.Mode = GPIO_MODE_IT_RISING_FALLING;
+  gpio_init_structure.Pull = GPIO_NOPULL;
+  HAL_GPIO_Init(SD_DETECT_GPIO_PORT, &gpio_init_structure);
+
+  HAL_NVIC_SetPriority(SD_DETECT_IRQn, CD_IRQ_PRIORITY, 0);
+  HAL_NVIC_EnableIRQ(SD_DETECT_IRQn);
 
   return (uint8_t)0;
 }
 
-/** @brief  SD detect IT treatment
+/** @brief  SD detect IT treatment, from the EXTI interrupt of the card detect
+  *         switch
+  * @note   Each edge restarts the settling time BSP_SD_Init() waits out. When
+  *         the switch reads no card, a DMA transfer in flight is aborted here
+  *         rather than left to time out. HAL_SD_Abort_IT() only stops the DMA
+  *         stream; the rest of the abort completes from its interrupt.
+  *         A polled transfer times out in its own loop. BSP_SD_DetectCallback()
+  *         follows.
   */
-__weak void BSP_SD_DetectIT(void)
+void BSP_SD_DetectIT(void)
 {
-  /* Code to be updated by the user or replaced by one from the FW pack (in a stmxxxx_sd.c file) */
+  if (__HAL_GPIO_EXTI_GET_IT(SD_DETECT_PIN) == 0U)
+  {
+    return;
+  }
+  __HAL_GPIO_EXTI_CLEAR_IT(SD_DETECT_PIN);
+
+  DetectTick = HAL_GetTick();
+  DetectMoved = 1;
+
+  if ((BSP_SD_IsDetected() != SD_PRESENT) && ((hsd.Context & SD_CONTEXT_DMA) != 0U))
+  {
+    (void)HAL_SD_Abort_IT(&hsd);
+  }
+
+  BSP_SD_DetectCallback();
 }
 /* USER CODE END InterruptMode */
 
@@ -230,6 +639,48 @@ __weak void BSP_SD_GetCardInfo(HAL_SD_CardInfoTypeDef *CardInfo)
 
 /* USER CODE BEGIN BeforeCallBacksSection */
 /* can be used to modify previous code / undefine following code / add code */
+/**
+  * @brief  Reads the SD Status register (ACMD13) of the card.
+  * @param  CardStatus: Pointer to HAL_SD_CardStatusTypeDef structure
+  * @retval SD status
+  * @note   The register is read by polling, so this must not be called while
+  *         a DMA transfer is in progress.
+  */
+uint8_t BSP_SD_GetCardStatus(HAL_SD_CardStatusTypeDef *CardStatus)
+{
+  if (HAL_SD_GetCardStatus(&hsd, CardStatus) != HAL_OK)
+  {
+    return MSD_ERROR;
+  }
+
+  return MSD_OK;
+}
+
+/**
+  * @brief  Decodes the CSD register read from the card on initialisation.
+  * @param  CardCSD: Pointer to HAL_SD_CardCSDTypeDef structure
+  * @retval SD status
+  */
+uint8_t BSP_SD_GetCardCSD(HAL_SD_CardCSDTypeDef *CardCSD)
+{
+  if (HAL_SD_GetCardCSD(&hsd, CardCSD) != HAL_OK)
+  {
+    return MSD_ERROR;
+  }
+
+  return MSD_OK;
+}
+
+/**
+  * @brief  Gets the Card IDentification register read by BSP_SD_Init().
+  * @param  CID: Receives the four words of the CID
+  * @retval None
+  * @note   The CID is unique to the card, serial number included.
+  */
+void BSP_SD_GetCardCID(uint32_t *CID)
+{
+  memcpy(CID, hsd.CID, sizeof(hsd.CID));
+}
 /* USER CODE END BeforeCallBacksSection */
 /**
   * @brief SD Abort callbacks
@@ -262,6 +713,16 @@ void HAL_SD_RxCpltCallback(SD_HandleTypeDef *hsd)
 }
 
 /* USER CODE BEGIN CallBacksSection_C */
+/**
+  * @brief Transfer error callback
+  * @param hsd: SD handle
+  * @retval None
+  */
+void HAL_SD_ErrorCallback(SD_HandleTypeDef *hsd)
+{
+  BSP_SD_ErrorCallback();
+}
+
 /**
   * @brief BSP SD Abort callback
   * @retval None
@@ -290,6 +751,26 @@ __weak void BSP_SD_WriteCpltCallback(void)
 __weak void BSP_SD_ReadCpltCallback(void)
 {
 
+}
+
+/**
+  * @brief BSP transfer error callback
+  * @retval None
+  * @note empty (up to the user to fill it in or to remove it if useless)
+  */
+__weak void BSP_SD_ErrorCallback(void)
+{
+
+}
+
+/**
+  * @brief BSP card detect callback, on either edge of the card detect switch
+  * @retval None
+  * @note empty (up to the user to fill it in or to remove it if useless)
+  */
+__weak void BSP_SD_DetectCallback(void)
+{
+
 }
 /* USER CODE END CallBacksSection_C */
 #endif
@@ -35,6 +35,16 @@
   */
 #define BSP_SD_CardInfo HAL_SD_CardInfoTypeDef
 
+/**
+  * @brief SD Card status structure (SD Status register)
+  */
+#define BSP_SD_CardStatus HAL_SD_CardStatusTypeDef
+
+/**
+  * @brief SD Card specific data structure (CSD register)
+  */
+#define BSP_SD_CardCSD HAL_SD_CardCSDTypeDef
+
 /* Exported constants --------------------------------------------------------*/
 /**
   * @brief  SD status structure definition
@@ -61,6 +71,11 @@
 /* USER CODE BEGIN BSP_H_CODE */
 /* Exported functions --------------------------------------------------------*/
 uint8_t BSP_SD_Init(void);
+uint8_t BSP_SD_NegotiateBus(void);
+uint8_t BSP_SD_IsSameCard(void);
+uint8_t BSP_SD_RecoverBusError(void);
+const char *BSP_SD_GetBusModeName(void);
+uint32_t BSP_SD_GetBusClock(void);
 uint8_t BSP_SD_ITConfig(void);
 void    BSP_SD_DetectIT(void);
 void    BSP_SD_DetectCallback(void);
@@ -74,6 +89,9 @@ void BSP_SD_DMA_Tx_IRQHandler(void);
 void BSP_SD_DMA_Rx_IRQHandler(void);
 uint8_t BSP_SD_GetCardState(void);
 void    BSP_SD_GetCardInfo(HAL_SD_CardInfoTypeDef *CardInfo);
+uint8_t BSP_SD_GetCardStatus(HAL_SD_CardStatusTypeDef *CardStatus);
+uint8_t BSP_SD_GetCardCSD(HAL_SD_CardCSDTypeDef *CardCSD);
+void    BSP_SD_GetCardCID(uint32_t *CID);
 uint8_t BSP_SD_IsDetected(void);
 
 /* These functions can be modified in case the current settings (e.g. DMA stream)
@@ -81,6 +99,7 @@ uint8_t BSP_SD_IsDetected(void);
 void    BSP_SD_AbortCallback(void);
 void    BSP_SD_WriteCpltCallback(void);
 void    BSP_SD_ReadCpltCallback(void);
+void    BSP_SD_ErrorCallback(void);
 /* USER CODE END BSP_H_CODE */
 #endif
 
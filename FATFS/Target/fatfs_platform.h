@@ -23,5 +23,6 @@
 #define SD_NOT_PRESENT           ((uint8_t)0x00)  /* also in bsp_driver_sd.h */
 #define SD_DETECT_PIN         GPIO_PIN_2
 #define SD_DETECT_GPIO_PORT   GPIOG
+#define SD_DETECT_IRQn        EXTI2_IRQn
 /* Prototypes ---------------------------------------------------------------*/
 uint8_t	BSP_PlatformIsDetected(void);
@@ -22,9 +22,22 @@
 /*-----------------------------------------------------------------------------/
 / Additional user header to be used
 /-----------------------------------------------------------------------------*/
+#if !defined(HOST_BUILD)
 #include "main.h"
 #include "stm32f4xx_hal.h"
 #include "bsp_driver_sd.h"
+#endif
+
+/* Placement of the file system objects and work areas the CPU alone touches:
+/  the volume object with its window, cache and free map, the LFN and
+/  directory entry buffers, the directory name index and the lock table. The
+/  SD driver bounces any transfer to or from CCM RAM through a buffer DMA can
+/  reach. */
+#if !defined(HOST_BUILD)
+#define _FS_CCMRAM  __CCMRAM
+#else
+#define _FS_CCMRAM
+#endif
 
 /*-----------------------------------------------------------------------------/
 / Function Configurations
@@ -63,9 +76,15 @@
 #define _USE_FASTSEEK        1
 /* This option switches fast seek feature. (0:Disable or 1:Enable) */
 
-#define	_USE_EXPAND		0
+#define	_USE_EXPAND		1
 /* This option switches f_expand function. (0:Disable or 1:Enable) */
 
+#define	_USE_ALIGNED	1
+/* This option switches f_write_aligned function. (0:Disable or 1:Enable)
+/  It writes a buffer padded to a whole number of sectors with no copy through
+/  the file's sector buffer, except for the data of a trailing partial sector,
+/  which is kept there for the next write. The padding is not file data. */
+
 #define _USE_CHMOD		0
 /* This option switches attribute manipulation functions, f_chmod() and f_utime().
 /  (0:Disable or 1:Enable) Also _FS_READONLY needs to be 0 to enable this option. */
@@ -109,7 +128,11 @@
 /   950 - Traditional Chinese (DBCS)
 */
 
+#if defined(APP_RTOS)
+#define _USE_LFN     2    /* 0 to 3 */
+#else
 #define _USE_LFN     1    /* 0 to 3 */
+#endif
 #define _MAX_LFN     255  /* Maximum LFN length to handle (12 to 255) */
 /* The _USE_LFN switches the support of long file name (LFN).
 /
@@ -124,7 +147,10 @@
 /  It should be set 255 to support full featured LFN operations.
 /  When use stack for the working buffer, take care on stack overflow. When use heap
 /  memory for the working buffer, memory management functions, ff_memalloc() and
-/  ff_memfree(), must be added to the project. */
+/  ff_memfree(), must be added to the project.
+/
+/  The RTOS build (APP_RTOS) is re-entrant, so it keeps the buffer on the
+/  stack of the calling thread. */
 
 #define _LFN_UNICODE    0 /* 0:ANSI/OEM or 1:Unicode */
 /* This option switches character encoding on the API. (0:ANSI/OEM or 1:UTF-16)
@@ -183,7 +209,7 @@
 /  to variable sector size and GET_SECTOR_SIZE command must be implemented to the
 /  disk_ioctl() function. */
 
-#define	_USE_TRIM      0
+#define	_USE_TRIM      1
 /* This option switches support of ATA-TRIM. (0:Disable or 1:Enable)
 /  To enable Trim function, also CTRL_TRIM command should be implemented to the
 /  disk_ioctl() function. */
@@ -209,11 +235,84 @@
 /  Instead of private sector buffer eliminated from the file object, common sector
 /  buffer in the file system object (FATFS) is used for the file data transfer. */
 
+#define _FS_WINCACHE    8  /* 1:Single window or 2-255:Number of sectors cached */
+/* This option sets how many FAT/directory sectors the file system object keeps
+/  in memory. At 1, only the sector in win[] is held, as in the original FatFs,
+/  and switching between a FAT and a directory sector costs a write back and a
+/  read every time. Above 1, sectors moved out of win[] are kept in a write-back
+/  cache of _FS_WINCACHE - 1 further sectors with LRU replacement, costing
+/  _MAX_SS bytes each in the FATFS structure. Dirty sectors are written when
+/  evicted, or in LBA order (FAT first) when the volume is synced.
+/  This option cannot be used with _FS_TINY or _FS_READONLY. */
+
+#define _FS_FREEMAP     4096  /* 0:Disable or 64-65535:Number of free map groups */
+/* This option keeps a count of free clusters for each group of clusters in the
+/  FATFS structure, at two bytes per group. Mounting reads nothing for it: each
+/  group is counted from its part of the FAT (or allocation bitmap) the first
+/  time cluster allocation or f_expand comes to it, and is kept up to date as
+/  clusters are allocated and freed. After that, allocation skips groups that
+/  have no free cluster, or that are entirely free, without reading the FAT.
+/  f_getfree counts all the groups left at once, if the free count is not
+/  known. A group is the smallest power of 2 clusters, 128 or more, that
+/  covers the volume in the given number of groups. It is ignored at read-only
+/  configuration. */
+
+#define _FS_FASTMOUNT   1  /* 0:Disable or 1:Enable */
+/* This option keeps a copy of the free cluster map on a FAT32 volume, in the
+/  unused sectors at the end of its reserved area, with the FSINFO free count
+/  and next free cluster and the volume serial number it goes with. It is
+/  written when the volume is synced with every group counted, and zeroed
+/  before the FAT next changes, so it is only ever found valid for the FAT as
+/  it is on the disk. A mount that finds it, matching the FSINFO, loads it
+/  instead of counting the groups again as they are used. Another host that changes the volume without keeping the FSINFO up to
+/  date is not noticed, so set bit 0 of _FS_NOFSINFO, which disables this
+/  option, where that can happen. It needs _FS_FREEMAP and is ignored at
+/  read-only configuration. */
+
+#define _FS_AUALIGN     1  /* 0:Disable or 1:Enable */
+/* This option makes f_expand start each contiguous block on an erase block
+/  boundary, taking the erase block size from the GET_BLOCK_SIZE command of
+/  disk_ioctl() when the volume is mounted. A memory card only reaches its
+/  speed class when whole allocation units are written in order. Free clusters
+/  skipped ahead of a boundary are left for other allocations. Nothing is
+/  aligned when the erase block is not a whole number of clusters, or does not
+/  fall on a cluster. It is ignored at read-only configuration. */
+
 #define _FS_EXFAT	1
 /* This option switches support of exFAT file system. (0:Disable or 1:Enable)
 /  When enable exFAT, also LFN needs to be enabled. (_USE_LFN >= 1)
 /  Note that enabling exFAT discards C89 compatibility. */
 
+#define _FS_HEADROOM    0x10000000  /* 0:Disable or >=1:Bytes of headroom */
+/* This option keeps files growing on an exFAT volume contiguous, so they stay
+/  in the no-FAT-chain form and never have their chain written to the FAT. A
+/  new chain starts where this many bytes (256 MiB here, rounded down to whole
+/  clusters and to no more than 1/8 of the volume) are free, on an allocation
+/  unit boundary if _FS_AUALIGN is enabled, and as much past the growing edge
+/  of each of the last four files to grow is left alone by other allocations
+/  for as long as free space allows. Once no such block is found, none is searched for again until
+/  clusters are freed or a file's headroom is released. Nothing is reserved on
+/  the disk; a file's headroom is forgotten when it is closed. It is ignored
+/  unless exFAT is enabled, and at read-only configuration. */
+
+#ifndef _FS_DIRINDEX
+#define _FS_DIRINDEX    2048  /* 0:Disable or 64-32768 (power of 2):Names indexed */
+#endif
+/* This option keeps a hashed index of the names in one directory, so opening
+/  a file there reads the sector holding its entry instead of every entry ahead
+/  of it. The directory indexed is the last one a search had to go more than
+/  128 entries into; the index is built at the next search in it, by reading
+/  the directory once, and kept up to date as files are created and removed
+/  there. It takes 8 bytes per name it can hold, half of it left free to keep
+/  lookups short, so 16 KiB of CCM RAM at 2048 names. A directory with more
+/  names than that, or entries beyond the 65534th, is searched as before, and
+/  the last four found too large are not read to build an index again until
+/  enough names are removed from them. Files with an LFN on a FAT volume take
+/  two names. Creating a file in the directory also starts looking for free
+/  entries after those known to be in use, whether or not its names fit. The
+/  host build takes another size from the make variable DIRINDEX. It is
+/  ignored at read-only configuration. */
+
 #define _FS_NORTC	0
 #define _NORTC_MON	6
 #define _NORTC_MDAY	4
@@ -227,7 +326,7 @@
 /  _NORTC_MDAY and _NORTC_YEAR have no effect.
 /  These options have no effect at read-only configuration (_FS_READONLY = 1). */
 
-#define _FS_LOCK    1     /* 0:Disable or >=1:Enable */
+#define _FS_LOCK    2     /* 0:Disable or >=1:Enable */
 /* The option _FS_LOCK switches file lock function to control duplicated file open
 /  and illegal operation to open objects. This option must be 0 when _FS_READONLY
 /  is 1.
@@ -238,9 +337,19 @@
 /      can be opened simultaneously under file lock control. Note that the file
 /      lock control is independent of re-entrancy. */
 
+#if defined(APP_RTOS)
+#define _FS_REENTRANT    1  /* 0:Disable or 1:Enable */
+#else
 #define _FS_REENTRANT    0  /* 0:Disable or 1:Enable */
+#endif
 #define _FS_TIMEOUT      1000 /* Timeout period in unit of time ticks */
+#define _USE_MUTEX       1  /* 0:Semaphore or 1:Mutex as the sync object */
+#if _FS_REENTRANT
+#include "cmsis_os.h"
+#define _SYNC_t          osMutexId_t
+#else
 #define _SYNC_t          NULL
+#endif
 /* The option _FS_REENTRANT switches the re-entrancy (thread safe) of the FatFs
 /  module itself. Note that regardless of this option, file access to different
 /  volume is always re-entrant and volume control functions, f_mount(), f_mkfs()
@@ -256,7 +365,12 @@
 /  The _FS_TIMEOUT defines timeout period in unit of time tick.
 /  The _SYNC_t defines O/S dependent sync object type. e.g. HANDLE, ID, OS_EVENT*,
 /  SemaphoreHandle_t and etc.. A header file for O/S definitions needs to be
-/  included somewhere in the scope of ff.h. */
+/  included somewhere in the scope of ff.h.
+/
+/  Re-entrancy follows the RTOS build (APP_RTOS), where the handlers in
+/  option/syscall.c lock each volume with a CMSIS-RTOS2 mutex. A mutex rather
+/  than a semaphore lets the kernel raise the priority of a thread that holds
+/  the volume while a higher priority thread waits for it. */
 
 /* define the ff_malloc ff_free macros as standard malloc free */
 #if !defined(ff_malloc) && !defined(ff_free)
@@ -18,7 +18,8 @@
 /* USER CODE END Header */
 
 /* Note: code generation based on sd_diskio_template_bspv1.c v2.1.4
-   as "Use dma template" is disabled. */
+   as "Use dma template" is disabled. The DMA transfer path selected by
+   SD_USE_DMA follows sd_diskio_dma_template_bspv1.c. */
 
 /* USER CODE BEGIN firstSection */
 /* can be used to modify / undefine following code or add new definitions */
@@ -28,6 +29,11 @@
 #include "ff_gen_drv.h"
 #include "sd_diskio.h"
 
+#include <string.h>
+#if defined(APP_RTOS)
+#include "cmsis_os.h"
+#endif
+
 /* Private typedef -----------------------------------------------------------*/
 /* Private define ------------------------------------------------------------*/
 /* use the default SD timout as defined in the platform BSP driver*/
@@ -51,12 +57,247 @@
 /* #define DISABLE_SD_INIT */
 /* USER CODE END disableSDInit */
 
+/*
+ * When SD_USE_DMA is defined (SD_DMA=1 in the Makefile) sector data is moved
+ * by DMA2 rather than by the CPU polling the SDIO FIFO. The caller still waits
+ * for the transfer to finish, but interrupts are serviced throughout and no
+ * FIFO under/overrun can occur when they are.
+ */
+#if defined(SD_USE_DMA)
+/* DMA completion is signalled from interrupt context, so the wait is bounded
+   in milliseconds rather than by the SDIO data timeout used for polling. */
+#define SD_DMA_TIMEOUT 30 * 1000
+
+/*
+ * The SDIO DMA streams transfer whole words, so a buffer which is not 4-byte
+ * aligned is bounced through an aligned scratch sector instead. So is one in
+ * CCM RAM, such as the FatFs window, as DMA has no path to it.
+ */
+#define ENABLE_SCRATCH_BUFFER
+#define SD_DMA_REACHABLE(buff) \
+  ((((uintptr_t)(buff) & 0x3) == 0) && \
+   (((uintptr_t)(buff) < CCMDATARAM_BASE) || ((uintptr_t)(buff) > CCMDATARAM_END)))
+
+/* Transfer completion states, set from the BSP callbacks */
+#define SD_DMA_PENDING  0
+#define SD_DMA_DONE     1
+#define SD_DMA_FAILED   2
+#endif
+
+/*
+ * With APP_RTOS (RTOS=1 in the Makefile) every wait for the card sleeps on a
+ * semaphore instead of spinning: the SD callbacks release it when a DMA
+ * transfer ends, and the card's busy state, which raises no interrupt, is
+ * polled once a tick. Lower priority threads then run while the thread that
+ * owns the card waits for it. The driver is still not reentrant, so only one
+ * thread may use it.
+ */
+#if defined(APP_RTOS)
+#define SD_WAIT_EVENT() ((void)osSemaphoreAcquire(sd_event, 1U))
+#else
+#define SD_WAIT_EVENT()
+#endif
+
+/*
+ * Without an RTOS the caller of SD_read, and of SD_write unless
+ * SD_WRITE_BEHIND queues it, gets control back only once the card has the
+ * data: FatFs has no way to be told later. While a DMA transfer is pending
+ * the core sleeps in WFI with PRIMASK set, so it wakes for the transfer's own
+ * interrupt, or SysTick, without missing one that fires as it goes to sleep.
+ * The card's busy state raises no interrupt and is still polled, spinning.
+ */
+#if defined(APP_RTOS)
+#define SD_WAIT_DMA(status) SD_WAIT_EVENT()
+#else
+#define SD_WAIT_DMA(status) \
+  do \
+  { \
+    __disable_irq(); \
+    if (*(status) == SD_DMA_PENDING) \
+    { \
+      __WFI(); \
+    } \
+    __enable_irq(); \
+  } while (0)
+#endif
+
+/*
+ * When SD_WRITE_BEHIND is also defined (SD_WRITE_BEHIND=1 in the Makefile)
+ * SD_write only copies the sectors into a RAM ring and returns. The ring is
+ * drained to the card by DMA while the caller carries on, so card busy time
+ * is only felt once SD_WB_SECTORS sectors are queued. CTRL_SYNC waits until
+ * the ring is empty.
+ *
+ * Queued sectors with consecutive LBAs are sent as a single multi-block
+ * write, whichever SD_write calls they came from. A run which may still grow
+ * is held back until the stream breaks, half the ring is waiting or a flush
+ * needs it, so sequential data costs one CMD25/CMD12 and one busy period per
+ * half ring rather than per FatFs request.
+ *
+ * A word aligned request of SD_WB_DIRECT_SECTORS or more, such as a frame
+ * passed to f_write_aligned, would only fill the ring and wait for it. It is
+ * sent by DMA straight from the caller's buffer instead, once the ring has
+ * drained so that the order of writes is kept.
+ *
+ * The ring drains without the caller: the write completion interrupt starts
+ * the next queued run. The card is usually still programming the last one by
+ * then, raising no interrupt when it is done, so SD_Tick() starts the run from
+ * the 1 kHz tick instead. The ring is only ever touched with interrupts
+ * masked, and SD_read holds queued runs back while it uses the bus.
+ *
+ * A run ending at the newest entry is held back, as the next request may
+ * continue it, but for no more than SD_WB_HOLD_MS after its last sector was
+ * queued. SD_Tick() then sends it as it stands.
+ */
+#if defined(SD_WRITE_BEHIND)
+#if !defined(SD_USE_DMA)
+#error "SD_WRITE_BEHIND requires SD_USE_DMA"
+#endif
+#ifndef SD_WB_SECTORS
+#define SD_WB_SECTORS 64
+#endif
+#ifndef SD_WB_DIRECT_SECTORS
+#define SD_WB_DIRECT_SECTORS (SD_WB_SECTORS / 2)
+#endif
+#ifndef SD_WB_HOLD_MS
+#define SD_WB_HOLD_MS 10
+#endif
+#endif
+
+/*
+ * A read which starts where the previous one ended is taken as a sequential
+ * stream and SD_RA_SECTORS are fetched in one multi-block read, serving the
+ * following reads from RAM. Set SD_RA_SECTORS to 0 to disable read-ahead.
+ */
+#ifndef SD_RA_SECTORS
+#define SD_RA_SECTORS 16
+#endif
+
+/*
+ * With _USE_TRIM, CTRL_TRIM does not erase straight away. The range is queued
+ * and erased by SD_Idle_Poll, one allocation unit (CMD32/33/38) at a time,
+ * while nothing else is in progress. Only whole, aligned AUs are erased, since
+ * a card writes fastest into an AU that has been erased entirely. A write to
+ * a queued AU takes it off the queue before the write is issued, so an AU is
+ * never erased after data has been written to it.
+ *
+ * REC_Open trims the extent of a new recording file, so the AUs ahead of the
+ * write pointer get erased while the recorder waits for data.
+ */
+#if _USE_TRIM
+/* Erase unit for a card that does not report its allocation unit */
+#ifndef SD_ERASE_SECTORS
+#define SD_ERASE_SECTORS 8192
+#endif
+#ifndef SD_ERASE_RANGES
+#define SD_ERASE_RANGES 8
+#endif
+#endif
+
+/*
+ * Card detect: BSP_SD_DetectIT aborts the DMA transfer in flight as the card
+ * leaves the slot and BSP_SD_DetectCallback below fails it, so the caller
+ * sees the error at once rather than after SD_DMA_TIMEOUT. The drive then
+ * reads as not initialized until SD_initialize, which FatFs calls on its next
+ * access. That succeeds once a card is back, after waiting for its switch to
+ * settle.
+ *
+ * SD_initialize adds STA_KEPT when the card is the one it last initialized,
+ * every write since was synced before it left, and it was out for less than
+ * SD_RESEAT_MS, too short to have been written elsewhere. FatFs then keeps the
+ * free cluster map rather than scanning the FAT again.
+ */
+#ifndef SD_RESEAT_MS
+#define SD_RESEAT_MS 10000
+#endif
+
 /* Private variables ---------------------------------------------------------*/
 /* Disk status */
 static volatile DSTATUS Stat = STA_NOINIT;
 
+/* Card detect state, see above */
+static volatile uint8_t sd_removed;     /* the card has left since SD_initialize */
+static volatile uint32_t sd_left_tick;  /* when it last left */
+static volatile uint8_t sd_left;        /* it has left since the last successful SD_initialize */
+static uint8_t sd_unsynced;             /* written since the last CTRL_SYNC or successful SD_initialize */
+
+#if defined(APP_RTOS)
+/* Released by the SD callbacks to wake a thread waiting for the card */
+static osSemaphoreId_t sd_event;
+#endif
+
+#if defined(SD_USE_DMA)
+static volatile uint8_t ReadStatus = SD_DMA_PENDING;
+static volatile uint8_t WriteStatus = SD_DMA_PENDING;
+#if defined(ENABLE_SCRATCH_BUFFER)
+__ALIGN_BEGIN static uint8_t scratch[BLOCKSIZE] __ALIGN_END;
+#endif
+#endif
+
+#if defined(SD_WRITE_BEHIND)
+/* Write-behind ring: sector data and destination LBA */
+__ALIGN_BEGIN static uint8_t wb_buf[SD_WB_SECTORS][BLOCKSIZE] __ALIGN_END;
+static __CCMRAM DWORD wb_lba[SD_WB_SECTORS];
+static UINT wb_head;        /* next entry to fill */
+static volatile UINT wb_tail;       /* oldest entry not yet on the card */
+static volatile UINT wb_count;      /* entries queued, including those in flight */
+static volatile UINT wb_inflight;   /* entries being transferred (0: bus idle) */
+static volatile uint8_t wb_hold;    /* SD_read owns the bus: start no run from interrupts */
+static volatile uint32_t wb_queued_tick;   /* when the newest entry was queued */
+static uint8_t wb_error;    /* a queued write failed since SD_initialize */
+#endif
+
+#if SD_RA_SECTORS > 0
+/* Read-ahead window */
+__ALIGN_BEGIN static uint8_t ra_buf[SD_RA_SECTORS][BLOCKSIZE] __ALIGN_END;
+static DWORD ra_lba;        /* first sector held in ra_buf */
+static UINT ra_count;       /* sectors held in ra_buf (0: empty) */
+static DWORD ra_next;       /* sector following the previous read */
+#endif
+
+/* Card registers read on initialisation */
+static DWORD au_sectors;    /* allocation unit from SD Status (0: not reported) */
+static uint8_t speed_class; /* Speed Class from SD Status, in MB/s */
+static uint8_t wr_factor;   /* R2W_FACTOR from the CSD: write time / read time, log2 */
+static uint32_t card_cid[4]; /* CID, telling one card from another (0: not read) */
+
+#if _USE_TRIM
+/* Ranges waiting to be erased, in er_unit aligned sectors */
+static __CCMRAM DWORD er_start[SD_ERASE_RANGES];   /* first sector of each range */
+static __CCMRAM DWORD er_end[SD_ERASE_RANGES];     /* sector following each range */
+static UINT er_count;                     /* ranges queued */
+static DWORD er_unit = SD_ERASE_SECTORS;  /* sectors erased by each command */
+#endif
+
+/* Statistics reported by SD_GetStats() */
+static __CCMRAM SD_DiskStats stats;
+
 /* Private function prototypes -----------------------------------------------*/
 static DSTATUS SD_CheckStatus(BYTE lun);
+static void SD_CountCommand(uint32_t *cmds, uint32_t *sectors, UINT count);
+static DRESULT SD_ReadBlocksOnce(BYTE *buff, DWORD sector, UINT count);
+static DRESULT SD_ReadBlocks(BYTE *buff, DWORD sector, UINT count);
+#if defined(SD_USE_DMA)
+static int SD_CheckStatusWithTimeout(uint32_t timeout);
+static DRESULT SD_WaitTransfer(volatile uint8_t *status);
+static DRESULT SD_WriteBlocksDMA(const BYTE *buff, DWORD sector, UINT count);
+#endif
+#if defined(SD_WRITE_BEHIND)
+static void SD_WB_Reset(void);
+static int SD_WB_Retire(void);
+static void SD_WB_Start(int force);
+static void SD_WB_Pump(int force);
+static DRESULT SD_WB_Wait(UINT max_count);
+static int SD_WB_Overlaps(DWORD sector, UINT count);
+static DRESULT SD_WB_Write(const BYTE *buff, DWORD sector, UINT count);
+#endif
+static void SD_ReadCardClass(void);
+#if _USE_TRIM
+static void SD_ER_Remove(UINT idx);
+static void SD_ER_Add(DWORD start, DWORD end);
+static void SD_ER_Clip(DWORD sector, UINT count);
+static void SD_ER_Step(void);
+#endif
 DSTATUS SD_initialize (BYTE);
 DSTATUS SD_status (BYTE);
 DRESULT SD_read (BYTE, BYTE*, DWORD, UINT);
@@ -89,16 +330,682 @@ const Diskio_drvTypeDef  SD_Driver =
 
 static DSTATUS SD_CheckStatus(BYTE lun)
 {
-  Stat = STA_NOINIT;
-
-  if(BSP_SD_GetCardState() == MSD_OK)
+  /* a card pulled out stays so until SD_initialize, even if put back */
+  if (sd_removed)
+  {
+    Stat = STA_NOINIT | STA_NODISK;
+  }
+  else if(BSP_SD_GetCardState() == MSD_OK)
   {
     Stat &= ~STA_NOINIT;
   }
+  /* a card still programming queued writes keeps the state it had */
 
   return Stat;
 }
 
+/**
+  * @brief  Accounts for a read or write data command
+  * @param  cmds: Command counter to increment
+  * @param  sectors: Sector counter to advance
+  * @param  count: Number of sectors transferred by the command
+  * @retval None
+  */
+static void SD_CountCommand(uint32_t *cmds, uint32_t *sectors, UINT count)
+{
+  (*cmds)++;
+  *sectors += count;
+
+  /* multi-block transfers are ended by CMD12 */
+  if (count > 1)
+  {
+    stats.stop_cmds++;
+  }
+}
+
+#if defined(SD_USE_DMA)
+/**
+  * @brief  Waits until the card is back in the transfer state
+  * @param  timeout: Maximum time to wait in ms
+  * @retval 0 when the card is ready, -1 on timeout
+  */
+static int SD_CheckStatusWithTimeout(uint32_t timeout)
+{
+  uint32_t timer = HAL_GetTick();
+
+  /* block until SDIO IP is ready again, a timeout occur or the card is pulled */
+  while((HAL_GetTick() - timer < timeout) && !sd_removed)
+  {
+    if (BSP_SD_GetCardState() == SD_TRANSFER_OK)
+    {
+      return 0;
+    }
+    SD_WAIT_EVENT();
+  }
+
+  return -1;
+}
+
+/**
+  * @brief  Waits for a DMA transfer started with BSP_SD_xxxBlocks_DMA()
+  * @param  status: Completion flag set by the matching BSP callback
+  * @retval DRESULT: Operation result
+  */
+static DRESULT SD_WaitTransfer(volatile uint8_t *status)
+{
+  uint32_t timer = HAL_GetTick();
+
+  /* Wait that the transfer is completed or a timeout occurs */
+  while((*status == SD_DMA_PENDING) && ((HAL_GetTick() - timer) < SD_DMA_TIMEOUT))
+  {
+    SD_WAIT_DMA(status);
+  }
+
+  if (*status != SD_DMA_DONE)
+  {
+    return RES_ERROR;
+  }
+
+  /* the card may still be programming the data it has just received */
+  if (SD_CheckStatusWithTimeout(SD_DMA_TIMEOUT) < 0)
+  {
+    return RES_ERROR;
+  }
+
+  return RES_OK;
+}
+
+/**
+  * @brief  Writes sector(s) by DMA and waits for the card to take them
+  * @param  *buff: Data to be written
+  * @param  sector: Sector address (LBA)
+  * @param  count: Number of sectors to write
+  * @retval DRESULT: Operation result
+  */
+static DRESULT SD_WriteBlocksDMA(const BYTE *buff, DWORD sector, UINT count)
+{
+  DRESULT res = RES_ERROR;
+
+  /* ensure the SD card is ready for a new operation */
+  if (SD_CheckStatusWithTimeout(SD_DMA_TIMEOUT) < 0)
+  {
+    return res;
+  }
+
+#if defined(ENABLE_SCRATCH_BUFFER)
+  if (SD_DMA_REACHABLE(buff))
+  {
+#endif
+    SD_CountCommand(&stats.wr_cmds, &stats.wr_sectors, count);
+    WriteStatus = SD_DMA_PENDING;
+    if(BSP_SD_WriteBlocks_DMA((uint32_t*)buff,
+                              (uint32_t)(sector),
+                              count) == MSD_OK)
+    {
+      res = SD_WaitTransfer(&WriteStatus);
+    }
+#if defined(ENABLE_SCRATCH_BUFFER)
+  }
+  else
+  {
+    /* Slow path, memcpy each sector to the scratch buffer and send it alone */
+    UINT i;
+
+    for (i = 0; i < count; i++)
+    {
+      memcpy((void *)scratch, (const void *)buff, BLOCKSIZE);
+      stats.wr_copied += BLOCKSIZE;
+      buff += BLOCKSIZE;
+
+      SD_CountCommand(&stats.wr_cmds, &stats.wr_sectors, 1);
+      WriteStatus = SD_DMA_PENDING;
+      if ((BSP_SD_WriteBlocks_DMA((uint32_t*)scratch, (uint32_t)sector++, 1) != MSD_OK) ||
+          (SD_WaitTransfer(&WriteStatus) != RES_OK))
+      {
+        break;
+      }
+    }
+
+    if (i == count)
+    {
+      res = RES_OK;
+    }
+  }
+#endif
+
+  return res;
+}
+#endif
+
+#if defined(SD_WRITE_BEHIND)
+/**
+  * @brief  Empties the write-behind ring, discarding anything queued
+  * @retval None
+  */
+static void SD_WB_Reset(void)
+{
+  uint32_t primask = __get_PRIMASK();
+
+  __disable_irq();
+  wb_head = 0;
+  wb_tail = 0;
+  wb_count = 0;
+  wb_inflight = 0;
+  wb_hold = 0;
+  wb_error = 0;
+  __set_PRIMASK(primask);
+}
+
+/**
+  * @brief  Releases the ring entries of a finished transfer
+  * @retval 1 when no transfer is in flight, 0 otherwise
+  * @note   From interrupt context the transfer can only have succeeded: a
+  *         failed one is retired, and the bus recovered, by the caller.
+  */
+static int SD_WB_Retire(void)
+{
+  uint32_t primask = __get_PRIMASK();
+
+  __disable_irq();
+  if ((wb_inflight != 0) && (WriteStatus == SD_DMA_FAILED))
+  {
+    /* nothing starts while the failed run is counted in flight, so the bus
+       is recovered with interrupts enabled; the run is then sent again at a
+       slower bus mode if the link was at fault */
+    __set_PRIMASK(primask);
+    if (!sd_removed && (BSP_SD_RecoverBusError() == MSD_OK))
+    {
+      wb_inflight = 0;
+      return 1;
+    }
+    __disable_irq();
+    wb_error = 1;
+  }
+  if ((wb_inflight != 0) && (WriteStatus == SD_DMA_PENDING))
+  {
+    __set_PRIMASK(primask);
+    return 0;
+  }
+
+  wb_tail = (wb_tail + wb_inflight) % SD_WB_SECTORS;
+  wb_count -= wb_inflight;
+  wb_inflight = 0;
+  __set_PRIMASK(primask);
+
+  return 1;
+}
+
+/**
+  * @brief  Starts the oldest run of consecutive sectors by DMA, if the bus is
+  *         idle and the card has finished programming
+  * @param  force: Start the oldest run even if it could still grow
+  * @retval None
+  * @note   Called with interrupts masked.
+  */
+static void SD_WB_Start(int force)
+{
+  UINT run;
+
+  if ((wb_inflight != 0) || (wb_count == 0))
+  {
+    return;
+  }
+
+  /* gather consecutive LBAs, stopping at the end of the ring */
+  run = 1;
+  while ((run < wb_count) && (wb_tail + run < SD_WB_SECTORS) &&
+         (wb_lba[wb_tail + run] == wb_lba[wb_tail] + run))
+  {
+    run++;
+  }
+
+  /* a run ending at the newest entry may be continued by the next request,
+     unless it has waited for one long enough */
+  if (!force && (run == wb_count) && (wb_tail + run < SD_WB_SECTORS) &&
+      (run < SD_WB_SECTORS / 2) &&
+      ((HAL_GetTick() - wb_queued_tick) < SD_WB_HOLD_MS))
+  {
+    return;
+  }
+
+  if (BSP_SD_GetCardState() != SD_TRANSFER_OK)
+  {
+    return;
+  }
+
+  SD_CountCommand(&stats.wr_cmds, &stats.wr_sectors, run);
+  WriteStatus = SD_DMA_PENDING;
+  wb_inflight = run;
+  if (BSP_SD_WriteBlocks_DMA((uint32_t*)wb_buf[wb_tail],
+                             (uint32_t)wb_lba[wb_tail],
+                             run) != MSD_OK)
+  {
+    WriteStatus = SD_DMA_FAILED;
+  }
+}
+
+/**
+  * @brief  Advances the write-behind ring without blocking
+  * @param  force: Start the oldest run even if it could still grow
+  * @retval None
+  * @note   Once the previous transfer has completed and the card has finished
+  *         programming it, the oldest run of consecutive sectors is started
+  *         by DMA. Safe from interrupt context.
+  */
+static void SD_WB_Pump(int force)
+{
+  uint32_t primask;
+
+  if (!SD_WB_Retire())
+  {
+    return;
+  }
+
+  primask = __get_PRIMASK();
+  __disable_irq();
+  SD_WB_Start(force);
+  __set_PRIMASK(primask);
+}
+
+/**
+  * @brief  Drains the write-behind ring down to a given depth
+  * @param  max_count: Number of entries which may remain queued
+  * @retval DRESULT: RES_ERROR on timeout or if a queued write has failed
+  */
+static DRESULT SD_WB_Wait(UINT max_count)
+{
+  uint32_t timer = HAL_GetTick();
+
+  SD_WB_Pump(1);
+  while (wb_count > max_count)
+  {
+    if (((HAL_GetTick() - timer) >= SD_DMA_TIMEOUT) || sd_removed)
+    {
+      return RES_ERROR;
+    }
+    SD_WAIT_EVENT();
+    SD_WB_Pump(1);
+  }
+
+  return wb_error ? RES_ERROR : RES_OK;
+}
+
+/**
+  * @brief  Checks whether any queued sector falls inside a range
+  * @param  sector: First sector of the range
+  * @param  count: Number of sectors in the range
+  * @retval 1 if the range overlaps the ring, 0 otherwise
+  */
+static int SD_WB_Overlaps(DWORD sector, UINT count)
+{
+  UINT i;
+  UINT idx;
+  UINT queued;
+
+  /* the completion interrupt may retire entries, but never both halves */
+  __disable_irq();
+  idx = wb_tail;
+  queued = wb_count;
+  __enable_irq();
+
+  for (i = 0; i < queued; i++)
+  {
+    if ((wb_lba[idx] >= sector) && (wb_lba[idx] - sector < count))
+    {
+      return 1;
+    }
+    idx = (idx + 1) % SD_WB_SECTORS;
+  }
+
+  return 0;
+}
+
+/**
+  * @brief  Queues sector(s) in the write-behind ring
+  * @param  *buff: Data to be written
+  * @param  sector: Sector address (LBA)
+  * @param  count: Number of sectors to write
+  * @retval DRESULT: Operation result
+  * @note   Blocks only while the ring is full, or for the whole transfer
+  *         when it is sent directly.
+  */
+static DRESULT SD_WB_Write(const BYTE *buff, DWORD sector, UINT count)
+{
+  UINT i;
+
+  if (wb_error)
+  {
+    return RES_ERROR;
+  }
+
+  if ((count >= SD_WB_DIRECT_SECTORS) && SD_DMA_REACHABLE(buff))
+  {
+    if (SD_WB_Wait(0) != RES_OK)
+    {
+      return RES_ERROR;
+    }
+    return SD_WriteBlocksDMA(buff, sector, count);
+  }
+
+  for (i = 0; i < count; i++)
+  {
+    if (wb_count == SD_WB_SECTORS)
+    {
+      stats.wb_stalls++;
+      if (SD_WB_Wait(SD_WB_SECTORS - 1) != RES_OK)
+      {
+        return RES_ERROR;
+      }
+    }
+
+    memcpy(wb_buf[wb_head], buff, BLOCKSIZE);
+    stats.wr_copied += BLOCKSIZE;
+    wb_lba[wb_head] = sector++;
+    wb_head = (wb_head + 1) % SD_WB_SECTORS;
+    __disable_irq();
+    wb_count++;
+    wb_queued_tick = HAL_GetTick();
+    __enable_irq();
+    buff += BLOCKSIZE;
+  }
+
+  if (wb_count > stats.wb_high_water)
+  {
+    stats.wb_high_water = wb_count;
+  }
+
+  SD_WB_Pump(0);
+
+  return RES_OK;
+}
+#endif
+
+/**
+  * @brief  Reads what the card states about its write performance: the
+  *         allocation unit and Speed Class from the SD Status register, and
+  *         the write speed factor from the CSD. Keeps its CID as well.
+  * @retval None
+  * @note   Fields the card does not report are left at 0.
+  */
+static void SD_ReadCardClass(void)
+{
+  /* AU_SIZE codes 1 to 15, in KiB (SD Physical Layer, SD Status) */
+  static const uint32_t au_kib[16] =
+  {
+    0, 16, 32, 64, 128, 256, 512, 1024, 2048, 4096, 8192, 12288, 16384,
+    24576, 32768, 65536
+  };
+  /* SPEED_CLASS codes 0 to 4, in MB/s */
+  static const uint8_t class_mbs[5] = { 0, 2, 4, 6, 10 };
+  BSP_SD_CardStatus CardStatus;
+  BSP_SD_CardCSD CardCSD;
+
+  au_sectors = 0;
+  speed_class = 0;
+  wr_factor = 0;
+  BSP_SD_GetCardCID(card_cid);
+
+  if (BSP_SD_GetCardCSD(&CardCSD) == MSD_OK)
+  {
+    wr_factor = CardCSD.WrSpeedFact;
+  }
+  if (BSP_SD_GetCardStatus(&CardStatus) == MSD_OK)
+  {
+    au_sectors = au_kib[CardStatus.AllocationUnitSize & 0x0F] * 1024U / SD_DEFAULT_BLOCK_SIZE;
+    if (CardStatus.SpeedClass < sizeof(class_mbs))
+    {
+      speed_class = class_mbs[CardStatus.SpeedClass];
+    }
+  }
+}
+
+#if _USE_TRIM
+/**
+  * @brief  Takes a range off the erase queue
+  * @param  idx: Index of the range
+  * @retval None
+  */
+static void SD_ER_Remove(UINT idx)
+{
+  er_count--;
+  for (; idx < er_count; idx++)
+  {
+    er_start[idx] = er_start[idx + 1];
+    er_end[idx] = er_end[idx + 1];
+  }
+}
+
+/**
+  * @brief  Queues the whole allocation units inside a range of sectors
+  * @param  start: First sector of the range
+  * @param  end: Sector following the range
+  * @retval None
+  * @note   Adjacent and overlapping ranges are merged. When the queue is full
+  *         the range is dropped, as a trim is only a hint.
+  */
+static void SD_ER_Add(DWORD start, DWORD end)
+{
+  UINT i;
+
+  start = (start + er_unit - 1) / er_unit * er_unit;
+  end = end / er_unit * er_unit;
+  if (start >= end)
+  {
+    return;
+  }
+
+  for (i = 0; i < er_count; i++)
+  {
+    if ((start <= er_end[i]) && (er_start[i] <= end))
+    {
+      /* absorb the queued range, then look for others the union touches */
+      start = (er_start[i] < start) ? er_start[i] : start;
+      end = (er_end[i] > end) ? er_end[i] : end;
+      SD_ER_Remove(i);
+      i = (UINT)-1;
+    }
+  }
+
+  if (er_count == SD_ERASE_RANGES)
+  {
+    stats.erase_dropped++;
+    return;
+  }
+  er_start[er_count] = start;
+  er_end[er_count] = end;
+  er_count++;
+}
+
+/**
+  * @brief  Takes the allocation units touched by a write off the queue
+  * @param  sector: First sector written
+  * @param  count: Number of sectors written
+  * @retval None
+  */
+static void SD_ER_Clip(DWORD sector, UINT count)
+{
+  DWORD lo = sector / er_unit * er_unit;
+  DWORD hi = (sector + count + er_unit - 1) / er_unit * er_unit;
+  UINT i;
+
+  for (i = 0; i < er_count; i++)
+  {
+    if ((lo >= er_end[i]) || (er_start[i] >= hi))
+    {
+      continue;
+    }
+    if ((er_start[i] < lo) && (er_end[i] > hi))
+    {
+      /* split, keeping the part ahead of the write if there is no room */
+      if (er_count < SD_ERASE_RANGES)
+      {
+        er_start[er_count] = er_start[i];
+        er_end[er_count] = lo;
+        er_count++;
+      }
+      er_start[i] = hi;
+    }
+    else if (er_start[i] < lo)
+    {
+      er_end[i] = lo;
+    }
+    else if (er_end[i] > hi)
+    {
+      er_start[i] = hi;
+    }
+    else
+    {
+      SD_ER_Remove(i--);
+    }
+  }
+}
+
+/**
+  * @brief  Erases the first queued allocation unit if the card is free
+  * @retval None
+  * @note   CMD38 returns once the card has accepted it. The card then stays
+  *         busy while it erases, which the next command waits for.
+  */
+static void SD_ER_Step(void)
+{
+  DWORD end;
+
+  if (er_count == 0)
+  {
+    return;
+  }
+#if defined(SD_WRITE_BEHIND)
+  if (wb_count != 0)
+  {
+    return;
+  }
+#endif
+  if (BSP_SD_GetCardState() != SD_TRANSFER_OK)
+  {
+    return;
+  }
+
+  end = er_start[0] + er_unit;
+  if (BSP_SD_Erase(er_start[0], end - 1) != MSD_OK)
+  {
+    /* not supported, or refused: give up on the whole range */
+    stats.erase_dropped++;
+    SD_ER_Remove(0);
+    return;
+  }
+  stats.erase_cmds++;
+  stats.erase_sectors += er_unit;
+
+#if SD_RA_SECTORS > 0
+  /* erased sectors no longer read back as the window holds them */
+  if ((ra_count != 0) && (er_start[0] < ra_lba + ra_count) && (ra_lba < end))
+  {
+    ra_count = 0;
+  }
+#endif
+
+  er_start[0] = end;
+  if (er_start[0] == er_end[0])
+  {
+    SD_ER_Remove(0);
+  }
+}
+#endif
+
+/**
+  * @brief  Reads Sector(s) from the card, without retrying
+  * @param  *buff: Data buffer to store read data
+  * @param  sector: Sector address (LBA)
+  * @param  count: Number of sectors to read
+  * @retval DRESULT: Operation result
+  */
+static DRESULT SD_ReadBlocksOnce(BYTE *buff, DWORD sector, UINT count)
+{
+  DRESULT res = RES_ERROR;
+
+#if defined(SD_USE_DMA)
+  /* ensure the SD card is ready for a new operation */
+  if (SD_CheckStatusWithTimeout(SD_DMA_TIMEOUT) < 0)
+  {
+    return res;
+  }
+
+#if defined(ENABLE_SCRATCH_BUFFER)
+  if (SD_DMA_REACHABLE(buff))
+  {
+#endif
+    SD_CountCommand(&stats.rd_cmds, &stats.rd_sectors, count);
+    ReadStatus = SD_DMA_PENDING;
+    if(BSP_SD_ReadBlocks_DMA((uint32_t*)buff,
+                             (uint32_t) (sector),
+                             count) == MSD_OK)
+    {
+      res = SD_WaitTransfer(&ReadStatus);
+    }
+#if defined(ENABLE_SCRATCH_BUFFER)
+  }
+  else
+  {
+    /* Slow path, fetch each sector a part and memcpy to destination buffer */
+    UINT i;
+
+    for (i = 0; i < count; i++)
+    {
+      SD_CountCommand(&stats.rd_cmds, &stats.rd_sectors, 1);
+      ReadStatus = SD_DMA_PENDING;
+      if ((BSP_SD_ReadBlocks_DMA((uint32_t*)scratch, (uint32_t)sector++, 1) != MSD_OK) ||
+          (SD_WaitTransfer(&ReadStatus) != RES_OK))
+      {
+        break;
+      }
+      memcpy(buff, scratch, BLOCKSIZE);
+      buff += BLOCKSIZE;
+    }
+
+    if (i == count)
+    {
+      res = RES_OK;
+    }
+  }
+#endif
+#else
+  SD_CountCommand(&stats.rd_cmds, &stats.rd_sectors, count);
+  if(BSP_SD_ReadBlocks((uint32_t*)buff,
+                       (uint32_t) (sector),
+                       count, SD_TIMEOUT) == MSD_OK)
+  {
+    /* wait until the read operation is finished, or the card is pulled */
+    while((BSP_SD_GetCardState()!= MSD_OK) && !sd_removed)
+    {
+      SD_WAIT_EVENT();
+    }
+    res = sd_removed ? RES_ERROR : RES_OK;
+  }
+#endif
+
+  return res;
+}
+
+/**
+  * @brief  Reads Sector(s) from the card
+  * @param  *buff: Data buffer to store read data
+  * @param  sector: Sector address (LBA)
+  * @param  count: Number of sectors to read
+  * @retval DRESULT: Operation result
+  * @note   Link errors are retried at slower bus modes until none is left.
+  */
+static DRESULT SD_ReadBlocks(BYTE *buff, DWORD sector, UINT count)
+{
+  DRESULT res;
+
+  do
+  {
+    res = SD_ReadBlocksOnce(buff, sector, count);
+  } while ((res != RES_OK) && !sd_removed && (BSP_SD_RecoverBusError() == MSD_OK));
+
+  return res;
+}
+
 /**
   * @brief  Initializes a Drive
   * @param  lun : not used
@@ -106,8 +1013,33 @@ static DSTATUS SD_CheckStatus(BYTE lun)
   */
 DSTATUS SD_initialize(BYTE lun)
 {
+  DSTATUS kept;
+
 Stat = STA_NOINIT;
 
+#if defined(APP_RTOS)
+  if (sd_event == NULL)
+  {
+    sd_event = osSemaphoreNew(1U, 0U, NULL);
+  }
+#endif
+
+#if defined(SD_WRITE_BEHIND)
+  SD_WB_Reset();
+#endif
+#if SD_RA_SECTORS > 0
+  ra_count = 0;
+  ra_next = 0xFFFFFFFF;
+#endif
+#if _USE_TRIM
+  er_count = 0;
+#endif
+
+  /* decided before the card is touched, see SD_RESEAT_MS */
+  kept = (!sd_unsynced && (!sd_left || ((HAL_GetTick() - sd_left_tick) < SD_RESEAT_MS))) ?
+         STA_KEPT : 0;
+  sd_removed = 0;
+
 #if !defined(DISABLE_SD_INIT)
 
   if(BSP_SD_Init() == MSD_OK)
@@ -119,7 +1051,33 @@ Stat = STA_NOINIT;
   Stat = SD_CheckStatus(lun);
 #endif
 
-  return Stat;
+  if (Stat & STA_NOINIT)
+  {
+    au_sectors = 0;
+    speed_class = 0;
+    wr_factor = 0;
+    memset(card_cid, 0, sizeof(card_cid));
+  }
+  else
+  {
+    SD_ReadCardClass();
+  }
+#if _USE_TRIM
+  er_unit = au_sectors ? au_sectors : SD_ERASE_SECTORS;
+#endif
+
+  if (Stat & STA_NOINIT)
+  {
+    return Stat;
+  }
+  if (!BSP_SD_IsSameCard())
+  {
+    kept = 0;
+  }
+  sd_left = 0;
+  sd_unsynced = 0;
+
+  return Stat | kept;
 }
 
 /**
@@ -129,6 +1087,15 @@ Stat = STA_NOINIT;
   */
 DSTATUS SD_status(BYTE lun)
 {
+#if defined(SD_WRITE_BEHIND)
+  /* don't query the card while queued writes may take the bus */
+  SD_WB_Pump(0);
+  if (wb_count != 0)
+  {
+    return Stat;
+  }
+#endif
+
   return SD_CheckStatus(lun);
 }
 
@@ -147,17 +1114,82 @@ DSTATUS SD_status(BYTE lun)
 DRESULT SD_read(BYTE lun, BYTE *buff, DWORD sector, UINT count)
 {
   DRESULT res = RES_ERROR;
+#if (SD_RA_SECTORS > 0) || defined(SD_WRITE_BEHIND)
+  UINT span = count;
+#endif
+#if SD_RA_SECTORS > 0
+  BSP_SD_CardInfo CardInfo;
 
-  if(BSP_SD_ReadBlocks((uint32_t*)buff,
-                       (uint32_t) (sector),
-                       count, SD_TIMEOUT) == MSD_OK)
+  /* serve what the previous read fetched ahead */
+  if ((ra_count != 0) && (sector >= ra_lba) && (sector - ra_lba + count <= ra_count))
   {
-    /* wait until the read operation is finished */
-    while(BSP_SD_GetCardState()!= MSD_OK)
+    memcpy(buff, ra_buf[sector - ra_lba], count * BLOCKSIZE);
+    ra_next = sector + count;
+    stats.ra_hits++;
+    return RES_OK;
+  }
+
+  /* a sequential stream of short reads is fetched in one transfer */
+  if ((sector == ra_next) && (count < SD_RA_SECTORS))
+  {
+    BSP_SD_GetCardInfo(&CardInfo);
+    if (sector + SD_RA_SECTORS <= CardInfo.LogBlockNbr)
     {
+      span = SD_RA_SECTORS;
     }
-    res = RES_OK;
   }
+  ra_next = sector + count;
+#endif
+
+#if defined(SD_WRITE_BEHIND)
+  /* queued data must reach the card before it can be read back, anything
+     else only has to wait for the bus */
+  if (SD_WB_Overlaps(sector, span))
+  {
+    if (SD_WB_Wait(0) != RES_OK)
+    {
+      return res;
+    }
+  }
+  else
+  {
+    uint32_t timer = HAL_GetTick();
+
+    wb_hold = 1;
+    while (!SD_WB_Retire())
+    {
+      if ((HAL_GetTick() - timer) >= SD_DMA_TIMEOUT)
+      {
+        wb_hold = 0;
+        return res;
+      }
+      SD_WAIT_DMA(&WriteStatus);
+    }
+  }
+#endif
+
+#if SD_RA_SECTORS > 0
+  if (span != count)
+  {
+    ra_count = 0;
+    res = SD_ReadBlocks(ra_buf[0], sector, span);
+    if (res == RES_OK)
+    {
+      ra_lba = sector;
+      ra_count = span;
+      memcpy(buff, ra_buf[0], count * BLOCKSIZE);
+    }
+  }
+  else
+#endif
+  {
+    res = SD_ReadBlocks(buff, sector, count);
+  }
+
+#if defined(SD_WRITE_BEHIND)
+  /* hand the bus back to the queued writes */
+  wb_hold = 0;
+#endif
 
   return res;
 }
@@ -179,16 +1211,36 @@ DRESULT SD_write(BYTE lun, const BYTE *buff, DWORD sector, UINT count)
 {
   DRESULT res = RES_ERROR;
 
+#if SD_RA_SECTORS > 0
+  /* drop a read-ahead window made stale by this write */
+  if ((ra_count != 0) && (sector < ra_lba + ra_count) && (ra_lba < sector + count))
+  {
+    ra_count = 0;
+  }
+#endif
+#if _USE_TRIM
+  SD_ER_Clip(sector, count);
+#endif
+  sd_unsynced = 1;
+
+#if defined(SD_WRITE_BEHIND)
+  res = SD_WB_Write(buff, sector, count);
+#elif defined(SD_USE_DMA)
+  res = SD_WriteBlocksDMA(buff, sector, count);
+#else
+  SD_CountCommand(&stats.wr_cmds, &stats.wr_sectors, count);
   if(BSP_SD_WriteBlocks((uint32_t*)buff,
                         (uint32_t)(sector),
                         count, SD_TIMEOUT) == MSD_OK)
   {
-	/* wait until the Write operation is finished */
-    while(BSP_SD_GetCardState() != MSD_OK)
+	/* wait until the Write operation is finished, or the card is pulled */
+    while((BSP_SD_GetCardState() != MSD_OK) && !sd_removed)
     {
+      SD_WAIT_EVENT();
     }
-    res = RES_OK;
+    res = sd_removed ? RES_ERROR : RES_OK;
   }
+#endif
 
   return res;
 }
@@ -216,7 +1268,19 @@ DRESULT SD_ioctl(BYTE lun, BYTE cmd, void *buff)
   {
   /* Make sure that no pending write process */
   case CTRL_SYNC :
+#if defined(SD_WRITE_BEHIND)
+    res = SD_WB_Wait(0);
+    if ((res == RES_OK) && (SD_CheckStatusWithTimeout(SD_DMA_TIMEOUT) < 0))
+    {
+      res = RES_ERROR;
+    }
+#else
     res = RES_OK;
+#endif
+    if (res == RES_OK)
+    {
+      sd_unsynced = 0;
+    }
     break;
 
   /* Get number of sectors on the disk (DWORD) */
@@ -233,13 +1297,22 @@ DRESULT SD_ioctl(BYTE lun, BYTE cmd, void *buff)
     res = RES_OK;
     break;
 
-  /* Get erase block size in unit of sector (DWORD) */
+  /* Get erase block size in unit of sector (DWORD): the allocation unit,
+     which f_mkfs aligns the data area to and f_expand aligns files to */
   case GET_BLOCK_SIZE :
     BSP_SD_GetCardInfo(&CardInfo);
-    *(DWORD*)buff = CardInfo.LogBlockSize / SD_DEFAULT_BLOCK_SIZE;
+    *(DWORD*)buff = au_sectors ? au_sectors : CardInfo.LogBlockSize / SD_DEFAULT_BLOCK_SIZE;
     res = RES_OK;
     break;
 
+#if _USE_TRIM
+  /* Queue a range of sectors (DWORD[2], inclusive) to be erased when idle */
+  case CTRL_TRIM :
+    SD_ER_Add(((DWORD*)buff)[0], ((DWORD*)buff)[1] + 1);
+    res = RES_OK;
+    break;
+#endif
+
   default:
     res = RES_PARERR;
   }
@@ -250,6 +1323,135 @@ DRESULT SD_ioctl(BYTE lun, BYTE cmd, void *buff)
 
 /* USER CODE BEGIN afterIoctlSection */
 /* can be used to modify previous code / undefine following code / add new code */
+/**
+  * @brief  Lets queued writes progress while the application is idle, then
+  *         erases the next queued block once they are all on the card
+  * @retval None
+  * @note   Does nothing unless SD_WRITE_BEHIND or _USE_TRIM is set.
+  */
+void SD_Idle_Poll(void)
+{
+#if defined(SD_WRITE_BEHIND)
+  SD_WB_Pump(0);
+#endif
+#if _USE_TRIM
+  if (!(Stat & STA_NOINIT))
+  {
+    SD_ER_Step();
+  }
+#endif
+}
+
+/**
+  * @brief  Starts the next queued write once the card has finished
+  *         programming the last one, or once a run held back for more data
+  *         has waited SD_WB_HOLD_MS
+  * @retval None
+  * @note   Called from the 1 kHz tick interrupt. Does nothing unless
+  *         SD_WRITE_BEHIND is set.
+  */
+void SD_Tick(void)
+{
+#if defined(SD_WRITE_BEHIND)
+  if ((wb_inflight == 0) && (wb_count != 0) && !wb_hold && !sd_removed)
+  {
+    SD_WB_Pump(0);
+  }
+#endif
+}
+
+/**
+  * @brief  Gets the disk driver statistics
+  * @param  *out: Receives a copy of the counters
+  * @retval None
+  */
+void SD_GetStats(SD_DiskStats *out)
+{
+  *out = stats;
+#if defined(SD_WRITE_BEHIND)
+  out->wb_sectors = SD_WB_SECTORS;
+#endif
+  out->au_sectors = au_sectors;
+  out->speed_class = speed_class;
+  out->wr_factor = wr_factor;
+  memcpy(out->cid, card_cid, sizeof(out->cid));
+}
+
+/**
+  * @brief Card detect callback, from interrupt context on either edge of the
+  *        card detect switch
+  * @retval None
+  * @note  On removal the transfer in flight has been aborted already, and is
+  *        failed here. The drive must then be initialized again.
+  */
+void BSP_SD_DetectCallback(void)
+{
+  if (BSP_SD_IsDetected() == SD_PRESENT)
+  {
+    return;
+  }
+
+  sd_removed = 1;
+  sd_left = 1;
+  sd_left_tick = HAL_GetTick();
+  Stat = STA_NOINIT | STA_NODISK;
+#if defined(SD_USE_DMA)
+  BSP_SD_ErrorCallback();
+#endif
+}
+
+#if defined(SD_USE_DMA)
+/**
+  * @brief Tx Transfer completed callback
+  * @retval None
+  */
+void BSP_SD_WriteCpltCallback(void)
+{
+  WriteStatus = SD_DMA_DONE;
+#if defined(SD_WRITE_BEHIND)
+  /* keep the bus busy with the next queued run while the caller carries on */
+  if ((wb_inflight != 0) && !wb_hold)
+  {
+    SD_WB_Pump(0);
+  }
+#endif
+#if defined(APP_RTOS)
+  osSemaphoreRelease(sd_event);
+#endif
+}
+
+/**
+  * @brief Rx Transfer completed callback
+  * @retval None
+  */
+void BSP_SD_ReadCpltCallback(void)
+{
+  ReadStatus = SD_DMA_DONE;
+#if defined(APP_RTOS)
+  osSemaphoreRelease(sd_event);
+#endif
+}
+
+/**
+  * @brief Transfer error callback
+  * @retval None
+  * @note  Only one direction is ever in flight, so fail whichever is pending.
+  */
+void BSP_SD_ErrorCallback(void)
+{
+  if (ReadStatus == SD_DMA_PENDING)
+  {
+    ReadStatus = SD_DMA_FAILED;
+  }
+  if (WriteStatus == SD_DMA_PENDING)
+  {
+    WriteStatus = SD_DMA_FAILED;
+  }
+#if defined(APP_RTOS)
+  osSemaphoreRelease(sd_event);
+#endif
+}
+#endif
 /* USER CODE END afterIoctlSection */
 
 /* USER CODE BEGIN lastSection */
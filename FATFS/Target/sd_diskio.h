@@ -30,10 +30,47 @@
 /* Includes ------------------------------------------------------------------*/
 #include "bsp_driver_sd.h"
 /* Exported types ------------------------------------------------------------*/
+/**
+  * @brief Disk driver statistics
+  */
+typedef struct
+{
+  uint32_t rd_cmds;        /* CMD17/CMD18 issued */
+  uint32_t wr_cmds;        /* CMD24/CMD25 issued, each followed by a busy wait */
+  uint32_t stop_cmds;      /* CMD12 issued to end multi-block transfers */
+  uint32_t rd_sectors;     /* Sectors read from the card */
+  uint32_t wr_sectors;     /* Sectors written to the card */
+  uint32_t ra_hits;        /* SD_read calls served from the read-ahead window */
+  uint32_t wb_stalls;      /* SD_write calls that waited for write-behind space */
+  uint32_t wb_high_water;  /* Most sectors held in the write-behind ring at once */
+  uint32_t wb_sectors;     /* Size of the write-behind ring, 0 without SD_WRITE_BEHIND */
+  uint32_t wr_copied;      /* Bytes copied to the scratch sector or write-behind ring */
+  uint32_t erase_cmds;     /* CMD38 issued by the pre-erase scheduler */
+  uint32_t erase_sectors;  /* Sectors erased ahead of being written */
+  uint32_t erase_dropped;  /* Trimmed ranges given up: queue full or erase refused */
+  uint32_t au_sectors;     /* Allocation unit reported by the card, 0 if none */
+  uint32_t speed_class;    /* Speed Class reported by the card in MB/s, 0 if none */
+  uint32_t wr_factor;      /* Write to read time ratio stated in the CSD, log2 */
+  uint32_t cid[4];         /* Card IDentification register, 0 if not read */
+} SD_DiskStats;
+
 /* Exported constants --------------------------------------------------------*/
+/* Exported macro ------------------------------------------------------------*/
+/* Commands issued per MiB transferred, given a command and a sector counter */
+#define SD_CMDS_PER_MIB(cmds, sectors) \
+  ((sectors) ? (uint32_t)(((uint64_t)(cmds) * 2048U) / (sectors)) : 0U)
+
 /* Exported functions ------------------------------------------------------- */
+/* The driver keeps one transfer in flight and is not reentrant. With APP_RTOS
+ * it must only be called from the one thread that owns the card, which also
+ * calls SD_Idle_Poll; FatFs serialises its own calls with the volume lock.
+ * SD_Tick is called from the 1 kHz tick interrupt instead. */
 extern const Diskio_drvTypeDef  SD_Driver;
 
+void SD_Idle_Poll(void);
+void SD_Tick(void);
+void SD_GetStats(SD_DiskStats *out);
+
 /* USER CODE BEGIN lastSection */
 /* can be used to modify / undefine previous code or add new definitions */
 /* USER CODE END lastSection */
@@ -0,0 +1,34 @@
+/**
+  ******************************************************************************
+  * @file    camera_sim.h
+  * @brief   Header for camera_sim.c module
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 STMicroelectronics.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __CAMERA_SIM_H
+#define __CAMERA_SIM_H
+
+/* Includes ------------------------------------------------------------------*/
+#include "camera.h"
+
+/* Exported constants --------------------------------------------------------*/
+/* Stream the simulated sensor sends until CAM_SimSetRate is called */
+#define CAM_SIM_DEFAULT_KIB_S  1024U
+#define CAM_SIM_DEFAULT_FPS    25U
+
+/* Exported functions ------------------------------------------------------- */
+void CAM_SimSetRate(uint32_t kib_s, uint32_t fps);
+void CAM_SimPoll(void);
+
+#endif /* __CAMERA_SIM_H */
@@ -0,0 +1,60 @@
+/**
+  ******************************************************************************
+  * @file    image_diskio.h
+  * @brief   Header for image_diskio.c module
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 STMicroelectronics.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __IMAGE_DISKIO_H
+#define __IMAGE_DISKIO_H
+
+/* Includes ------------------------------------------------------------------*/
+#include "ff_gen_drv.h"
+
+/* Exported types ------------------------------------------------------------*/
+/**
+  * @brief Disk image driver statistics
+  */
+typedef struct
+{
+  uint32_t rd_cmds;        /* IMAGE_read calls */
+  uint32_t wr_cmds;        /* IMAGE_write calls */
+  uint32_t rd_sectors;     /* Sectors read from the image */
+  uint32_t wr_sectors;     /* Sectors written to the image */
+  uint32_t syncs;          /* CTRL_SYNC requests */
+  uint32_t trims;          /* CTRL_TRIM requests */
+  uint32_t trim_sectors;   /* Sectors trimmed */
+  uint64_t delay_ns;       /* Simulated latency spent in total */
+} IMAGE_DiskStats;
+
+/* Exported constants --------------------------------------------------------*/
+#define IMAGE_SECTOR_SIZE 512
+
+/* Size of a new image in sectors, 64 MiB by default */
+#ifndef IMAGE_DEFAULT_SECTORS
+#define IMAGE_DEFAULT_SECTORS (128U * 1024U)
+#endif
+
+/* Exported functions ------------------------------------------------------- */
+extern const Diskio_drvTypeDef  IMAGE_Driver;
+
+int IMAGE_Open(const char *path, DWORD sectors);
+void IMAGE_Close(void);
+void IMAGE_Eject(void);
+DWORD IMAGE_GetSectorCount(void);
+void IMAGE_SetBlockSize(DWORD sectors);
+void IMAGE_SetLatency(uint32_t command_us, uint32_t sector_ns);
+void IMAGE_GetStats(IMAGE_DiskStats *out);
+
+#endif /* __IMAGE_DISKIO_H */
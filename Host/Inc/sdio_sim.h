@@ -0,0 +1,43 @@
+/**
+  ******************************************************************************
+  * @file    sdio_sim.h
+  * @brief   Header for sdio_sim.c module
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 STMicroelectronics.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __SDIO_SIM_H
+#define __SDIO_SIM_H
+
+/* Includes ------------------------------------------------------------------*/
+#include "bsp_driver_sd.h"
+
+/* Exported types ------------------------------------------------------------*/
+/**
+  * @brief Simulated SDIO bus statistics
+  */
+typedef struct
+{
+  uint32_t transfers;      /* DMA transfers started */
+  uint32_t interrupts;     /* Completion interrupts delivered to the driver */
+  uint32_t busy_polls;     /* Card state queries answered busy */
+  uint32_t refused;        /* Commands refused as the bus or card was busy */
+  uint32_t erases;         /* Erase commands */
+} SDIO_SimStats;
+
+/* Exported functions ------------------------------------------------------- */
+void SDIO_SimSetLatency(uint32_t command_us, uint32_t sector_ns);
+void SDIO_SimEject(void);
+void SDIO_SimGetStats(SDIO_SimStats *out);
+
+#endif /* __SDIO_SIM_H */
@@ -0,0 +1,86 @@
+/**
+  ******************************************************************************
+  * @file    stm32f4xx_hal.h
+  * @brief   Host stand-in for the HAL definitions the SD disk driver uses
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 STMicroelectronics.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+/* Note: only what sd_diskio.c and bsp_driver_sd.h need is declared here. The
+   functions are implemented by sdio_sim.c, which models the SDIO peripheral
+   and its DMA completion interrupt over the disk image. */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __STM32F4xx_HAL_H
+#define __STM32F4xx_HAL_H
+
+/* Includes ------------------------------------------------------------------*/
+#include <stdint.h>
+
+/* Exported types ------------------------------------------------------------*/
+#define __IO volatile
+
+/**
+  * @brief  SD Card Information Structure definition
+  */
+typedef struct
+{
+  uint32_t CardType;                     /*!< Specifies the card Type                         */
+  uint32_t CardVersion;                  /*!< Specifies the card version                      */
+  uint32_t Class;                        /*!< Specifies the class of the card class           */
+  uint32_t RelCardAdd;                   /*!< Specifies the Relative Card Address             */
+  uint32_t BlockNbr;                     /*!< Specifies the Card Capacity in blocks           */
+  uint32_t BlockSize;                    /*!< Specifies one block size in bytes               */
+  uint32_t LogBlockNbr;                  /*!< Specifies the Card logical Capacity in blocks   */
+  uint32_t LogBlockSize;                 /*!< Specifies logical block size in bytes           */
+}HAL_SD_CardInfoTypeDef;
+
+/**
+  * @brief  Card Specific Data: the fields the driver reads
+  */
+typedef struct
+{
+  __IO uint8_t  WrSpeedFact;          /*!< Write speed factor                    */
+}HAL_SD_CardCSDTypeDef;
+
+/**
+  * @brief  SD Card Status returned by ACMD13: the fields the driver reads
+  */
+typedef struct
+{
+  __IO uint8_t  SpeedClass;             /*!< Carries information about the speed class of the card      */
+  __IO uint8_t  AllocationUnitSize;     /*!< Carries information about the card's allocation unit size  */
+}HAL_SD_CardStatusTypeDef;
+
+/* Exported constants --------------------------------------------------------*/
+#define BLOCKSIZE   512U /*!< Block size is 512 bytes */
+
+/* No host address is in CCM RAM, so every word aligned buffer takes DMA */
+#define CCMDATARAM_BASE       UINTPTR_MAX
+#define CCMDATARAM_END        0U
+
+/* Exported macro ------------------------------------------------------------*/
+#define __ALIGN_BEGIN
+#define __ALIGN_END    __attribute__((aligned(4)))
+#define __CCMRAM
+
+/* Exported functions ------------------------------------------------------- */
+uint32_t HAL_GetTick(void);
+
+/* PRIMASK and WFI: the simulated interrupt is a signal, masked while disabled */
+void __disable_irq(void);
+void __enable_irq(void);
+uint32_t __get_PRIMASK(void);
+void __set_PRIMASK(uint32_t priMask);
+void __WFI(void);
+
+#endif /* __STM32F4xx_HAL_H */
@@ -0,0 +1,262 @@
+/**
+  ******************************************************************************
+  * @file    camera_sim.c
+  * @brief   Simulated JPEG sensor behind the camera.h interface, for the
+  *          host build
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 STMicroelectronics.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+/* Note: there is no interrupt to run the capture, so the caller calls
+   CAM_SimPoll() often, and it catches up with the wall clock. Everything the
+   sensor would have sent since the last call goes into the ring in one go,
+   chunk by chunk as the DMA would fill it, and chunks that find the ring full
+   are dropped. A storage writer polling between its writes therefore sees the
+   ring fill while the disk is busy, as it would on the board. Frames are
+   JPEG-like: start and end markers around a body filled with the frame number,
+   their size varying by up to a quarter either side of the average. */
+
+/* Includes ------------------------------------------------------------------*/
+#include <string.h>
+#include <time.h>
+#include "camera_sim.h"
+
+/* Private variables ---------------------------------------------------------*/
+/* JPEG start and end of image markers */
+static const uint8_t sim_marker[4] = { 0xFFU, 0xD8U, 0xFFU, 0xD9U };
+
+static RING_Buffer *sim_ring;
+static uint32_t sim_mode;
+static uint32_t sim_running;
+static CAM_Stats sim_stats;
+
+static uint32_t sim_kib_s = CAM_SIM_DEFAULT_KIB_S;
+static uint32_t sim_fps = CAM_SIM_DEFAULT_FPS;
+static uint32_t sim_seed;
+
+static uint64_t sim_start_ns;    /* Clock at CAM_Start */
+static uint64_t sim_sent;        /* Bytes the sensor has sent since */
+
+static uint8_t *sim_chunk;       /* Slot being filled, NULL if it is dropped */
+static uint32_t sim_fill;        /* Bytes of the chunk sent */
+static uint32_t sim_frame_len;   /* Bytes in the frame being sent */
+static uint32_t sim_frame_pos;   /* Bytes of it sent */
+
+/* Private function prototypes -----------------------------------------------*/
+static uint64_t CAM_SimNow(void);
+static void CAM_SimSend(uint8_t *dst, uint32_t n);
+static void CAM_SimCommit(void);
+
+/* Private functions ---------------------------------------------------------*/
+static uint64_t CAM_SimNow(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000U + (uint64_t)ts.tv_nsec;
+}
+
+/**
+  * @brief  Produces the next n bytes of the current frame
+  * @param  dst: Where to put them, NULL to only move on
+  * @param  n: Bytes, no more than are left in the frame
+  * @retval None
+  */
+static void CAM_SimSend(uint8_t *dst, uint32_t n)
+{
+  uint32_t i;
+  uint32_t pos;
+
+  if (dst != NULL)
+  {
+    memset(dst, (int)(sim_stats.frames & 0x7FU), n);
+    for (i = 0; i < 4U; i++)
+    {
+      // Two marker bytes at the start of the frame, two at its end
+      pos = (i < 2U) ? i : sim_frame_len - 4U + i;
+      if (pos >= sim_frame_pos && pos < sim_frame_pos + n)
+      {
+        dst[pos - sim_frame_pos] = sim_marker[i];
+      }
+    }
+  }
+  sim_frame_pos += n;
+}
+
+/**
+  * @brief  Hands over the chunk being filled, or counts it dropped
+  * @retval None
+  */
+static void CAM_SimCommit(void)
+{
+  if (sim_chunk != NULL)
+  {
+    RING_Commit(sim_ring);
+    sim_stats.chunks++;
+    CAM_ChunkCallback();
+  }
+  else
+  {
+    sim_stats.dropped++;
+  }
+  sim_fill = 0;
+}
+
+/* Exported functions --------------------------------------------------------*/
+/**
+  * @brief  Sets the stream for the next CAM_Start
+  * @param  kib_s: Average data rate
+  * @param  fps: Frames per second
+  * @retval None
+  */
+void CAM_SimSetRate(uint32_t kib_s, uint32_t fps)
+{
+  sim_kib_s = kib_s ? kib_s : CAM_SIM_DEFAULT_KIB_S;
+  sim_fps = fps ? fps : CAM_SIM_DEFAULT_FPS;
+}
+
+/**
+  * @brief  Sends what the sensor would have sent since the last call
+  * @retval None
+  * @note   Does nothing unless capture is running.
+  */
+void CAM_SimPoll(void)
+{
+  uint64_t due;
+  uint32_t avg;
+  uint32_t n;
+
+  if (!sim_running)
+  {
+    return;
+  }
+  due = (CAM_SimNow() - sim_start_ns) * sim_kib_s * 1024U / 1000000000U;
+
+  while (sim_running && sim_sent < due)
+  {
+    if (sim_frame_pos == sim_frame_len)
+    {
+      avg = sim_kib_s * 1024U / sim_fps;
+      sim_seed = sim_seed * 1103515245U + 12345U;
+      sim_frame_len = avg - avg / 4U + (sim_seed >> 8) % (avg / 2U + 1U);
+      if (sim_frame_len < 4U)
+      {
+        sim_frame_len = 4U;
+      }
+      sim_frame_pos = 0;
+    }
+    if (sim_fill == 0)
+    {
+      // The DMA takes the next free slot, or drops the chunk
+      sim_chunk = (uint8_t *)RING_AcquireAhead(sim_ring, 0U);
+    }
+
+    n = sim_ring->slot_size - sim_fill;
+    if (n > sim_frame_len - sim_frame_pos)
+    {
+      n = sim_frame_len - sim_frame_pos;
+    }
+    if (n > due - sim_sent)
+    {
+      n = (uint32_t)(due - sim_sent);
+    }
+    CAM_SimSend(sim_chunk ? sim_chunk + sim_fill : NULL, n);
+    sim_fill += n;
+    sim_sent += n;
+
+    if (sim_fill == sim_ring->slot_size)
+    {
+      CAM_SimCommit();
+    }
+    if (sim_frame_pos == sim_frame_len)
+    {
+      sim_stats.frames++;
+      if (sim_mode & CAM_SNAPSHOT)
+      {
+        CAM_Stop();
+      }
+    }
+  }
+}
+
+/**
+  * @brief  Starts the simulated sensor sending into a ring
+  * @param  ring: Ring to fill, slots at most CAM_CHUNK_BYTES
+  * @param  mode: CAM_SNAPSHOT, or 0 for continuous; frames are always JPEG
+  * @retval 0, or -1 if capture is already running or the ring is unusable
+  */
+int CAM_Start(RING_Buffer *ring, uint32_t mode)
+{
+  if (sim_running || ring->n_slots < 2U || ring->slot_size > CAM_CHUNK_BYTES)
+  {
+    return -1;
+  }
+  sim_ring = ring;
+  sim_mode = mode;
+  memset(&sim_stats, 0, sizeof(sim_stats));
+  sim_seed = 1;
+  sim_sent = 0;
+  sim_fill = 0;
+  sim_frame_len = 0;
+  sim_frame_pos = 0;
+  sim_start_ns = CAM_SimNow();
+  sim_running = 1;
+  return 0;
+}
+
+/**
+  * @brief  Stops the sensor, committing the partial chunk padded with zeros
+  * @retval None
+  */
+void CAM_Stop(void)
+{
+  if (!sim_running)
+  {
+    return;
+  }
+  if (sim_fill != 0)
+  {
+    if (sim_chunk != NULL)
+    {
+      memset(sim_chunk + sim_fill, 0, sim_ring->slot_size - sim_fill);
+    }
+    CAM_SimCommit();
+  }
+  sim_running = 0;
+}
+
+/**
+  * @brief  Tells whether capture is running
+  * @retval 1 while running, 0 once stopped or a snapshot has completed
+  */
+uint32_t CAM_IsRunning(void)
+{
+  return sim_running;
+}
+
+/**
+  * @brief  Reads the capture statistics
+  * @param  out: Receives the statistics
+  * @retval None
+  */
+void CAM_GetStats(CAM_Stats *out)
+{
+  *out = sim_stats;
+}
+
+/**
+  * @brief  Called from CAM_SimPoll or CAM_Stop each time a chunk is committed
+  * @retval None
+  */
+__weak void CAM_ChunkCallback(void)
+{
+}
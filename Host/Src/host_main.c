@@ -0,0 +1,466 @@
+/**
+  ******************************************************************************
+  * @file    host_main.c
+  * @brief   Entry point of the host build: runs the write benchmark, or a
+  *          recording from a simulated camera or a loop recording of many
+  *          days, on a disk image through the same FatFs application layer
+  *          as the board
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 STMicroelectronics.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+/* Includes ------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "fatfs.h"
+#include "benchmark.h"
+#include "recorder.h"
+#include "frame_ring.h"
+#include "camera_sim.h"
+#include "sd_diskio.h"
+#include "sdio_sim.h"
+
+/* Private define ------------------------------------------------------------*/
+#define CAPTURE_FILE_NAME  "capture.bin"
+
+/* The capture ring, sized as on the board, and the recording synced once a
+ * second */
+#define CAPTURE_RING_SIZE  (64U * 1024U)
+#define CAPTURE_SYNC_US    1000000U
+
+/* Rate of the loop recording without -r, low enough that weeks of segments
+ * run in a few seconds */
+#define LOOP_DEFAULT_KIB_S 16U
+
+/* The paced stream written through the write-behind ring by -q: records small
+ * enough to be queued rather than sent directly */
+#define QUEUE_FILE_NAME    "queue.bin"
+#define QUEUE_RECORD_BYTES 4096U
+
+/* Private variables ---------------------------------------------------------*/
+static FRESULT fatfs_err;
+static BYTE mkfs_work[_MAX_SS];
+static IMAGE_DiskStats image_stats;
+static BENCH_Profile card_profile;
+static uint8_t capture_mem[CAPTURE_RING_SIZE];
+static RING_Buffer capture_ring;
+static REC_File capture_rec;
+static int use_sdio;
+static SD_DiskStats sd_stats;
+static SDIO_SimStats sdio_stats;
+static uint32_t queue_record[QUEUE_RECORD_BYTES / sizeof(uint32_t)];
+
+/* Private functions ---------------------------------------------------------*/
+static uint64_t now_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000U + (uint64_t)ts.tv_nsec / 1000U;
+}
+
+// Records the simulated camera for the given time, writing as the storage
+// thread does on the board: everything waiting in the ring, then poll again
+static FRESULT capture(uint32_t seconds, uint32_t kib_s)
+{
+  RING_Stats ring_stats;
+  CAM_Stats cam_stats;
+  uint64_t start;
+  uint64_t last_sync;
+  uint64_t t;
+  uint32_t max_write_us = 0;
+  uint32_t n;
+  uint8_t *first;
+  uint64_t clipped = 0;
+  FSIZE_t capacity;
+  FSIZE_t free_bytes;
+  FATFS *fs;
+  DWORD free_clst;
+  UINT written;
+  FRESULT res;
+  FRESULT close_res;
+
+  // A rate the volume cannot hold for the whole run records until it is full
+  if ((res = f_getfree(SDPath, &free_clst, &fs)) != FR_OK) {
+    return res;
+  }
+  free_bytes = (FSIZE_t)free_clst * fs->csize * _MAX_SS;
+  capacity = (FSIZE_t)kib_s * 1024U * seconds + 2U * CAM_CHUNK_BYTES;
+  if (capacity > free_bytes) {
+    printf("capture: %lu KiB needed, recording the %lu KiB free.\n",
+           (unsigned long)(capacity / 1024U), (unsigned long)(free_bytes / 1024U));
+    capacity = free_bytes;
+  }
+
+  n = RING_Init(&capture_ring, capture_mem, sizeof(capture_mem), CAM_CHUNK_BYTES);
+  if ((res = REC_Open(&capture_rec, CAPTURE_FILE_NAME, capacity)) != FR_OK) {
+    return res;
+  }
+  printf("capture: %lu s at %lu KiB/s, %lu fps, %lu B chunks, %lu in the ring.\n",
+         (unsigned long)seconds, (unsigned long)kib_s, (unsigned long)CAM_SIM_DEFAULT_FPS,
+         (unsigned long)CAM_CHUNK_BYTES, (unsigned long)n);
+  if ((uint64_t)card_profile.buffer_kib * 1024U > (uint64_t)n * CAM_CHUNK_BYTES) {
+    printf("capture: the card may need %lu KiB of buffering, chunks may drop.\n",
+           (unsigned long)card_profile.buffer_kib);
+  }
+
+  CAM_SimSetRate(kib_s, CAM_SIM_DEFAULT_FPS);
+  CAM_Start(&capture_ring, CAM_JPEG);
+  start = last_sync = now_us();
+  for (;;) {
+    t = now_us();
+    if (t - start >= (uint64_t)seconds * 1000000U) {
+      CAM_Stop();
+    } else {
+      CAM_SimPoll();
+    }
+
+    // After an error the chunks are still released, so capture can finish
+    n = RING_Peek(&capture_ring, &first);
+    if (n != 0) {
+      if (res == FR_OK) {
+        t = now_us();
+        res = REC_Write(&capture_rec, first, n * CAM_CHUNK_BYTES, &written);
+        t = now_us() - t;
+        clipped += n * CAM_CHUNK_BYTES - written;
+        if (t > max_write_us) {
+          max_write_us = (uint32_t)t;
+        }
+      }
+      RING_Release(&capture_ring, n);
+    } else if (!CAM_IsRunning()) {
+      break;
+    }
+    if (res == FR_OK && now_us() - last_sync >= CAPTURE_SYNC_US) {
+      res = REC_Sync(&capture_rec);
+      last_sync = now_us();
+    }
+  }
+
+  close_res = REC_Close(&capture_rec);
+  CAM_GetStats(&cam_stats);
+  RING_GetStats(&capture_ring, &ring_stats);
+  printf("capture: %lu frames, %lu chunks written, %lu dropped, longest write %lu us.\n",
+         (unsigned long)cam_stats.frames, (unsigned long)cam_stats.chunks,
+         (unsigned long)cam_stats.dropped, (unsigned long)max_write_us);
+  printf("capture ring: %lu of %lu slots at most.\n",
+         (unsigned long)ring_stats.high_water, (unsigned long)ring_stats.n_slots);
+  if (clipped != 0) {
+    printf("capture: the recording filled, %lu KiB not written.\n",
+           (unsigned long)(clipped / 1024U));
+  }
+  return (res != FR_OK) ? res : close_res;
+}
+
+// Writes a paced stream of small records through the write-behind ring,
+// spinning outside the driver between them as a producer waiting for data
+// would. Queued runs then only reach the card from the completion interrupt
+// and the tick, and a write which finds room in the ring should never wait.
+static FRESULT queue_stream(uint32_t seconds, uint32_t kib_s)
+{
+  SD_DiskStats before;
+  SD_DiskStats after;
+  uint64_t period_us = (uint64_t)QUEUE_RECORD_BYTES * 1000000U / ((uint64_t)kib_s * 1024U);
+  uint64_t start;
+  uint64_t t;
+  uint32_t records = (uint32_t)((uint64_t)seconds * 1000000U / period_us);
+  uint32_t i;
+  uint32_t max_room_us = 0;
+  uint32_t full_waits = 0;
+  UINT written;
+  FRESULT res;
+  FRESULT close_res;
+
+  if (!use_sdio) {
+    printf("queue: needs -b, the image alone has no write-behind ring.\n");
+    return FR_INVALID_PARAMETER;
+  }
+  if ((res = REC_Open(&capture_rec, QUEUE_FILE_NAME,
+                      (FSIZE_t)records * QUEUE_RECORD_BYTES)) != FR_OK) {
+    return res;
+  }
+
+  start = now_us();
+  for (i = 0; i < records && res == FR_OK; i++) {
+    while (now_us() - start < i * period_us) {
+    }
+    queue_record[0] = i;
+    SD_GetStats(&before);
+    t = now_us();
+    res = REC_Write(&capture_rec, queue_record, QUEUE_RECORD_BYTES, &written);
+    t = now_us() - t;
+    SD_GetStats(&after);
+    if (after.wb_stalls != before.wb_stalls) {
+      full_waits++;
+    } else if (t > max_room_us) {
+      max_room_us = (uint32_t)t;
+    }
+  }
+
+  close_res = REC_Close(&capture_rec);
+  SD_GetStats(&after);
+  printf("queue: %lu records of %u B at %lu KiB/s, %lu waited on a full ring, "
+         "longest with room %lu us, ring held %lu of %lu sectors at most.\n",
+         (unsigned long)i, QUEUE_RECORD_BYTES, (unsigned long)kib_s,
+         (unsigned long)full_waits, (unsigned long)max_room_us,
+         (unsigned long)after.wb_high_water, (unsigned long)after.wb_sectors);
+  return (res != FR_OK) ? res : close_res;
+}
+
+// Pulls the card and puts it back, then times the remount FatFs makes on its
+// next access against a mount from scratch
+static FRESULT reseat_card(void)
+{
+  FATFS *fs;
+  DWORD free_clst;
+  uint64_t t;
+  uint32_t reseat_us;
+  uint32_t reseat_sectors;
+  uint32_t mount_us;
+  uint32_t mount_sectors;
+  FRESULT res;
+
+  if (use_sdio) {
+    SDIO_SimEject();
+  } else {
+    IMAGE_Eject();
+  }
+  IMAGE_GetStats(&image_stats);
+  reseat_sectors = image_stats.rd_sectors;
+  t = now_us();
+  res = f_getfree(SDPath, &free_clst, &fs);
+  reseat_us = (uint32_t)(now_us() - t);
+  IMAGE_GetStats(&image_stats);
+  reseat_sectors = image_stats.rd_sectors - reseat_sectors;
+  if (res != FR_OK) {
+    return res;
+  }
+
+  mount_sectors = image_stats.rd_sectors;
+  t = now_us();
+  res = f_mount(&SDFatFS, SDPath, 1);
+  if (res == FR_OK) {
+    res = f_getfree(SDPath, &free_clst, &fs);
+  }
+  mount_us = (uint32_t)(now_us() - t);
+  IMAGE_GetStats(&image_stats);
+  mount_sectors = image_stats.rd_sectors - mount_sectors;
+  printf("reseated card: remounted in %lu us reading %lu sectors, "
+         "a mount from scratch takes %lu us reading %lu sectors.\n",
+         (unsigned long)reseat_us, (unsigned long)reseat_sectors, (unsigned long)mount_us,
+         (unsigned long)mount_sectors);
+  return res;
+}
+
+static void usage(const char *argv0)
+{
+  printf("usage: %s [-i image] [-s sectors] [-u sectors] [-f] [-x] [-a] [-c command_us]\n"
+         "          [-t sector_ns] [-v seconds] [-l days] [-g mib] [-d files]\n"
+         "          [-q seconds] [-r kib_s] [-p] [-b] [-n]\n"
+         "  -i  disk image to map, created if missing (default: RAM only)\n"
+         "  -s  size of a new image in 512 B sectors (default: %u)\n"
+         "  -u  allocation unit reported to FatFs in sectors (default: 1)\n"
+         "  -f  format the image before mounting (implied without -i)\n"
+         "  -x  format it as exFAT\n"
+         "  -a  time mounting and allocation on the volume left 90%% full\n"
+         "      instead of the write sweep\n"
+         "  -c  latency added to every read or write command, in us\n"
+         "  -t  latency added for every sector moved, in ns\n"
+         "  -v  record a simulated camera for this long instead of the write sweep\n"
+         "  -l  loop record this many days of one-minute segments instead of the\n"
+         "      write sweep\n"
+         "  -g  grow a recording of this many MiB with a side file instead of the\n"
+         "      write sweep\n"
+         "  -d  fill a directory with this many files and time opening them by\n"
+         "      name instead of the write sweep\n"
+         "  -q  write a paced stream of %u B records through the write-behind\n"
+         "      ring for this long instead of the write sweep (needs -b)\n"
+         "  -r  camera data rate in KiB/s (default: %u, or %u for -l)\n"
+         "  -p  then pull the card and put it back, and time the remount\n"
+         "  -b  go through the SD disk driver and a simulated SDIO bus, whose DMA\n"
+         "      completes from an interrupt, instead of straight to the image\n"
+         "  -n  probe the card again, even if its profile is kept on the image\n",
+         argv0, IMAGE_DEFAULT_SECTORS, QUEUE_RECORD_BYTES, CAM_SIM_DEFAULT_KIB_S,
+         LOOP_DEFAULT_KIB_S);
+}
+
+int main(int argc, char *argv[])
+{
+  const char *image_path = NULL;
+  DWORD sectors = 0;
+  DWORD au_sectors = 1;
+  uint32_t command_us = 0;
+  uint32_t sector_ns = 0;
+  uint32_t capture_s = 0;
+  uint32_t capture_kib_s = 0;
+  uint32_t loop_days = 0;
+  uint32_t streams_mib = 0;
+  uint32_t dir_files = 0;
+  uint32_t queue_s = 0;
+  BYTE format_opt = FM_ANY;
+  int format = 0;
+  int fill = 0;
+  int reseat = 0;
+  int reprobe = 0;
+  uint32_t cid[4];
+  int opt;
+
+  while ((opt = getopt(argc, argv, "i:s:u:fxac:t:v:l:g:d:q:r:pbnh")) != -1) {
+    switch (opt) {
+    case 'i': image_path = optarg; break;
+    case 's': sectors = (DWORD)strtoul(optarg, NULL, 0); break;
+    case 'u': au_sectors = (DWORD)strtoul(optarg, NULL, 0); break;
+    case 'f': format = 1; break;
+    case 'x': format = 1; format_opt = FM_EXFAT; break;
+    case 'a': fill = 1; break;
+    case 'c': command_us = (uint32_t)strtoul(optarg, NULL, 0); break;
+    case 't': sector_ns = (uint32_t)strtoul(optarg, NULL, 0); break;
+    case 'v': capture_s = (uint32_t)strtoul(optarg, NULL, 0); break;
+    case 'l': loop_days = (uint32_t)strtoul(optarg, NULL, 0); break;
+    case 'g': streams_mib = (uint32_t)strtoul(optarg, NULL, 0); break;
+    case 'd': dir_files = (uint32_t)strtoul(optarg, NULL, 0); break;
+    case 'q': queue_s = (uint32_t)strtoul(optarg, NULL, 0); break;
+    case 'r': capture_kib_s = (uint32_t)strtoul(optarg, NULL, 0); break;
+    case 'p': reseat = 1; break;
+    case 'b': use_sdio = 1; break;
+    case 'n': reprobe = 1; break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  if (IMAGE_Open(image_path, sectors) != 0) {
+    printf("failed to open disk image %s.\n", image_path);
+    return 1;
+  }
+  IMAGE_SetBlockSize(au_sectors);
+  MX_FATFS_Init();
+  if (use_sdio) {
+    FATFS_UnLinkDriver(SDPath);
+    if (FATFS_LinkDriver(&SD_Driver, SDPath) != 0) {
+      printf("failed to link the SD driver.\n");
+      return 1;
+    }
+  }
+
+  // A RAM-only image starts out blank
+  if (format || image_path == NULL) {
+    if ((fatfs_err = f_mkfs(SDPath, format_opt, 0, mkfs_work, sizeof(mkfs_work)))) {
+      printf("failed to format disk image, code: %i.\n", fatfs_err);
+      return fatfs_err;
+    }
+  }
+
+  // Format without latency, then time everything else with it
+  if (use_sdio) {
+    SDIO_SimSetLatency(command_us, sector_ns);
+  } else {
+    IMAGE_SetLatency(command_us, sector_ns);
+  }
+
+  if ((fatfs_err = f_mount(&SDFatFS, SDPath, 1))) {
+    printf("failed to mount disk image, code: %i.\n", fatfs_err);
+    return fatfs_err;
+  }
+  printf("disk image: %lu KiB, FAT type %i, %lu B clusters, data at sector %lu, "
+         "latency %lu us + %lu ns/sector.\n",
+         (unsigned long)(IMAGE_GetSectorCount() / 2), SDFatFS.fs_type,
+         (unsigned long)SDFatFS.csize * IMAGE_SECTOR_SIZE, (unsigned long)SDFatFS.database,
+         (unsigned long)command_us, (unsigned long)sector_ns);
+
+  // An image states no Speed Class, only the allocation unit given with -u,
+  // and has the CID the simulated bus gives it
+  BSP_SD_GetCardCID(cid);
+  if ((fatfs_err = BENCH_ProfileCard(SDPath, 0, au_sectors > 1 ? au_sectors : 0, cid, reprobe,
+                                     &card_profile))) {
+    printf("card profile failed, code: %i.\n", fatfs_err);
+    return fatfs_err;
+  }
+  BENCH_PrintProfile(&card_profile);
+  BENCH_RunCpu();
+
+  if (capture_s != 0) {
+    if ((fatfs_err = capture(capture_s, capture_kib_s ? capture_kib_s :
+                                        CAM_SIM_DEFAULT_KIB_S))) {
+      printf("capture failed, code: %i.\n", fatfs_err);
+      return fatfs_err;
+    }
+  } else if (loop_days != 0) {
+    if ((fatfs_err = BENCH_RunLoop(SDPath, loop_days * 24U * 3600U / BENCH_LOOP_SEGMENT_S,
+                                   (capture_kib_s ? capture_kib_s : LOOP_DEFAULT_KIB_S) *
+                                   1024U * BENCH_LOOP_SEGMENT_S))) {
+      printf("loop recording failed, code: %i.\n", fatfs_err);
+      return fatfs_err;
+    }
+  } else if (streams_mib != 0) {
+    if ((fatfs_err = BENCH_RunStreams(SDPath, streams_mib * 1024U * 1024U))) {
+      printf("streams benchmark failed, code: %i.\n", fatfs_err);
+      return fatfs_err;
+    }
+  } else if (dir_files != 0) {
+    if ((fatfs_err = BENCH_RunDirectory(SDPath, dir_files))) {
+      printf("directory benchmark failed, code: %i.\n", fatfs_err);
+      return fatfs_err;
+    }
+  } else if (queue_s != 0) {
+    if ((fatfs_err = queue_stream(queue_s, capture_kib_s ? capture_kib_s :
+                                           CAM_SIM_DEFAULT_KIB_S))) {
+      printf("queue stream failed, code: %i.\n", fatfs_err);
+      return fatfs_err;
+    }
+  } else if ((fatfs_err = fill ? BENCH_RunFill(SDPath) : BENCH_Run(SDPath))) {
+    printf("benchmark failed, code: %i.\n", fatfs_err);
+    return fatfs_err;
+  }
+
+  if (reseat && (fatfs_err = reseat_card())) {
+    printf("remount failed, code: %i.\n", fatfs_err);
+    return fatfs_err;
+  }
+
+  // Report how many disk commands the transfers took
+  IMAGE_GetStats(&image_stats);
+  printf("disk writes: %lu commands, %lu sectors.\n",
+         (unsigned long)image_stats.wr_cmds, (unsigned long)image_stats.wr_sectors);
+  printf("disk reads: %lu commands, %lu sectors.\n",
+         (unsigned long)image_stats.rd_cmds, (unsigned long)image_stats.rd_sectors);
+  printf("syncs: %lu, simulated latency: %lu ms.\n", (unsigned long)image_stats.syncs,
+         (unsigned long)(image_stats.delay_ns / 1000000U));
+  printf("trims: %lu, %lu sectors.\n", (unsigned long)image_stats.trims,
+         (unsigned long)image_stats.trim_sectors);
+  if (use_sdio) {
+    SD_GetStats(&sd_stats);
+    SDIO_SimGetStats(&sdio_stats);
+    printf("card writes: %lu commands, %lu per MiB.\n", (unsigned long)sd_stats.wr_cmds,
+           (unsigned long)SD_CMDS_PER_MIB(sd_stats.wr_cmds, sd_stats.wr_sectors));
+    printf("card reads: %lu commands, %lu per MiB, %lu read-ahead hits.\n",
+           (unsigned long)sd_stats.rd_cmds,
+           (unsigned long)SD_CMDS_PER_MIB(sd_stats.rd_cmds, sd_stats.rd_sectors),
+           (unsigned long)sd_stats.ra_hits);
+    printf("sdio: %lu DMA transfers, %lu completion interrupts, %lu busy polls, "
+           "%lu commands refused, %lu erases.\n",
+           (unsigned long)sdio_stats.transfers, (unsigned long)sdio_stats.interrupts,
+           (unsigned long)sdio_stats.busy_polls, (unsigned long)sdio_stats.refused,
+           (unsigned long)sdio_stats.erases);
+  }
+  printf("fatfs window: %lu hits, %lu misses, %lu write-backs.\n",
+         (unsigned long)SDFatFS.wc_hit, (unsigned long)SDFatFS.wc_miss,
+         (unsigned long)SDFatFS.wc_write);
+
+  f_mount(NULL, SDPath, 0);
+  FATFS_UnLinkDriver(SDPath);
+  IMAGE_Close();
+  return 0;
+}
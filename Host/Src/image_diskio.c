@@ -0,0 +1,371 @@
+/**
+  ******************************************************************************
+  * @file    image_diskio.c
+  * @brief   Disk image I/O driver for the host build
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 STMicroelectronics.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+/* Note: the image is mmap'd, so a transfer costs a memcpy plus whatever
+   latency has been configured with IMAGE_SetLatency(). Without an image file
+   the sectors live in an anonymous mapping and are lost on IMAGE_Close(). */
+
+/* Includes ------------------------------------------------------------------*/
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "image_diskio.h"
+
+/* Private variables ---------------------------------------------------------*/
+/* Disk status */
+static volatile DSTATUS Stat = STA_NOINIT;
+
+static BYTE *image;         /* mapped sectors (NULL: not open) */
+static DWORD image_sectors; /* size of the mapping in sectors */
+static int image_fd = -1;   /* backing file (-1: anonymous mapping) */
+static DWORD image_block = 1; /* erase block reported by GET_BLOCK_SIZE */
+static BYTE image_known;    /* initialized since it was mapped */
+
+/* Simulated card latency: a fixed cost per command plus a cost per sector */
+static uint32_t latency_command_ns;
+static uint32_t latency_sector_ns;
+
+/* Statistics reported by IMAGE_GetStats() */
+static IMAGE_DiskStats stats;
+
+/* Private function prototypes -----------------------------------------------*/
+static void IMAGE_Delay(UINT count);
+DSTATUS IMAGE_initialize (BYTE);
+DSTATUS IMAGE_status (BYTE);
+DRESULT IMAGE_read (BYTE, BYTE*, DWORD, UINT);
+#if _USE_WRITE == 1
+DRESULT IMAGE_write (BYTE, const BYTE*, DWORD, UINT);
+#endif /* _USE_WRITE == 1 */
+#if _USE_IOCTL == 1
+DRESULT IMAGE_ioctl (BYTE, BYTE, void*);
+#endif  /* _USE_IOCTL == 1 */
+
+const Diskio_drvTypeDef  IMAGE_Driver =
+{
+  IMAGE_initialize,
+  IMAGE_status,
+  IMAGE_read,
+#if  _USE_WRITE == 1
+  IMAGE_write,
+#endif /* _USE_WRITE == 1 */
+
+#if  _USE_IOCTL == 1
+  IMAGE_ioctl,
+#endif /* _USE_IOCTL == 1 */
+};
+
+/* Private functions ---------------------------------------------------------*/
+
+/**
+  * @brief  Spins for the latency of one command moving count sectors
+  * @param  count: Number of sectors transferred by the command
+  * @retval None
+  * @note   Busy-waits rather than sleeping, as the delays are often shorter
+  *         than the scheduler can resolve.
+  */
+static void IMAGE_Delay(UINT count)
+{
+  uint64_t delay = latency_command_ns + (uint64_t)latency_sector_ns * count;
+  struct timespec start;
+  struct timespec now;
+
+  if (delay == 0)
+  {
+    return;
+  }
+  stats.delay_ns += delay;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  do
+  {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+  } while ((uint64_t)(now.tv_sec - start.tv_sec) * 1000000000U
+           + (uint64_t)now.tv_nsec - (uint64_t)start.tv_nsec < delay);
+}
+
+/**
+  * @brief  Initializes a Drive
+  * @param  lun : not used
+  * @retval DSTATUS: Operation status
+  */
+DSTATUS IMAGE_initialize(BYTE lun)
+{
+  DSTATUS kept;
+
+  if (image == NULL)
+  {
+    Stat = STA_NOINIT;
+    return Stat;
+  }
+
+  /* writes go straight to the image, so it holds all of them */
+  kept = image_known ? STA_KEPT : 0;
+  image_known = 1;
+  Stat = 0;
+  return Stat | kept;
+}
+
+/**
+  * @brief  Gets Disk Status
+  * @param  lun : not used
+  * @retval DSTATUS: Operation status
+  */
+DSTATUS IMAGE_status(BYTE lun)
+{
+  return Stat;
+}
+
+/**
+  * @brief  Reads Sector(s)
+  * @param  lun : not used
+  * @param  *buff: Data buffer to store read data
+  * @param  sector: Sector address (LBA)
+  * @param  count: Number of sectors to read (1..128)
+  * @retval DRESULT: Operation result
+  */
+DRESULT IMAGE_read(BYTE lun, BYTE *buff, DWORD sector, UINT count)
+{
+  if (Stat & STA_NOINIT) return RES_NOTRDY;
+  if (sector >= image_sectors || count > image_sectors - sector) return RES_PARERR;
+
+  IMAGE_Delay(count);
+  memcpy(buff, image + (size_t)sector * IMAGE_SECTOR_SIZE,
+         (size_t)count * IMAGE_SECTOR_SIZE);
+  stats.rd_cmds++;
+  stats.rd_sectors += count;
+  return RES_OK;
+}
+
+/**
+  * @brief  Writes Sector(s)
+  * @param  lun : not used
+  * @param  *buff: Data to be written
+  * @param  sector: Sector address (LBA)
+  * @param  count: Number of sectors to write (1..128)
+  * @retval DRESULT: Operation result
+  */
+#if _USE_WRITE == 1
+DRESULT IMAGE_write(BYTE lun, const BYTE *buff, DWORD sector, UINT count)
+{
+  if (Stat & STA_NOINIT) return RES_NOTRDY;
+  if (sector >= image_sectors || count > image_sectors - sector) return RES_PARERR;
+
+  IMAGE_Delay(count);
+  memcpy(image + (size_t)sector * IMAGE_SECTOR_SIZE, buff,
+         (size_t)count * IMAGE_SECTOR_SIZE);
+  stats.wr_cmds++;
+  stats.wr_sectors += count;
+  return RES_OK;
+}
+#endif /* _USE_WRITE == 1 */
+
+/**
+  * @brief  I/O control operation
+  * @param  lun : not used
+  * @param  cmd: Control code
+  * @param  *buff: Buffer to send/receive control data
+  * @retval DRESULT: Operation result
+  */
+#if _USE_IOCTL == 1
+DRESULT IMAGE_ioctl(BYTE lun, BYTE cmd, void *buff)
+{
+  DRESULT res = RES_ERROR;
+
+  if (Stat & STA_NOINIT) return RES_NOTRDY;
+
+  switch (cmd)
+  {
+  /* Writes land in the mapping straight away; the file is only synced on
+     IMAGE_Close() so host I/O does not show up in the timings */
+  case CTRL_SYNC :
+    stats.syncs++;
+    res = RES_OK;
+    break;
+
+  /* Get number of sectors on the disk (DWORD) */
+  case GET_SECTOR_COUNT :
+    *(DWORD*)buff = image_sectors;
+    res = RES_OK;
+    break;
+
+  /* Get R/W sector size (WORD) */
+  case GET_SECTOR_SIZE :
+    *(WORD*)buff = IMAGE_SECTOR_SIZE;
+    res = RES_OK;
+    break;
+
+  /* Get erase block size in unit of sector (DWORD) */
+  case GET_BLOCK_SIZE :
+    *(DWORD*)buff = image_block;
+    res = RES_OK;
+    break;
+
+#if _USE_TRIM
+  /* Trimmed sectors keep their data, as a card that has not erased them yet */
+  case CTRL_TRIM :
+    stats.trims++;
+    stats.trim_sectors += ((DWORD*)buff)[1] - ((DWORD*)buff)[0] + 1;
+    res = RES_OK;
+    break;
+#endif
+
+  default:
+    res = RES_PARERR;
+  }
+
+  return res;
+}
+#endif /* _USE_IOCTL == 1 */
+
+/* Exported functions --------------------------------------------------------*/
+
+/**
+  * @brief  Maps a disk image
+  * @param  path: image file, created if missing, or NULL for a RAM-only disk
+  * @param  sectors: size to give a new or RAM-only image, 0 for the default;
+  *         an existing image keeps its own size
+  * @retval 0 on success, -1 on failure
+  */
+int IMAGE_Open(const char *path, DWORD sectors)
+{
+  struct stat st;
+  void *map;
+
+  IMAGE_Close();
+  if (sectors == 0)
+  {
+    sectors = IMAGE_DEFAULT_SECTORS;
+  }
+
+  if (path == NULL)
+  {
+    map = mmap(NULL, (size_t)sectors * IMAGE_SECTOR_SIZE, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  }
+  else
+  {
+    image_fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (image_fd < 0 || fstat(image_fd, &st) != 0)
+    {
+      IMAGE_Close();
+      return -1;
+    }
+    if (st.st_size >= IMAGE_SECTOR_SIZE)
+    {
+      sectors = (DWORD)(st.st_size / IMAGE_SECTOR_SIZE);
+    }
+    else if (ftruncate(image_fd, (off_t)sectors * IMAGE_SECTOR_SIZE) != 0)
+    {
+      IMAGE_Close();
+      return -1;
+    }
+    map = mmap(NULL, (size_t)sectors * IMAGE_SECTOR_SIZE, PROT_READ | PROT_WRITE,
+               MAP_SHARED, image_fd, 0);
+  }
+
+  if (map == MAP_FAILED)
+  {
+    IMAGE_Close();
+    return -1;
+  }
+  image = map;
+  image_sectors = sectors;
+  memset(&stats, 0, sizeof(stats));
+  return 0;
+}
+
+/**
+  * @brief  Writes back and unmaps the disk image
+  * @retval None
+  */
+void IMAGE_Close(void)
+{
+  if (image != NULL)
+  {
+    if (image_fd >= 0)
+    {
+      msync(image, (size_t)image_sectors * IMAGE_SECTOR_SIZE, MS_SYNC);
+    }
+    munmap(image, (size_t)image_sectors * IMAGE_SECTOR_SIZE);
+  }
+  if (image_fd >= 0)
+  {
+    close(image_fd);
+  }
+  image = NULL;
+  image_sectors = 0;
+  image_fd = -1;
+  image_known = 0;
+  Stat = STA_NOINIT;
+}
+
+/**
+  * @brief  Pulls the card and puts it back, as the card detect switch would
+  *         report it
+  * @retval None
+  * @note   The drive must be initialized again, and finds the image as it
+  *         was left.
+  */
+void IMAGE_Eject(void)
+{
+  Stat = STA_NOINIT | STA_NODISK;
+}
+
+/**
+  * @brief  Gets the size of the mapped image
+  * @retval Number of sectors, 0 when no image is open
+  */
+DWORD IMAGE_GetSectorCount(void)
+{
+  return image_sectors;
+}
+
+/**
+  * @brief  Sets the erase block size reported to FatFs, as a card reports its
+  *         allocation unit
+  * @param  sectors: Erase block size in sectors, 1 for none
+  * @retval None
+  */
+void IMAGE_SetBlockSize(DWORD sectors)
+{
+  image_block = sectors ? sectors : 1;
+}
+
+/**
+  * @brief  Sets the latency simulated for every read or write command
+  * @param  command_us: Fixed cost of a command in us
+  * @param  sector_ns: Additional cost of each sector moved in ns
+  * @retval None
+  */
+void IMAGE_SetLatency(uint32_t command_us, uint32_t sector_ns)
+{
+  latency_command_ns = command_us * 1000U;
+  latency_sector_ns = sector_ns;
+}
+
+/**
+  * @brief  Gets the disk image driver statistics
+  * @param  *out: Receives a copy of the counters
+  * @retval None
+  */
+void IMAGE_GetStats(IMAGE_DiskStats *out)
+{
+  *out = stats;
+}
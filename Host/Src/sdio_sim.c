@@ -0,0 +1,494 @@
+/**
+  ******************************************************************************
+  * @file    sdio_sim.c
+  * @brief   Simulated SDIO bus and card for the host build
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2023 STMicroelectronics.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+
+/* Note: this implements the BSP_SD_xxx() functions sd_diskio.c calls, so the
+   SD disk driver runs on the host unchanged, over the disk image. A DMA
+   transfer is only started here: the sectors move and the driver's completion
+   callback runs from a SIGALRM handler once the simulated bus time has passed,
+   interrupting whatever the program is doing as the SDIO interrupt would.
+   After a write the card stays busy programming for the command latency, and
+   is polled by the driver as on the board.
+
+   The same handler stands in for SysTick, calling SD_Tick() once a
+   millisecond as stm32f4xx_it.c does, so queued writes the card was too busy
+   to take are started while the program is elsewhere.
+
+   __disable_irq() masks the signal and __WFI() waits for it, so the driver's
+   critical sections and sleeps behave as they do with PRIMASK. */
+
+/* Includes ------------------------------------------------------------------*/
+#include <signal.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include "image_diskio.h"
+#include "sdio_sim.h"
+#include "sd_diskio.h"
+
+/* Private define ------------------------------------------------------------*/
+/* No transfer completes sooner, so completion always arrives asynchronously */
+#define SDIO_SIM_MIN_NS  1000U
+
+/* SysTick period */
+#define SDIO_SIM_TICK_NS 1000000U
+
+/* Private variables ---------------------------------------------------------*/
+static uint8_t sim_present = 1;       /* the card is in the slot */
+static uint8_t sim_ready;             /* initialized since it was inserted */
+static uint8_t sim_known;             /* initialized at least once */
+static uint8_t sim_same;              /* the last BSP_SD_Init() found it again */
+static uint8_t sim_installed;         /* the signal handler is in place */
+
+/* Transfer in flight: 0 sectors when the bus is idle */
+static volatile UINT xfer_count;
+static uint8_t xfer_write;
+static BYTE *xfer_buff;
+static DWORD xfer_lba;
+static uint64_t xfer_done_ns;         /* when its completion interrupt fires */
+static uint64_t tick_next_ns;         /* when SysTick next fires */
+
+static volatile uint64_t busy_until_ns; /* the card programs until then */
+
+/* Simulated latency, see SDIO_SimSetLatency() */
+static uint32_t latency_command_ns;
+static uint32_t latency_sector_ns;
+
+/* Statistics reported by SDIO_SimGetStats() */
+static SDIO_SimStats stats;
+
+/* Private function prototypes -----------------------------------------------*/
+static uint64_t SDIO_SimNow(void);
+static void SDIO_SimArm(void);
+static void SDIO_SimIRQHandler(int sig);
+static void SDIO_SimComplete(UINT count, uint64_t now);
+static uint8_t SDIO_SimStart(uint32_t *pData, uint32_t Addr, uint32_t NumOfBlocks,
+                             uint8_t write);
+
+/* Private functions ---------------------------------------------------------*/
+static uint64_t SDIO_SimNow(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000U + (uint64_t)ts.tv_nsec;
+}
+
+/**
+  * @brief  Schedules the simulated interrupt for the next tick or transfer
+  *         completion, whichever is sooner
+  * @retval None
+  */
+static void SDIO_SimArm(void)
+{
+  struct itimerval it;
+  uint64_t now = SDIO_SimNow();
+  uint64_t next = tick_next_ns;
+  uint64_t us;
+
+  if ((xfer_count != 0) && (xfer_done_ns < next))
+  {
+    next = xfer_done_ns;
+  }
+  us = (next > now) ? (next - now + 999U) / 1000U : 1U;
+
+  memset(&it, 0, sizeof(it));
+  it.it_value.tv_sec = (time_t)(us / 1000000U);
+  it.it_value.tv_usec = (suseconds_t)(us % 1000000U);
+  setitimer(ITIMER_REAL, &it, NULL);
+}
+
+/**
+  * @brief  SDIO and SysTick interrupts: completes the transfer in flight once
+  *         it is due, and ticks once a millisecond
+  * @param  sig: not used
+  * @retval None
+  * @note   The data moves here rather than when the transfer starts, so a
+  *         buffer the driver reuses or reads before completion shows up.
+  */
+static void SDIO_SimIRQHandler(int sig)
+{
+  uint64_t now = SDIO_SimNow();
+  UINT count = xfer_count;
+
+  (void)sig;
+  if ((count != 0) && (now >= xfer_done_ns))
+  {
+    SDIO_SimComplete(count, now);
+  }
+  if (now >= tick_next_ns)
+  {
+    tick_next_ns = now + SDIO_SIM_TICK_NS;
+    SD_Tick();
+  }
+  SDIO_SimArm();
+}
+
+/**
+  * @brief  Moves the data of the transfer in flight and calls the driver's
+  *         completion callback
+  * @param  count: Sectors in flight
+  * @param  now: Time of the interrupt
+  * @retval None
+  */
+static void SDIO_SimComplete(UINT count, uint64_t now)
+{
+  DRESULT res;
+
+  if (xfer_write)
+  {
+    res = IMAGE_Driver.disk_write(0, xfer_buff, xfer_lba, count);
+    busy_until_ns = now + latency_command_ns;
+  }
+  else
+  {
+    res = IMAGE_Driver.disk_read(0, xfer_buff, xfer_lba, count);
+  }
+  xfer_count = 0;
+  stats.interrupts++;
+
+  if (res != RES_OK)
+  {
+    BSP_SD_ErrorCallback();
+  }
+  else if (xfer_write)
+  {
+    BSP_SD_WriteCpltCallback();
+  }
+  else
+  {
+    BSP_SD_ReadCpltCallback();
+  }
+}
+
+/**
+  * @brief  Starts a DMA transfer, as CMD18 or CMD25 would
+  * @param  pData: Buffer the DMA reads or fills
+  * @param  Addr: First sector
+  * @param  NumOfBlocks: Number of sectors
+  * @param  write: 1 for a write, 0 for a read
+  * @retval MSD_OK once started, MSD_ERROR if the bus or card is busy
+  */
+static uint8_t SDIO_SimStart(uint32_t *pData, uint32_t Addr, uint32_t NumOfBlocks,
+                             uint8_t write)
+{
+  uint64_t now = SDIO_SimNow();
+  uint64_t delay;
+  sigset_t set;
+  sigset_t saved;
+
+  if (!sim_ready || (xfer_count != 0) || (now < busy_until_ns) || (NumOfBlocks == 0) ||
+      (Addr >= IMAGE_GetSectorCount()) || (NumOfBlocks > IMAGE_GetSectorCount() - Addr))
+  {
+    stats.refused++;
+    return MSD_ERROR;
+  }
+
+  /* a read waits for the card to fetch the data, a write for it to program */
+  delay = (uint64_t)latency_sector_ns * NumOfBlocks;
+  if (!write)
+  {
+    delay += latency_command_ns;
+  }
+  if (delay < SDIO_SIM_MIN_NS)
+  {
+    delay = SDIO_SIM_MIN_NS;
+  }
+
+  /* the interrupt may not see a half set up transfer; this may be called
+     from the interrupt itself, so the mask is restored rather than cleared */
+  sigemptyset(&set);
+  sigaddset(&set, SIGALRM);
+  sigprocmask(SIG_BLOCK, &set, &saved);
+  xfer_buff = (BYTE *)pData;
+  xfer_lba = Addr;
+  xfer_write = write;
+  xfer_done_ns = now + delay;
+  xfer_count = NumOfBlocks;
+  stats.transfers++;
+  SDIO_SimArm();
+  sigprocmask(SIG_SETMASK, &saved, NULL);
+
+  return MSD_OK;
+}
+
+/* Exported functions --------------------------------------------------------*/
+
+/**
+  * @brief  Milliseconds since the first call, as SysTick counts them
+  * @retval Tick count
+  */
+uint32_t HAL_GetTick(void)
+{
+  static uint64_t start_ns;
+
+  if (start_ns == 0)
+  {
+    start_ns = SDIO_SimNow();
+  }
+  return (uint32_t)((SDIO_SimNow() - start_ns) / 1000000U);
+}
+
+void __disable_irq(void)
+{
+  sigset_t set;
+
+  sigemptyset(&set);
+  sigaddset(&set, SIGALRM);
+  sigprocmask(SIG_BLOCK, &set, NULL);
+}
+
+void __enable_irq(void)
+{
+  sigset_t set;
+
+  sigemptyset(&set);
+  sigaddset(&set, SIGALRM);
+  sigprocmask(SIG_UNBLOCK, &set, NULL);
+}
+
+uint32_t __get_PRIMASK(void)
+{
+  sigset_t set;
+
+  sigprocmask(SIG_BLOCK, NULL, &set);
+  return sigismember(&set, SIGALRM) ? 1U : 0U;
+}
+
+void __set_PRIMASK(uint32_t priMask)
+{
+  if (priMask)
+  {
+    __disable_irq();
+  }
+  else
+  {
+    __enable_irq();
+  }
+}
+
+/**
+  * @brief  Sleeps until the next interrupt, which is taken even while masked
+  *         and runs before this returns
+  * @retval None
+  */
+void __WFI(void)
+{
+  sigset_t set;
+
+  sigprocmask(SIG_BLOCK, NULL, &set);
+  sigdelset(&set, SIGALRM);
+  sigsuspend(&set);
+}
+
+/**
+  * @brief  Initializes the card found in the slot
+  * @retval MSD_OK, or MSD_ERROR without a card or an image
+  */
+uint8_t BSP_SD_Init(void)
+{
+  struct sigaction sa;
+
+  if (!sim_installed)
+  {
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = SDIO_SimIRQHandler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGALRM, &sa, NULL);
+    sim_installed = 1;
+    tick_next_ns = SDIO_SimNow() + SDIO_SIM_TICK_NS;
+    SDIO_SimArm();
+  }
+
+  if (!sim_present || (IMAGE_Driver.disk_initialize(0) & STA_NOINIT))
+  {
+    return MSD_ERROR;
+  }
+  xfer_count = 0;
+  busy_until_ns = 0;
+  sim_same = sim_known;
+  sim_known = 1;
+  sim_ready = 1;
+  return MSD_OK;
+}
+
+/**
+  * @brief  Tells whether the last BSP_SD_Init() found the card it had found
+  *         before; the image is always the same card.
+  * @retval 1 if it is the same card, 0 otherwise
+  */
+uint8_t BSP_SD_IsSameCard(void)
+{
+  return sim_same;
+}
+
+/**
+  * @brief  The simulated link has no errors, so there is no slower mode to try
+  * @retval MSD_ERROR
+  */
+uint8_t BSP_SD_RecoverBusError(void)
+{
+  return MSD_ERROR;
+}
+
+uint8_t BSP_SD_ReadBlocks_DMA(uint32_t *pData, uint32_t ReadAddr, uint32_t NumOfBlocks)
+{
+  return SDIO_SimStart(pData, ReadAddr, NumOfBlocks, 0);
+}
+
+uint8_t BSP_SD_WriteBlocks_DMA(uint32_t *pData, uint32_t WriteAddr, uint32_t NumOfBlocks)
+{
+  return SDIO_SimStart(pData, WriteAddr, NumOfBlocks, 1);
+}
+
+/**
+  * @brief  Erases a range of sectors, which then read back as zeroes
+  * @param  StartAddr: First sector
+  * @param  EndAddr: Last sector
+  * @retval MSD_OK, or MSD_ERROR if the bus or card is busy
+  * @note   The card stays busy for the command latency afterwards.
+  */
+uint8_t BSP_SD_Erase(uint32_t StartAddr, uint32_t EndAddr)
+{
+  static const BYTE zero[BLOCKSIZE];
+  uint64_t now = SDIO_SimNow();
+  uint32_t sector;
+
+  if (!sim_ready || (xfer_count != 0) || (now < busy_until_ns) || (EndAddr < StartAddr) ||
+      (EndAddr >= IMAGE_GetSectorCount()))
+  {
+    stats.refused++;
+    return MSD_ERROR;
+  }
+
+  for (sector = StartAddr; sector <= EndAddr; sector++)
+  {
+    (void)IMAGE_Driver.disk_write(0, zero, sector, 1);
+  }
+  busy_until_ns = now + latency_command_ns;
+  stats.erases++;
+  return MSD_OK;
+}
+
+uint8_t BSP_SD_GetCardState(void)
+{
+  if (!sim_ready || (xfer_count != 0) || (SDIO_SimNow() < busy_until_ns))
+  {
+    stats.busy_polls++;
+    return SD_TRANSFER_BUSY;
+  }
+  return SD_TRANSFER_OK;
+}
+
+void BSP_SD_GetCardInfo(HAL_SD_CardInfoTypeDef *CardInfo)
+{
+  memset(CardInfo, 0, sizeof(*CardInfo));
+  CardInfo->BlockNbr = IMAGE_GetSectorCount();
+  CardInfo->BlockSize = BLOCKSIZE;
+  CardInfo->LogBlockNbr = IMAGE_GetSectorCount();
+  CardInfo->LogBlockSize = BLOCKSIZE;
+}
+
+/**
+  * @brief  Reports the allocation unit the image was given, and no Speed Class
+  * @param  CardStatus: Pointer to HAL_SD_CardStatusTypeDef structure
+  * @retval MSD_OK
+  */
+uint8_t BSP_SD_GetCardStatus(HAL_SD_CardStatusTypeDef *CardStatus)
+{
+  DWORD block = 1;
+  uint8_t code;
+
+  memset((void *)CardStatus, 0, sizeof(*CardStatus));
+  (void)IMAGE_Driver.disk_ioctl(0, GET_BLOCK_SIZE, &block);
+
+  /* AU_SIZE codes 1 to 9 are 16 KiB doubling to 4 MiB */
+  for (code = 1; code <= 9; code++)
+  {
+    if (block == (32U << (code - 1U)))
+    {
+      CardStatus->AllocationUnitSize = code;
+    }
+  }
+  return MSD_OK;
+}
+
+uint8_t BSP_SD_GetCardCSD(HAL_SD_CardCSDTypeDef *CardCSD)
+{
+  memset((void *)CardCSD, 0, sizeof(*CardCSD));
+  return MSD_OK;
+}
+
+/**
+  * @brief  Gives the image a CID of its own, its serial number made from its
+  *         size
+  * @param  CID: Receives the four words of the CID
+  * @retval None
+  */
+void BSP_SD_GetCardCID(uint32_t *CID)
+{
+  CID[0] = 0x00534453U; /* "SDS" */
+  CID[1] = 0x494D2020U; /* "IM  " */
+  CID[2] = 0x10000000U;
+  CID[3] = IMAGE_GetSectorCount();
+}
+
+uint8_t BSP_SD_IsDetected(void)
+{
+  return sim_present ? SD_PRESENT : SD_NOT_PRESENT;
+}
+
+/**
+  * @brief  Sets the latency simulated for every read or write command
+  * @param  command_us: Time a read takes to start, or a write to program
+  * @param  sector_ns: Bus time of each sector moved
+  * @retval None
+  */
+void SDIO_SimSetLatency(uint32_t command_us, uint32_t sector_ns)
+{
+  latency_command_ns = command_us * 1000U;
+  latency_sector_ns = sector_ns;
+}
+
+/**
+  * @brief  Pulls the card and puts it back, as the card detect interrupt would
+  *         report it
+  * @retval None
+  * @note   The transfer in flight is aborted and failed. The card must be
+  *         initialized again, and holds what had reached it.
+  */
+void SDIO_SimEject(void)
+{
+  __disable_irq();
+  sim_present = 0;
+  xfer_count = 0;
+  busy_until_ns = 0;
+  sim_ready = 0;
+  BSP_SD_DetectCallback();
+  sim_present = 1;
+  __enable_irq();
+}
+
+/**
+  * @brief  Gets the simulated bus statistics
+  * @param  *out: Receives a copy of the counters
+  * @retval None
+  */
+void SDIO_SimGetStats(SDIO_SimStats *out)
+{
+  *out = stats;
+}
@@ -54,7 +54,9 @@ DSTATUS disk_initialize (
 {
   DSTATUS stat = RES_OK;
 
-  if(disk.is_initialized[pdrv] == 0)
+  /* a drive whose medium has been swapped since is initialized again */
+  if((disk.is_initialized[pdrv] == 0) ||
+     (disk.drv[pdrv]->disk_status(disk.lun[pdrv]) & STA_NOINIT))
   {
     disk.is_initialized[pdrv] = 1;
     stat = disk.drv[pdrv]->disk_initialize(disk.lun[pdrv]);
@@ -44,6 +44,7 @@ DWORD get_fattime (void);
 #define STA_NOINIT		0x01	/* Drive not initialized */
 #define STA_NODISK		0x02	/* No medium in the drive */
 #define STA_PROTECT		0x04	/* Write protected */
+#define STA_KEPT		0x08	/* Same medium as at the last initialization, holding all written since (disk_initialize only) */
 
 
 /* Command code for disk_ioctrl fucntion */
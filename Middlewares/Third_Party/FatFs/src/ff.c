@@ -437,6 +437,16 @@
 #define	FSI_Free_Count		488		/* FAT32 FSI: Number of free clusters (DWORD) */
 #define	FSI_Nxt_Free		492		/* FAT32 FSI: Last allocated cluster (DWORD) */
 
+#define	MC_Sig				0		/* Mount cache: Signature (DWORD) */
+#define	MC_VolID			4		/* Mount cache: Volume serial number (DWORD) */
+#define	MC_FatBase			8		/* Mount cache: FAT base sector (DWORD) */
+#define	MC_DataBase			12		/* Mount cache: Data base sector (DWORD) */
+#define	MC_NumClst			16		/* Mount cache: Number of FAT entries (DWORD) */
+#define	MC_Free_Count		20		/* Mount cache: FSINFO free cluster count it goes with (DWORD) */
+#define	MC_Nxt_Free			24		/* Mount cache: FSINFO last allocated cluster it goes with (DWORD) */
+#define	MC_Shift			28		/* Mount cache: Clusters per map group in log2 (BYTE) */
+#define	MC_SIGNATURE		0x434D4646	/* "FFMC" */
+
 #define MBR_Table			446		/* MBR: Offset of partition table in the MBR */
 #define	SZ_PTE				16		/* MBR: Size of a partition table entry */
 #define PTE_Boot			0		/* MBR PTE: Boot indicator */
@@ -500,6 +510,92 @@
 #endif
 
 
+/* Window cache */
+#if _FS_WINCACHE < 1 || _FS_WINCACHE > 255
+#error Wrong _FS_WINCACHE setting
+#endif
+#if _FS_WINCACHE > 1 && (_FS_TINY || _FS_READONLY)
+#error _FS_WINCACHE must be 1 at tiny or read-only configuration
+#endif
+
+
+/* Free cluster map */
+#if _FS_FREEMAP && (_FS_FREEMAP < 64 || _FS_FREEMAP > 65535)
+#error Wrong _FS_FREEMAP setting
+#endif
+#if _FS_READONLY
+#undef _FS_FREEMAP
+#define _FS_FREEMAP 0
+#endif
+#define FM_UNKNOWN	0xFFFF	/* Map entry of a group not counted yet (a group holds 32768 clusters at most) */
+
+
+/* Mount cache */
+#if !_FS_FREEMAP || (_FS_NOFSINFO & 1)
+#undef _FS_FASTMOUNT
+#define _FS_FASTMOUNT 0
+#endif
+
+
+/* Allocation unit alignment */
+#if _FS_READONLY
+#undef _FS_AUALIGN
+#define _FS_AUALIGN 0
+#endif
+
+
+/* Streaming headroom */
+#if !_FS_EXFAT || _FS_READONLY
+#undef _FS_HEADROOM
+#define _FS_HEADROOM 0
+#endif
+#if _FS_HEADROOM
+#define	HR_FILES	4		/* Growing files whose headroom is kept */
+typedef struct {
+	FATFS *fs;		/* Volume (NULL:blank entry) */
+	WORD id;		/* Volume mount ID */
+	DWORD sclust;	/* Start cluster of the file */
+	DWORD top;		/* Cluster next to its growing edge, where its headroom starts */
+} HRSLOT;
+#endif
+
+
+/* Directory index */
+#if _FS_DIRINDEX && (_FS_DIRINDEX < 64 || _FS_DIRINDEX > 32768 || (_FS_DIRINDEX & (_FS_DIRINDEX - 1)))
+#error Wrong _FS_DIRINDEX setting
+#endif
+#if _FS_READONLY
+#undef _FS_DIRINDEX
+#define _FS_DIRINDEX 0
+#endif
+#if _FS_DIRINDEX
+#define	DI_SLOTS	(_FS_DIRINDEX * 2)	/* Hash table slots, no more than half of them used */
+#define	DI_MIN		128		/* Entries a search has to pass before its directory is indexed */
+#define	DI_FREE		0		/* DISLOT.ent of a slot never used */
+#define	DI_GONE		0xFFFF	/* DISLOT.ent of a slot whose entry was removed */
+#define	DI_LARGE	4		/* Directories remembered as too large to index */
+typedef struct {
+	WORD key;		/* Hash of the name */
+	WORD ent;		/* Index of the top entry of the block + 1, DI_FREE or DI_GONE */
+} DISLOT;
+typedef struct {
+	FATFS *fs;		/* Volume (NULL:blank) */
+	WORD id;		/* Volume mount ID */
+	BYTE stat;		/* 0:to be built at the next search, 1:valid, 2:directory too large */
+	DWORD sclust;	/* Start cluster of the directory (0:root) */
+	DWORD hint;		/* Offset dir_alloc starts from, no free entry before it */
+	UINT used;		/* Slots other than DI_FREE */
+	DISLOT slot[DI_SLOTS];
+} DIRIDX;
+typedef struct {
+	FATFS *fs;		/* Volume (NULL:blank entry) */
+	WORD id;		/* Volume mount ID */
+	DWORD sclust;	/* Start cluster of the directory (0:root) */
+	DWORD over;		/* Names it holds beyond what the index can */
+} DILARGE;
+#endif
+
+
 /* File lock controls */
 #if _FS_LOCK != 0
 #if _FS_READONLY
@@ -538,7 +634,16 @@ static BYTE CurrVol;			/* Current drive */
 #endif
 
 #if _FS_LOCK != 0
-static FILESEM Files[_FS_LOCK];	/* Open object lock semaphores */
+static _FS_CCMRAM FILESEM Files[_FS_LOCK];	/* Open object lock semaphores */
+#endif
+
+#if _FS_HEADROOM
+static _FS_CCMRAM HRSLOT Headroom[HR_FILES];	/* Growing files, most recently grown first */
+#endif
+
+#if _FS_DIRINDEX
+static _FS_CCMRAM DIRIDX DirIndex;	/* Name index of a directory searched at length */
+static _FS_CCMRAM DILARGE DirLarge[DI_LARGE];	/* Directories found too large to index, most recently found first */
 #endif
 
 #if _USE_LFN == 0		/* Non-LFN configuration */
@@ -554,9 +659,9 @@ static FILESEM Files[_FS_LOCK];	/* Open object lock semaphores */
 
 #if _USE_LFN == 1		/* LFN enabled with static working buffer */
 #if _FS_EXFAT
-static BYTE	DirBuf[MAXDIRB(_MAX_LFN)];	/* Directory entry block scratchpad buffer */
+static _FS_CCMRAM BYTE	DirBuf[MAXDIRB(_MAX_LFN)];	/* Directory entry block scratchpad buffer */
 #endif
-static WCHAR LfnBuf[_MAX_LFN + 1];	/* LFN enabled with static working buffer */
+static _FS_CCMRAM WCHAR LfnBuf[_MAX_LFN + 1];	/* LFN enabled with static working buffer */
 #define	DEF_NAMBUF
 #define INIT_NAMBUF(fs)
 #define	FREE_NAMBUF()
@@ -878,6 +983,66 @@ void clear_lock (	/* Clear lock entries of the volume */
 /*-----------------------------------------------------------------------*/
 /* Move/Flush disk access window in the file system object               */
 /*-----------------------------------------------------------------------*/
+#if _FS_WINCACHE > 1
+static
+void wc_drop (		/* Forget any cached copy of a sector */
+	FATFS* fs,		/* File system object */
+	DWORD sect		/* Sector number just written or loaded by other means */
+)
+{
+	UINT i;
+
+
+	for (i = 0; i < _FS_WINCACHE - 1; i++) {
+		if (fs->wc_sect[i] == sect) {
+			fs->wc_sect[i] = 0xFFFFFFFF; fs->wc_flag[i] = 0;
+		}
+	}
+}
+
+
+static
+void wc_reset (		/* Empty the window cache without writing it back */
+	FATFS* fs		/* File system object */
+)
+{
+	UINT i;
+
+
+	for (i = 0; i < _FS_WINCACHE - 1; i++) {
+		fs->wc_sect[i] = 0xFFFFFFFF; fs->wc_flag[i] = 0; fs->wc_used[i] = 0;
+	}
+	fs->wc_clock = 0;
+}
+
+
+static
+FRESULT wc_flush (	/* Write back a window cache entry if it is dirty */
+	FATFS* fs,		/* File system object */
+	UINT i			/* Cache entry */
+)
+{
+	DWORD wsect;
+	UINT nf;
+
+
+	if (fs->wc_flag[i]) {
+		wsect = fs->wc_sect[i];
+		if (disk_write(fs->drv, fs->wc_buf[i], wsect, 1) != RES_OK) return FR_DISK_ERR;
+		fs->wc_flag[i] = 0;
+		fs->wc_write++;
+		if (wsect - fs->fatbase < fs->fsize) {		/* Is it in the FAT area? */
+			for (nf = fs->n_fats; nf >= 2; nf--) {	/* Reflect the change to all FAT copies */
+				wsect += fs->fsize;
+				disk_write(fs->drv, fs->wc_buf[i], wsect, 1);
+			}
+		}
+	}
+	return FR_OK;
+}
+#endif
+
+
 #if !_FS_READONLY
 static
 FRESULT sync_window (	/* Returns FR_OK or FR_DISK_ERROR */
@@ -895,6 +1060,10 @@ FRESULT sync_window (	/* Returns FR_OK or FR_DISK_ERROR */
 			res = FR_DISK_ERR;
 		} else {
 			fs->wflag = 0;
+			fs->wc_write++;
+#if _FS_WINCACHE > 1
+			wc_drop(fs, wsect);		/* A cached copy is stale if the window was relabelled */
+#endif
 			if (wsect - fs->fatbase < fs->fsize) {		/* Is it in the FAT area? */
 				for (nf = fs->n_fats; nf >= 2; nf--) {	/* Reflect the change to all FAT copies */
 					wsect += fs->fsize;
@@ -915,13 +1084,46 @@ FRESULT move_window (	/* Returns FR_OK or FR_DISK_ERROR */
 )
 {
 	FRESULT res = FR_OK;
+#if _FS_WINCACHE > 1
+	UINT i, v;
+	DWORD t;
+	BYTE b;
+#endif
 
 
 	if (sector != fs->winsect) {	/* Window offset changed? */
-#if !_FS_READONLY
+#if _FS_WINCACHE > 1
+		fs->wc_clock++;
+		for (i = 0; i < _FS_WINCACHE - 1 && fs->wc_sect[i] != sector; i++) ;
+		if (i < _FS_WINCACHE - 1) {	/* Cached: swap it with the window, dirty flag and all */
+			wc_drop(fs, fs->winsect);
+			for (v = 0; v < SS(fs); v++) {
+				b = fs->win[v]; fs->win[v] = fs->wc_buf[i][v]; fs->wc_buf[i][v] = b;
+			}
+			fs->wc_sect[i] = fs->winsect; fs->winsect = sector;
+			b = fs->wc_flag[i]; fs->wc_flag[i] = fs->wflag; fs->wflag = b;
+			fs->wc_used[i] = fs->wc_clock;
+			fs->wc_hit++;
+			return FR_OK;
+		}
+		if (fs->winsect != 0xFFFFFFFF) {	/* Move the window into the least recently used entry */
+			for (i = v = 0; i < _FS_WINCACHE - 1; i++) {
+				if (fs->wc_sect[i] == 0xFFFFFFFF) { v = i; break; }
+				if (fs->wc_used[i] < fs->wc_used[v]) v = i;
+			}
+			res = wc_flush(fs, v);			/* Write-back the evicted sector */
+			if (res != FR_OK) return res;
+			t = fs->winsect;
+			wc_drop(fs, t);
+			mem_cpy(fs->wc_buf[v], fs->win, SS(fs));
+			fs->wc_sect[v] = t; fs->wc_flag[v] = fs->wflag; fs->wc_used[v] = fs->wc_clock;
+			fs->wflag = 0;
+		}
+#elif !_FS_READONLY
 		res = sync_window(fs);		/* Write-back changes */
 #endif
 		if (res == FR_OK) {			/* Fill sector window with new data */
+			fs->wc_miss++;
 			if (disk_read(fs->drv, fs->win, sector, 1) != RES_OK) {
 				sector = 0xFFFFFFFF;	/* Invalidate window if data is not reliable */
 				res = FR_DISK_ERR;
@@ -935,6 +1137,198 @@ FRESULT move_window (	/* Returns FR_OK or FR_DISK_ERROR */
 
 
 
+#if _FS_FREEMAP
+/*-----------------------------------------------------------------------*/
+/* Free cluster map - Get the group size for the volume                  */
+/*-----------------------------------------------------------------------*/
+
+static
+UINT fm_group (	/* Clusters per group in log2, 0:Volume cannot be mapped */
+	FATFS* fs	/* File system object, with n_fatent set */
+)
+{
+	UINT sh;
+
+
+	for (sh = 7; ((fs->n_fatent - 1) >> sh) >= _FS_FREEMAP; sh++) ;	/* Smallest group to cover the volume */
+	return (sh > 15) ? 0 : sh;	/* Not mapped if a group count does not fit in a WORD */
+}
+
+
+/*-----------------------------------------------------------------------*/
+/* Free cluster map - Start with no group counted                        */
+/*-----------------------------------------------------------------------*/
+
+static
+void fm_reset (
+	FATFS* fs	/* File system object, with n_fatent set */
+)
+{
+	DWORD g;
+
+
+	fs->fm_shift = (BYTE)fm_group(fs);
+	fs->fm_unknown = fs->fm_shift ? ((fs->n_fatent - 1) >> fs->fm_shift) + 1 : 0;
+	for (g = 0; g < fs->fm_unknown; g++) fs->fmap[g] = FM_UNKNOWN;	/* Each is counted when first looked at */
+#if _FS_FASTMOUNT
+	fs->mc_lo = 0; fs->mc_hi = 0xFFFFFFFF;	/* The whole map is for the mount cache to write */
+#endif
+}
+#endif /* _FS_FREEMAP */
+
+
+
+
+#if _FS_FASTMOUNT
+/*-----------------------------------------------------------------------*/
+/* Mount cache - Find room for it at the end of the reserved area        */
+/*-----------------------------------------------------------------------*/
+
+static
+DWORD mc_place (	/* Header sector, 0:No room */
+	FATFS* fs,		/* File system object, with n_fatent and fatbase set */
+	DWORD bsect,	/* Volume base sector */
+	UINT bkboot		/* Backup boot sector offset (0:none) */
+)
+{
+	UINT sh;
+	DWORD nsect;
+
+
+	sh = fm_group(fs);
+	if (!sh) return 0;
+	nsect = ((((fs->n_fatent - 1) >> sh) + 1) * 2 + SS(fs) - 1) / SS(fs);	/* Map sectors */
+	if (bkboot < 3) bkboot = 3;		/* (Sectors 0 to 2 may hold boot code) */
+	if (fs->fatbase - bsect < bkboot + 3 + nsect + 1) return 0;	/* Past the backup boot sectors? */
+	return fs->fatbase - 1;
+}
+
+
+/*-----------------------------------------------------------------------*/
+/* Mount cache - Zero the header before the FAT changes                  */
+/*-----------------------------------------------------------------------*/
+
+static
+FRESULT mc_stale (	/* FR_OK(0):succeeded, !=0:error */
+	FATFS* fs		/* File system object */
+)
+{
+	FRESULT res;
+
+
+	res = move_window(fs, fs->mc_sect);
+	if (res == FR_OK) {
+		mem_set(fs->win, 0, SS(fs));
+		fs->wflag = 1;
+		res = sync_window(fs);	/* Written now, ahead of any FAT sector */
+		if (res == FR_OK) fs->mc_valid = 0;
+	}
+	return res;
+}
+
+
+/*-----------------------------------------------------------------------*/
+/* Mount cache - Write the map and the header                            */
+/*-----------------------------------------------------------------------*/
+
+static
+FRESULT mc_save (	/* FR_OK(0):succeeded, !=0:error */
+	FATFS* fs		/* File system object, synced */
+)
+{
+	FRESULT res = FR_OK;
+	DWORD ng, nsect, sect, g;
+	UINT i;
+
+
+	ng = ((fs->n_fatent - 1) >> fs->fm_shift) + 1;	/* Map groups */
+	nsect = (ng * 2 + SS(fs) - 1) / SS(fs);
+	if (fs->mc_hi >= ng) fs->mc_hi = ng - 1;
+	if (fs->mc_lo <= fs->mc_hi) {	/* Write the map sectors changed since the last time */
+		for (sect = fs->mc_lo * 2 / SS(fs); sect <= fs->mc_hi * 2 / SS(fs) && res == FR_OK; sect++) {
+			mem_set(fs->win, 0, SS(fs));
+			g = sect * (SS(fs) / 2);
+			for (i = 0; i < SS(fs) / 2 && g < ng; i++, g++) st_word(fs->win + i * 2, fs->fmap[g]);
+			fs->winsect = fs->mc_sect - nsect + sect;
+			fs->wflag = 1;
+			res = sync_window(fs);
+		}
+	}
+	if (res == FR_OK) {		/* Then the header, which makes it valid */
+		mem_set(fs->win, 0, SS(fs));
+		st_dword(fs->win + MC_Sig, MC_SIGNATURE);
+		st_dword(fs->win + MC_VolID, fs->mc_volid);
+		st_dword(fs->win + MC_FatBase, fs->fatbase);
+		st_dword(fs->win + MC_DataBase, fs->database);
+		st_dword(fs->win + MC_NumClst, fs->n_fatent);
+		st_dword(fs->win + MC_Free_Count, fs->free_clst);
+		st_dword(fs->win + MC_Nxt_Free, fs->last_clst);
+		fs->win[MC_Shift] = fs->fm_shift;
+		fs->winsect = fs->mc_sect;
+		fs->wflag = 1;
+		res = sync_window(fs);
+	}
+	if (res == FR_OK) {
+		fs->mc_valid = 1;
+		fs->mc_lo = 0xFFFFFFFF; fs->mc_hi = 0;
+	}
+	return res;
+}
+
+
+/*-----------------------------------------------------------------------*/
+/* Mount cache - Load the free cluster map if the cache is valid         */
+/*-----------------------------------------------------------------------*/
+
+static
+FRESULT mc_load (	/* FR_OK(0):map loaded, !=0:no valid cache or error */
+	FATFS* fs		/* File system object, with the FSINFO loaded */
+)
+{
+	FRESULT res;
+	DWORD ng, nsect, sect, g, nfree;
+	UINT sh, i;
+
+
+	if (!fs->mc_sect || fs->free_clst == 0xFFFFFFFF) return FR_NO_FILESYSTEM;
+	res = move_window(fs, fs->mc_sect);
+	if (res != FR_OK) return res;
+	if (ld_dword(fs->win + MC_Sig) != MC_SIGNATURE) return FR_NO_FILESYSTEM;
+	fs->mc_valid = 1;		/* Zero it before the FAT changes, whether it is used or not */
+	sh = fm_group(fs);
+	if (ld_dword(fs->win + MC_VolID) != fs->mc_volid		/* Same volume, as it was left? */
+		|| ld_dword(fs->win + MC_FatBase) != fs->fatbase
+		|| ld_dword(fs->win + MC_DataBase) != fs->database
+		|| ld_dword(fs->win + MC_NumClst) != fs->n_fatent
+		|| ld_dword(fs->win + MC_Free_Count) != fs->free_clst
+		|| ld_dword(fs->win + MC_Nxt_Free) != fs->last_clst
+		|| fs->win[MC_Shift] != sh) {
+		return FR_NO_FILESYSTEM;
+	}
+
+	ng = ((fs->n_fatent - 1) >> sh) + 1;
+	nsect = (ng * 2 + SS(fs) - 1) / SS(fs);
+	mem_set(fs->fmap, 0, sizeof fs->fmap);
+	nfree = 0;
+	for (sect = 0, g = 0; sect < nsect; sect++) {
+		res = move_window(fs, fs->mc_sect - nsect + sect);
+		if (res != FR_OK) return res;
+		for (i = 0; i < SS(fs) / 2 && g < ng; i++, g++) {
+			fs->fmap[g] = ld_word(fs->win + i * 2);
+			nfree += fs->fmap[g];
+		}
+	}
+	if (nfree != fs->free_clst) return FR_NO_FILESYSTEM;	/* The map must add up to the free count */
+	fs->fm_shift = (BYTE)sh;	/* Now the map is valid */
+	fs->fm_unknown = 0;
+	fs->mc_lo = 0xFFFFFFFF; fs->mc_hi = 0;
+	return FR_OK;
+}
+#endif /* _FS_FASTMOUNT */
+
+
+
+
 #if !_FS_READONLY
 /*-----------------------------------------------------------------------*/
 /* Synchronize file system and strage device                             */
@@ -946,10 +1340,43 @@ FRESULT sync_fs (	/* FR_OK:succeeded, !=0:error */
 )
 {
 	FRESULT res;
+#if _FS_WINCACHE > 1
+	UINT i, n;
+	DWORD sect;
+#endif
+#if _FS_FASTMOUNT
+	int mc;
+#endif
 
 
+#if _FS_WINCACHE > 1
+	/* Write back the window and all dirty cache entries in LBA order, so the
+	   FAT goes to the disk before the directory entries which refer to it */
+	for (res = FR_OK; res == FR_OK; ) {
+		sect = 0xFFFFFFFF; n = _FS_WINCACHE;
+		for (i = 0; i < _FS_WINCACHE - 1; i++) {
+			if (fs->wc_flag[i] && fs->wc_sect[i] < sect) {
+				sect = fs->wc_sect[i]; n = i;
+			}
+		}
+		if (fs->wflag && fs->winsect <= sect) {
+			res = sync_window(fs);
+		} else if (n < _FS_WINCACHE) {
+			res = wc_flush(fs, n);
+		} else {
+			break;
+		}
+	}
+#else
 	res = sync_window(fs);
+#endif
 	if (res == FR_OK) {
+#if _FS_FASTMOUNT
+		/* The mount cache is to be written if it is not valid for the FAT now on the disk,
+		   and the FSInfo with it as the cache holds only for the FSInfo it was written with */
+		mc = (fs->fs_type == FS_FAT32 && fs->mc_sect && fs->fm_shift && !fs->fm_unknown && !fs->mc_valid && !(fs->fsi_flag & 0x80));
+		if (mc) fs->fsi_flag = 1;
+#endif
 		/* Update FSInfo sector if needed */
 		if (fs->fs_type == FS_FAT32 && fs->fsi_flag == 1) {
 			/* Create FSInfo structure */
@@ -964,6 +1391,9 @@ FRESULT sync_fs (	/* FR_OK:succeeded, !=0:error */
 			disk_write(fs->drv, fs->win, fs->winsect, 1);
 			fs->fsi_flag = 0;
 		}
+#if _FS_FASTMOUNT
+		if (mc) res = mc_save(fs);	/* Write the mount cache */
+#endif
 		/* Make sure that no pending write process in the physical drive */
 		if (disk_ioctl(fs->drv, CTRL_SYNC, 0) != RES_OK) res = FR_DISK_ERR;
 	}
@@ -1035,7 +1465,7 @@ DWORD get_fat (	/* 0xFFFFFFFF:Disk error, 1:Internal error, 2..0x7FFFFFFF:Cluste
 			break;
 #if _FS_EXFAT
 		case FS_EXFAT :
-			if (obj->objsize) {
+			if ((obj->objsize != 0 && obj->sclust != 0) || obj->stat == 0) {	/* Object except root dir must have valid data length */
 				DWORD cofs = clst - obj->sclust;	/* Offset from start cluster */
 				DWORD clen = (DWORD)((obj->objsize - 1) / SS(fs)) / fs->csize;	/* Number of clusters - 1 */
 
@@ -1089,6 +1519,12 @@ FRESULT put_fat (	/* FR_OK(0):succeeded, !=0:error */
 	FRESULT res = FR_INT_ERR;
 
 	if (clst >= 2 && clst < fs->n_fatent) {	/* Check if in valid range */
+#if _FS_FASTMOUNT
+		if (fs->mc_valid) {		/* The mount cache would no longer hold for the FAT */
+			res = mc_stale(fs);
+			if (res != FR_OK) return res;
+		}
+#endif
 		switch (fs->fs_type) {
 		case FS_FAT12 :	/* Bitfield items */
 			bc = (UINT)clst; bc += bc / 2;
@@ -1133,6 +1569,204 @@ FRESULT put_fat (	/* FR_OK(0):succeeded, !=0:error */
 
 
 
+#if _FS_FREEMAP
+/*-----------------------------------------------------------------------*/
+/* Free cluster map - Count clusters allocated or freed                  */
+/*-----------------------------------------------------------------------*/
+
+static
+void fm_change (
+	FATFS* fs,	/* File system object */
+	DWORD clst,	/* Cluster number to change from */
+	DWORD ncl,	/* Number of clusters changed */
+	int bv		/* 1:Allocated or 0:Freed */
+)
+{
+	DWORD n;
+	WORD *p;
+
+
+	if (!fs->fm_shift) return;	/* Map not valid? */
+#if _FS_FASTMOUNT
+	if (ncl && (clst >> fs->fm_shift) < fs->mc_lo) fs->mc_lo = clst >> fs->fm_shift;	/* Groups for the mount cache to write */
+	if (ncl && ((clst + ncl - 1) >> fs->fm_shift) > fs->mc_hi) fs->mc_hi = (clst + ncl - 1) >> fs->fm_shift;
+#endif
+	while (ncl) {
+		n = (((clst >> fs->fm_shift) + 1) << fs->fm_shift) - clst;	/* Clusters left in the group */
+		if (n > ncl) n = ncl;
+		p = &fs->fmap[clst >> fs->fm_shift];
+		if (*p != FM_UNKNOWN) {		/* (A group not counted yet is counted from the FAT as changed) */
+			*p = bv ? (WORD)(*p - n) : (WORD)(*p + n);
+		}
+		clst += n; ncl -= n;
+	}
+}
+
+
+/*-----------------------------------------------------------------------*/
+/* Free cluster map - Count the free clusters in a group                 */
+/*-----------------------------------------------------------------------*/
+
+static
+DWORD fm_count (	/* Number of free clusters, 0xFFFFFFFF:Disk error */
+	FATFS* fs,	/* File system object */
+	DWORD clst,	/* Cluster number to count from */
+	DWORD ecl	/* Cluster number next to the last to count */
+)
+{
+	DWORD nfree = 0, stat;
+	_FDID obj;
+
+
+	mem_set(&obj, 0, sizeof obj);	/* Not an object of the volume, only its FAT is read */
+#if _FS_EXFAT
+	if (fs->fs_type == FS_EXFAT) {	/* exFAT: Count clear bits in the allocation bitmap */
+		for ( ; clst < ecl; clst++) {
+			if (move_window(fs, fs->database + (clst - 2) / 8 / SS(fs)) != FR_OK) return 0xFFFFFFFF;
+			if (!(fs->win[(clst - 2) / 8 % SS(fs)] & (1 << ((clst - 2) % 8)))) nfree++;
+		}
+		return nfree;
+	}
+#endif
+	obj.fs = fs;
+	for ( ; clst < ecl; clst++) {	/* FAT12/16/32: Count zero entries */
+		stat = get_fat(&obj, clst);
+		if (stat == 0xFFFFFFFF || stat == 1) return 0xFFFFFFFF;
+		if (stat == 0) nfree++;
+	}
+	return nfree;
+}
+
+
+/*-----------------------------------------------------------------------*/
+/* Free cluster map - Take the free count from the map once complete     */
+/*-----------------------------------------------------------------------*/
+
+static
+void fm_total (
+	FATFS* fs	/* File system object, with every group counted */
+)
+{
+	DWORD ng, g, nfree;
+
+
+	ng = ((fs->n_fatent - 1) >> fs->fm_shift) + 1;
+	for (g = nfree = 0; g < ng; g++) nfree += fs->fmap[g];
+	if (fs->free_clst != nfree) {
+		fs->free_clst = nfree;	/* Now free_clst is valid */
+		fs->fsi_flag |= 1;		/* FSInfo is to be updated */
+	}
+}
+
+
+/*-----------------------------------------------------------------------*/
+/* Free cluster map - Get state of clusters up to the end of the group   */
+/*-----------------------------------------------------------------------*/
+
+static
+DWORD fm_span (	/* 0:All free, 2:All in use, 1:Not known from the map */
+	FATFS* fs,	/* File system object */
+	DWORD clst,	/* Cluster number to check from */
+	DWORD* ecl	/* Returns the cluster next to the span */
+)
+{
+	DWORD top, nxt, n;
+
+
+	*ecl = clst + 1;
+	if (!fs->fm_shift) return 1;	/* Map not valid? */
+	top = clst >> fs->fm_shift << fs->fm_shift;
+	nxt = top + ((DWORD)1 << fs->fm_shift);	/* Top of the next group */
+	if (nxt > fs->n_fatent) nxt = fs->n_fatent;
+	if (top < 2) top = 2;			/* (Cluster 0 and 1 are not counted) */
+	n = fs->fmap[clst >> fs->fm_shift];
+	if (n == FM_UNKNOWN) {			/* Not counted since the mount? Count it now */
+		n = fm_count(fs, top, nxt);
+		if (n == 0xFFFFFFFF) return 1;
+		fs->fmap[clst >> fs->fm_shift] = (WORD)n;
+		if (--fs->fm_unknown == 0) fm_total(fs);
+	}
+	if (n == 0) {					/* No free cluster in the group? */
+		*ecl = nxt; return 2;
+	}
+	if (clst == top && n == nxt - top) {	/* Entire group is free? */
+		*ecl = nxt; return 0;
+	}
+	return 1;
+}
+
+
+/*-----------------------------------------------------------------------*/
+/* Free cluster map - Check if the medium holds all the map reflects     */
+/*-----------------------------------------------------------------------*/
+
+static
+int fm_clean (	/* 1:FAT32 volume synced with nothing left to write back, 0:Not known */
+	FATFS* fs	/* File system object */
+)
+{
+#if _FS_WINCACHE > 1
+	UINT i;
+
+
+	for (i = 0; i < _FS_WINCACHE - 1; i++) {
+		if (fs->wc_flag[i]) return 0;	/* Dirty sector in the window cache? */
+	}
+#endif
+	return (fs->fs_type == FS_FAT32 && fs->fsi_flag == 0 && !fs->wflag);	/* FSInfo enabled and up to date? */
+}
+
+#define FM_TALLY(fs, sh, clst)	if (sh) (fs)->fmap[(clst) >> (sh)]++
+#else
+#define FM_TALLY(fs, sh, clst)
+#endif /* _FS_FREEMAP */
+
+
+
+
+#if _FS_AUALIGN
+/*-----------------------------------------------------------------------*/
+/* Allocation unit - Get the erase block size and find its boundaries    */
+/*-----------------------------------------------------------------------*/
+
+static
+void au_init (
+	FATFS* fs	/* File system object */
+)
+{
+	DWORD szb, n;
+
+
+	fs->au_clst = 1; fs->au_ofs = 0;	/* No alignment by default */
+	if (disk_ioctl(fs->drv, GET_BLOCK_SIZE, &szb) != RES_OK) return;
+	if (szb <= fs->csize || szb % fs->csize) return;	/* Not a multiple of the cluster size? */
+	n = (szb - fs->database % szb) % szb;	/* Sectors from the top of the data area to the first boundary */
+	if (n % fs->csize) return;				/* Boundaries do not fall on clusters? */
+	fs->au_clst = szb / fs->csize;
+	fs->au_ofs = n / fs->csize;
+}
+
+
+static
+DWORD au_ceil (	/* First cluster at or after clst on an allocation unit boundary */
+	FATFS* fs,	/* File system object */
+	DWORD clst	/* Cluster number (2..) */
+)
+{
+	DWORD r;
+
+
+	if (fs->au_clst <= 1) return clst;
+	r = (clst - 2 + fs->au_clst - fs->au_ofs) % fs->au_clst;
+	return r ? clst + fs->au_clst - r : clst;
+}
+#else
+#define au_ceil(fs, clst)	(clst)
+#endif /* _FS_AUALIGN */
+
+
+
+
 #if _FS_EXFAT && !_FS_READONLY
 /*-----------------------------------------------------------------------*/
 /* exFAT: Accessing FAT and Allocation Bitmap                            */
@@ -1146,17 +1780,41 @@ static
 DWORD find_bitmap (	/* 0:Not found, 2..:Cluster block found, 0xFFFFFFFF:Disk error */
 	FATFS* fs,	/* File system object */
 	DWORD clst,	/* Cluster number to scan from */
-	DWORD ncl	/* Number of contiguous clusters to find (1..) */
+	DWORD ncl,	/* Number of contiguous clusters to find (1..) */
+	int au		/* 1:Block must start on an allocation unit boundary */
 )
 {
 	BYTE bm, bv;
 	UINT i;
 	DWORD val, scl, ctr;
+#if _FS_FREEMAP
+	DWORD n, ecl;
+#endif
 
 
 	clst -= 2;	/* The first bit in the bitmap corresponds to cluster #2 */
 	if (clst >= fs->n_fatent - 2) clst = 0;
 	scl = val = clst; ctr = 0;
+#if _FS_FREEMAP
+	if (fs->fm_shift) {	/* Scan with the free cluster map, a bit at a time where it is not conclusive */
+		for (;;) {
+			bv = (BYTE)fm_span(fs, val + 2, &ecl);
+			n = ecl - 2 - val;			/* Number of clusters in the span */
+			if (bv == 1) {				/* Get bit value from the bitmap */
+				if (move_window(fs, fs->database + val / 8 / SS(fs)) != FR_OK) return 0xFFFFFFFF;
+				bv = fs->win[val / 8 % SS(fs)] & (1 << (val % 8));
+			}
+			if (!bv) {	/* Are they free clusters? */
+				if (au && ctr == 0) scl = au_ceil(fs, val + 2) - 2;	/* Start a block on the boundary */
+				if (val + n > scl && (ctr += val + n - (scl > val ? scl : val)) >= ncl) return scl + 2;	/* Check if run length is sufficient for required */
+			}
+			if (clst > val && clst < val + n) return 0;	/* All cluster scanned? (start cluster in the span) */
+			if ((val += n) >= fs->n_fatent - 2) val = 0;	/* Next cluster (with wrap-around) */
+			if (bv || val == 0) { scl = val; ctr = 0; }	/* Restart at an in-use span and at the end of the bitmap */
+			if (val == clst) return 0;	/* All cluster scanned? */
+		}
+	}
+#endif
 	for (;;) {
 		if (move_window(fs, fs->database + val / 8 / SS(fs)) != FR_OK) return 0xFFFFFFFF;	/* (assuming bitmap is located top of the cluster heap) */
 		i = val / 8 % SS(fs); bm = 1 << (val % 8);
@@ -1167,10 +1825,15 @@ DWORD find_bitmap (	/* 0:Not found, 2..:Cluster block found, 0xFFFFFFFF:Disk err
 					val = 0; bm = 0; i = SS(fs);
 				}
 				if (!bv) {	/* Is it a free cluster? */
-					if (++ctr == ncl) return scl + 2;	/* Check if run length is sufficient for required */
+					if (au && ctr == 0 && au_ceil(fs, scl + 2) != scl + 2) {
+						scl = val;		/* Not on the boundary, try the next cluster */
+					} else {
+						if (++ctr == ncl) return scl + 2;	/* Check if run length is sufficient for required */
+					}
 				} else {
 					scl = val; ctr = 0;		/* Encountered a cluster in-use, restart to scan */
 				}
+				if (val == 0) { scl = 0; ctr = 0; }	/* A run cannot wrap around the end of the bitmap */
 				if (val == clst) return 0;	/* All cluster scanned? */
 			} while (bm);
 			bm = 1;
@@ -1259,10 +1922,237 @@ FRESULT fill_last_frag (
 	return FR_OK;
 }
 
+
+#if _FS_HEADROOM
+/*---------------------------------------------*/
+/* Find the headroom entry of a file           */
+/*---------------------------------------------*/
+
+static
+int hr_find (	/* Entry index, -1:None */
+	FATFS* fs,	/* File system object */
+	DWORD scl	/* Start cluster of the file (0:none) */
+)
+{
+	int i;
+
+
+	if (scl == 0) return -1;
+	for (i = 0; i < HR_FILES; i++) {
+		if (Headroom[i].fs == fs && Headroom[i].id == fs->id && Headroom[i].sclust == scl) return i;
+	}
+	return -1;
+}
+
+
+/*---------------------------------------------*/
+/* Move a file's headroom past its new edge    */
+/*---------------------------------------------*/
+
+static
+void hr_grow (
+	FATFS* fs,	/* File system object */
+	DWORD scl,	/* Start cluster of the file */
+	DWORD ecl	/* Cluster just added at its growing edge */
+)
+{
+	int i;
+
+
+	i = hr_find(fs, scl);
+	if (i < 0) {
+		i = HR_FILES - 1;			/* A file not grown lately takes the place of the least recent one */
+		if (Headroom[i].fs == fs) fs->hr_none = 0;	/* whose headroom is released */
+	}
+	for ( ; i > 0; i--) Headroom[i] = Headroom[i - 1];	/* Most recently grown first */
+	Headroom[0].fs = fs; Headroom[0].id = fs->id;
+	Headroom[0].sclust = scl; Headroom[0].top = ecl + 1;
+}
+
+
+/*---------------------------------------------*/
+/* Forget a file's headroom                    */
+/*---------------------------------------------*/
+
+static
+void hr_drop (
+	FATFS* fs,	/* File system object */
+	DWORD scl	/* Start cluster of the file */
+)
+{
+	int i;
+
+
+	i = hr_find(fs, scl);
+	if (i >= 0) {
+		Headroom[i].fs = 0;
+		fs->hr_none = 0;	/* Its headroom is released */
+	}
+}
+
+
+/*---------------------------------------------*/
+/* Find a free block clear of others' headroom */
+/*---------------------------------------------*/
+
+static
+DWORD hr_bitmap (	/* 0:Not found, 2..:Cluster block found, 0xFFFFFFFF:Disk error */
+	FATFS* fs,	/* File system object */
+	DWORD clst,	/* Cluster number to scan from */
+	DWORD ncl,	/* Number of contiguous clusters to find (1..) */
+	int au,		/* 1:Block must start on an allocation unit boundary */
+	DWORD own	/* Start cluster of the file looking, whose own headroom is free to take (0:none) */
+)
+{
+	DWORD scl, top, end;
+	UINT i, n;
+
+
+	for (n = 0; n <= 2 * HR_FILES; n++) {	/* Each try either fits or moves past one file's headroom */
+		scl = find_bitmap(fs, clst, ncl, au);
+		if (scl == 0 || scl == 0xFFFFFFFF) return scl;
+		for (i = 0; i < HR_FILES; i++) {
+			if (Headroom[i].fs != fs || Headroom[i].id != fs->id || Headroom[i].sclust == own) continue;
+			top = Headroom[i].top;
+			end = (top + fs->hr_clst < fs->n_fatent) ? top + fs->hr_clst : fs->n_fatent;
+			if (scl < end && scl + ncl > top) break;	/* Overlaps it? */
+		}
+		if (i == HR_FILES) return scl;
+		clst = (end < fs->n_fatent) ? end : 2;	/* Search again past it */
+	}
+	return 0;
+}
+
+
+/*---------------------------------------------*/
+/* Choose the next cluster of a chain          */
+/*---------------------------------------------*/
+
+static
+DWORD hr_alloc (	/* 0:No free cluster, 2..:Cluster, 0xFFFFFFFF:Disk error */
+	_FDID* obj,	/* Object to allocate for */
+	DWORD clst,	/* Cluster to stretch from, 0:New chain */
+	DWORD scl,	/* Cluster to search from */
+	int file	/* 1:The object is a file (directories take no headroom) */
+)
+{
+	FATFS *fs = obj->fs;
+	DWORD ncl;
+
+
+	if (clst != 0 && clst + 1 < fs->n_fatent) {	/* The cluster next to the edge keeps the chain contiguous */
+		if (move_window(fs, fs->database + (clst - 1) / 8 / SS(fs)) != FR_OK) return 0xFFFFFFFF;
+		if (!(fs->win[(clst - 1) / 8 % SS(fs)] & (1 << ((clst - 1) % 8)))) return clst + 1;
+	}
+	ncl = 0;
+	if (file && !fs->hr_none && (clst == 0 || hr_find(fs, obj->sclust) >= 0)) {	/* A file starting or running out of room starts a block with headroom */
+		ncl = hr_bitmap(fs, scl, fs->hr_clst, 1, obj->sclust);
+		if (ncl == 0) fs->hr_none = 1;	/* Do not search again until space is released */
+	}
+	if (ncl == 0) ncl = hr_bitmap(fs, scl, 1, 0, obj->sclust);
+	if (ncl == 0) ncl = find_bitmap(fs, scl, 1, 0);	/* Take others' headroom only when nothing else is left */
+	return ncl;
+}
+#endif	/* _FS_HEADROOM */
+
 #endif	/* _FS_EXFAT && !_FS_READONLY */
 
 
 
+#if _FS_FREEMAP || (!_FS_READONLY && _FS_MINIMIZE == 0)
+/*-----------------------------------------------------------------------*/
+/* FAT handling - Count free clusters and build the free cluster map     */
+/*-----------------------------------------------------------------------*/
+static
+FRESULT scan_free (	/* FR_OK(0):succeeded, !=0:error */
+	FATFS* fs		/* File system object */
+)
+{
+	FRESULT res = FR_OK;
+	DWORD nfree, clst, sect, stat;
+	UINT i;
+	BYTE *p;
+	_FDID obj;
+#if _FS_FREEMAP
+	UINT sh;
+
+
+	sh = fm_group(fs);
+	fs->fm_shift = 0;
+	mem_set(fs->fmap, 0, sizeof fs->fmap);
+#endif
+
+	nfree = 0;
+	if (fs->fs_type == FS_FAT12) {	/* FAT12: Sector unalighed FAT entries */
+		mem_set(&obj, 0, sizeof obj);	/* Not an object of the volume, only its FAT is read */
+		clst = 2; obj.fs = fs;
+		do {
+			stat = get_fat(&obj, clst);
+			if (stat == 0xFFFFFFFF) { res = FR_DISK_ERR; break; }
+			if (stat == 1) { res = FR_INT_ERR; break; }
+			if (stat == 0) { nfree++; FM_TALLY(fs, sh, clst); }
+		} while (++clst < fs->n_fatent);
+	} else {
+#if _FS_EXFAT
+		if (fs->fs_type == FS_EXFAT) {	/* exFAT: Scan bitmap table */
+			BYTE bm;
+			UINT b;
+
+			clst = fs->n_fatent - 2;
+			sect = fs->database;
+			i = 0;
+			do {
+				if (i == 0 && (res = move_window(fs, sect++)) != FR_OK) break;
+				for (b = 8, bm = fs->win[i]; b && clst; b--, clst--) {
+					if (!(bm & 1)) { nfree++; FM_TALLY(fs, sh, fs->n_fatent - clst); }
+					bm >>= 1;
+				}
+				i = (i + 1) % SS(fs);
+			} while (clst);
+		} else
+#endif
+		{	/* FAT16/32: Sector alighed FAT entries */
+			clst = fs->n_fatent; sect = fs->fatbase;
+			i = 0; p = 0;
+			do {
+				if (i == 0) {
+					res = move_window(fs, sect++);
+					if (res != FR_OK) break;
+					p = fs->win;
+					i = SS(fs);
+				}
+				if (fs->fs_type == FS_FAT16) {
+					stat = ld_word(p);
+					p += 2; i -= 2;
+				} else {
+					stat = ld_dword(p) & 0x0FFFFFFF;
+					p += 4; i -= 4;
+				}
+				if (stat == 0) { nfree++; FM_TALLY(fs, sh, fs->n_fatent - clst); }
+			} while (--clst);
+		}
+	}
+	if (res == FR_OK) {
+		if (fs->free_clst != nfree) {
+			fs->free_clst = nfree;	/* Now free_clst is valid */
+			fs->fsi_flag |= 1;		/* FSInfo is to be updated */
+		}
+#if _FS_FREEMAP
+		fs->fm_shift = (BYTE)sh;	/* Now the map is valid */
+		fs->fm_unknown = 0;
+#endif
+#if _FS_FASTMOUNT
+		fs->mc_lo = 0; fs->mc_hi = 0xFFFFFFFF;	/* The whole map is for the mount cache to write */
+#endif
+	}
+	return res;
+}
+
+#endif
+
+
+
+
 #if !_FS_READONLY
 /*-----------------------------------------------------------------------*/
 /* FAT handling - Remove a cluster chain                                 */
@@ -1306,6 +2196,9 @@ FRESULT remove_chain (	/* FR_OK(0):succeeded, !=0:error */
 			fs->free_clst++;
 			fs->fsi_flag |= 1;
 		}
+#if _FS_FREEMAP
+		fm_change(fs, clst, 1, 0);	/* Update free cluster map */
+#endif
 #if _FS_EXFAT || _USE_TRIM
 		if (ecl + 1 == nxt) {	/* Is next cluster contiguous? */
 			ecl = nxt;
@@ -1314,6 +2207,9 @@ FRESULT remove_chain (	/* FR_OK(0):succeeded, !=0:error */
 			if (fs->fs_type == FS_EXFAT) {
 				res = change_bitmap(fs, scl, ecl - scl + 1, 0);	/* Mark the cluster block 'free' on the bitmap */
 				if (res != FR_OK) return res;
+#if _FS_HEADROOM
+				fs->hr_none = 0;	/* A block with headroom may be free again */
+#endif
 			}
 #endif
 #if _USE_TRIM
@@ -1350,12 +2246,16 @@ FRESULT remove_chain (	/* FR_OK(0):succeeded, !=0:error */
 static
 DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:Disk error, >=2:New cluster# */
 	_FDID* obj,			/* Corresponding object */
-	DWORD clst			/* Cluster# to stretch, 0:Create a new chain */
+	DWORD clst,			/* Cluster# to stretch, 0:Create a new chain */
+	int file			/* 1:The object is a file, which may keep headroom */
 )
 {
 	DWORD cs, ncl, scl;
 	FRESULT res;
 	FATFS *fs = obj->fs;
+#if _FS_FREEMAP
+	DWORD ecl;
+#endif
 
 
 	if (clst == 0) {	/* Create a new chain */
@@ -1372,7 +2272,11 @@ DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:Disk err
 
 #if _FS_EXFAT
 	if (fs->fs_type == FS_EXFAT) {	/* On the exFAT volume */
-		ncl = find_bitmap(fs, scl, 1);				/* Find a free cluster */
+#if _FS_HEADROOM
+		ncl = hr_alloc(obj, clst, scl, file);		/* Find a free cluster, keeping clear of others' headroom */
+#else
+		ncl = find_bitmap(fs, scl, 1, 0);			/* Find a free cluster */
+#endif
 		if (ncl == 0 || ncl == 0xFFFFFFFF) return ncl;	/* No free cluster or hard error? */
 		res = change_bitmap(fs, ncl, 1, 1);			/* Mark the cluster 'in use' */
 		if (res == FR_INT_ERR) return 1;
@@ -1394,6 +2298,9 @@ DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:Disk err
 				if (res == FR_OK) obj->n_frag = 1;
 			}
 		}
+#if _FS_HEADROOM
+		if (file) hr_grow(fs, clst ? obj->sclust : ncl, ncl);	/* Its headroom starts past the new edge */
+#endif
 	} else
 #endif
 	{	/* On the FAT12/16/32 volume */
@@ -1404,6 +2311,15 @@ DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:Disk err
 				ncl = 2;
 				if (ncl > scl) return 0;	/* No free cluster */
 			}
+#if _FS_FREEMAP
+			cs = fm_span(fs, ncl, &ecl);	/* Check the group on the free cluster map */
+			if (cs == 2) {					/* No free cluster in rest of the group */
+				if (scl >= ncl && scl < ecl) return 0;	/* No free cluster */
+				ncl = ecl - 1;
+				continue;
+			}
+			if (cs == 1)
+#endif
 			cs = get_fat(obj, ncl);			/* Get the cluster status */
 			if (cs == 0) break;				/* Found a free cluster */
 			if (cs == 1 || cs == 0xFFFFFFFF) return cs;	/* An error occurred */
@@ -1419,6 +2335,9 @@ DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:Disk err
 		fs->last_clst = ncl;
 		if (fs->free_clst <= fs->n_fatent - 2) fs->free_clst--;
 		fs->fsi_flag |= 1;
+#if _FS_FREEMAP
+		fm_change(fs, ncl, 1, 1);	/* Update free cluster map */
+#endif
 	} else {
 		ncl = (res == FR_DISK_ERR) ? 0xFFFFFFFF : 1;	/* Failed. Generate error status */
 	}
@@ -1548,7 +2467,7 @@ FRESULT dir_next (	/* FR_OK(0):succeeded, FR_NO_FILE:End of table, FR_DENIED:Cou
 					if (!stretch) {								/* If no stretch, report EOT */
 						dp->sect = 0; return FR_NO_FILE;
 					}
-					clst = create_chain(&dp->obj, dp->clust);	/* Allocate a cluster */
+					clst = create_chain(&dp->obj, dp->clust, 0);	/* Allocate a cluster */
 					if (clst == 0) return FR_DENIED;			/* No free cluster */
 					if (clst == 1) return FR_INT_ERR;			/* Internal error */
 					if (clst == 0xFFFFFFFF) return FR_DISK_ERR;	/* Disk error */
@@ -1594,9 +2513,17 @@ FRESULT dir_alloc (	/* FR_OK(0):succeeded, !=0:error */
 	FRESULT res;
 	UINT n;
 	FATFS *fs = dp->obj.fs;
+#if _FS_DIRINDEX
+	DWORD fst = 0xFFFFFFFF;
+	int mine = DirIndex.fs == fs && DirIndex.id == fs->id && DirIndex.sclust == dp->obj.sclust;
+
+
+	res = dir_sdi(dp, mine ? DirIndex.hint : 0);	/* Skip the entries known to be in use */
+#else
 
 
 	res = dir_sdi(dp, 0);
+#endif
 	if (res == FR_OK) {
 		n = 0;
 		do {
@@ -1606,6 +2533,9 @@ FRESULT dir_alloc (	/* FR_OK(0):succeeded, !=0:error */
 			if ((fs->fs_type == FS_EXFAT) ? (int)((dp->dir[XDIR_Type] & 0x80) == 0) : (int)(dp->dir[DIR_Name] == DDEM || dp->dir[DIR_Name] == 0)) {
 #else
 			if (dp->dir[DIR_Name] == DDEM || dp->dir[DIR_Name] == 0) {
+#endif
+#if _FS_DIRINDEX
+				if (fst == 0xFFFFFFFF) fst = dp->dptr;	/* First blank entry met */
 #endif
 				if (++n == nent) break;	/* A block of contiguous free entries is found */
 			} else {
@@ -1614,6 +2544,11 @@ FRESULT dir_alloc (	/* FR_OK(0):succeeded, !=0:error */
 			res = dir_next(dp, 1);
 		} while (res == FR_OK);	/* Next entry with table stretch enabled */
 	}
+#if _FS_DIRINDEX
+	if (res == FR_OK && mine) {	/* Entries up to the block are in use unless a shorter blank was passed */
+		DirIndex.hint = (fst == dp->dptr - (nent - 1) * SZDIRE) ? dp->dptr : fst;
+	}
+#endif
 
 	if (res == FR_NO_FILE) res = FR_DENIED;	/* No directory entry to allocate */
 	return res;
@@ -2037,6 +2972,7 @@ FRESULT load_obj_dir (
 	dp->obj.sclust = obj->c_scl;
 	dp->obj.stat = (BYTE)obj->c_size;
 	dp->obj.objsize = obj->c_size & 0xFFFFFF00;
+	dp->obj.n_frag = 0;	/* No fragment pending on the FAT */
 	dp->blk_ofs = obj->c_ofs;
 
 	res = dir_sdi(dp, dp->blk_ofs);	/* Goto object's entry block */
@@ -2135,70 +3071,474 @@ FRESULT dir_read (
 {
 	FRESULT res = FR_NO_FILE;
 	FATFS *fs = dp->obj.fs;
-	BYTE a, c;
+	BYTE a, c;
+#if _USE_LFN != 0
+	BYTE ord = 0xFF, sum = 0xFF;
+#endif
+
+	while (dp->sect) {
+		res = move_window(fs, dp->sect);
+		if (res != FR_OK) break;
+		c = dp->dir[DIR_Name];	/* Test for the entry type */
+		if (c == 0) {
+			res = FR_NO_FILE; break; /* Reached to end of the directory */
+		}
+#if _FS_EXFAT
+		if (fs->fs_type == FS_EXFAT) {	/* On the exFAT volume */
+			if (_USE_LABEL && vol) {
+				if (c == 0x83) break;	/* Volume label entry? */
+			} else {
+				if (c == 0x85) {		/* Start of the file entry block? */
+					dp->blk_ofs = dp->dptr;	/* Get location of the block */
+					res = load_xdir(dp);	/* Load the entry block */
+					if (res == FR_OK) {
+						dp->obj.attr = fs->dirbuf[XDIR_Attr] & AM_MASK;	/* Get attribute */
+					}
+					break;
+				}
+			}
+		} else
+#endif
+		{	/* On the FAT12/16/32 volume */
+			dp->obj.attr = a = dp->dir[DIR_Attr] & AM_MASK;	/* Get attribute */
+#if _USE_LFN != 0	/* LFN configuration */
+			if (c == DDEM || c == '.' || (int)((a & ~AM_ARC) == AM_VOL) != vol) {	/* An entry without valid data */
+				ord = 0xFF;
+			} else {
+				if (a == AM_LFN) {			/* An LFN entry is found */
+					if (c & LLEF) {			/* Is it start of an LFN sequence? */
+						sum = dp->dir[LDIR_Chksum];
+						c &= (BYTE)~LLEF; ord = c;
+						dp->blk_ofs = dp->dptr;
+					}
+					/* Check LFN validity and capture it */
+					ord = (c == ord && sum == dp->dir[LDIR_Chksum] && pick_lfn(fs->lfnbuf, dp->dir)) ? ord - 1 : 0xFF;
+				} else {					/* An SFN entry is found */
+					if (ord || sum != sum_sfn(dp->dir)) {	/* Is there a valid LFN? */
+						dp->blk_ofs = 0xFFFFFFFF;			/* It has no LFN. */
+					}
+					break;
+				}
+			}
+#else		/* Non LFN configuration */
+			if (c != DDEM && c != '.' && a != AM_LFN && (int)((a & ~AM_ARC) == AM_VOL) == vol) {	/* Is it a valid entry? */
+				break;
+			}
+#endif
+		}
+		res = dir_next(dp, 0);		/* Next entry */
+		if (res != FR_OK) break;
+	}
+
+	if (res != FR_OK) dp->sect = 0;		/* Terminate the read operation on error or EOT */
+	return res;
+}
+
+#endif	/* _FS_MINIMIZE <= 1 || _USE_LABEL || _FS_RPATH >= 2 */
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Directory handling - Match the name against the entries from here on   */
+/*-----------------------------------------------------------------------*/
+
+static
+FRESULT dir_match (	/* FR_OK(0):found, FR_NO_FILE:not found, !=0:error */
+	DIR* dp,		/* Pointer to the directory object with the file name, at the entry to start from */
+	int one			/* 0:Search to the end of the table, 1:Only the first object met */
+)
+{
+	FRESULT res;
+	FATFS *fs = dp->obj.fs;
+	BYTE c;
+#if _USE_LFN != 0
+	BYTE a, ord, sum;
+#endif
+
+#if _FS_EXFAT
+	if (fs->fs_type == FS_EXFAT) {	/* On the exFAT volume */
+		BYTE nc;
+		UINT di, ni;
+		WORD hash = xname_sum(fs->lfnbuf);		/* Hash value of the name to find */
+
+		while ((res = dir_read(dp, 0)) == FR_OK) {	/* Read an item */
+			nc = 0xFF;
+#if _MAX_LFN < 255
+			if (fs->dirbuf[XDIR_NumName] <= _MAX_LFN)		/* Skip comparison if inaccessible object name */
+#endif
+			if (ld_word(fs->dirbuf + XDIR_NameHash) == hash) {	/* Skip comparison if hash mismatched */
+				for (nc = fs->dirbuf[XDIR_NumName], di = SZDIRE * 2, ni = 0; nc; nc--, di += 2, ni++) {	/* Compare the name */
+					if ((di % SZDIRE) == 0) di += 2;
+					if (ff_wtoupper(ld_word(fs->dirbuf + di)) != ff_wtoupper(fs->lfnbuf[ni])) break;
+				}
+				if (nc == 0 && !fs->lfnbuf[ni]) break;	/* Name matched? */
+			}
+			if (one) { res = FR_NO_FILE; break; }	/* Only the first object? */
+		}
+		return res;
+	}
+#endif
+	/* On the FAT12/16/32 volume */
+#if _USE_LFN != 0
+	ord = sum = 0xFF; dp->blk_ofs = 0xFFFFFFFF;	/* Reset LFN sequence */
+#endif
+	do {
+		res = move_window(fs, dp->sect);
+		if (res != FR_OK) break;
+		c = dp->dir[DIR_Name];
+		if (c == 0) { res = FR_NO_FILE; break; }	/* Reached to end of table */
+#if _USE_LFN != 0	/* LFN configuration */
+		dp->obj.attr = a = dp->dir[DIR_Attr] & AM_MASK;
+		if (c == DDEM || ((a & AM_VOL) && a != AM_LFN)) {	/* An entry without valid data */
+			ord = 0xFF; dp->blk_ofs = 0xFFFFFFFF;	/* Reset LFN sequence */
+		} else {
+			if (a == AM_LFN) {			/* An LFN entry is found */
+				if (!(dp->fn[NSFLAG] & NS_NOLFN)) {
+					if (c & LLEF) {		/* Is it start of LFN sequence? */
+						sum = dp->dir[LDIR_Chksum];
+						c &= (BYTE)~LLEF; ord = c;	/* LFN start order */
+						dp->blk_ofs = dp->dptr;	/* Start offset of LFN */
+					}
+					/* Check validity of the LFN entry and compare it with given name */
+					ord = (c == ord && sum == dp->dir[LDIR_Chksum] && cmp_lfn(fs->lfnbuf, dp->dir)) ? ord - 1 : 0xFF;
+				}
+			} else {					/* An SFN entry is found */
+				if (!ord && sum == sum_sfn(dp->dir)) break;	/* LFN matched? */
+				if (!(dp->fn[NSFLAG] & NS_LOSS) && !mem_cmp(dp->dir, dp->fn, 11)) break;	/* SFN matched? */
+				ord = 0xFF; dp->blk_ofs = 0xFFFFFFFF;	/* Reset LFN sequence */
+				if (one) { res = FR_NO_FILE; break; }	/* Only the first object? */
+			}
+		}
+#else		/* Non LFN configuration */
+		dp->obj.attr = dp->dir[DIR_Attr] & AM_MASK;
+		if (!(dp->dir[DIR_Attr] & AM_VOL) && !mem_cmp(dp->dir, dp->fn, 11)) break;	/* Is it a valid entry? */
+		if (one) { res = FR_NO_FILE; break; }	/* Only the first object? */
+#endif
+		res = dir_next(dp, 0);	/* Next entry */
+	} while (res == FR_OK);
+
+	return res;
+}
+
+
+
+
+#if _FS_DIRINDEX
+/*-----------------------------------------------------------------------*/
+/* Directory handling - Hashed name index                                */
+/*-----------------------------------------------------------------------*/
+/* The index holds the hash of each name in one directory with the offset
+/  of its entry block, for dir_find to go straight to the few blocks a name
+/  can be in. A block is found by its SFN and, if it has one, by its LFN, or
+/  on exFAT by its name. The name hash exFAT keeps in the stream extension
+/  entry is not used, as it gives few values for names such as seg0001.bin
+/  to seg9999.bin, differing only in a few digits. It is built from the
+/  directory the first time it is searched after a long search through it,
+/  and kept up to date by dir_register and dir_remove. Every block it points
+/  at is read and compared before it is taken, so a stale slot costs a read
+/  but never a wrong match. Along with it goes the offset of the first entry
+/  in the directory that can be blank, for dir_alloc to search from rather
+/  than from the top. dir_alloc moves it past the block it allocates and
+/  dir_remove moves it back to a block it frees. A directory with more
+/  names than the index holds is remembered along with how many more, and
+/  not indexed again until enough of them are removed for it to fit. */
+
+static
+int di_mine (		/* 1:The index is of this directory, 0:Not */
+	DIR* dp			/* Directory object */
+)
+{
+	return DirIndex.fs == dp->obj.fs && DirIndex.id == dp->obj.fs->id && DirIndex.sclust == dp->obj.sclust;
+}
+
+
+static
+int di_large (		/* Entry index in DirLarge[], -1:Not known to be too large */
+	DIR* dp			/* Directory object */
+)
+{
+	int i;
+
+
+	for (i = 0; i < DI_LARGE; i++) {
+		if (DirLarge[i].fs == dp->obj.fs && DirLarge[i].id == dp->obj.fs->id && DirLarge[i].sclust == dp->obj.sclust) return i;
+	}
+	return -1;
+}
+
+
+static
+void di_over (
+	DIR* dp,		/* Directory object */
+	int n			/* Names added to the directory (<0:removed) */
+)
+{
+	int i;
+
+
+	i = di_large(dp);
+	if (i < 0) return;
+	if (n < 0 && DirLarge[i].over <= (DWORD)-n) {
+		DirLarge[i].fs = 0;		/* It fits now */
+		if (di_mine(dp)) DirIndex.stat = 0;	/* Build the index at the next search, or after the next long search */
+	} else {
+		DirLarge[i].over += n;
+	}
+}
+
+
+static
+WORD di_sum (		/* Add a character to a name hash */
+	WORD sum,		/* Hash of the characters before */
+	UINT i,			/* Position of the character in the name */
+	WCHAR chr		/* Character, in upper case */
+)
+{
+	DWORD x = ((DWORD)chr << 8 | i) * 0x9E3779B1;	/* Scramble the character with its position */
+
+
+	x ^= x >> 15; x *= 0x85EBCA6B; x ^= x >> 13;
+	return sum + (WORD)(x >> 16);	/* Independent of the order the characters are added in */
+}
+
+
+static
+WORD di_sfn (		/* Hash of an SFN */
+	const BYTE* sfn	/* Pointer to the SFN as in the entry */
+)
+{
+	UINT i;
+	WORD sum = 0;
+
+
+	for (i = 0; i < 11; i++) sum = di_sum(sum, i, sfn[i]);
+	return sum;
+}
+
+
+#if _USE_LFN != 0
+static
+WORD di_lfn (		/* Hash of an LFN, with the characters an LFN entry adds */
+	WORD sum,		/* Hash of the characters of the LFN entries before (0:none, or a WCHAR* LFN is given) */
+	const BYTE* dir,	/* Pointer to an LFN entry, or NULL */
+	const WCHAR* lfn	/* Pointer to the LFN if dir is NULL */
+)
+{
+	UINT i, s;
+	WCHAR wc;
+
+
+	if (!dir) {		/* The whole name */
+		for (i = 0; lfn[i]; i++) sum = di_sum(sum, i, ff_wtoupper(lfn[i]));
+		return sum;
+	}
+	i = ((dir[LDIR_Ord] & ~LLEF) - 1) * 13;	/* Position of the first character of the entry */
+	for (s = 0; s < 13; s++) {
+		wc = ld_word(dir + LfnOfs[s]);
+		if (wc == 0) break;		/* End of the name */
+		sum = di_sum(sum, i + s, ff_wtoupper(wc));
+	}
+	return sum;
+}
+#endif
+
+
+#if _FS_EXFAT
+static
+WORD di_xname (		/* Hash of an exFAT name, with the characters a name entry adds */
+	WORD sum,		/* Hash of the characters of the name entries before */
+	const BYTE* dir,	/* Pointer to a file name entry */
+	UINT* ni,		/* Characters of the name before, updated */
+	UINT nc			/* Characters in the name */
+)
+{
+	UINT s;
+
+
+	for (s = 0; s < 15 && *ni < nc; s++, (*ni)++) {
+		sum = di_sum(sum, *ni, ff_wtoupper(ld_word(dir + 2 + s * 2)));
+	}
+	return sum;
+}
+#endif
+
+
+static
+UINT di_slot (		/* Slot a hash is probed from */
+	WORD key
+)
+{
+	return (UINT)(((DWORD)key * 0x9E3779B1) >> 16) & (DI_SLOTS - 1);
+}
+
+
+static
+int di_put (		/* 1:Added, 0:The index is full */
+	WORD key,		/* Hash of the name */
+	DWORD ofs		/* Offset of the top of the entry block */
+)
+{
+	UINT i;
+	DWORD ent = ofs / SZDIRE + 1;
+
+
+	if (ent >= DI_GONE || DirIndex.used >= _FS_DIRINDEX) return 0;
+	for (i = di_slot(key); DirIndex.slot[i].ent != DI_FREE && DirIndex.slot[i].ent != DI_GONE; i = (i + 1) & (DI_SLOTS - 1)) ;
+	if (DirIndex.slot[i].ent == DI_FREE) DirIndex.used++;
+	DirIndex.slot[i].key = key;
+	DirIndex.slot[i].ent = (WORD)ent;
+	return 1;
+}
+
+
+static
+void di_drop (
+	WORD key,		/* Hash of the name */
+	DWORD ofs		/* Offset of the top of the entry block */
+)
+{
+	UINT i;
+
+
+	for (i = di_slot(key); DirIndex.slot[i].ent != DI_FREE; i = (i + 1) & (DI_SLOTS - 1)) {
+		if (DirIndex.slot[i].key == key && DirIndex.slot[i].ent == ofs / SZDIRE + 1) {
+			DirIndex.slot[i].ent = DI_GONE;
+			break;
+		}
+	}
+}
+
+
+static
+FRESULT di_build (	/* FR_OK(0):succeeded, !=0:error */
+	DIR* dp			/* Directory object of the directory to index */
+)
+{
+	FRESULT res;
+	FATFS *fs = dp->obj.fs;
+	DWORD top = 0, over = 0;
+	BYTE c, a;
+	int i;
 #if _USE_LFN != 0
 	BYTE ord = 0xFF, sum = 0xFF;
+	WORD key = 0;
+#endif
+#if _FS_EXFAT
+	UINT ni = 0, nc = 0;
 #endif
 
-	while (dp->sect) {
+
+	mem_set(DirIndex.slot, 0, sizeof DirIndex.slot);
+	DirIndex.used = 0;
+	res = dir_sdi(dp, 0);
+	while (res == FR_OK) {				/* Read it to the end, counting the names that do not fit */
 		res = move_window(fs, dp->sect);
 		if (res != FR_OK) break;
-		c = dp->dir[DIR_Name];	/* Test for the entry type */
-		if (c == 0) {
-			res = FR_NO_FILE; break; /* Reached to end of the directory */
-		}
+		c = dp->dir[DIR_Name];
+		if (c == 0) break;				/* End of table */
 #if _FS_EXFAT
 		if (fs->fs_type == FS_EXFAT) {	/* On the exFAT volume */
-			if (_USE_LABEL && vol) {
-				if (c == 0x83) break;	/* Volume label entry? */
-			} else {
-				if (c == 0x85) {		/* Start of the file entry block? */
-					dp->blk_ofs = dp->dptr;	/* Get location of the block */
-					res = load_xdir(dp);	/* Load the entry block */
-					if (res == FR_OK) {
-						dp->obj.attr = fs->dirbuf[XDIR_Attr] & AM_MASK;	/* Get attribute */
-					}
-					break;
+			if (c == 0x85) {			/* File entry, the stream extension and file name entries follow */
+				top = dp->dptr; ord = 1;
+			} else if (c == 0xC0 && ord == 1) {
+				nc = dp->dir[XDIR_NumName - SZDIRE]; ni = 0; key = 0; ord = 2;
+			} else if (c == 0xC1 && ord == 2) {
+				key = di_xname(key, dp->dir, &ni, nc);
+				if (ni == nc) {			/* Got the whole name */
+					if (!di_put(key, top)) over++;
+					ord = 0xFF;
 				}
+			} else {
+				ord = 0xFF;
 			}
 		} else
 #endif
-		{	/* On the FAT12/16/32 volume */
-			dp->obj.attr = a = dp->dir[DIR_Attr] & AM_MASK;	/* Get attribute */
-#if _USE_LFN != 0	/* LFN configuration */
-			if (c == DDEM || c == '.' || (int)((a & ~AM_ARC) == AM_VOL) != vol) {	/* An entry without valid data */
+		{								/* On the FAT12/16/32 volume, as dir_find takes the entries */
+			a = dp->dir[DIR_Attr] & AM_MASK;
+			if (c == DDEM || ((a & AM_VOL) && a != AM_LFN)) {
+#if _USE_LFN != 0
 				ord = 0xFF;
-			} else {
-				if (a == AM_LFN) {			/* An LFN entry is found */
-					if (c & LLEF) {			/* Is it start of an LFN sequence? */
-						sum = dp->dir[LDIR_Chksum];
-						c &= (BYTE)~LLEF; ord = c;
-						dp->blk_ofs = dp->dptr;
-					}
-					/* Check LFN validity and capture it */
-					ord = (c == ord && sum == dp->dir[LDIR_Chksum] && pick_lfn(fs->lfnbuf, dp->dir)) ? ord - 1 : 0xFF;
-				} else {					/* An SFN entry is found */
-					if (ord || sum != sum_sfn(dp->dir)) {	/* Is there a valid LFN? */
-						dp->blk_ofs = 0xFFFFFFFF;			/* It has no LFN. */
-					}
-					break;
+			} else if (a == AM_LFN) {
+				if (c & LLEF) {
+					sum = dp->dir[LDIR_Chksum];
+					c &= (BYTE)~LLEF; ord = c;
+					top = dp->dptr; key = 0;
 				}
-			}
-#else		/* Non LFN configuration */
-			if (c != DDEM && c != '.' && a != AM_LFN && (int)((a & ~AM_ARC) == AM_VOL) == vol) {	/* Is it a valid entry? */
-				break;
-			}
+				if (c == ord && sum == dp->dir[LDIR_Chksum]) {
+					key = di_lfn(key, dp->dir, 0); ord--;
+				} else {
+					ord = 0xFF;
+				}
+#endif
+			} else {					/* SFN entry */
+#if _USE_LFN != 0
+				if (!ord && sum == sum_sfn(dp->dir)) {	/* With an LFN */
+					if (!di_put(key, top)) over++;
+				} else {
+					top = dp->dptr;
+				}
+				ord = 0xFF;
+#else
+				top = dp->dptr;
 #endif
+				if (!di_put(di_sfn(dp->dir), top)) over++;
+			}
 		}
-		res = dir_next(dp, 0);		/* Next entry */
-		if (res != FR_OK) break;
+		res = dir_next(dp, 0);
+	}
+	if (res == FR_NO_FILE) res = FR_OK;	/* Reached the end of a dynamic table */
+	if (res != FR_OK) return res;
+	DirIndex.stat = over ? 2 : 1;
+	i = di_large(dp);
+	if (over) {							/* Remember it as too large, and by how much */
+		if (i < 0) i = DI_LARGE - 1;
+		for ( ; i > 0; i--) DirLarge[i] = DirLarge[i - 1];
+		DirLarge[0].fs = fs; DirLarge[0].id = fs->id;
+		DirLarge[0].sclust = dp->obj.sclust; DirLarge[0].over = over;
+	} else if (i >= 0) {
+		DirLarge[i].fs = 0;
 	}
+	return FR_OK;
+}
 
-	if (res != FR_OK) dp->sect = 0;		/* Terminate the read operation on error or EOT */
-	return res;
+
+static
+FRESULT di_find (	/* FR_OK(0):found, FR_NO_FILE:not found, !=0:error */
+	DIR* dp			/* Directory object with the file name */
+)
+{
+	FRESULT res;
+	FATFS *fs = dp->obj.fs;
+	WORD key[2];
+	UINT i, k, nk = 0;
+
+
+#if _FS_EXFAT
+	if (fs->fs_type == FS_EXFAT) {
+		key[nk++] = di_lfn(0, 0, fs->lfnbuf);
+	} else
+#endif
+	{
+#if _USE_LFN != 0
+		if (!(dp->fn[NSFLAG] & NS_NOLFN)) key[nk++] = di_lfn(0, 0, fs->lfnbuf);
+		if (!(dp->fn[NSFLAG] & NS_LOSS)) key[nk++] = di_sfn(dp->fn);
+#else
+		key[nk++] = di_sfn(dp->fn);
+#endif
+	}
+	for (k = 0; k < nk; k++) {
+		for (i = di_slot(key[k]); DirIndex.slot[i].ent != DI_FREE; i = (i + 1) & (DI_SLOTS - 1)) {
+			if (DirIndex.slot[i].ent != DI_GONE && DirIndex.slot[i].key == key[k]) {	/* Read the block and compare */
+				res = dir_sdi(dp, (DWORD)(DirIndex.slot[i].ent - 1) * SZDIRE);
+				if (res == FR_OK) res = dir_match(dp, 1);
+				if (res != FR_NO_FILE) return res;
+			}
+		}
+	}
+	return FR_NO_FILE;
 }
+#endif	/* _FS_DIRINDEX */
 
-#endif	/* _FS_MINIMIZE <= 1 || _USE_LABEL || _FS_RPATH >= 2 */
 
 
 
@@ -2212,71 +3552,29 @@ FRESULT dir_find (	/* FR_OK(0):succeeded, !=0:error */
 )
 {
 	FRESULT res;
-	FATFS *fs = dp->obj.fs;
-	BYTE c;
-#if _USE_LFN != 0
-	BYTE a, ord, sum;
-#endif
 
-	res = dir_sdi(dp, 0);			/* Rewind directory object */
-	if (res != FR_OK) return res;
-#if _FS_EXFAT
-	if (fs->fs_type == FS_EXFAT) {	/* On the exFAT volume */
-		BYTE nc;
-		UINT di, ni;
-		WORD hash = xname_sum(fs->lfnbuf);		/* Hash value of the name to find */
 
-		while ((res = dir_read(dp, 0)) == FR_OK) {	/* Read an item */
-#if _MAX_LFN < 255
-			if (fs->dirbuf[XDIR_NumName] > _MAX_LFN) continue;			/* Skip comparison if inaccessible object name */
-#endif
-			if (ld_word(fs->dirbuf + XDIR_NameHash) != hash) continue;	/* Skip comparison if hash mismatched */
-			for (nc = fs->dirbuf[XDIR_NumName], di = SZDIRE * 2, ni = 0; nc; nc--, di += 2, ni++) {	/* Compare the name */
-				if ((di % SZDIRE) == 0) di += 2;
-				if (ff_wtoupper(ld_word(fs->dirbuf + di)) != ff_wtoupper(fs->lfnbuf[ni])) break;
-			}
-			if (nc == 0 && !fs->lfnbuf[ni]) break;	/* Name matched? */
+#if _FS_DIRINDEX
+	if (di_mine(dp)) {
+		if (DirIndex.stat == 0) {	/* Build the index, wanted since the last search */
+			res = di_build(dp);
+			if (res != FR_OK) return res;
 		}
-		return res;
+		if (DirIndex.stat == 1) return di_find(dp);
 	}
 #endif
-	/* On the FAT12/16/32 volume */
-#if _USE_LFN != 0
-	ord = sum = 0xFF; dp->blk_ofs = 0xFFFFFFFF;	/* Reset LFN sequence */
-#endif
-	do {
-		res = move_window(fs, dp->sect);
-		if (res != FR_OK) break;
-		c = dp->dir[DIR_Name];
-		if (c == 0) { res = FR_NO_FILE; break; }	/* Reached to end of table */
-#if _USE_LFN != 0	/* LFN configuration */
-		dp->obj.attr = a = dp->dir[DIR_Attr] & AM_MASK;
-		if (c == DDEM || ((a & AM_VOL) && a != AM_LFN)) {	/* An entry without valid data */
-			ord = 0xFF; dp->blk_ofs = 0xFFFFFFFF;	/* Reset LFN sequence */
-		} else {
-			if (a == AM_LFN) {			/* An LFN entry is found */
-				if (!(dp->fn[NSFLAG] & NS_NOLFN)) {
-					if (c & LLEF) {		/* Is it start of LFN sequence? */
-						sum = dp->dir[LDIR_Chksum];
-						c &= (BYTE)~LLEF; ord = c;	/* LFN start order */
-						dp->blk_ofs = dp->dptr;	/* Start offset of LFN */
-					}
-					/* Check validity of the LFN entry and compare it with given name */
-					ord = (c == ord && sum == dp->dir[LDIR_Chksum] && cmp_lfn(fs->lfnbuf, dp->dir)) ? ord - 1 : 0xFF;
-				}
-			} else {					/* An SFN entry is found */
-				if (!ord && sum == sum_sfn(dp->dir)) break;	/* LFN matched? */
-				if (!(dp->fn[NSFLAG] & NS_LOSS) && !mem_cmp(dp->dir, dp->fn, 11)) break;	/* SFN matched? */
-				ord = 0xFF; dp->blk_ofs = 0xFFFFFFFF;	/* Reset LFN sequence */
-			}
-		}
-#else		/* Non LFN configuration */
-		dp->obj.attr = dp->dir[DIR_Attr] & AM_MASK;
-		if (!(dp->dir[DIR_Attr] & AM_VOL) && !mem_cmp(dp->dir, dp->fn, 11)) break;	/* Is it a valid entry? */
+	res = dir_sdi(dp, 0);			/* Rewind directory object */
+	if (res != FR_OK) return res;
+	res = dir_match(dp, 0);			/* Search the whole table */
+#if _FS_DIRINDEX
+	if ((res == FR_OK || res == FR_NO_FILE) && dp->dptr >= DI_MIN * SZDIRE && !di_mine(dp) && di_large(dp) < 0) {	/* A long search in a directory that may fit? */
+		DirIndex.fs = dp->obj.fs;	/* Index the directory at the next search */
+		DirIndex.id = dp->obj.fs->id;
+		DirIndex.sclust = dp->obj.sclust;
+		DirIndex.hint = 0;
+		DirIndex.stat = 0;
+	}
 #endif
-		res = dir_next(dp, 0);	/* Next entry */
-	} while (res == FR_OK);
-
 	return res;
 }
 
@@ -2295,6 +3593,9 @@ FRESULT dir_register (	/* FR_OK:succeeded, FR_DENIED:no free entry or too many S
 {
 	FRESULT res;
 	FATFS *fs = dp->obj.fs;
+#if _FS_DIRINDEX
+	DWORD top = 0;
+#endif
 #if _USE_LFN != 0	/* LFN configuration */
 	UINT n, nlen, nent;
 	BYTE sn[12], sum;
@@ -2312,22 +3613,32 @@ FRESULT dir_register (	/* FR_OK:succeeded, FR_DENIED:no free entry or too many S
 		if (res != FR_OK) return res;
 		dp->blk_ofs = dp->dptr - SZDIRE * (nent - 1);	/* Set the allocated entry block offset */
 
-		if (dp->obj.sclust != 0 && (dp->obj.stat & 4)) {	/* Has the sub-directory been stretched? */
-			dp->obj.objsize += (DWORD)fs->csize * SS(fs);	/* Increase the directory size by cluster size */
+		if (dp->obj.stat & 4) {								/* Has the directory been stretched? */
+			dp->obj.stat &= ~4;								/* Back to the allocation status alone */
 			res = fill_first_frag(&dp->obj);				/* Fill first fragment on the FAT if needed */
 			if (res != FR_OK) return res;
-			res = fill_last_frag(&dp->obj, dp->clust, 0xFFFFFFFF);	/* Fill last fragment on the FAT if needed */
-			if (res != FR_OK) return res;
-			res = load_obj_dir(&dj, &dp->obj);				/* Load the object status */
-			if (res != FR_OK) return res;
-			st_qword(fs->dirbuf + XDIR_FileSize, dp->obj.objsize);		/* Update the allocation status */
-			st_qword(fs->dirbuf + XDIR_ValidFileSize, dp->obj.objsize);
-			fs->dirbuf[XDIR_GenFlags] = dp->obj.stat | 1;
-			res = store_xdir(&dj);							/* Store the object status */
+			res = fill_last_frag(&dp->obj, dp->clust, 0xFFFFFFFF);	/* Fill last fragment on the FAT if needed, the root's too */
 			if (res != FR_OK) return res;
+			if (dp->obj.sclust != 0) {						/* Is it a sub-directory? (the root has no entry) */
+				dp->obj.objsize += (DWORD)fs->csize * SS(fs);	/* Increase the directory size by cluster size */
+				res = load_obj_dir(&dj, &dp->obj);			/* Load the object status */
+				if (res != FR_OK) return res;
+				st_qword(fs->dirbuf + XDIR_FileSize, dp->obj.objsize);		/* Update the allocation status */
+				st_qword(fs->dirbuf + XDIR_ValidFileSize, dp->obj.objsize);
+				fs->dirbuf[XDIR_GenFlags] = dp->obj.stat | 1;
+				res = store_xdir(&dj);						/* Store the object status */
+				if (res != FR_OK) return res;
+			}
 		}
 
 		create_xdir(fs->dirbuf, fs->lfnbuf);	/* Create on-memory directory block to be written later */
+#if _FS_DIRINDEX
+		if (di_mine(dp) && DirIndex.stat == 1) {
+			if (!di_put(di_lfn(0, 0, fs->lfnbuf), dp->blk_ofs)) DirIndex.stat = 0;	/* Rebuild the index at the next search */
+		} else {
+			di_over(dp, 1);
+		}
+#endif
 		return FR_OK;
 	}
 #endif
@@ -2348,6 +3659,9 @@ FRESULT dir_register (	/* FR_OK:succeeded, FR_DENIED:no free entry or too many S
 	/* Create an SFN with/without LFNs. */
 	nent = (sn[NSFLAG] & NS_LFN) ? (nlen + 12) / 13 + 1 : 1;	/* Number of entries to allocate */
 	res = dir_alloc(dp, nent);		/* Allocate entries */
+#if _FS_DIRINDEX
+	top = dp->dptr - (nent - 1) * SZDIRE;	/* Top of the entry block */
+#endif
 	if (res == FR_OK && --nent) {	/* Set LFN entry if needed */
 		res = dir_sdi(dp, dp->dptr - nent * SZDIRE);
 		if (res == FR_OK) {
@@ -2364,6 +3678,9 @@ FRESULT dir_register (	/* FR_OK:succeeded, FR_DENIED:no free entry or too many S
 
 #else	/* Non LFN configuration */
 	res = dir_alloc(dp, 1);		/* Allocate an entry for SFN */
+#if _FS_DIRINDEX
+	top = dp->dptr;
+#endif
 
 #endif
 
@@ -2379,6 +3696,20 @@ FRESULT dir_register (	/* FR_OK:succeeded, FR_DENIED:no free entry or too many S
 			fs->wflag = 1;
 		}
 	}
+#if _FS_DIRINDEX
+	if (res == FR_OK && di_mine(dp) && DirIndex.stat == 1) {	/* Add the object to the index */
+		if (!di_put(di_sfn(dp->fn), top)) DirIndex.stat = 0;
+#if _USE_LFN != 0
+		if ((sn[NSFLAG] & NS_LFN) && !di_put(di_lfn(0, 0, fs->lfnbuf), top)) DirIndex.stat = 0;
+#endif
+	} else if (res == FR_OK) {
+#if _USE_LFN != 0
+		di_over(dp, (sn[NSFLAG] & NS_LFN) ? 2 : 1);
+#else
+		di_over(dp, 1);
+#endif
+	}
+#endif
 
 	return res;
 }
@@ -2401,12 +3732,35 @@ FRESULT dir_remove (	/* FR_OK:Succeeded, FR_DISK_ERR:A disk error */
 	FATFS *fs = dp->obj.fs;
 #if _USE_LFN != 0	/* LFN configuration */
 	DWORD last = dp->dptr;
+#if _FS_DIRINDEX
+	DWORD top = (dp->blk_ofs == 0xFFFFFFFF) ? last : dp->blk_ofs;
+	WORD key = 0, skey = 0;
+#if _FS_EXFAT
+	UINT ni = 0, nc = 0;
+#endif
+#endif
 
 	res = (dp->blk_ofs == 0xFFFFFFFF) ? FR_OK : dir_sdi(dp, dp->blk_ofs);	/* Goto top of the entry block if LFN is exist */
 	if (res == FR_OK) {
 		do {
 			res = move_window(fs, dp->sect);
 			if (res != FR_OK) break;
+#if _FS_DIRINDEX
+			/* Get the hashes the block is indexed by */
+#if _FS_EXFAT
+			if (fs->fs_type == FS_EXFAT) {
+				if (dp->dir[XDIR_Type] == 0xC0) nc = dp->dir[XDIR_NumName - SZDIRE];
+				if (dp->dir[XDIR_Type] == 0xC1) key = di_xname(key, dp->dir, &ni, nc);
+			} else
+#endif
+			{
+				if (dp->dir[DIR_Attr] == AM_LFN) {
+					key = di_lfn(key, dp->dir, 0);
+				} else {
+					skey = di_sfn(dp->dir);
+				}
+			}
+#endif
 			/* Mark an entry 'deleted' */
 			if (_FS_EXFAT && fs->fs_type == FS_EXFAT) {	/* On the exFAT volume */
 				dp->dir[XDIR_Type] &= 0x7F;
@@ -2419,10 +3773,25 @@ FRESULT dir_remove (	/* FR_OK:Succeeded, FR_DISK_ERR:A disk error */
 		} while (res == FR_OK);
 		if (res == FR_NO_FILE) res = FR_INT_ERR;
 	}
+#if _FS_DIRINDEX
+	if (res == FR_OK && di_mine(dp)) {	/* Take the object out of the index */
+		if (key) di_drop(key, top);
+		if (skey) di_drop(skey, top);
+		if (top < DirIndex.hint) DirIndex.hint = top;	/* The block is free for dir_alloc */
+	}
+	if (res == FR_OK) di_over(dp, -((key != 0) + (skey != 0)));
+#endif
 #else			/* Non LFN configuration */
 
 	res = move_window(fs, dp->sect);
 	if (res == FR_OK) {
+#if _FS_DIRINDEX
+		if (di_mine(dp)) {	/* Take the object out of the index */
+			di_drop(di_sfn(dp->dir), dp->dptr);
+			if (dp->dptr < DirIndex.hint) DirIndex.hint = dp->dptr;
+		}
+		di_over(dp, -1);
+#endif
 		dp->dir[DIR_Name] = DDEM;
 		fs->wflag = 1;
 	}
@@ -2882,6 +4251,7 @@ FRESULT follow_path (	/* FR_OK(0): successful, !=0: error code */
 				obj->sclust = ld_dword(fs->dirbuf + XDIR_FstClus);	/* Open next directory */
 				obj->stat = fs->dirbuf[XDIR_GenFlags] & 2;
 				obj->objsize = ld_qword(fs->dirbuf + XDIR_FileSize);
+				obj->n_frag = 0;
 			} else
 #endif
 			{
@@ -2968,6 +4338,9 @@ BYTE check_fs (	/* 0:FAT, 1:exFAT, 2:Valid BS but not FAT, 3:Not a BS, 4:Disk er
 )
 {
 	fs->wflag = 0; fs->winsect = 0xFFFFFFFF;		/* Invaidate window */
+#if _FS_WINCACHE > 1
+	wc_reset(fs);
+#endif
 	if (move_window(fs, sect) != FR_OK) return 4;	/* Load boot record */
 
 	if (ld_word(fs->win + BS_55AA) != 0xAA55) return 3;	/* Check boot record signature (always placed here even if the sector size is >512) */
@@ -3003,6 +4376,9 @@ FRESULT find_volume (	/* FR_OK(0): successful, !=0: any error occurred */
 	WORD nrsv;
 	FATFS *fs;
 	UINT i;
+#if _FS_FREEMAP
+	DWORD fm_key[4];
+#endif
 
 
 	/* Get logical drive number */
@@ -3031,12 +4407,23 @@ FRESULT find_volume (	/* FR_OK(0): successful, !=0: any error occurred */
 	/* The file system object is not valid. */
 	/* Following code attempts to mount the volume. (analyze BPB and initialize the fs object) */
 
+#if _FS_FREEMAP
+	if (fs->fs_type && !fm_clean(fs)) fs->fm_shift = 0;	/* Was the volume left with changes the map reflects? */
+	fm_key[0] = fs->fatbase; fm_key[1] = fs->database;	/* Where the map was built, to tell the same volume */
+	fm_key[2] = fs->n_fatent; fm_key[3] = fs->free_clst;
+#endif
 	fs->fs_type = 0;					/* Clear the file system object */
+#if _FS_FASTMOUNT
+	fs->mc_sect = 0;
+#endif
 	fs->drv = LD2PD(vol);				/* Bind the logical drive and a physical drive */
 	stat = disk_initialize(fs->drv);	/* Initialize the physical drive */
 	if (stat & STA_NOINIT) { 			/* Check if the initialization succeeded */
 		return FR_NOT_READY;			/* Failed to initialize due to no medium or hard error */
 	}
+#if _FS_FREEMAP
+	if (!(stat & STA_KEPT)) fs->fm_shift = 0;	/* Another medium, or it may have changed since */
+#endif
 	if (!_FS_READONLY && mode && (stat & STA_PROTECT)) { /* Check disk write protection if needed */
 		return FR_WRITE_PROTECTED;
 	}
@@ -3154,6 +4541,10 @@ FRESULT find_volume (	/* FR_OK(0): successful, !=0: any error occurred */
 			if (fs->n_rootdir) return FR_NO_FILESYSTEM;	/* (BPB_RootEntCnt must be 0) */
 			fs->dirbase = ld_dword(fs->win + BPB_RootClus32);	/* Root directory start cluster */
 			szbfat = fs->n_fatent * 4;					/* (Needed FAT size) */
+#if _FS_FASTMOUNT
+			fs->mc_volid = ld_dword(fs->win + BS_VolID32);
+			fs->mc_sect = mc_place(fs, bsect, ld_word(fs->win + BPB_BkBootSec32));
+#endif
 		} else {
 			if (fs->n_rootdir == 0)	return FR_NO_FILESYSTEM;/* (BPB_RootEntCnt must not be 0) */
 			fs->dirbase = fs->fatbase + fasize;			/* Root directory start sector */
@@ -3201,6 +4592,26 @@ FRESULT find_volume (	/* FR_OK(0): successful, !=0: any error occurred */
 #endif
 #if _FS_LOCK != 0			/* Clear file lock semaphores */
 	clear_lock(fs);
+#endif
+#if _FS_AUALIGN
+	au_init(fs);			/* Find the allocation unit boundaries */
+#endif
+#if _FS_HEADROOM
+	fs->hr_clst = _FS_HEADROOM / ((DWORD)fs->csize * SS(fs));	/* Headroom in clusters */
+	if (fs->hr_clst > (fs->n_fatent - 2) / 8) fs->hr_clst = (fs->n_fatent - 2) / 8;	/* No more than 1/8 of the volume */
+	if (fs->hr_clst == 0) fs->hr_clst = 1;
+	fs->hr_none = 0;
+#endif
+#if _FS_FREEMAP
+	if (!fs->fm_shift || fmt != FS_FAT32	/* Keep the map of a FAT32 volume remounted as it was left */
+		|| fs->fatbase != fm_key[0] || fs->database != fm_key[1]
+		|| fs->n_fatent != fm_key[2] || fs->free_clst != fm_key[3]) {
+#if _FS_FASTMOUNT
+		fs->mc_valid = 0;
+		if (fmt != FS_FAT32 || mc_load(fs) != FR_OK)	/* Load the map from the mount cache if it holds */
+#endif
+		fm_reset(fs);	/* Otherwise count each group of the FAT as allocation first comes to it */
+	}
 #endif
 	return FR_OK;
 }
@@ -3286,6 +4697,9 @@ FRESULT f_mount (
 
 	if (fs) {
 		fs->fs_type = 0;				/* Clear new fs object */
+#if _FS_FREEMAP
+		fs->fm_shift = 0;				/* Its free cluster map is not of this volume */
+#endif
 #if _FS_REENTRANT						/* Create sync object for the new volume */
 		if (!ff_cre_syncobj((BYTE)vol, &fs->sobj)) return FR_INT_ERR;
 #endif
@@ -3450,6 +4864,7 @@ FRESULT f_open (
 				fp->obj.sclust = ld_dword(fs->dirbuf + XDIR_FstClus);	/* Get object allocation info */
 				fp->obj.objsize = ld_qword(fs->dirbuf + XDIR_FileSize);
 				fp->obj.stat = fs->dirbuf[XDIR_GenFlags] & 2;
+				fp->obj.n_frag = 0;										/* No fragment pending on the FAT */
 			} else
 #endif
 			{
@@ -3608,11 +5023,13 @@ FRESULT f_read (
 /* Write File                                                            */
 /*-----------------------------------------------------------------------*/
 
-FRESULT f_write (
+static
+FRESULT write_file (
 	FIL* fp,			/* Pointer to the file object */
 	const void* buff,	/* Pointer to the data to be written */
 	UINT btw,			/* Number of bytes to write */
-	UINT* bw			/* Pointer to number of bytes written */
+	UINT* bw,			/* Pointer to number of bytes written */
+	BYTE pad			/* 1:Write a trailing partial sector straight from buff, padded by the bytes following the data */
 )
 {
 	FRESULT res;
@@ -3631,6 +5048,10 @@ FRESULT f_write (
 	if ((!_FS_EXFAT || fs->fs_type != FS_EXFAT) && (DWORD)(fp->fptr + btw) < (DWORD)fp->fptr) {
 		btw = (UINT)(0xFFFFFFFF - (DWORD)fp->fptr);
 	}
+	if (fp->fptr % SS(fs) != 0 ||			/* Padding applies from a sector boundary only */
+		((!_FS_EXFAT || fs->fs_type != FS_EXFAT) && (DWORD)(fp->fptr + btw + SS(fs)) < (DWORD)fp->fptr)) {
+		pad = 0;
+	}
 
 	for ( ;  btw;							/* Repeat until all data written */
 		wbuff += wcnt, fp->fptr += wcnt, fp->obj.objsize = (fp->fptr > fp->obj.objsize) ? fp->fptr : fp->obj.objsize, *bw += wcnt, btw -= wcnt) {
@@ -3640,7 +5061,7 @@ FRESULT f_write (
 				if (fp->fptr == 0) {		/* On the top of the file? */
 					clst = fp->obj.sclust;	/* Follow from the origin */
 					if (clst == 0) {		/* If no cluster is allocated, */
-						clst = create_chain(&fp->obj, 0);	/* create a new cluster chain */
+						clst = create_chain(&fp->obj, 0, 1);	/* create a new cluster chain */
 					}
 				} else {					/* On the middle or end of the file */
 #if _USE_FASTSEEK
@@ -3649,7 +5070,7 @@ FRESULT f_write (
 					} else
 #endif
 					{
-						clst = create_chain(&fp->obj, fp->clust);	/* Follow or stretch cluster chain on the FAT */
+						clst = create_chain(&fp->obj, fp->clust, 1);	/* Follow or stretch cluster chain on the FAT */
 					}
 				}
 				if (clst == 0) break;		/* Could not allocate a new cluster (disk full) */
@@ -3669,7 +5090,7 @@ FRESULT f_write (
 			sect = clust2sect(fs, fp->clust);	/* Get current sector */
 			if (!sect) ABORT(fs, FR_INT_ERR);
 			sect += csect;
-			cc = btw / SS(fs);				/* When remaining bytes >= sector size, */
+			cc = (btw + (pad ? SS(fs) - 1 : 0)) / SS(fs);	/* When remaining bytes >= sector size (or padded), */
 			if (cc) {						/* Write maximum contiguous sectors directly */
 				if (csect + cc > fs->csize) {	/* Clip at cluster boundary */
 					cc = fs->csize - csect;
@@ -3685,10 +5106,21 @@ FRESULT f_write (
 				if (fp->sect - sect < cc) { /* Refill sector cache if it gets invalidated by the direct write */
 					mem_cpy(fp->buf, wbuff + ((fp->sect - sect) * SS(fs)), SS(fs));
 					fp->flag &= (BYTE)~FA_DIRTY;
+					fs->wr_copy += SS(fs);
 				}
 #endif
 #endif
 				wcnt = SS(fs) * cc;		/* Number of bytes transferred */
+				if (wcnt > btw) {		/* Padded sector? The padding is not file data */
+					wcnt -= SS(fs);		/* Offset of the partial sector in wbuff */
+#if !_FS_TINY
+					mem_cpy(fp->buf, wbuff + wcnt, btw - wcnt);	/* Keep its data in the sector cache as written */
+					fp->flag &= (BYTE)~FA_DIRTY;
+					fs->wr_copy += btw - wcnt;
+#endif
+					fp->sect = sect + cc - 1;	/* The next write fills the rest of it */
+					wcnt = btw;
+				}
 				continue;
 			}
 #if _FS_TINY
@@ -3715,6 +5147,7 @@ FRESULT f_write (
 		mem_cpy(fp->buf + fp->fptr % SS(fs), wbuff, wcnt);	/* Fit data to the sector */
 		fp->flag |= FA_DIRTY;
 #endif
+		fs->wr_copy += wcnt;
 	}
 
 	fp->flag |= FA_MODIFIED;				/* Set file change flag */
@@ -3723,6 +5156,43 @@ FRESULT f_write (
 }
 
 
+FRESULT f_write (
+	FIL* fp,			/* Pointer to the file object */
+	const void* buff,	/* Pointer to the data to be written */
+	UINT btw,			/* Number of bytes to write */
+	UINT* bw			/* Pointer to number of bytes written */
+)
+{
+	return write_file(fp, buff, btw, bw, 0);
+}
+
+
+
+#if _USE_ALIGNED
+/*-----------------------------------------------------------------------*/
+/* Write File from a Sector Aligned Buffer                               */
+/*-----------------------------------------------------------------------*/
+/* When the file pointer is on a sector boundary, all the data including a
+/  trailing partial sector is passed to disk_write straight from buff. The
+/  bytes following the data in buff, up to the sector end, go to the disk
+/  with it, so buff must be readable up to there. They are not file data:
+/  the file pointer and size move on by btw only, and the partial sector is
+/  kept in the sector cache, where the next write fills it in. At any other
+/  file pointer, this works as f_write. */
+
+FRESULT f_write_aligned (
+	FIL* fp,			/* Pointer to the file object */
+	const void* buff,	/* Pointer to the data to be written, padded to a multiple of the sector size */
+	UINT btw,			/* Number of bytes to write (not counting padding) */
+	UINT* bw			/* Pointer to number of bytes written (not counting padding) */
+)
+{
+	return write_file(fp, buff, btw, bw, 1);
+}
+
+#endif /* _USE_ALIGNED */
+
+
 
 
 /*-----------------------------------------------------------------------*/
@@ -3829,6 +5299,9 @@ FRESULT f_close (
 			if (res == FR_OK)
 #endif
 			{
+#if _FS_HEADROOM
+				hr_drop(fs, fp->obj.sclust);	/* It is no longer growing */
+#endif
 				fp->obj.fs = 0;			/* Invalidate file object */
 			}
 #if _FS_REENTRANT
@@ -4093,7 +5566,7 @@ FRESULT f_lseek (
 				clst = fp->obj.sclust;					/* start from the first cluster */
 #if !_FS_READONLY
 				if (clst == 0) {						/* If no cluster chain, create a new chain */
-					clst = create_chain(&fp->obj, 0);
+					clst = create_chain(&fp->obj, 0, 1);
 					if (clst == 1) ABORT(fs, FR_INT_ERR);
 					if (clst == 0xFFFFFFFF) ABORT(fs, FR_DISK_ERR);
 					fp->obj.sclust = clst;
@@ -4110,7 +5583,7 @@ FRESULT f_lseek (
 							fp->obj.objsize = fp->fptr;
 							fp->flag |= FA_MODIFIED;
 						}
-						clst = create_chain(&fp->obj, clst);	/* Follow chain with forceed stretch */
+						clst = create_chain(&fp->obj, clst, 1);	/* Follow chain with forceed stretch */
 						if (clst == 0) {				/* Clip file size in case of disk full */
 							ofs = 0; break;
 						}
@@ -4190,6 +5663,7 @@ FRESULT f_opendir (
 						obj->sclust = ld_dword(fs->dirbuf + XDIR_FstClus);	/* Get object allocation info */
 						obj->objsize = ld_qword(fs->dirbuf + XDIR_FileSize);
 						obj->stat = fs->dirbuf[XDIR_GenFlags] & 2;
+						obj->n_frag = 0;
 					} else
 #endif
 					{
@@ -4393,10 +5867,6 @@ FRESULT f_getfree (
 {
 	FRESULT res;
 	FATFS *fs;
-	DWORD nfree, clst, sect, stat;
-	UINT i;
-	BYTE *p;
-	_FDID obj;
 
 
 	/* Get logical drive */
@@ -4404,62 +5874,10 @@ FRESULT f_getfree (
 	if (res == FR_OK) {
 		*fatfs = fs;				/* Return ptr to the fs object */
 		/* If free_clst is valid, return it without full cluster scan */
-		if (fs->free_clst <= fs->n_fatent - 2) {
-			*nclst = fs->free_clst;
-		} else {
-			/* Get number of free clusters */
-			nfree = 0;
-			if (fs->fs_type == FS_FAT12) {	/* FAT12: Sector unalighed FAT entries */
-				clst = 2; obj.fs = fs;
-				do {
-					stat = get_fat(&obj, clst);
-					if (stat == 0xFFFFFFFF) { res = FR_DISK_ERR; break; }
-					if (stat == 1) { res = FR_INT_ERR; break; }
-					if (stat == 0) nfree++;
-				} while (++clst < fs->n_fatent);
-			} else {
-#if _FS_EXFAT
-				if (fs->fs_type == FS_EXFAT) {	/* exFAT: Scan bitmap table */
-					BYTE bm;
-					UINT b;
-
-					clst = fs->n_fatent - 2;
-					sect = fs->database;
-					i = 0;
-					do {
-						if (i == 0 && (res = move_window(fs, sect++)) != FR_OK) break;
-						for (b = 8, bm = fs->win[i]; b && clst; b--, clst--) {
-							if (!(bm & 1)) nfree++;
-							bm >>= 1;
-						}
-						i = (i + 1) % SS(fs);
-					} while (clst);
-				} else
-#endif
-				{	/* FAT16/32: Sector alighed FAT entries */
-					clst = fs->n_fatent; sect = fs->fatbase;
-					i = 0; p = 0;
-					do {
-						if (i == 0) {
-							res = move_window(fs, sect++);
-							if (res != FR_OK) break;
-							p = fs->win;
-							i = SS(fs);
-						}
-						if (fs->fs_type == FS_FAT16) {
-							if (ld_word(p) == 0) nfree++;
-							p += 2; i -= 2;
-						} else {
-							if ((ld_dword(p) & 0x0FFFFFFF) == 0) nfree++;
-							p += 4; i -= 4;
-						}
-					} while (--clst);
-				}
-			}
-			*nclst = nfree;			/* Return the free clusters */
-			fs->free_clst = nfree;	/* Now free_clst is valid */
-			fs->fsi_flag |= 1;		/* FSInfo is to be updated */
+		if (fs->free_clst > fs->n_fatent - 2) {
+			res = scan_free(fs);	/* Get number of free clusters */
 		}
+		*nclst = fs->free_clst;		/* Return the free clusters */
 	}
 
 	LEAVE_FF(fs, res);
@@ -4563,6 +5981,7 @@ FRESULT f_unlink (
 					obj.sclust = dclst = ld_dword(fs->dirbuf + XDIR_FstClus);
 					obj.objsize = ld_qword(fs->dirbuf + XDIR_FileSize);
 					obj.stat = fs->dirbuf[XDIR_GenFlags] & 2;
+					obj.n_frag = 0;
 				} else
 #endif
 				{
@@ -4581,6 +6000,7 @@ FRESULT f_unlink (
 						if (fs->fs_type == FS_EXFAT) {
 							sdj.obj.objsize = obj.objsize;
 							sdj.obj.stat = obj.stat;
+							sdj.obj.n_frag = 0;
 						}
 #endif
 						res = dir_sdi(&sdj, 0);
@@ -4594,6 +6014,11 @@ FRESULT f_unlink (
 			}
 			if (res == FR_OK) {
 				res = dir_remove(&dj);			/* Remove the directory entry */
+#if _FS_DIRINDEX
+				if (res == FR_OK && dclst && (dj.obj.attr & AM_DIR) && DirIndex.fs == fs && DirIndex.sclust == dclst) {
+					DirIndex.fs = 0;			/* Forget the index of the removed directory */
+				}
+#endif
 				if (res == FR_OK && dclst) {	/* Remove the cluster chain if exist */
 #if _FS_EXFAT
 					res = remove_chain(&obj, dclst, 0);
@@ -4641,7 +6066,7 @@ FRESULT f_mkdir (
 			res = FR_INVALID_NAME;
 		}
 		if (res == FR_NO_FILE) {				/* Can create a new directory */
-			dcl = create_chain(&dj.obj, 0);		/* Allocate a cluster for the new directory table */
+			dcl = create_chain(&dj.obj, 0, 0);	/* Allocate a cluster for the new directory table */
 			dj.obj.objsize = (DWORD)fs->csize * SS(fs);
 			res = FR_OK;
 			if (dcl == 0) res = FR_DENIED;		/* No space to allocate a new cluster */
@@ -4936,6 +6361,9 @@ FRESULT f_getlabel (
 	/* Get volume label */
 	if (res == FR_OK && label) {
 		dj.obj.fs = fs; dj.obj.sclust = 0;	/* Open root directory */
+#if _FS_EXFAT
+		dj.obj.n_frag = 0;
+#endif
 		res = dir_sdi(&dj, 0);
 		if (res == FR_OK) {
 		 	res = dir_read(&dj, 1);			/* Find a volume label entry */
@@ -5085,6 +6513,9 @@ FRESULT f_setlabel (
 
 	/* Set volume label */
 	dj.obj.sclust = 0;		/* Open root directory */
+#if _FS_EXFAT
+	dj.obj.n_frag = 0;
+#endif
 	res = dir_sdi(&dj, 0);
 	if (res == FR_OK) {
 		res = dir_read(&dj, 1);	/* Get volume label entry */
@@ -5097,6 +6528,9 @@ FRESULT f_setlabel (
 					mem_cpy(dj.dir, dirvn, 11);	/* Change the volume label */
 				} else {
 					dj.dir[DIR_Name] = DDEM;	/* Remove the volume label */
+#if _FS_DIRINDEX
+					if (di_mine(&dj) && dj.dptr < DirIndex.hint) DirIndex.hint = dj.dptr;
+#endif
 				}
 			}
 			fs->wflag = 1;
@@ -5145,7 +6579,7 @@ FRESULT f_expand (
 {
 	FRESULT res;
 	FATFS *fs;
-	DWORD n, clst, stcl, scl, ncl, tcl, lclst;
+	DWORD n, clst, stcl, scl, ncl, tcl, lclst, ecl, pcl;
 
 
 	res = validate(&fp->obj, &fs);		/* Check validity of the file object */
@@ -5161,7 +6595,11 @@ FRESULT f_expand (
 
 #if _FS_EXFAT
 	if (fs->fs_type == FS_EXFAT) {
-		scl = find_bitmap(fs, stcl, tcl);			/* Find a contiguous cluster block */
+#if _FS_HEADROOM
+		scl = hr_bitmap(fs, stcl, tcl, 1, 0);		/* Find a contiguous cluster block clear of growing files */
+		if (scl == 0)
+#endif
+		scl = find_bitmap(fs, stcl, tcl, 1);		/* Find a contiguous cluster block */
 		if (scl == 0) res = FR_DENIED;				/* No contiguous cluster block was found */
 		if (scl == 0xFFFFFFFF) res = FR_DISK_ERR;
 		if (res == FR_OK) {	/* A contiguous free area is found */
@@ -5177,16 +6615,25 @@ FRESULT f_expand (
 	{
 		scl = clst = stcl; ncl = 0;
 		for (;;) {	/* Find a contiguous cluster block */
-			n = get_fat(&fp->obj, clst);
-			if (++clst >= fs->n_fatent) clst = 2;
+			pcl = clst;
+#if _FS_FREEMAP
+			n = fm_span(fs, clst, &ecl);	/* Get state of clusters clst..ecl-1 from the free cluster map */
+			if (n == 1)
+#endif
+			{
+				n = get_fat(&fp->obj, clst); ecl = clst + 1;
+			}
+			if ((clst = ecl) >= fs->n_fatent) clst = 2;
 			if (n == 1) { res = FR_INT_ERR; break; }
 			if (n == 0xFFFFFFFF) { res = FR_DISK_ERR; break; }
-			if (n == 0) {	/* Is it a free cluster? */
-				if (++ncl == tcl) break;	/* Break if a contiguous cluster block is found */
+			if (n == 0) {	/* Are they free clusters? */
+				if (ncl == 0) scl = au_ceil(fs, pcl);	/* Start a block on an allocation unit boundary */
+				if (ecl > scl && (ncl += ecl - (scl > pcl ? scl : pcl)) >= tcl) break;	/* Break if a contiguous cluster block is found */
 			} else {
 				scl = clst; ncl = 0;		/* Not a free cluster */
 			}
-			if (clst == stcl) { res = FR_DENIED; break; }	/* No contiguous cluster? */
+			if (clst == 2) { scl = 2; ncl = 0; }	/* A block cannot wrap around the end of the FAT */
+			if (clst == stcl || (stcl > pcl && stcl < ecl)) { res = FR_DENIED; break; }	/* No contiguous cluster? */
 		}
 		if (res == FR_OK) {	/* A contiguous free area is found */
 			if (opt) {		/* Allocate it now */
@@ -5212,6 +6659,9 @@ FRESULT f_expand (
 				fs->free_clst -= tcl;
 				fs->fsi_flag |= 1;
 			}
+#if _FS_FREEMAP
+			fm_change(fs, scl, tcl, 1);	/* Update free cluster map */
+#endif
 		}
 	}
 
@@ -5334,7 +6784,7 @@ FRESULT f_mkfs (
 	stat = disk_initialize(pdrv);
 	if (stat & STA_NOINIT) return FR_NOT_READY;
 	if (stat & STA_PROTECT) return FR_WRITE_PROTECTED;
-	if (disk_ioctl(pdrv, GET_BLOCK_SIZE, &sz_blk) != RES_OK || !sz_blk || sz_blk > 32768 || (sz_blk & (sz_blk - 1))) sz_blk = 1;	/* Erase block to align data area */
+	if (disk_ioctl(pdrv, GET_BLOCK_SIZE, &sz_blk) != RES_OK || !sz_blk || sz_blk > 131072) sz_blk = 1;	/* Erase block to align data area (AUs up to 64 MiB, 12/24 MiB ones not a power of 2) */
 #if _MAX_SS != _MIN_SS		/* Get sector size of the medium if variable sector size cfg. */
 	if (disk_ioctl(pdrv, GET_SECTOR_SIZE, &ss) != RES_OK) return FR_DISK_ERR;
 	if (ss > _MAX_SS || ss < _MIN_SS || (ss & (ss - 1))) return FR_DISK_ERR;
@@ -5405,7 +6855,7 @@ FRESULT f_mkfs (
 		}
 		b_fat = b_vol + 32;										/* FAT start at offset 32 */
 		sz_fat = ((sz_vol / au + 2) * 4 + ss - 1) / ss;			/* Number of FAT sectors */
-		b_data = (b_fat + sz_fat + sz_blk - 1) & ~(sz_blk - 1);	/* Align data area to the erase block boundary */
+		b_data = (b_fat + sz_fat + sz_blk - 1) / sz_blk * sz_blk;	/* Align data area to the erase block boundary */
 		if (b_data >= sz_vol / 2) return FR_MKFS_ABORTED;		/* Too small volume? */
 		n_clst = (sz_vol - (b_data - b_vol)) / au;				/* Number of clusters */
 		if (n_clst <16) return FR_MKFS_ABORTED;					/* Too few clusters? */
@@ -5582,10 +7032,14 @@ FRESULT f_mkfs (
 			b_data = b_fat + sz_fat * n_fats + sz_dir;	/* Data base */
 
 			/* Align data base to erase block boundary (for flash memory media) */
-			n = ((b_data + sz_blk - 1) & ~(sz_blk - 1)) - b_data;	/* Next nearest erase block from current data base */
+			n = (b_data + sz_blk - 1) / sz_blk * sz_blk - b_data;	/* Next nearest erase block from current data base */
+			if (fmt == FS_FAT32 ? sz_rsv + n > 0xFFFF : sz_fat + n / n_fats > 0xFFFF) n = 0;	/* Leave it unaligned if the 16-bit size field cannot take the gap */
 			if (fmt == FS_FAT32) {		/* FAT32: Move FAT base */
 				sz_rsv += n; b_fat += n;
 			} else {					/* FAT12/16: Expand FAT size */
+				if (n % n_fats) {		/* (Take the remainder into the reserved area) */
+					n--; sz_rsv++; b_fat++;
+				}
 				sz_fat += n / n_fats;
 			}
 
@@ -5671,6 +7125,10 @@ FRESULT f_mkfs (
 			st_word(buf + BS_55AA, 0xAA55);
 			disk_write(pdrv, buf, b_vol + 7, 1);		/* Write backup FSINFO (VBR + 7) */
 			disk_write(pdrv, buf, b_vol + 1, 1);		/* Write original FSINFO (VBR + 1) */
+#if _FS_FASTMOUNT
+			mem_set(buf, 0, ss);
+			disk_write(pdrv, buf, b_fat - 1, 1);		/* Clear a mount cache left by an earlier volume */
+#endif
 		}
 
 		/* Initialize FAT area */
@@ -106,6 +106,26 @@ typedef struct {
 #if !_FS_READONLY
 	DWORD	last_clst;		/* Last allocated cluster */
 	DWORD	free_clst;		/* Number of free clusters */
+#if _FS_FREEMAP
+	BYTE	fm_shift;		/* Clusters per free map group in log2 (0:map not valid) */
+	WORD	fmap[_FS_FREEMAP];	/* Number of free clusters in each group (0xFFFF:not counted yet) */
+	DWORD	fm_unknown;		/* Number of groups not counted yet */
+#if _FS_FASTMOUNT
+	BYTE	mc_valid;		/* The mount cache on the disk may be valid (it is zeroed before the FAT changes) */
+	DWORD	mc_sect;		/* Mount cache header sector, the map in the sectors before it (0:no room) */
+	DWORD	mc_volid;		/* Volume serial number */
+	DWORD	mc_lo;			/* First map group changed since the cache was written (0xFFFFFFFF:none) */
+	DWORD	mc_hi;			/* Last map group changed since */
+#endif
+#endif
+#if _FS_AUALIGN
+	DWORD	au_clst;		/* Clusters per allocation unit (1:no alignment) */
+	DWORD	au_ofs;			/* Clusters from cluster #2 to the first allocation unit boundary */
+#endif
+#if _FS_EXFAT && _FS_HEADROOM
+	DWORD	hr_clst;		/* Clusters of headroom */
+	BYTE	hr_none;		/* No free block with headroom was found (cleared as space is released) */
+#endif
 #endif
 #if _FS_RPATH != 0
 	DWORD	cdir;			/* Current directory start cluster (0:root) */
@@ -122,6 +142,17 @@ typedef struct {
 	DWORD	dirbase;		/* Root directory base sector/cluster */
 	DWORD	database;		/* Data base sector */
 	DWORD	winsect;		/* Current sector appearing in the win[] */
+	DWORD	wc_hit;			/* Window moves served from the window cache */
+	DWORD	wc_miss;		/* Window moves that read the disk */
+	DWORD	wc_write;		/* Window sectors written back to the disk */
+	DWORD	wr_copy;		/* File data bytes copied to a sector buffer by f_write */
+#if _FS_WINCACHE > 1
+	DWORD	wc_clock;		/* Window cache use counter */
+	DWORD	wc_sect[_FS_WINCACHE - 1];	/* Sector held by each cache entry (0xFFFFFFFF:empty) */
+	DWORD	wc_used[_FS_WINCACHE - 1];	/* Last use of each cache entry (LRU) */
+	BYTE	wc_flag[_FS_WINCACHE - 1];	/* Cache entry flags (b0:dirty) */
+	BYTE	wc_buf[_FS_WINCACHE - 1][_MAX_SS];	/* Cached sectors moved out of the win[] */
+#endif
 	BYTE	win[_MAX_SS];	/* Disk access window for Directory, FAT (and file data at tiny cfg) */
 } FATFS;
 
@@ -265,6 +296,7 @@ FRESULT f_getlabel (const TCHAR* path, TCHAR* label, DWORD* vsn);	/* Get volume
 FRESULT f_setlabel (const TCHAR* label);							/* Set volume label */
 FRESULT f_forward (FIL* fp, UINT(*func)(const BYTE*,UINT), UINT btf, UINT* bf);	/* Forward data to the stream */
 FRESULT f_expand (FIL* fp, FSIZE_t szf, BYTE opt);					/* Allocate a contiguous block to the file */
+FRESULT f_write_aligned (FIL* fp, const void* buff, UINT btw, UINT* bw);	/* Write data from a sector padded buffer without copying */
 FRESULT f_mount (FATFS* fs, const TCHAR* path, BYTE opt);			/* Mount/Unmount a logical drive */
 FRESULT f_mkfs (const TCHAR* path, BYTE opt, DWORD au, void* work, UINT len);	/* Create a FAT volume */
 FRESULT f_fdisk (BYTE pdrv, const DWORD* szt, void* work);			/* Divide a physical drive into some partitions */